@@ -5,6 +5,141 @@
 #include <string.h>
 #include "bih.h"
 
+// number of intervals the child centers are sorted into when looking for the
+// best split with the surface area heuristic
+#define BIH_SAHBINS 16
+
+typedef struct bih_sahbin_s
+{
+	int count;
+	float mins[3];
+	float maxs[3];
+}
+bih_sahbin_t;
+
+static float BIH_HalfArea(const float *mins, const float *maxs)
+{
+	float x = maxs[0] - mins[0];
+	float y = maxs[1] - mins[1];
+	float z = maxs[2] - mins[2];
+	return x * y + y * z + z * x;
+}
+
+static int BIH_SAHBin(const bih_leaf_t *child, int axis, float centermin, float scale)
+{
+	int bin = (int)(((child->mins[axis] + child->maxs[axis]) * 0.5f - centermin) * scale);
+	return bin < 0 ? 0 : (bin >= BIH_SAHBINS ? BIH_SAHBINS - 1 : bin);
+}
+
+static void BIH_SAHAddBounds(bih_sahbin_t *bin, const float *mins, const float *maxs, int count)
+{
+	int k;
+	if (!bin->count)
+	{
+		for (k = 0;k < 3;k++)
+		{
+			bin->mins[k] = mins[k];
+			bin->maxs[k] = maxs[k];
+		}
+	}
+	else
+	{
+		for (k = 0;k < 3;k++)
+		{
+			if (bin->mins[k] > mins[k]) bin->mins[k] = mins[k];
+			if (bin->maxs[k] < maxs[k]) bin->maxs[k] = maxs[k];
+		}
+	}
+	bin->count += count;
+}
+
+// sorts the children into front and back lists at the split that minimizes
+// the surface area of both sides weighted by the number of children in them,
+// which is what a query can expect to have to look at, returns the number of
+// front children (at the start of leaflist) or 0 if no split separates them
+static int BIH_PartitionSAH(bih_t *bih, int numchildren, int *leaflist, int *bestaxis)
+{
+	int i;
+	int axis;
+	int bestbin = 0;
+	int front = 0;
+	int back = 0;
+	float center;
+	float cost;
+	float bestcost = 0;
+	float centermins[3];
+	float centermaxs[3];
+	float scale[3];
+	float frontarea[BIH_SAHBINS];
+	int frontcount[BIH_SAHBINS];
+	bih_sahbin_t bins[BIH_SAHBINS];
+	bih_sahbin_t side;
+	bih_leaf_t *child;
+	// bounds of the child centers, the bins divide these
+	for (i = 0;i < numchildren;i++)
+	{
+		child = bih->leafs + leaflist[i];
+		for (axis = 0;axis < 3;axis++)
+		{
+			center = (child->mins[axis] + child->maxs[axis]) * 0.5f;
+			if (!i || centermins[axis] > center) centermins[axis] = center;
+			if (!i || centermaxs[axis] < center) centermaxs[axis] = center;
+		}
+	}
+	*bestaxis = -1;
+	for (axis = 0;axis < 3;axis++)
+	{
+		if (!(centermaxs[axis] > centermins[axis]))
+			continue;
+		scale[axis] = BIH_SAHBINS / (centermaxs[axis] - centermins[axis]);
+		memset(bins, 0, sizeof(bins));
+		for (i = 0;i < numchildren;i++)
+		{
+			child = bih->leafs + leaflist[i];
+			BIH_SAHAddBounds(bins + BIH_SAHBin(child, axis, centermins[axis], scale[axis]), child->mins, child->maxs, 1);
+		}
+		// sweep from the front to know the front side of every split...
+		memset(&side, 0, sizeof(side));
+		for (i = BIH_SAHBINS - 1;i > 0;i--)
+		{
+			if (bins[i].count)
+				BIH_SAHAddBounds(&side, bins[i].mins, bins[i].maxs, bins[i].count);
+			frontcount[i] = side.count;
+			frontarea[i] = side.count ? BIH_HalfArea(side.mins, side.maxs) : 0;
+		}
+		// ...and from the back to evaluate them, split i puts bins < i in back
+		memset(&side, 0, sizeof(side));
+		for (i = 1;i < BIH_SAHBINS;i++)
+		{
+			if (bins[i-1].count)
+				BIH_SAHAddBounds(&side, bins[i-1].mins, bins[i-1].maxs, bins[i-1].count);
+			if (!side.count || !frontcount[i])
+				continue;
+			cost = BIH_HalfArea(side.mins, side.maxs) * side.count + frontarea[i] * frontcount[i];
+			if (*bestaxis < 0 || bestcost > cost)
+			{
+				*bestaxis = axis;
+				bestbin = i;
+				bestcost = cost;
+			}
+		}
+	}
+	if (*bestaxis < 0)
+		return 0;
+	axis = *bestaxis;
+	for (i = 0;i < numchildren;i++)
+	{
+		child = bih->leafs + leaflist[i];
+		if (BIH_SAHBin(child, axis, centermins[axis], scale[axis]) < bestbin)
+			bih->leafsortscratch[back++] = leaflist[i];
+		else
+			leaflist[front++] = leaflist[i];
+	}
+	if (back)
+		memcpy(leaflist + front, bih->leafsortscratch, back*sizeof(leaflist[0]));
+	return front;
+}
+
 static int BIH_BuildNode(bih_t *bih, int numchildren, int *leaflist, float *totalmins, float *totalmaxs)
 {
 	int i;
@@ -82,43 +217,48 @@ static int BIH_BuildNode(bih_t *bih, int numchildren, int *leaflist, float *tota
 			node->children[j] = leaflist[j];
 		return nodenum;
 	}
-	// pick longest axis
-	longestaxis = 0;
-	if (size[0] < size[1]) longestaxis = 1;
-	if (size[longestaxis] < size[2]) longestaxis = 2;
-	// iterate possible split axis choices, starting with the longest axis, if
-	// all fail it means all children have the same bounds and we simply split
-	// the list in half because each node can only have two children.
-	for (j = 0;j < 3;j++)
+	if (bih->method == BIH_BUILD_SAH && (front = BIH_PartitionSAH(bih, numchildren, leaflist, &axis)) > 0)
+		back = numchildren - front;
+	else
 	{
-		// pick an axis
-		axis = (longestaxis + j) % 3;
-		// sort children into front and back lists
-		splitdist = (node->mins[axis] + node->maxs[axis]) * 0.5f;
-		front = 0;
-		back = 0;
-		for (i = 0;i < numchildren;i++)
+		// pick longest axis
+		longestaxis = 0;
+		if (size[0] < size[1]) longestaxis = 1;
+		if (size[longestaxis] < size[2]) longestaxis = 2;
+		// iterate possible split axis choices, starting with the longest axis, if
+		// all fail it means all children have the same bounds and we simply split
+		// the list in half because each node can only have two children.
+		for (j = 0;j < 3;j++)
 		{
-			child = bih->leafs + leaflist[i];
-			d = (child->mins[axis] + child->maxs[axis]) * 0.5f;
-			if (d < splitdist)
-				bih->leafsortscratch[back++] = leaflist[i];
-			else
-				leaflist[front++] = leaflist[i];
+			// pick an axis
+			axis = (longestaxis + j) % 3;
+			// sort children into front and back lists
+			splitdist = (node->mins[axis] + node->maxs[axis]) * 0.5f;
+			front = 0;
+			back = 0;
+			for (i = 0;i < numchildren;i++)
+			{
+				child = bih->leafs + leaflist[i];
+				d = (child->mins[axis] + child->maxs[axis]) * 0.5f;
+				if (d < splitdist)
+					bih->leafsortscratch[back++] = leaflist[i];
+				else
+					leaflist[front++] = leaflist[i];
+			}
+			// now copy the back ones into the space made in the leaflist for them
+			if (back)
+				memcpy(leaflist + front, bih->leafsortscratch, back*sizeof(leaflist[0]));
+			// if both sides have some children, it's good enough for us.
+			if (front && back)
+				break;
+		}
+		if (j == 3)
+		{
+			// somewhat common case: no good choice, divide children arbitrarily
+			axis = 0;
+			back = numchildren >> 1;
+			front = numchildren - back;
 		}
-		// now copy the back ones into the space made in the leaflist for them
-		if (back)
-			memcpy(leaflist + front, bih->leafsortscratch, back*sizeof(leaflist[0]));
-		// if both sides have some children, it's good enough for us.
-		if (front && back)
-			break;
-	}
-	if (j == 3)
-	{
-		// somewhat common case: no good choice, divide children arbitrarily
-		axis = 0;
-		back = numchildren >> 1;
-		front = numchildren - back;
 	}
 
 	// we now have front and back children divided in leaflist...
@@ -130,7 +270,7 @@ static int BIH_BuildNode(bih_t *bih, int numchildren, int *leaflist, float *tota
 	return nodenum;
 }
 
-int BIH_Build(bih_t *bih, int numleafs, bih_leaf_t *leafs, int maxnodes, bih_node_t *nodes, int *temp_leafsort, int *temp_leafsortscratch)
+int BIH_Build(bih_t *bih, int numleafs, bih_leaf_t *leafs, int maxnodes, bih_node_t *nodes, int *temp_leafsort, int *temp_leafsortscratch, bih_buildmethod_t method)
 {
 	int i;
 
@@ -142,6 +282,7 @@ int BIH_Build(bih_t *bih, int numleafs, bih_leaf_t *leafs, int maxnodes, bih_nod
 	bih->numnodes = 0;
 	bih->maxnodes = maxnodes;
 	bih->nodes = nodes;
+	bih->method = method;
 
 	// clear things we intend to rebuild
 	memset(bih->nodes, 0, sizeof(bih->nodes[0]) * bih->maxnodes);
@@ -152,14 +293,17 @@ int BIH_Build(bih_t *bih, int numleafs, bih_leaf_t *leafs, int maxnodes, bih_nod
 	return bih->error;
 }
 
-static void BIH_GetTriangleListForBox_Node(const bih_t *bih, int nodenum, int maxtriangles, int *trianglelist_idx, int *trianglelist_surf, int *numtrianglespointer, const float *mins, const float *maxs)
+static int BIH_GetTriangleListForBox_Node(const bih_t *bih, int nodenum, int maxtriangles, int *trianglelist_idx, int *trianglelist_surf, const float *mins, const float *maxs, int numtriangles)
 {
 	int axis;
-	bih_node_t *node;
-	bih_leaf_t *leaf;
-	for(;;)
+	int nodestackpos = 0;
+	int nodestack[BIH_MAXNODESTACK];
+	const bih_node_t *node;
+	const bih_leaf_t *leaf;
+	nodestack[nodestackpos++] = nodenum;
+	while (nodestackpos)
 	{
-		node = bih->nodes + nodenum;
+		node = bih->nodes + nodestack[--nodestackpos];
 		// check if this is an unordered node (which holds an array of leaf numbers)
 		if (node->type == BIH_UNORDERED)
 		{
@@ -173,44 +317,47 @@ static void BIH_GetTriangleListForBox_Node(const bih_t *bih, int nodenum, int ma
 				switch(leaf->type)
 				{
 				case BIH_RENDERTRIANGLE:
-					if (*numtrianglespointer >= maxtriangles)
+					if (numtriangles >= maxtriangles)
 					{
-						++*numtrianglespointer; // so the caller can detect overflow
+						++numtriangles; // so the caller can detect overflow
 						break;
 					}
 					if(trianglelist_surf)
-						trianglelist_surf[*numtrianglespointer] = leaf->surfaceindex;
-					trianglelist_idx[*numtrianglespointer] = leaf->itemindex;
-					++*numtrianglespointer;
+						trianglelist_surf[numtriangles] = leaf->surfaceindex;
+					trianglelist_idx[numtriangles] = leaf->itemindex;
+					++numtriangles;
 					break;
 				default:
 					break;
 				}
 			}
-			return;
+			continue;
 		}
-		// splitting node
+		// splitting node, the front child is pushed last so it is visited
+		// first (if the box falls between the child groups nothing is pushed),
+		// a child that does not fit on the stack gets a walk of its own
 		axis = node->type - BIH_SPLITX;
 		if (mins[axis] < node->backmax)
 		{
-			if (maxs[axis] > node->frontmin)
-				BIH_GetTriangleListForBox_Node(bih, node->front, maxtriangles, trianglelist_idx, trianglelist_surf, numtrianglespointer, mins, maxs);
-			nodenum = node->back;
-			continue;
+			if (nodestackpos < BIH_MAXNODESTACK)
+				nodestack[nodestackpos++] = node->back;
+			else
+				numtriangles = BIH_GetTriangleListForBox_Node(bih, node->back, maxtriangles, trianglelist_idx, trianglelist_surf, mins, maxs, numtriangles);
 		}
 		if (maxs[axis] > node->frontmin)
 		{
-			nodenum = node->front;
-			continue;
+			if (nodestackpos < BIH_MAXNODESTACK)
+				nodestack[nodestackpos++] = node->front;
+			else
+				numtriangles = BIH_GetTriangleListForBox_Node(bih, node->front, maxtriangles, trianglelist_idx, trianglelist_surf, mins, maxs, numtriangles);
 		}
-		// fell between the child groups, nothing here
-		return;
 	}
+	return numtriangles;
 }
 
 int BIH_GetTriangleListForBox(const bih_t *bih, int maxtriangles, int *trianglelist_idx, int *trianglelist_surf, const float *mins, const float *maxs)
 {
-	int numtriangles = 0;
-	BIH_GetTriangleListForBox_Node(bih, bih->rootnode, maxtriangles, trianglelist_idx, trianglelist_surf, &numtriangles, mins, maxs);
-	return numtriangles;
+	if (!bih->nodes)
+		return 0;
+	return BIH_GetTriangleListForBox_Node(bih, bih->rootnode, maxtriangles, trianglelist_idx, trianglelist_surf, mins, maxs, 0);
 }
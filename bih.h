@@ -7,6 +7,9 @@
 #define BIH_H
 
 #define BIH_MAXUNORDEREDCHILDREN 8
+// depth of the node stack used by the queries, deeper parts are walked
+// separately
+#define BIH_MAXNODESTACK 1024
 
 typedef enum biherror_e
 {
@@ -32,6 +35,13 @@ typedef enum bih_leaftype_e
 }
 bih_leaftype_t;
 
+typedef enum bih_buildmethod_e
+{
+	BIH_BUILD_MIDPOINT, // split at the middle of the longest axis, fast to build
+	BIH_BUILD_SAH // binned surface area heuristic, slower to build but fewer nodes are visited by queries
+}
+bih_buildmethod_t;
+
 typedef struct bih_node_s
 {
 	bih_nodetype_t type; // = BIH_SPLITX and similar values
@@ -78,13 +88,14 @@ typedef struct bih_s
 
 	// fields used only during BIH_Build:
 	int maxnodes;
+	bih_buildmethod_t method;
 	int error; // set to a value if an error occurs in building (such as numnodes == maxnodes)
 	int *leafsort;
 	int *leafsortscratch;
 }
 bih_t;
 
-int BIH_Build(bih_t *bih, int numleafs, bih_leaf_t *leafs, int maxnodes, bih_node_t *nodes, int *temp_leafsort, int *temp_leafsortscratch);
+int BIH_Build(bih_t *bih, int numleafs, bih_leaf_t *leafs, int maxnodes, bih_node_t *nodes, int *temp_leafsort, int *temp_leafsortscratch, bih_buildmethod_t method);
 
 int BIH_GetTriangleListForBox(const bih_t *bih, int maxtriangles, int *trianglelist_idx, int *trianglelist_surf, const float *mins, const float *maxs);
 
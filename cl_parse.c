@@ -488,14 +488,14 @@ static void CL_SetupWorldModel(void)
 		Cvar_SetQuick(&cl_worldname, cl.worldname);
 		Cvar_SetQuick(&cl_worldnamenoextension, cl.worldnamenoextension);
 		Cvar_SetQuick(&cl_worldbasename, cl.worldbasename);
-		World_SetSize(&cl.world, cl.worldname, cl.worldmodel->normalmins, cl.worldmodel->normalmaxs, prog);
+		World_SetSize(&cl.world, cl.worldname, cl.worldmodel->normalmins, cl.worldmodel->normalmaxs, prog, false);
 	}
 	else
 	{
 		Cvar_SetQuick(&cl_worldmessage, cl.worldmessage);
 		Cvar_SetQuick(&cl_worldnamenoextension, "");
 		Cvar_SetQuick(&cl_worldbasename, "");
-		World_SetSize(&cl.world, "", defaultmins, defaultmaxs, prog);
+		World_SetSize(&cl.world, "", defaultmins, defaultmaxs, prog, false);
 	}
 	World_Start(&cl.world);
 
@@ -1078,6 +1078,40 @@ static void CL_UpdateItemsAndWeapon(void)
 #define LOADPROGRESSWEIGHT_WORLDMODEL      30.0
 #define LOADPROGRESSWEIGHT_WORLDMODEL_INIT  2.0
 
+/// lets the worker threads inflate the models and sounds that are about to be loaded
+static void CL_PrefetchPrecaches(void)
+{
+	int i, len, numpaths = 0;
+	const char **paths;
+	char (*names)[MAX_QPATH + 16];
+
+	paths = (const char **)Mem_Alloc(tempmempool, (MAX_MODELS + MAX_SOUNDS * 2) * sizeof(*paths));
+	names = (char (*)[MAX_QPATH + 16])Mem_Alloc(tempmempool, MAX_SOUNDS * 2 * sizeof(*names));
+	// a local game uses the models of the server
+	if (!sv.active)
+		for (i = cl.loadmodel_current;i < cl.loadmodel_total;i++)
+			if (cl.model_name[i][0] && cl.model_name[i][0] != '*')
+				paths[numpaths++] = cl.model_name[i];
+	// same names as S_LoadSound tries first
+	for (i = cl.loadsound_current;i < cl.loadsound_total;i++)
+	{
+		if (!cl.sound_name[i][0])
+			continue;
+		dpsnprintf(names[i * 2], sizeof(names[i * 2]), "sound/%s", cl.sound_name[i]);
+		paths[numpaths++] = names[i * 2];
+		len = (int)strlen(names[i * 2]);
+		if (len >= 4 && !strcasecmp(names[i * 2] + len - 4, ".wav"))
+		{
+			strlcpy(names[i * 2 + 1], names[i * 2], sizeof(names[i * 2 + 1]));
+			memcpy(names[i * 2 + 1] + len - 3, "ogg", 4);
+			paths[numpaths++] = names[i * 2 + 1];
+		}
+	}
+	FS_PrefetchFiles(paths, numpaths);
+	Mem_Free(names);
+	Mem_Free(paths);
+}
+
 static void CL_BeginDownloads(qboolean aborteddownload)
 {
 	char vabuf[1024];
@@ -1124,6 +1158,9 @@ static void CL_BeginDownloads(qboolean aborteddownload)
 		}
 	}
 
+	if ((cl.loadmodel_current == 1 && cl.loadmodel_current < cl.loadmodel_total) || (cl.loadsound_current == 1 && cl.loadsound_current < cl.loadsound_total))
+		CL_PrefetchPrecaches();
+
 	if (cl.loadmodel_current < cl.loadmodel_total)
 	{
 		// loading models
@@ -1236,6 +1273,8 @@ static void CL_BeginDownloads(qboolean aborteddownload)
 		SCR_PopLoadingScreen(false);
 		// finished loading sounds
 	}
+	// anything not loaded from the prefetch lists
+	FS_PrefetchFlush();
 
 	if(IS_NEXUIZ_DERIVED(gamemode))
 		Cvar_SetValueQuick(&cl_serverextension_download, false);
@@ -455,18 +455,16 @@ static void VM_CL_precache_model (prvm_prog_t *prog)
 	VM_Warning(prog, "VM_CL_precache_model: model \"%s\" not found\n", name);
 }
 
-// #22 entity(vector org, float rad) findradius
-static void VM_CL_findradius (prvm_prog_t *prog)
+// shared by findradius and findradius_sorted
+static void VM_CL_FindRadius (prvm_prog_t *prog, qboolean sorted)
 {
 	prvm_edict_t	*ent, *chain;
-	vec_t			radius, radius2;
-	vec3_t			org, eorg, mins, maxs;
-	int				i, numtouchedicts;
+	vec_t			radius;
+	vec3_t			org, mins, maxs;
+	int				i, numedicts, numtouchedicts;
 	static prvm_edict_t	*touchedicts[MAX_EDICTS];
 	int             chainfield;
 
-	VM_SAFEPARMCOUNTRANGE(2, 3, VM_CL_findradius);
-
 	if(prog->argc == 3)
 		chainfield = PRVM_G_INT(OFS_PARM2);
 	else
@@ -478,7 +476,6 @@ static void VM_CL_findradius (prvm_prog_t *prog)
 
 	VectorCopy(PRVM_G_VECTOR(OFS_PARM0), org);
 	radius = PRVM_G_FLOAT(OFS_PARM1);
-	radius2 = radius * radius;
 
 	mins[0] = org[0] - (radius + 1);
 	mins[1] = org[1] - (radius + 1);
@@ -493,35 +490,44 @@ static void VM_CL_findradius (prvm_prog_t *prog)
 		Con_Printf("CSQC_EntitiesInBox returned %i edicts, max was %i\n", numtouchedicts, MAX_EDICTS);
 		numtouchedicts = MAX_EDICTS;
 	}
-	for (i = 0;i < numtouchedicts;i++)
+	for (i = 0, numedicts = 0;i < numtouchedicts;i++)
 	{
 		ent = touchedicts[i];
 		// Quake did not return non-solid entities but darkplaces does
 		// (note: this is the reason you can't blow up fallen zombies)
 		if (PRVM_clientedictfloat(ent, solid) == SOLID_NOT && !sv_gameplayfix_blowupfallenzombies.integer)
 			continue;
-		// LordHavoc: compare against bounding box rather than center so it
-		// doesn't miss large objects, and use DotProduct instead of Length
-		// for a major speedup
-		VectorSubtract(org, PRVM_clientedictvector(ent, origin), eorg);
-		if (sv_gameplayfix_findradiusdistancetobox.integer)
-		{
-			eorg[0] -= bound(PRVM_clientedictvector(ent, mins)[0], eorg[0], PRVM_clientedictvector(ent, maxs)[0]);
-			eorg[1] -= bound(PRVM_clientedictvector(ent, mins)[1], eorg[1], PRVM_clientedictvector(ent, maxs)[1]);
-			eorg[2] -= bound(PRVM_clientedictvector(ent, mins)[2], eorg[2], PRVM_clientedictvector(ent, maxs)[2]);
-		}
-		else
-			VectorMAMAM(1, eorg, -0.5f, PRVM_clientedictvector(ent, mins), -0.5f, PRVM_clientedictvector(ent, maxs), eorg);
-		if (DotProduct(eorg, eorg) < radius2)
-		{
-			PRVM_EDICTFIELDEDICT(ent, chainfield) = PRVM_EDICT_TO_PROG(chain);
-			chain = ent;
-		}
+		touchedicts[numedicts++] = ent;
+	}
+	// LordHavoc: compare against bounding box rather than center so it
+	// doesn't miss large objects, and use DotProduct instead of Length
+	// for a major speedup
+	numedicts = VM_FindRadius_Filter(prog, org, radius, sv_gameplayfix_findradiusdistancetobox.integer != 0, sorted, touchedicts, numedicts);
+	// the chain is built backwards, so the sorted one starts at the nearest
+	for (i = 0;i < numedicts;i++)
+	{
+		ent = touchedicts[sorted ? numedicts - 1 - i : i];
+		PRVM_EDICTFIELDEDICT(ent, chainfield) = PRVM_EDICT_TO_PROG(chain);
+		chain = ent;
 	}
 
 	VM_RETURN_EDICT(chain);
 }
 
+// #22 entity(vector org, float rad) findradius
+static void VM_CL_findradius (prvm_prog_t *prog)
+{
+	VM_SAFEPARMCOUNTRANGE(2, 3, VM_CL_findradius);
+	VM_CL_FindRadius(prog, false);
+}
+
+// #636 entity(vector org, float rad, .entity tofield) findradius_sorted (DP_QC_FINDRADIUS_SORTED)
+static void VM_CL_findradius_sorted (prvm_prog_t *prog)
+{
+	VM_SAFEPARMCOUNTRANGE(2, 3, VM_CL_findradius_sorted);
+	VM_CL_FindRadius(prog, true);
+}
+
 // #34 float() droptofloor
 static void VM_CL_droptofloor (prvm_prog_t *prog)
 {
@@ -1872,6 +1878,7 @@ static void VM_CL_copyentity (prvm_prog_t *prog)
 		return;
 	}
 	memcpy(out->fields.fp, in->fields.fp, prog->entityfields * sizeof(prvm_vec_t));
+	PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(out));
 	CL_LinkEdict(out);
 }
 
@@ -4754,7 +4761,7 @@ VM_setbindmaps,						// #632 float(vector bm) setbindmap
 NULL,							// #633
 NULL,							// #634
 NULL,							// #635
-NULL,							// #636
+VM_CL_findradius_sorted,		// #636 entity(vector org, float rad, .entity tofield) findradius_sorted (DP_QC_FINDRADIUS_SORTED)
 NULL,							// #637
 VM_CL_RotateMoves,					// #638
 VM_digest_hex,						// #639
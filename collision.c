@@ -1443,6 +1443,36 @@ static void Collision_TransformBrush(const matrix4x4_t *matrix, colbrushf_t *bru
 	}
 }
 
+/*
+collision cache
+
+Line traces against static surfaces are kept in a hash table split into
+shards (picked by the hash) that can be searched and filled from several
+threads at once: a reader never locks, every entry has a version that is
+odd while a thread rewrites it, so a reader that sees the version change
+around its copy just treats that entry as a miss.  Entries remember the
+generation (counted up by Collision_Cache_NewFrame) they were last used in
+and only those not used in the current generation are replaced, a shard
+that found nothing to replace grows at the next frame.  Collision_Cache_Reset
+and Collision_Cache_NewFrame must not run while other threads trace.
+*/
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define Collision_Cache_MemoryBarrier() MemoryBarrier()
+#define Collision_Cache_CompareAndSwap(p, oldvalue, newvalue) (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(newvalue), (LONG)(oldvalue)) == (LONG)(oldvalue))
+#else
+#define Collision_Cache_MemoryBarrier() __sync_synchronize()
+#define Collision_Cache_CompareAndSwap(p, oldvalue, newvalue) __sync_bool_compare_and_swap(p, oldvalue, newvalue)
+#endif
+
+#define COLLISION_CACHE_SHARDS 16
+// entries of a shard to start with and at most, powers of two
+#define COLLISION_CACHE_SHARDMIN 16
+#define COLLISION_CACHE_SHARDMAX 8192
+// entries looked at from the one the hash points to
+#define COLLISION_CACHE_PROBES 8
+
 typedef struct collision_cachedtrace_parameters_s
 {
 	dp_model_t *model;
@@ -1457,53 +1487,44 @@ collision_cachedtrace_parameters_t;
 
 typedef struct collision_cachedtrace_s
 {
-	qboolean valid;
+	volatile unsigned int version; // odd while being written
+	volatile unsigned int generation; // of the last use, 0 = never used
+	unsigned int fullhashindex;
 	collision_cachedtrace_parameters_t p;
 	trace_t result;
 }
 collision_cachedtrace_t;
 
+typedef struct collision_cacheshard_s
+{
+	collision_cachedtrace_t *entries;
+	unsigned int size;
+	volatile int full; // a trace found nothing to replace, grow at the next frame
+}
+collision_cacheshard_t;
+
 static mempool_t *collision_cachedtrace_mempool;
-static collision_cachedtrace_t *collision_cachedtrace_array;
-static int collision_cachedtrace_firstfree;
-static int collision_cachedtrace_lastused;
-static int collision_cachedtrace_max;
-static unsigned char collision_cachedtrace_sequence;
-static int collision_cachedtrace_hashsize;
-static int *collision_cachedtrace_hash;
-static unsigned int *collision_cachedtrace_arrayfullhashindex;
-static unsigned int *collision_cachedtrace_arrayhashindex;
-static unsigned int *collision_cachedtrace_arraynext;
-static unsigned char *collision_cachedtrace_arrayused;
-static qboolean collision_cachedtrace_rebuildhash;
+static collision_cacheshard_t collision_cachedtrace_shards[COLLISION_CACHE_SHARDS];
+static unsigned int collision_cachedtrace_generation;
+
+static void Collision_Cache_AllocShard(collision_cacheshard_t *shard, unsigned int size)
+{
+	if (shard->entries)
+		Mem_Free(shard->entries);
+	shard->entries = NULL;
+	shard->size = size;
+	shard->full = false;
+	if (size)
+		shard->entries = (collision_cachedtrace_t *)Mem_Alloc(collision_cachedtrace_mempool, size * sizeof(collision_cachedtrace_t));
+}
 
 void Collision_Cache_Reset(qboolean resetlimits)
 {
-	if (collision_cachedtrace_hash)
-		Mem_Free(collision_cachedtrace_hash);
-	if (collision_cachedtrace_array)
-		Mem_Free(collision_cachedtrace_array);
-	if (collision_cachedtrace_arrayfullhashindex)
-		Mem_Free(collision_cachedtrace_arrayfullhashindex);
-	if (collision_cachedtrace_arrayhashindex)
-		Mem_Free(collision_cachedtrace_arrayhashindex);
-	if (collision_cachedtrace_arraynext)
-		Mem_Free(collision_cachedtrace_arraynext);
-	if (collision_cachedtrace_arrayused)
-		Mem_Free(collision_cachedtrace_arrayused);
-	if (resetlimits || !collision_cachedtrace_max)
-		collision_cachedtrace_max = collision_cache.integer ? 128 : 1;
-	collision_cachedtrace_firstfree = 1;
-	collision_cachedtrace_lastused = 0;
-	collision_cachedtrace_hashsize = collision_cachedtrace_max;
-	collision_cachedtrace_array = (collision_cachedtrace_t *)Mem_Alloc(collision_cachedtrace_mempool, collision_cachedtrace_max * sizeof(collision_cachedtrace_t));
-	collision_cachedtrace_hash = (int *)Mem_Alloc(collision_cachedtrace_mempool, collision_cachedtrace_hashsize * sizeof(int));
-	collision_cachedtrace_arrayfullhashindex = (unsigned int *)Mem_Alloc(collision_cachedtrace_mempool, collision_cachedtrace_max * sizeof(unsigned int));
-	collision_cachedtrace_arrayhashindex = (unsigned int *)Mem_Alloc(collision_cachedtrace_mempool, collision_cachedtrace_max * sizeof(unsigned int));
-	collision_cachedtrace_arraynext = (unsigned int *)Mem_Alloc(collision_cachedtrace_mempool, collision_cachedtrace_max * sizeof(unsigned int));
-	collision_cachedtrace_arrayused = (unsigned char *)Mem_Alloc(collision_cachedtrace_mempool, collision_cachedtrace_max * sizeof(unsigned char));
-	collision_cachedtrace_sequence = 1;
-	collision_cachedtrace_rebuildhash = false;
+	int i;
+	collision_cacheshard_t *shard;
+	for (i = 0, shard = collision_cachedtrace_shards;i < COLLISION_CACHE_SHARDS;i++, shard++)
+		Collision_Cache_AllocShard(shard, resetlimits || !shard->size ? (collision_cache.integer ? COLLISION_CACHE_SHARDMIN : 0) : shard->size);
+	collision_cachedtrace_generation = 1;
 }
 
 void Collision_Cache_Init(mempool_t *mempool)
@@ -1512,62 +1533,24 @@ void Collision_Cache_Init(mempool_t *mempool)
 	Collision_Cache_Reset(true);
 }
 
-static void Collision_Cache_RebuildHash(void)
+void Collision_Cache_NewFrame(void)
 {
-	int index;
-	int range = collision_cachedtrace_lastused + 1;
-	unsigned char sequence = collision_cachedtrace_sequence;
-	int firstfree = collision_cachedtrace_max;
-	int lastused = 0;
-	int *hash = collision_cachedtrace_hash;
-	unsigned int hashindex;
-	unsigned int *arrayhashindex = collision_cachedtrace_arrayhashindex;
-	unsigned int *arraynext = collision_cachedtrace_arraynext;
-	collision_cachedtrace_rebuildhash = false;
-	memset(collision_cachedtrace_hash, 0, collision_cachedtrace_hashsize * sizeof(int));
-	for (index = 1;index < range;index++)
+	int i;
+	collision_cacheshard_t *shard;
+	if ((collision_cache.integer != 0) != (collision_cachedtrace_shards[0].size != 0))
+		Collision_Cache_Reset(true);
+	for (i = 0, shard = collision_cachedtrace_shards;i < COLLISION_CACHE_SHARDS;i++, shard++)
 	{
-		if (collision_cachedtrace_arrayused[index] == sequence)
+		if (shard->full)
 		{
-			hashindex = arrayhashindex[index];
-			arraynext[index] = hash[hashindex];
-			hash[hashindex] = index;
-			lastused = index;
+			if (shard->size < COLLISION_CACHE_SHARDMAX)
+				Collision_Cache_AllocShard(shard, shard->size * 2);
+			shard->full = false;
 		}
-		else
-		{
-			if (firstfree > index)
-				firstfree = index;
-			collision_cachedtrace_arrayused[index] = 0;
-		}
-	}
-	collision_cachedtrace_firstfree = firstfree;
-	collision_cachedtrace_lastused = lastused;
-}
-
-void Collision_Cache_NewFrame(void)
-{
-	if (collision_cache.integer)
-	{
-		if (collision_cachedtrace_max < 128)
-			Collision_Cache_Reset(true);
-	}
-	else
-	{
-		if (collision_cachedtrace_max > 1)
-			Collision_Cache_Reset(true);
-	}
-	// rebuild hash if sequence would overflow byte, otherwise increment
-	if (collision_cachedtrace_sequence == 255)
-	{
-		Collision_Cache_RebuildHash();
-		collision_cachedtrace_sequence = 1;
-	}
-	else
-	{
-		collision_cachedtrace_rebuildhash = true;
-		collision_cachedtrace_sequence++;
 	}
+	// entries of older generations stay valid, they are just free to replace
+	if (++collision_cachedtrace_generation == 0)
+		Collision_Cache_Reset(false);
 }
 
 static unsigned int Collision_Cache_HashIndexForArray(unsigned int *array, unsigned int size)
@@ -1577,143 +1560,155 @@ static unsigned int Collision_Cache_HashIndexForArray(unsigned int *array, unsig
 	// this is a super-cheesy checksum, designed only for speed
 	for (i = 0;i < size;i++)
 		hashindex += array[i] * (1 + i);
+	// mix the bits, the low ones pick the shard and the entry
+	hashindex ^= hashindex >> 16;
+	hashindex *= 0x45d9f3b;
+	hashindex ^= hashindex >> 16;
 	return hashindex;
 }
 
-static collision_cachedtrace_t *Collision_Cache_Lookup(dp_model_t *model, const matrix4x4_t *matrix, const matrix4x4_t *inversematrix, const vec3_t start, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask)
+static qboolean Collision_Cache_SameParameters(const collision_cachedtrace_parameters_t *a, const collision_cachedtrace_parameters_t *b)
 {
-	int hashindex = 0;
-	unsigned int fullhashindex;
-	int index = 0;
-	int range;
-	unsigned char sequence = collision_cachedtrace_sequence;
-	int *hash = collision_cachedtrace_hash;
-	unsigned int *arrayfullhashindex = collision_cachedtrace_arrayfullhashindex;
-	unsigned int *arraynext = collision_cachedtrace_arraynext;
-	collision_cachedtrace_t *cached = collision_cachedtrace_array + index;
-	collision_cachedtrace_parameters_t params;
-	// all non-cached traces use the same index
-	if (!collision_cache.integer)
-		r_refdef.stats[r_stat_photoncache_traced]++;
-	else
+	//return !memcmp(a, b, sizeof(*a));
+	return a->model == b->model
+	 && a->end[0] == b->end[0]
+	 && a->end[1] == b->end[1]
+	 && a->end[2] == b->end[2]
+	 && a->start[0] == b->start[0]
+	 && a->start[1] == b->start[1]
+	 && a->start[2] == b->start[2]
+	 && a->hitsupercontentsmask == b->hitsupercontentsmask
+	 && a->skipsupercontentsmask == b->skipsupercontentsmask
+	 && a->skipmaterialflagsmask == b->skipmaterialflagsmask
+	 && a->matrix.m[0][0] == b->matrix.m[0][0]
+	 && a->matrix.m[0][1] == b->matrix.m[0][1]
+	 && a->matrix.m[0][2] == b->matrix.m[0][2]
+	 && a->matrix.m[0][3] == b->matrix.m[0][3]
+	 && a->matrix.m[1][0] == b->matrix.m[1][0]
+	 && a->matrix.m[1][1] == b->matrix.m[1][1]
+	 && a->matrix.m[1][2] == b->matrix.m[1][2]
+	 && a->matrix.m[1][3] == b->matrix.m[1][3]
+	 && a->matrix.m[2][0] == b->matrix.m[2][0]
+	 && a->matrix.m[2][1] == b->matrix.m[2][1]
+	 && a->matrix.m[2][2] == b->matrix.m[2][2]
+	 && a->matrix.m[2][3] == b->matrix.m[2][3]
+	 && a->matrix.m[3][0] == b->matrix.m[3][0]
+	 && a->matrix.m[3][1] == b->matrix.m[3][1]
+	 && a->matrix.m[3][2] == b->matrix.m[3][2]
+	 && a->matrix.m[3][3] == b->matrix.m[3][3];
+}
+
+/// returns the shard for the parameters (or NULL if the cache is off) and
+/// fills in the rest of them and their hash
+static collision_cacheshard_t *Collision_Cache_Parameters(collision_cachedtrace_parameters_t *params, unsigned int *fullhashindex, dp_model_t *model, const matrix4x4_t *matrix, const vec3_t start, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask)
+{
+	collision_cacheshard_t *shard;
+	memset(params, 0, sizeof(*params));
+	params->model = model;
+	VectorCopy(start, params->start);
+	VectorCopy(end,   params->end);
+	params->hitsupercontentsmask = hitsupercontentsmask;
+	params->skipsupercontentsmask = skipsupercontentsmask;
+	params->skipmaterialflagsmask = skipmaterialflagsmask;
+	params->matrix = *matrix;
+	*fullhashindex = Collision_Cache_HashIndexForArray((unsigned int *)params, sizeof(*params) / sizeof(unsigned int));
+	shard = collision_cachedtrace_shards + (*fullhashindex & (COLLISION_CACHE_SHARDS - 1));
+	return shard->entries ? shard : NULL;
+}
+
+static qboolean Collision_Cache_Lookup(collision_cacheshard_t *shard, const collision_cachedtrace_parameters_t *params, unsigned int fullhashindex, trace_t *trace)
+{
+	int probe;
+	unsigned int version;
+	unsigned int mask = shard->size - 1;
+	unsigned int index = fullhashindex / COLLISION_CACHE_SHARDS;
+	collision_cachedtrace_t *cached;
+	trace_t result;
+	for (probe = 0;probe < COLLISION_CACHE_PROBES;probe++)
 	{
-		// cached trace lookup
-		memset(&params, 0, sizeof(params));
-		params.model = model;
-		VectorCopy(start, params.start);
-		VectorCopy(end,   params.end);
-		params.hitsupercontentsmask = hitsupercontentsmask;
-		params.skipsupercontentsmask = skipsupercontentsmask;
-		params.skipmaterialflagsmask = skipmaterialflagsmask;
-		params.matrix = *matrix;
-		fullhashindex = Collision_Cache_HashIndexForArray((unsigned int *)&params, sizeof(params) / sizeof(unsigned int));
-		hashindex = (int)(fullhashindex % (unsigned int)collision_cachedtrace_hashsize);
-		for (index = hash[hashindex];index;index = arraynext[index])
-		{
-			if (arrayfullhashindex[index] != fullhashindex)
-				continue;
-			cached = collision_cachedtrace_array + index;
-			//if (memcmp(&cached->p, &params, sizeof(params)))
-			if (cached->p.model != params.model
-			 || cached->p.end[0] != params.end[0]
-			 || cached->p.end[1] != params.end[1]
-			 || cached->p.end[2] != params.end[2]
-			 || cached->p.start[0] != params.start[0]
-			 || cached->p.start[1] != params.start[1]
-			 || cached->p.start[2] != params.start[2]
-			 || cached->p.hitsupercontentsmask != params.hitsupercontentsmask
-			 || cached->p.skipsupercontentsmask != params.skipsupercontentsmask
-			 || cached->p.skipmaterialflagsmask != params.skipmaterialflagsmask
-			 || cached->p.matrix.m[0][0] != params.matrix.m[0][0]
-			 || cached->p.matrix.m[0][1] != params.matrix.m[0][1]
-			 || cached->p.matrix.m[0][2] != params.matrix.m[0][2]
-			 || cached->p.matrix.m[0][3] != params.matrix.m[0][3]
-			 || cached->p.matrix.m[1][0] != params.matrix.m[1][0]
-			 || cached->p.matrix.m[1][1] != params.matrix.m[1][1]
-			 || cached->p.matrix.m[1][2] != params.matrix.m[1][2]
-			 || cached->p.matrix.m[1][3] != params.matrix.m[1][3]
-			 || cached->p.matrix.m[2][0] != params.matrix.m[2][0]
-			 || cached->p.matrix.m[2][1] != params.matrix.m[2][1]
-			 || cached->p.matrix.m[2][2] != params.matrix.m[2][2]
-			 || cached->p.matrix.m[2][3] != params.matrix.m[2][3]
-			 || cached->p.matrix.m[3][0] != params.matrix.m[3][0]
-			 || cached->p.matrix.m[3][1] != params.matrix.m[3][1]
-			 || cached->p.matrix.m[3][2] != params.matrix.m[3][2]
-			 || cached->p.matrix.m[3][3] != params.matrix.m[3][3]
-			)
-				continue;
-			// found a matching trace in the cache
-			r_refdef.stats[r_stat_photoncache_cached]++;
-			cached->valid = true;
-			collision_cachedtrace_arrayused[index] = collision_cachedtrace_sequence;
-			return cached;
-		}
-		r_refdef.stats[r_stat_photoncache_traced]++;
-		// find an unused cache entry
-		for (index = collision_cachedtrace_firstfree, range = collision_cachedtrace_max;index < range;index++)
-			if (collision_cachedtrace_arrayused[index] == 0)
-				break;
-		if (index == range)
-		{
-			// all claimed, but probably some are stale...
-			for (index = 1, range = collision_cachedtrace_max;index < range;index++)
-				if (collision_cachedtrace_arrayused[index] != sequence)
-					break;
-			if (index < range)
-			{
-				// found a stale one, rebuild the hash
-				Collision_Cache_RebuildHash();
-			}
-			else
-			{
-				// we need to grow the cache
-				collision_cachedtrace_max *= 2;
-				Collision_Cache_Reset(false);
-				index = 1;
-			}
-		}
-		// link the new cache entry into the hash bucket
-		collision_cachedtrace_firstfree = index + 1;
-		if (collision_cachedtrace_lastused < index)
-			collision_cachedtrace_lastused = index;
-		cached = collision_cachedtrace_array + index;
-		collision_cachedtrace_arraynext[index] = collision_cachedtrace_hash[hashindex];
-		collision_cachedtrace_hash[hashindex] = index;
-		collision_cachedtrace_arrayhashindex[index] = hashindex;
-		cached->valid = false;
-		cached->p = params;
-		collision_cachedtrace_arrayfullhashindex[index] = fullhashindex;
-		collision_cachedtrace_arrayused[index] = collision_cachedtrace_sequence;
+		cached = shard->entries + ((index + probe) & mask);
+		version = cached->version;
+		if (version & 1)
+			continue;
+		Collision_Cache_MemoryBarrier();
+		if (cached->fullhashindex != fullhashindex || !Collision_Cache_SameParameters(&cached->p, params))
+			continue;
+		result = cached->result;
+		Collision_Cache_MemoryBarrier();
+		// if it changed while we copied it, someone else is reusing it
+		if (cached->version != version)
+			continue;
+		// found a matching trace in the cache
+		cached->generation = collision_cachedtrace_generation;
+		*trace = result;
+		return true;
 	}
-	return cached;
+	return false;
 }
 
-void Collision_Cache_ClipLineToGenericEntitySurfaces(trace_t *trace, dp_model_t *model, matrix4x4_t *matrix, matrix4x4_t *inversematrix, const vec3_t start, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask)
+static void Collision_Cache_Store(collision_cacheshard_t *shard, const collision_cachedtrace_parameters_t *params, unsigned int fullhashindex, const trace_t *trace)
 {
-	collision_cachedtrace_t *cached = Collision_Cache_Lookup(model, matrix, inversematrix, start, end, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask);
-	if (cached->valid)
+	int probe;
+	unsigned int version;
+	unsigned int mask = shard->size - 1;
+	unsigned int index = fullhashindex / COLLISION_CACHE_SHARDS;
+	unsigned int generation = collision_cachedtrace_generation;
+	collision_cachedtrace_t *cached;
+	for (probe = 0;probe < COLLISION_CACHE_PROBES;probe++)
 	{
-		*trace = cached->result;
+		cached = shard->entries + ((index + probe) & mask);
+		version = cached->version;
+		// leave entries alone that are written or were used this frame
+		if ((version & 1) || cached->generation == generation)
+			continue;
+		if (!Collision_Cache_CompareAndSwap(&cached->version, version, version + 1))
+			continue;
+		Collision_Cache_MemoryBarrier();
+		cached->fullhashindex = fullhashindex;
+		cached->p = *params;
+		cached->result = *trace;
+		cached->generation = generation;
+		Collision_Cache_MemoryBarrier();
+		cached->version = version + 2;
 		return;
 	}
+	shard->full = true;
+}
+
+void Collision_Cache_ClipLineToGenericEntitySurfaces(trace_t *trace, dp_model_t *model, matrix4x4_t *matrix, matrix4x4_t *inversematrix, const vec3_t start, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask, collision_cachestats_t *stats)
+{
+	collision_cachedtrace_parameters_t params;
+	unsigned int fullhashindex;
+	collision_cacheshard_t *shard = Collision_Cache_Parameters(&params, &fullhashindex, model, matrix, start, end, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask);
+	if (shard && Collision_Cache_Lookup(shard, &params, fullhashindex, trace))
+	{
+		stats->cached++;
+		return;
+	}
+	stats->traced++;
 
 	Collision_ClipLineToGenericEntity(trace, model, NULL, NULL, vec3_origin, vec3_origin, 0, matrix, inversematrix, start, end, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, collision_extendmovelength.value, true);
 
-	cached->result = *trace;
+	if (shard)
+		Collision_Cache_Store(shard, &params, fullhashindex, trace);
 }
 
-void Collision_Cache_ClipLineToWorldSurfaces(trace_t *trace, dp_model_t *model, const vec3_t start, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask)
+void Collision_Cache_ClipLineToWorldSurfaces(trace_t *trace, dp_model_t *model, const vec3_t start, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask, collision_cachestats_t *stats)
 {
-	collision_cachedtrace_t *cached = Collision_Cache_Lookup(model, &identitymatrix, &identitymatrix, start, end, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask);
-	if (cached->valid)
+	collision_cachedtrace_parameters_t params;
+	unsigned int fullhashindex;
+	collision_cacheshard_t *shard = Collision_Cache_Parameters(&params, &fullhashindex, model, &identitymatrix, start, end, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask);
+	if (shard && Collision_Cache_Lookup(shard, &params, fullhashindex, trace))
 	{
-		*trace = cached->result;
+		stats->cached++;
 		return;
 	}
+	stats->traced++;
 
 	Collision_ClipLineToWorld(trace, model, start, end, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, collision_extendmovelength.value, true);
 
-	cached->result = *trace;
+	if (shard)
+		Collision_Cache_Store(shard, &params, fullhashindex, trace);
 }
 
 typedef struct extendtraceinfo_s
@@ -45,6 +45,7 @@
 #endif
 
 #include "thread.h"
+#include "taskqueue.h"
 
 #include "fs.h"
 #include "wad.h"
@@ -103,6 +104,11 @@ typedef int filedesc_t;
 static filedesc_t FILEDESC_DUP(const char *filename, filedesc_t fd) {
 	return dup(fd);
 }
+// uncompressed files in packages can be mapped into memory
+# define FS_MMAP 1
+# ifndef WIN32
+#  include <sys/mman.h>
+# endif
 #endif
 
 /** \page fs File System
@@ -229,6 +235,8 @@ typedef struct
 #define QFILE_FLAG_DATA (1 << 2)
 /// real file will be removed on close
 #define QFILE_FLAG_REMOVE (1 << 3)
+/// data is a private mapping of a package (set with QFILE_FLAG_DATA)
+#define QFILE_FLAG_MAPPED (1 << 4)
 
 #define FILE_BUFF_SIZE 2048
 typedef struct
@@ -256,6 +264,8 @@ struct qfile_s
 	ztoolkit_t*		ztk;	///< For zipped files.
 
 	const unsigned char *data;	///< For data files.
+	void *mapbase;	///< For mapped files, start and size of the mapping
+	size_t mapsize;
 
 	const char *filename; ///< Kept around for QFILE_FLAG_REMOVE, unused otherwise
 };
@@ -322,6 +332,7 @@ typedef struct pack_s
 	int numfiles;
 	qboolean vpack;
 	packfile_t *files;
+	fs_offset_t filesize; ///< size of the package file, 0 until a file in it is mapped
 } pack_t;
 //@}
 
@@ -348,9 +359,12 @@ void FS_Ls_f(void);
 void FS_Which_f(void);
 
 static searchpath_t *FS_FindFile (const char *name, int* index, qboolean quiet);
+static void FS_Index_Invalidate (const char *ospath);
 static packfile_t* FS_AddFileToPack (const char* name, pack_t* pack,
 									fs_offset_t offset, fs_offset_t packsize,
 									fs_offset_t realsize, int flags);
+static pack_t *FS_PackCache_Get (const char *packfile, filedesc_t packhandle);
+static void FS_PackCache_Put (pack_t *pack);
 
 
 /*
@@ -365,6 +379,26 @@ mempool_t *fs_mempool;
 void *fs_mutex = NULL;
 
 searchpath_t *fs_searchpaths = NULL;
+
+/// hash index of every file in fs_searchpaths, see FS_Index_Build
+typedef struct fsindexentry_s
+{
+	const char *name;
+	searchpath_t *search; ///< NULL if the name has to be looked up the slow way
+	int index; ///< in search->pack->files, -1 for directories
+	int order; ///< position of search in fs_searchpaths, lowest wins
+	qboolean ignorecase;
+	struct fsindexentry_s *next;
+} fsindexentry_t;
+
+static mempool_t *fs_index_mempool = NULL;
+static fsindexentry_t **fs_index_hash = NULL;
+static int fs_index_hashsize = 0;
+static int fs_index_numentries = 0;
+static unsigned char *fs_index_block = NULL;
+static size_t fs_index_blockused = 0;
+static qboolean fs_index_dirty = true;
+static qboolean fs_index_deepdirs = false; ///< directories were cut off at FS_INDEX_MAXDEPTH
 const char *const fs_checkgamedir_missing = "missing";
 
 #define MAX_FILES_IN_PACK	65536
@@ -385,6 +419,10 @@ int fs_all_gamedirs_count = 0;
 cvar_t scr_screenshot_name = {CVAR_NORESETTODEFAULTS, "scr_screenshot_name","dp", "prefix name for saved screenshots (changes based on -game commandline, as well as which game mode is running; the date is encoded using strftime escapes)"};
 cvar_t fs_empty_files_in_pack_mark_deletions = {0, "fs_empty_files_in_pack_mark_deletions", "0", "if enabled, empty files in a pak/pk3 count as not existing but cancel the search in further packs, effectively allowing patch pak/pk3 files to 'delete' files"};
 cvar_t cvar_fs_gamedir = {CVAR_READONLY | CVAR_NORESETTODEFAULTS, "fs_gamedir", "", "the list of currently selected gamedirs (use the 'gamedir' command to change this)"};
+cvar_t fs_mmap = {0, "fs_mmap", "1", "map uncompressed files in pak/pk3 archives into memory instead of reading them through a file handle, models, textures and sounds in them are then loaded without a copy"};
+cvar_t fs_prefetch = {0, "fs_prefetch", "1", "inflate compressed files of a level's precache lists in pk3 archives on the worker threads (see taskqueue_maxthreads) while earlier ones are loaded"};
+cvar_t fs_packcache = {0, "fs_packcache", "1", "keep the file lists of pak/pk3 archives in packcache.dat so that unchanged archives are not parsed again when the search path is built"};
+cvar_t fs_index = {0, "fs_index", "1", "look files up in a hash index of the whole search path instead of checking every pack and directory, the index is rebuilt when the search path changes and follows files written by the engine (use fs_rescan after adding files to game directories by other means, or set to 0)"};
 
 
 /*
@@ -820,10 +858,16 @@ static filedesc_t FS_SysOpenFiledesc(const char *filepath, const char *mode, qbo
 static pack_t *FS_LoadPackPK3 (const char *packfile)
 {
 	filedesc_t packhandle;
+	pack_t *pack;
 	packhandle = FS_SysOpenFiledesc (packfile, "rb", false);
 	if (!FILEDESC_ISVALID(packhandle))
 		return NULL;
-	return FS_LoadPackPK3FromFD(packfile, packhandle, false);
+	if ((pack = FS_PackCache_Get(packfile, packhandle)))
+		return pack;
+	pack = FS_LoadPackPK3FromFD(packfile, packhandle, false);
+	if (pack)
+		FS_PackCache_Put(pack);
+	return pack;
 }
 
 
@@ -926,6 +970,283 @@ static packfile_t* FS_AddFileToPack (const char* name, pack_t* pack,
 }
 
 
+
+/*
+=============================================================================
+
+PACK DIRECTORY CACHE
+
+Reading the central directory of a big pk3 and then the local header of each
+file for its true offset takes many small reads, so the sorted file lists of
+the packs are kept in packcache.dat in the user directory (or the base
+directory), keyed by path, size and modification time of each pack.  A pack
+that did not change since is then created from that list without parsing it.
+
+=============================================================================
+*/
+
+#define FS_PACKCACHE_FILENAME "packcache.dat"
+#define FS_PACKCACHE_VERSION 1
+
+typedef struct fs_packcache_s
+{
+	char filename[MAX_OSPATH];
+	fs_offset_t filesize;
+	fs_offset_t filetime;
+	int numfiles;
+	packfile_t *files;
+	qboolean used; ///< written back to the cache file
+	struct fs_packcache_s *next;
+} fs_packcache_t;
+
+typedef struct fs_packcacheheader_s
+{
+	char id[8];
+	int version;
+	int packfilesize; ///< sizeof(packfile_t), the file is only valid for one build
+	int numpacks;
+} fs_packcacheheader_t;
+
+typedef struct fs_packcacheentry_s
+{
+	fs_offset_t filesize;
+	fs_offset_t filetime;
+	int filenamelength; ///< including the terminating 0
+	int numfiles;
+} fs_packcacheentry_t;
+
+static fs_packcache_t *fs_packcaches;
+static qboolean fs_packcache_loaded;
+static qboolean fs_packcache_dirty;
+
+static void FS_PackCache_Path (char *path, size_t pathsize)
+{
+	dpsnprintf(path, pathsize, "%s%s", *fs_userdir ? fs_userdir : fs_basedir, FS_PACKCACHE_FILENAME);
+}
+
+static qboolean FS_PackCache_Stat (const char *packfile, fs_offset_t *filesize, fs_offset_t *filetime)
+{
+	struct stat st;
+
+	if (stat(packfile, &st) == -1)
+		return false;
+	*filesize = st.st_size;
+	*filetime = st.st_mtime;
+	return true;
+}
+
+/*
+====================
+FS_PackCache_Load
+
+Read the whole cache file at once and split it into one entry per pack
+====================
+*/
+static void FS_PackCache_Load (void)
+{
+	char path[MAX_OSPATH];
+	filedesc_t handle;
+	fs_offset_t size, ofs;
+	unsigned char *buf;
+	fs_packcacheheader_t header;
+	fs_packcacheentry_t entry;
+	fs_packcache_t *cache;
+	int i;
+
+	if (fs_packcache_loaded)
+		return;
+	fs_packcache_loaded = true;
+
+	FS_PackCache_Path(path, sizeof(path));
+	handle = FS_SysOpenFiledesc(path, "rb", false);
+	if (!FILEDESC_ISVALID(handle))
+		return;
+	size = FILEDESC_SEEK(handle, 0, SEEK_END);
+	if (size < (fs_offset_t)sizeof(header) || FILEDESC_SEEK(handle, 0, SEEK_SET) != 0)
+	{
+		FILEDESC_CLOSE(handle);
+		return;
+	}
+	buf = (unsigned char *)Mem_Alloc(tempmempool, size);
+	if (FILEDESC_READ(handle, buf, size) != size)
+	{
+		FILEDESC_CLOSE(handle);
+		Mem_Free(buf);
+		return;
+	}
+	FILEDESC_CLOSE(handle);
+
+	memcpy(&header, buf, sizeof(header));
+	ofs = sizeof(header);
+	if (memcmp(header.id, "DPPACKS", 8) || header.version != FS_PACKCACHE_VERSION || header.packfilesize != (int)sizeof(packfile_t))
+	{
+		Mem_Free(buf);
+		return;
+	}
+	for (i = 0;i < header.numpacks;i++)
+	{
+		if (size - ofs < (fs_offset_t)sizeof(entry))
+			break;
+		memcpy(&entry, buf + ofs, sizeof(entry));
+		ofs += sizeof(entry);
+		if (entry.filenamelength < 1 || entry.filenamelength > MAX_OSPATH || entry.numfiles < 0 || entry.numfiles > MAX_FILES_IN_PACK
+		 || size - ofs < entry.filenamelength + (fs_offset_t)entry.numfiles * (fs_offset_t)sizeof(packfile_t)
+		 || buf[ofs + entry.filenamelength - 1])
+			break;
+		cache = (fs_packcache_t *)Mem_Alloc(fs_mempool, sizeof(fs_packcache_t));
+		memcpy(cache->filename, buf + ofs, entry.filenamelength);
+		ofs += entry.filenamelength;
+		cache->filesize = entry.filesize;
+		cache->filetime = entry.filetime;
+		cache->numfiles = entry.numfiles;
+		cache->files = (packfile_t *)Mem_Alloc(fs_mempool, entry.numfiles * sizeof(packfile_t));
+		memcpy(cache->files, buf + ofs, entry.numfiles * sizeof(packfile_t));
+		ofs += entry.numfiles * sizeof(packfile_t);
+		cache->next = fs_packcaches;
+		fs_packcaches = cache;
+	}
+	Mem_Free(buf);
+	Con_DPrintf("Loaded %s (%i packs)\n", path, i);
+}
+
+/*
+====================
+FS_PackCache_Save
+
+Write the packs used since the start back to the cache file if one changed
+====================
+*/
+static void FS_PackCache_Save (void)
+{
+	char path[MAX_OSPATH];
+	filedesc_t handle;
+	fs_packcacheheader_t header;
+	fs_packcacheentry_t entry;
+	fs_packcache_t *cache;
+	qboolean ok = true;
+
+	if (!fs_packcache_dirty)
+		return;
+	fs_packcache_dirty = false;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.id, "DPPACKS", 8);
+	header.version = FS_PACKCACHE_VERSION;
+	header.packfilesize = sizeof(packfile_t);
+	for (cache = fs_packcaches;cache;cache = cache->next)
+		if (cache->used)
+			header.numpacks++;
+
+	FS_PackCache_Path(path, sizeof(path));
+	FS_CreatePath(path);
+	handle = FS_SysOpenFiledesc(path, "wb", false);
+	if (!FILEDESC_ISVALID(handle))
+		return;
+	ok = FILEDESC_WRITE(handle, &header, sizeof(header)) == sizeof(header);
+	for (cache = fs_packcaches;cache && ok;cache = cache->next)
+	{
+		if (!cache->used)
+			continue;
+		memset(&entry, 0, sizeof(entry));
+		entry.filesize = cache->filesize;
+		entry.filetime = cache->filetime;
+		entry.filenamelength = strlen(cache->filename) + 1;
+		entry.numfiles = cache->numfiles;
+		ok = FILEDESC_WRITE(handle, &entry, sizeof(entry)) == sizeof(entry)
+		  && FILEDESC_WRITE(handle, cache->filename, entry.filenamelength) == entry.filenamelength
+		  && FILEDESC_WRITE(handle, cache->files, cache->numfiles * sizeof(packfile_t)) == (fs_offset_t)(cache->numfiles * sizeof(packfile_t));
+	}
+	FILEDESC_CLOSE(handle);
+	if (!ok)
+	{
+		Con_Printf("Could not write %s\n", path);
+		remove(path);
+	}
+}
+
+/*
+====================
+FS_PackCache_Get
+
+Create a package entry from the cache if the pack did not change since its
+file list was stored, the handle is owned by the pack then
+====================
+*/
+static pack_t *FS_PackCache_Get (const char *packfile, filedesc_t packhandle)
+{
+	fs_packcache_t *cache;
+	fs_offset_t filesize, filetime;
+	pack_t *pack;
+
+	if (!fs_packcache.integer)
+		return NULL;
+	FS_PackCache_Load();
+	for (cache = fs_packcaches;cache;cache = cache->next)
+		if (!strcmp(cache->filename, packfile))
+			break;
+	if (!cache || !FS_PackCache_Stat(packfile, &filesize, &filetime) || cache->filesize != filesize || cache->filetime != filetime)
+		return NULL;
+	cache->used = true;
+
+	pack = (pack_t *)Mem_Alloc(fs_mempool, sizeof (pack_t));
+	pack->ignorecase = true; // PAK and PK3 both ignore case
+	strlcpy (pack->filename, packfile, sizeof (pack->filename));
+	pack->handle = packhandle;
+	pack->numfiles = cache->numfiles;
+	pack->files = (packfile_t *)Mem_Alloc(fs_mempool, cache->numfiles * sizeof(packfile_t));
+	memcpy(pack->files, cache->files, cache->numfiles * sizeof(packfile_t));
+
+	Con_DPrintf("Added packfile %s (%i files, cached)\n", packfile, pack->numfiles);
+	return pack;
+}
+
+/*
+====================
+FS_PackCache_Put
+
+Store the file list of a freshly parsed pack, the true offsets of all its
+files are looked up first so they are not needed anymore when it is cached
+====================
+*/
+static void FS_PackCache_Put (pack_t *pack)
+{
+	fs_packcache_t *cache, **prev;
+	fs_offset_t filesize, filetime;
+	int i;
+
+	if (!fs_packcache.integer || !FS_PackCache_Stat(pack->filename, &filesize, &filetime))
+		return;
+	FS_PackCache_Load();
+
+	for (i = 0;i < pack->numfiles;i++)
+		if (!PK3_GetTrueFileOffset(&pack->files[i], pack))
+			return;
+
+	for (prev = &fs_packcaches;(cache = *prev);prev = &cache->next)
+	{
+		if (!strcmp(cache->filename, pack->filename))
+		{
+			*prev = cache->next;
+			if (cache->files)
+				Mem_Free(cache->files);
+			Mem_Free(cache);
+			break;
+		}
+	}
+	cache = (fs_packcache_t *)Mem_Alloc(fs_mempool, sizeof(fs_packcache_t));
+	strlcpy(cache->filename, pack->filename, sizeof(cache->filename));
+	cache->filesize = filesize;
+	cache->filetime = filetime;
+	cache->numfiles = pack->numfiles;
+	cache->files = (packfile_t *)Mem_Alloc(fs_mempool, pack->numfiles * sizeof(packfile_t));
+	memcpy(cache->files, pack->files, pack->numfiles * sizeof(packfile_t));
+	cache->used = true;
+	cache->next = fs_packcaches;
+	fs_packcaches = cache;
+	fs_packcache_dirty = true;
+}
+
+
 static void FS_mkdir (const char *path)
 {
 	if(COM_CheckParm("-readonly"))
@@ -1016,6 +1337,8 @@ static pack_t *FS_LoadPackPAK (const char *packfile)
 	packhandle = FS_SysOpenFiledesc(packfile, "rb", false);
 	if (!FILEDESC_ISVALID(packhandle))
 		return NULL;
+	if ((pack = FS_PackCache_Get(packfile, packhandle)))
+		return pack;
 	if(FILEDESC_READ (packhandle, (void *)&header, sizeof(header)) != sizeof(header))
 	{
 		Con_Printf ("%s is not a packfile\n", packfile);
@@ -1078,6 +1401,8 @@ static pack_t *FS_LoadPackPAK (const char *packfile)
 
 	Mem_Free(info);
 
+	FS_PackCache_Put(pack);
+
 	Con_DPrintf("Added packfile %s (%i files)\n", packfile, numpackfiles);
 	return pack;
 }
@@ -1208,6 +1533,7 @@ static qboolean FS_AddPack_Fullpath(const char *pakfile, const char *shortname,
 				if(!strcasecmp(pak->filename + l - 7, ".pk3dir"))
 					pak->filename[l - 3] = 0;
 		}
+		fs_index_dirty = true;
 		return true;
 	}
 	else
@@ -1301,6 +1627,7 @@ static void FS_AddGameDirectory (const char *dir)
 	strlcpy (search->filename, dir, sizeof (search->filename));
 	search->next = fs_searchpaths;
 	fs_searchpaths = search;
+	fs_index_dirty = true;
 }
 
 
@@ -1375,6 +1702,8 @@ static void FS_ClearSearchPath (void)
 	// unload all packs and directory information, close all pack files
 	// (if a qfile is still reading a pack it won't be harmed because it used
 	//  dup() to get its own handle already)
+	fs_index_dirty = true;
+	FS_PrefetchFlush();
 	while (fs_searchpaths)
 	{
 		searchpath_t *search = fs_searchpaths;
@@ -1404,6 +1733,7 @@ static void FS_AddSelfPack(void)
 		search->next = fs_searchpaths;
 		search->pack = fs_selfpack;
 		fs_searchpaths = search;
+		fs_index_dirty = true;
 	}
 }
 
@@ -1509,6 +1839,9 @@ void FS_Rescan (void)
 		break;
 	}
 
+	// store the file lists of new or changed packs
+	FS_PackCache_Save();
+
 	// unload all wads so that future queries will return the new data
 	W_UnloadAll();
 }
@@ -2180,6 +2513,10 @@ void FS_Init_Commands(void)
 	Cvar_RegisterVariable (&scr_screenshot_name);
 	Cvar_RegisterVariable (&fs_empty_files_in_pack_mark_deletions);
 	Cvar_RegisterVariable (&cvar_fs_gamedir);
+	Cvar_RegisterVariable (&fs_index);
+	Cvar_RegisterVariable (&fs_packcache);
+	Cvar_RegisterVariable (&fs_mmap);
+	Cvar_RegisterVariable (&fs_prefetch);
 
 	Cmd_AddCommand ("gamedir", FS_GameDir_f, "changes active gamedir list (can take multiple arguments), not including base directory (example usage: gamedir ctf)");
 	Cmd_AddCommand ("fs_rescan", FS_Rescan_f, "rescans filesystem for new pack archives and any other changes");
@@ -2200,6 +2537,9 @@ void FS_Shutdown (void)
 	// (hopefully there aren't any other open files, but they'll be cleaned up
 	//  by the OS anyway)
 	FS_ClearSearchPath();
+	FS_PackCache_Save();
+	fs_packcaches = NULL;
+	fs_packcache_loaded = false;
 	Mem_FreePool (&fs_mempool);
 	PK3_CloseLibrary ();
 
@@ -2326,6 +2666,8 @@ qfile_t* FS_SysOpen (const char* filepath, const char* mode, qboolean nonblockin
 	}
 
 	file->filename = Mem_strdup(fs_mempool, filepath);
+	if (mode[0] == 'w' || mode[0] == 'a' || strchr (mode, '+'))
+		FS_Index_Invalidate(filepath);
 
 	file->real_length = FILEDESC_SEEK (file->handle, 0, SEEK_END);
 
@@ -2339,6 +2681,116 @@ qfile_t* FS_SysOpen (const char* filepath, const char* mode, qboolean nonblockin
 }
 
 
+/// smaller files are read, mapping them costs more than it saves
+#define FS_MMAP_MINSIZE 16384
+
+/// a file loaded by FS_LoadFileView as a mapping (or prefetched data)
+typedef struct fs_fileview_s
+{
+	unsigned char *data;
+	void *mapbase; ///< NULL if data was allocated in fs_mempool
+	size_t mapsize;
+	struct fs_fileview_s *next;
+}
+fs_fileview_t;
+
+static fs_fileview_t *fs_fileviews = NULL;
+
+static void FS_UnmapRegion (void *base, size_t size)
+{
+#if FS_MMAP
+#ifdef WIN32
+	UnmapViewOfFile(base);
+#else
+	munmap(base, size);
+#endif
+#endif
+}
+
+/*
+===========
+FS_MapPackedFile
+
+Open an uncompressed packed file as a private (copy on write) mapping of
+its package, one byte longer than the file so FS_LoadFileView can end it
+with a 0.  Returns NULL if the file should be read instead.
+===========
+*/
+static qfile_t *FS_MapPackedFile (pack_t *pack, packfile_t *pfile)
+{
+#if FS_MMAP
+	qfile_t *file;
+	fs_offset_t start;
+	size_t mapsize;
+	void *base;
+	static fs_offset_t granularity;
+#ifdef WIN32
+	HANDLE mapping;
+#else
+	struct stat st;
+#endif
+
+	if (!fs_mmap.integer || (pfile->flags & PACKFILE_FLAG_DEFLATED) || pfile->realsize < FS_MMAP_MINSIZE)
+		return NULL;
+
+	if (!pack->filesize)
+	{
+#ifdef WIN32
+		pack->filesize = _filelengthi64(pack->handle);
+#else
+		if (fstat(pack->handle, &st) == 0)
+			pack->filesize = st.st_size;
+#endif
+	}
+	// the central directory (pk3) or the directory (pak) is usually after the
+	// files, so there is a byte after the file
+	if (pfile->offset + pfile->realsize >= pack->filesize)
+		return NULL;
+
+	if (!granularity)
+	{
+#ifdef WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		granularity = info.dwAllocationGranularity;
+#else
+		granularity = sysconf(_SC_PAGESIZE);
+#endif
+	}
+	start = pfile->offset - pfile->offset % granularity;
+	mapsize = (size_t)(pfile->offset + pfile->realsize + 1 - start);
+
+#ifdef WIN32
+	mapping = CreateFileMapping((HANDLE)_get_osfhandle(pack->handle), NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (!mapping)
+		return NULL;
+	base = MapViewOfFile(mapping, FILE_MAP_COPY, (DWORD)((unsigned long long)start >> 32), (DWORD)start, mapsize);
+	// the view keeps the mapping alive
+	CloseHandle(mapping);
+	if (!base)
+		return NULL;
+#else
+	base = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, pack->handle, start);
+	if (base == MAP_FAILED)
+		return NULL;
+#endif
+
+	file = (qfile_t *)Mem_Alloc (fs_mempool, sizeof (*file));
+	memset (file, 0, sizeof (*file));
+	file->handle = FILEDESC_INVALID;
+	file->flags = QFILE_FLAG_PACKED | QFILE_FLAG_DATA | QFILE_FLAG_MAPPED;
+	file->real_length = pfile->realsize;
+	file->ungetc = EOF;
+	file->data = (unsigned char *)base + (pfile->offset - start);
+	file->mapbase = base;
+	file->mapsize = mapsize;
+	return file;
+#else
+	return NULL;
+#endif
+}
+
+
 /*
 ===========
 FS_OpenPackedFile
@@ -2370,6 +2822,9 @@ static qfile_t *FS_OpenPackedFile (pack_t* pack, int pack_ind)
 	}
 #endif
 
+	if ((file = FS_MapPackedFile (pack, pfile)))
+		return file;
+
 	// LordHavoc: FILEDESC_SEEK affects all duplicates of a handle so we do it before
 	// the dup() call to avoid having to close the dup_handle on error here
 	if (FILEDESC_SEEK (pack->handle, pfile->offset, SEEK_SET) == -1)
@@ -2494,6 +2949,254 @@ int FS_CheckNastyPath (const char *path, qboolean isgamedir)
 }
 
 
+/*
+=============================================================================
+
+SEARCH PATH INDEX
+
+Instead of binary searching every pack and checking every directory with
+a stat for each lookup, all files of all search paths are put in one hash
+table, keeping only the first search path each name is found in.
+
+=============================================================================
+*/
+
+#define FS_INDEX_BLOCKSIZE (256 << 10)
+#define FS_INDEX_MAXDEPTH 16
+#ifdef WIN32
+#define FS_INDEX_DIRIGNORECASE true
+#else
+#define FS_INDEX_DIRIGNORECASE false
+#endif
+
+static void *FS_Index_Alloc(size_t size)
+{
+	void *p;
+	size = (size + 15) & ~(size_t)15;
+	if (!fs_index_block || fs_index_blockused + size > FS_INDEX_BLOCKSIZE)
+	{
+		fs_index_block = (unsigned char *)Mem_Alloc(fs_index_mempool, max(size, FS_INDEX_BLOCKSIZE));
+		fs_index_blockused = 0;
+	}
+	p = fs_index_block + fs_index_blockused;
+	fs_index_blockused += size;
+	return p;
+}
+
+/// case insensitive so that names in pk3 files match regardless of case
+static unsigned int FS_Index_HashName(const char *name)
+{
+	unsigned int hash = 5381;
+	for (;*name;name++)
+		hash = hash * 33 + (unsigned char)tolower((unsigned char)*name);
+	return hash;
+}
+
+static void FS_Index_Resize(int hashsize)
+{
+	fsindexentry_t **hash, *e, *next;
+	int i;
+	hash = (fsindexentry_t **)Mem_Alloc(fs_index_mempool, hashsize * sizeof(*hash));
+	for (i = 0;i < fs_index_hashsize;i++)
+	{
+		for (e = fs_index_hash[i];e;e = next)
+		{
+			next = e->next;
+			e->next = hash[FS_Index_HashName(e->name) & (hashsize - 1)];
+			hash[FS_Index_HashName(e->name) & (hashsize - 1)] = e;
+		}
+	}
+	if (fs_index_hash)
+		Mem_Free(fs_index_hash);
+	fs_index_hash = hash;
+	fs_index_hashsize = hashsize;
+}
+
+static void FS_Index_Add(const char *name, qboolean copyname, searchpath_t *search, int index, int order, qboolean ignorecase)
+{
+	fsindexentry_t *e;
+	unsigned int hash = FS_Index_HashName(name);
+	// an earlier search path already has this name (with a case sensitivity
+	// that covers this one)
+	for (e = fs_index_hash[hash & (fs_index_hashsize - 1)];e;e = e->next)
+		if (!strcmp(e->name, name) && (e->ignorecase || !ignorecase) && e->order <= order)
+			return;
+	if (fs_index_numentries >= fs_index_hashsize)
+		FS_Index_Resize(fs_index_hashsize * 2);
+	e = (fsindexentry_t *)FS_Index_Alloc(sizeof(*e));
+	if (copyname)
+	{
+		size_t len = strlen(name) + 1;
+		char *copy = (char *)FS_Index_Alloc(len);
+		memcpy(copy, name, len);
+		e->name = copy;
+	}
+	else
+		e->name = name;
+	e->search = search;
+	e->index = index;
+	e->order = order;
+	e->ignorecase = ignorecase;
+	e->next = fs_index_hash[hash & (fs_index_hashsize - 1)];
+	fs_index_hash[hash & (fs_index_hashsize - 1)] = e;
+	fs_index_numentries++;
+}
+
+static void FS_Index_AddDirectory(searchpath_t *search, int order, const char *path, int depth)
+{
+	int i;
+	stringlist_t list;
+	char subpath[MAX_OSPATH];
+
+	stringlistinit(&list);
+	listdirectory(&list, search->filename, path);
+	for (i = 0;i < list.numstrings;i++)
+	{
+		FS_Index_Add(list.strings[i], true, search, -1, order, FS_INDEX_DIRIGNORECASE);
+		dpsnprintf(subpath, sizeof(subpath), "%s%s", search->filename, list.strings[i]);
+		if (FS_SysFileType(subpath) != FS_FILETYPE_DIRECTORY)
+			continue;
+		// the contents of deeper directories are found by FS_Index_FindFile
+		// going to the search paths
+		if (depth >= FS_INDEX_MAXDEPTH)
+		{
+			fs_index_deepdirs = true;
+			continue;
+		}
+		dpsnprintf(subpath, sizeof(subpath), "%s/", list.strings[i]);
+		FS_Index_AddDirectory(search, order, subpath, depth + 1);
+	}
+	stringlistfreecontents(&list);
+}
+
+static void FS_Index_Build(void)
+{
+	searchpath_t *search;
+	int i, order;
+	double starttime = Sys_DirtyTime();
+
+	if (!fs_index_mempool)
+		fs_index_mempool = Mem_AllocPool("file index", 0, fs_mempool);
+	Mem_EmptyPool(fs_index_mempool);
+	fs_index_hash = NULL;
+	fs_index_hashsize = 0;
+	fs_index_numentries = 0;
+	fs_index_block = NULL;
+	fs_index_deepdirs = false;
+	FS_Index_Resize(4096);
+
+	for (search = fs_searchpaths, order = 0;search;search = search->next, order++)
+	{
+		if (search->pack && !search->pack->vpack)
+		{
+			for (i = 0;i < search->pack->numfiles;i++)
+				FS_Index_Add(search->pack->files[i].name, false, search, i, order, search->pack->ignorecase);
+		}
+		else
+			FS_Index_AddDirectory(search, order, "", 0);
+	}
+	fs_index_dirty = false;
+	Con_DPrintf("FS_Index_Build: %i files indexed in %.1fms\n", fs_index_numentries, (Sys_DirtyTime() - starttime) * 1000.0);
+}
+
+/// names the index can not answer for (they mean the same as a different
+/// string to the OS)
+static qboolean FS_Index_Unusual(const char *name)
+{
+	const char *s;
+	if (!name[0] || name[0] == '/')
+		return true;
+	for (s = name;*s;s++)
+	{
+		if (*s == '\\' || *s == ':' || (*s == '/' && (s[1] == '/' || !s[1])))
+			return true;
+		if (*s == '.' && (s == name || s[-1] == '/') && (!s[1] || s[1] == '/' || (s[1] == '.' && (!s[2] || s[2] == '/'))))
+			return true;
+	}
+	return false;
+}
+
+/*
+====================
+FS_Index_Invalidate
+
+Called when a file is written or removed by its OS path, makes lookups of
+it and its parent directories go through the search paths again
+====================
+*/
+static void FS_Index_Invalidate (const char *ospath)
+{
+	searchpath_t *search;
+	char name[MAX_OSPATH];
+	const char *s;
+	char *slash;
+	size_t len;
+
+	if (fs_index_dirty || !fs_index_hash)
+		return;
+	for (search = fs_searchpaths;search;search = search->next)
+	{
+		if (search->pack && !search->pack->vpack)
+			continue;
+		len = strlen(search->filename);
+		if (strncmp(ospath, search->filename, len))
+			continue;
+		for (s = ospath + len;*s == '/';s++)
+			;
+		strlcpy(name, s, sizeof(name));
+		// order -1 wins over anything in the index
+		while (name[0])
+		{
+			FS_Index_Add(name, true, NULL, -1, -1, FS_INDEX_DIRIGNORECASE);
+			if (!(slash = strrchr(name, '/')))
+				break;
+			*slash = 0;
+		}
+	}
+}
+
+/*
+====================
+FS_Index_FindFile
+
+Returns false if the name has to be looked up in the search paths instead
+====================
+*/
+static qboolean FS_Index_FindFile (const char *name, searchpath_t **found, int *index)
+{
+	fsindexentry_t *e, *best = NULL;
+	const char *s;
+	int depth;
+
+	if (!fs_index.integer || FS_Index_Unusual(name))
+		return false;
+	if (fs_index_dirty || !fs_index_hash)
+	{
+		if (!fs_searchpaths)
+			return false;
+		FS_Index_Build();
+	}
+	if (fs_index_deepdirs)
+	{
+		// below the depth the directories were indexed to
+		for (s = name, depth = 0;*s;s++)
+			if (*s == '/')
+				depth++;
+		if (depth > FS_INDEX_MAXDEPTH)
+			return false;
+	}
+
+	for (e = fs_index_hash[FS_Index_HashName(name) & (fs_index_hashsize - 1)];e;e = e->next)
+		if ((!best || e->order < best->order) && !(e->ignorecase ? strcasecmp : strcmp)(e->name, name))
+			best = e;
+	if (best && !best->search)
+		return false;
+	*found = best ? best->search : NULL;
+	*index = best ? best->index : -1;
+	return true;
+}
+
+
 /*
 ====================
 FS_FindFile
@@ -2508,6 +3211,30 @@ static searchpath_t *FS_FindFile (const char *name, int* index, qboolean quiet)
 {
 	searchpath_t *search;
 	pack_t *pak;
+	int ind;
+
+	if (FS_Index_FindFile(name, &search, &ind))
+	{
+		if (search && ind >= 0 && fs_empty_files_in_pack_mark_deletions.integer && search->pack->files[ind].realsize == 0)
+		{
+			if (!quiet && developer_extra.integer)
+				Con_DPrintf("FS_FindFile: %s is marked as deleted\n", name);
+			search = NULL;
+			ind = -1;
+		}
+		else if (search && !quiet && developer_extra.integer)
+		{
+			if (ind >= 0)
+				Con_DPrintf("FS_FindFile: %s in %s\n", search->pack->files[ind].name, search->pack->filename);
+			else
+				Con_DPrintf("FS_FindFile: %s%s\n", search->filename, name);
+		}
+		else if (!search && !quiet && developer_extra.integer)
+			Con_DPrintf("FS_FindFile: can't find %s\n", name);
+		if (index != NULL)
+			*index = ind;
+		return search;
+	}
 
 	// search through the path, one element at a time
 	for (search = fs_searchpaths;search;search = search->next)
@@ -2781,6 +3508,8 @@ int FS_Close (qfile_t* file)
 {
 	if(file->flags & QFILE_FLAG_DATA)
 	{
+		if (file->flags & QFILE_FLAG_MAPPED)
+			FS_UnmapRegion(file->mapbase, file->mapsize);
 		Mem_Free(file);
 		return 0;
 	}
@@ -3302,6 +4031,166 @@ void FS_Purge (qfile_t* file)
 }
 
 
+/*
+=============================================================================
+
+PREFETCHING
+
+FS_PrefetchFiles inflates compressed files in packages on the task queue
+worker threads, FS_LoadFile and FS_LoadFileView then take the finished
+data instead of reading the file themselves.
+
+=============================================================================
+*/
+
+typedef struct fs_prefetch_s
+{
+	taskqueue_task_t task;
+	char path[MAX_QPATH];
+	char packfilename[MAX_OSPATH];
+	fs_offset_t offset; ///< true offset of the compressed data
+	fs_offset_t packsize;
+	fs_offset_t realsize;
+	unsigned char *data; ///< realsize + 1 bytes in fs_mempool, NULL if inflating failed
+	struct fs_prefetch_s *next;
+}
+fs_prefetch_t;
+
+static fs_prefetch_t *fs_prefetches = NULL;
+
+static void FS_Prefetch_Task(taskqueue_task_t *task)
+{
+	fs_prefetch_t *p = (fs_prefetch_t *)task->p[0];
+	filedesc_t handle;
+	unsigned char *compressed;
+	z_stream zstream;
+
+	// a handle of its own, the package handle and its duplicates share the
+	// file position with whatever the main thread reads
+	handle = FS_SysOpenFiledesc(p->packfilename, "rb", false);
+	if (!FILEDESC_ISVALID(handle))
+		return;
+	compressed = (unsigned char *)Mem_Alloc(fs_mempool, p->packsize);
+	if (FILEDESC_SEEK(handle, p->offset, SEEK_SET) != -1 && FILEDESC_READ(handle, compressed, p->packsize) == p->packsize)
+	{
+		p->data = (unsigned char *)Mem_Alloc(fs_mempool, p->realsize + 1);
+		memset(&zstream, 0, sizeof(zstream));
+		if (qz_inflateInit2(&zstream, -MAX_WBITS) == Z_OK)
+		{
+			zstream.next_in = compressed;
+			zstream.avail_in = (unsigned int)p->packsize;
+			zstream.next_out = p->data;
+			zstream.avail_out = (unsigned int)p->realsize;
+			qz_inflate(&zstream, Z_FINISH);
+			qz_inflateEnd(&zstream);
+		}
+		if (zstream.total_out != (unsigned long)p->realsize)
+		{
+			Mem_Free(p->data);
+			p->data = NULL;
+		}
+		else
+			p->data[p->realsize] = 0;
+	}
+	Mem_Free(compressed);
+	FILEDESC_CLOSE(handle);
+}
+
+/*
+============
+FS_PrefetchFiles
+
+Starts inflating the given files if they are compressed in a package
+============
+*/
+void FS_PrefetchFiles (const char *const *paths, int numpaths)
+{
+	int i, ind;
+	searchpath_t *search;
+	packfile_t *pfile;
+	fs_prefetch_t *p;
+
+	// without worker threads this would only load the files earlier
+	if (!fs_prefetch.integer || !TaskQueue_NumThreads())
+		return;
+#ifndef LINK_TO_ZLIB
+	if (!zlib_dll)
+		return;
+#endif
+
+	for (i = 0;i < numpaths;i++)
+	{
+		if (!paths[i][0] || strlen(paths[i]) >= MAX_QPATH || FS_CheckNastyPath(paths[i], false))
+			continue;
+		for (p = fs_prefetches;p;p = p->next)
+			if (!strcmp(p->path, paths[i]))
+				break;
+		if (p)
+			continue;
+
+		if (fs_mutex) Thread_LockMutex(fs_mutex);
+		search = FS_FindFile(paths[i], &ind, true);
+		pfile = NULL;
+		if (search && search->pack && !search->pack->vpack && ind >= 0)
+		{
+			pfile = &search->pack->files[ind];
+			if (!(pfile->flags & PACKFILE_FLAG_DEFLATED) || (!(pfile->flags & PACKFILE_FLAG_TRUEOFFS) && !PK3_GetTrueFileOffset(pfile, search->pack)))
+				pfile = NULL;
+		}
+		if (fs_mutex) Thread_UnlockMutex(fs_mutex);
+		if (!pfile)
+			continue;
+
+		p = (fs_prefetch_t *)Mem_Alloc(fs_mempool, sizeof(*p));
+		strlcpy(p->path, paths[i], sizeof(p->path));
+		strlcpy(p->packfilename, search->pack->filename, sizeof(p->packfilename));
+		p->offset = pfile->offset;
+		p->packsize = pfile->packsize;
+		p->realsize = pfile->realsize;
+		p->next = fs_prefetches;
+		fs_prefetches = p;
+		TaskQueue_Setup(&p->task, NULL, FS_Prefetch_Task, 0, 0, p, NULL);
+		TaskQueue_Enqueue(1, &p->task);
+	}
+}
+
+/// removes the prefetch of a file from the list and waits for it to finish
+static fs_prefetch_t *FS_Prefetch_Take (const char *path)
+{
+	fs_prefetch_t **link, *p;
+	for (link = &fs_prefetches;(p = *link);link = &p->next)
+	{
+		if (!strcmp(p->path, path))
+		{
+			*link = p->next;
+			TaskQueue_WaitForTaskDone(&p->task);
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+============
+FS_PrefetchFlush
+
+Waits for and frees all prefetched files nobody loaded
+============
+*/
+void FS_PrefetchFlush (void)
+{
+	fs_prefetch_t *p;
+	while ((p = fs_prefetches))
+	{
+		fs_prefetches = p->next;
+		TaskQueue_WaitForTaskDone(&p->task);
+		if (p->data)
+			Mem_Free(p->data);
+		Mem_Free(p);
+	}
+}
+
+
 /*
 ============
 FS_LoadAndCloseQFile
@@ -3349,11 +4238,124 @@ Always appends a 0 byte.
 */
 unsigned char *FS_LoadFile (const char *path, mempool_t *pool, qboolean quiet, fs_offset_t *filesizepointer)
 {
-	qfile_t *file = FS_OpenVirtualFile(path, quiet);
+	qfile_t *file;
+	fs_prefetch_t *prefetch;
+	unsigned char *buf;
+
+	if (fs_prefetches && (prefetch = FS_Prefetch_Take(path)))
+	{
+		buf = NULL;
+		if (prefetch->data)
+		{
+			buf = (unsigned char *)Mem_Alloc(pool, prefetch->realsize + 1);
+			memcpy(buf, prefetch->data, prefetch->realsize + 1);
+			if (filesizepointer)
+				*filesizepointer = prefetch->realsize;
+			if (developer_loadfile.integer)
+				Con_Printf("loaded prefetched file \"%s\" (%u bytes)\n", path, (unsigned int)prefetch->realsize);
+			Mem_Free(prefetch->data);
+		}
+		Mem_Free(prefetch);
+		if (buf)
+			return buf;
+	}
+
+	file = FS_OpenVirtualFile(path, quiet);
 	return FS_LoadAndCloseQFile(file, path, pool, quiet, filesizepointer);
 }
 
 
+/*
+============
+FS_LoadFileView
+
+Same as FS_LoadFile, but an uncompressed file in a package is returned as
+a private mapping of the package instead of a copy, and prefetched data
+is returned as it is.  Changes to the data are allowed and stay private.
+Must be freed with FS_FreeFileView.
+============
+*/
+unsigned char *FS_LoadFileView (const char *path, mempool_t *pool, qboolean quiet, fs_offset_t *filesizepointer)
+{
+	qfile_t *file;
+	fs_fileview_t *view;
+	fs_prefetch_t *prefetch;
+	unsigned char *buf = NULL;
+	fs_offset_t filesize = 0;
+
+	view = (fs_fileview_t *)Mem_Alloc(fs_mempool, sizeof(*view));
+	if (fs_prefetches && (prefetch = FS_Prefetch_Take(path)))
+	{
+		// the prefetched data is handed out as it is
+		buf = prefetch->data;
+		filesize = prefetch->realsize;
+		Mem_Free(prefetch);
+		if (buf && developer_loadfile.integer)
+			Con_Printf("loaded prefetched file \"%s\" (%u bytes)\n", path, (unsigned int)filesize);
+	}
+	if (!buf)
+	{
+		file = FS_OpenVirtualFile(path, quiet);
+		if (!file || !(file->flags & QFILE_FLAG_MAPPED))
+		{
+			Mem_Free(view);
+			return FS_LoadAndCloseQFile(file, path, pool, quiet, filesizepointer);
+		}
+		buf = (unsigned char *)file->data;
+		buf[file->real_length] = '\0';
+		filesize = file->real_length;
+		view->mapbase = file->mapbase;
+		view->mapsize = file->mapsize;
+		if (developer_loadfile.integer)
+			Con_Printf("mapped file \"%s\" (%u bytes)\n", path, (unsigned int)filesize);
+		// the mapping now belongs to the view
+		Mem_Free(file);
+	}
+
+	view->data = buf;
+	if (fs_mutex) Thread_LockMutex(fs_mutex);
+	view->next = fs_fileviews;
+	fs_fileviews = view;
+	if (fs_mutex) Thread_UnlockMutex(fs_mutex);
+
+	if (filesizepointer)
+		*filesizepointer = filesize;
+	return buf;
+}
+
+
+/*
+============
+FS_FreeFileView
+
+Frees data returned by FS_LoadFileView
+============
+*/
+void FS_FreeFileView (unsigned char *data)
+{
+	fs_fileview_t **link, *view = NULL;
+
+	if (fs_mutex) Thread_LockMutex(fs_mutex);
+	for (link = &fs_fileviews;*link;link = &(*link)->next)
+	{
+		if ((*link)->data == data)
+		{
+			view = *link;
+			*link = view->next;
+			break;
+		}
+	}
+	if (fs_mutex) Thread_UnlockMutex(fs_mutex);
+
+	if (view && view->mapbase)
+		FS_UnmapRegion(view->mapbase, view->mapsize);
+	else
+		Mem_Free(data);
+	if (view)
+		Mem_Free(view);
+}
+
+
 /*
 ============
 FS_SysLoadFile
@@ -3970,13 +4972,14 @@ int FS_CRCFile(const char *filename, size_t *filesizepointer)
 	return crc;
 }
 
-unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflated_size, int level, mempool_t *mempool)
+unsigned char *FS_DeflateQuiet(const unsigned char *data, size_t size, size_t *deflated_size, int level, mempool_t *mempool, const char **error)
 {
 	z_stream strm;
 	unsigned char *out = NULL;
 	unsigned char *tmp;
 
 	*deflated_size = 0;
+	*error = NULL;
 #ifndef LINK_TO_ZLIB
 	if(!zlib_dll)
 		return NULL;
@@ -3992,7 +4995,7 @@ unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflat
 
 	if(qz_deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, Z_MEMLEVEL_DEFAULT, Z_BINARY) != Z_OK)
 	{
-		Con_Printf("FS_Deflate: deflate init error!\n");
+		*error = "deflate init error!";
 		return NULL;
 	}
 
@@ -4002,7 +5005,7 @@ unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflat
 	tmp = (unsigned char *) Mem_Alloc(tempmempool, size);
 	if(!tmp)
 	{
-		Con_Printf("FS_Deflate: not enough memory in tempmempool!\n");
+		*error = "not enough memory in tempmempool!";
 		qz_deflateEnd(&strm);
 		return NULL;
 	}
@@ -4012,7 +5015,7 @@ unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflat
 
 	if(qz_deflate(&strm, Z_FINISH) != Z_STREAM_END)
 	{
-		Con_Printf("FS_Deflate: deflate failed!\n");
+		*error = "deflate failed!";
 		qz_deflateEnd(&strm);
 		Mem_Free(tmp);
 		return NULL;
@@ -4020,14 +5023,14 @@ unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflat
 	
 	if(qz_deflateEnd(&strm) != Z_OK)
 	{
-		Con_Printf("FS_Deflate: deflateEnd failed\n");
+		*error = "deflateEnd failed";
 		Mem_Free(tmp);
 		return NULL;
 	}
 
 	if(strm.total_out >= size)
 	{
-		Con_Printf("FS_Deflate: deflate is useless on this data!\n");
+		*error = "deflate is useless on this data!";
 		Mem_Free(tmp);
 		return NULL;
 	}
@@ -4035,7 +5038,7 @@ unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflat
 	out = (unsigned char *) Mem_Alloc(mempool, strm.total_out);
 	if(!out)
 	{
-		Con_Printf("FS_Deflate: not enough memory in target mempool!\n");
+		*error = "not enough memory in target mempool!";
 		Mem_Free(tmp);
 		return NULL;
 	}
@@ -4048,6 +5051,15 @@ unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflat
 	return out;
 }
 
+unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflated_size, int level, mempool_t *mempool)
+{
+	const char *error;
+	unsigned char *out = FS_DeflateQuiet(data, size, deflated_size, level, mempool, &error);
+	if (error)
+		Con_Printf("FS_Deflate: %s\n", error);
+	return out;
+}
+
 static void AssertBufsize(sizebuf_t *buf, int length)
 {
 	if(buf->cursize + length > buf->maxsize)
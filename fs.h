@@ -111,6 +111,13 @@ fssearch_t *FS_Search(const char *pattern, int caseinsensitive, int quiet);
 void FS_FreeSearch(fssearch_t *search);
 
 unsigned char *FS_LoadFile (const char *path, mempool_t *pool, qboolean quiet, fs_offset_t *filesizepointer);
+/// like FS_LoadFile but may return a mapping of a package instead of a copy, free with FS_FreeFileView
+unsigned char *FS_LoadFileView (const char *path, mempool_t *pool, qboolean quiet, fs_offset_t *filesizepointer);
+void FS_FreeFileView (unsigned char *data);
+/// starts inflating compressed files on the worker threads, FS_LoadFile and FS_LoadFileView use the result
+void FS_PrefetchFiles (const char *const *paths, int numpaths);
+/// waits for and frees prefetched files that were not loaded
+void FS_PrefetchFlush (void);
 unsigned char *FS_SysLoadFile (const char *path, mempool_t *pool, qboolean quiet, fs_offset_t *filesizepointer);
 qboolean FS_WriteFileInBlocks (const char *filename, const void *const *data, const fs_offset_t *len, size_t count);
 qboolean FS_WriteFile (const char *filename, const void *data, fs_offset_t len);
@@ -131,6 +138,8 @@ qboolean FS_FileExists (const char *filename);		// the file can be into a packag
 qboolean FS_SysFileExists (const char *filename);	// only look for files outside of packages
 
 unsigned char *FS_Deflate(const unsigned char *data, size_t size, size_t *deflated_size, int level, mempool_t *mempool);
+// same without printing (safe on worker threads), *error describes a failure
+unsigned char *FS_DeflateQuiet(const unsigned char *data, size_t size, size_t *deflated_size, int level, mempool_t *mempool, const char **error);
 unsigned char *FS_Inflate(const unsigned char *data, size_t size, size_t *inflated_size, mempool_t *mempool);
 
 qboolean FS_HasZlib(void);
@@ -28,8 +28,10 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "progsvm.h"
 #include "csprogs.h"
 #include "sv_demo.h"
+#include "sv_save.h"
 #include "snd_main.h"
 #include "thread.h"
+#include "taskqueue.h"
 #include "utf8lib.h"
 
 /*
@@ -544,6 +546,9 @@ void SV_DropClient(qboolean crash)
 		EntityFrame4_FreeDatabase(host_client->entitydatabase4);
 	if (host_client->entitydatabase5)
 		EntityFrame5_FreeDatabase(host_client->entitydatabase5);
+	if (host_client->visibilitycache)
+		Mem_Free(host_client->visibilitycache);
+	host_client->visibilitycache = NULL;
 
 	if (sv.active)
 	{
@@ -585,6 +590,9 @@ void Host_ShutdownServer(void)
 
 	Con_DPrintf("Host_ShutdownServer\n");
 
+	// this is also the last chance to write an autosave before the engine quits
+	SV_Savegame_WaitForAutosave();
+
 	if (!sv.active)
 		return;
 
@@ -765,6 +773,9 @@ void Host_Main(void)
 
 		Curl_Run();
 
+		// start or stop worker threads if taskqueue_maxthreads changed
+		TaskQueue_Frame(false);
+
 		// check for commands typed to the host
 		Host_GetConsoleCommands();
 
@@ -916,6 +927,8 @@ void Host_Main(void)
 			// send an heartbeat if enough time has passed since the last one
 			NetConn_Heartbeat(0);
 			R_TimeReport("servernetwork");
+
+			SV_Savegame_Frame();
 		}
 		else if (!svs.threaded)
 		{
@@ -1270,6 +1283,7 @@ static void Host_Init (void)
 	Host_ServerOptions();
 
 	Thread_Init();
+	TaskQueue_Init();
 
 	if (cls.state == ca_dedicated)
 		Cmd_AddCommand ("disconnect", CL_Disconnect_f, "disconnect from server (or disconnect all clients if running a server)");
@@ -1441,6 +1455,7 @@ void Host_Shutdown(void)
 	}
 
 	SV_StopThread();
+	TaskQueue_Shutdown();
 	Thread_Shutdown();
 	Cmd_Shutdown();
 	Key_Shutdown();
@@ -20,6 +20,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "quakedef.h"
 #include "sv_demo.h"
+#include "sv_save.h"
 #include "image.h"
 
 #include "prvm_cmds.h"
@@ -555,6 +556,27 @@ LOAD / SAVE GAME
 
 #define	SAVEGAME_VERSION	5
 
+extern cvar_t sv_savegame_binary;
+
+/// fills comment (SAVEGAME_COMMENT_LENGTH+1 chars) with the savegame comment
+/// the menu shows
+void Host_Savegame_Comment(prvm_prog_t *prog, char *comment)
+{
+	int i;
+
+	memset(comment, 0, SAVEGAME_COMMENT_LENGTH+1);
+	if(prog == SVVM_prog)
+		dpsnprintf(comment, SAVEGAME_COMMENT_LENGTH+1, "%-21.21s kills:%3i/%3i", PRVM_GetString(prog, PRVM_serveredictstring(prog->edicts, message)), (int)PRVM_serverglobalfloat(killed_monsters), (int)PRVM_serverglobalfloat(total_monsters));
+	else
+		dpsnprintf(comment, SAVEGAME_COMMENT_LENGTH+1, "(crash dump of %s progs)", prog->name);
+	// convert space to _ to make stdio happy
+	// LordHavoc: convert control characters to _ as well
+	for (i=0 ; i<SAVEGAME_COMMENT_LENGTH ; i++)
+		if (ISWHITESPACEORCONTROL(comment[i]))
+			comment[i] = '_';
+	comment[SAVEGAME_COMMENT_LENGTH] = '\0';
+}
+
 void Host_Savegame_to(prvm_prog_t *prog, const char *name)
 {
 	qfile_t	*f;
@@ -582,18 +604,7 @@ void Host_Savegame_to(prvm_prog_t *prog, const char *name)
 
 	FS_Printf(f, "%i\n", SAVEGAME_VERSION);
 
-	memset(comment, 0, sizeof(comment));
-	if(isserver)
-		dpsnprintf(comment, sizeof(comment), "%-21.21s kills:%3i/%3i", PRVM_GetString(prog, PRVM_serveredictstring(prog->edicts, message)), (int)PRVM_serverglobalfloat(killed_monsters), (int)PRVM_serverglobalfloat(total_monsters));
-	else
-		dpsnprintf(comment, sizeof(comment), "(crash dump of %s progs)", prog->name);
-	// convert space to _ to make stdio happy
-	// LordHavoc: convert control characters to _ as well
-	for (i=0 ; i<SAVEGAME_COMMENT_LENGTH ; i++)
-		if (ISWHITESPACEORCONTROL(comment[i]))
-			comment[i] = '_';
-	comment[SAVEGAME_COMMENT_LENGTH] = '\0';
-
+	Host_Savegame_Comment(prog, comment);
 	FS_Printf(f, "%s\n", comment);
 	if(isserver)
 	{
@@ -752,10 +763,45 @@ static void Host_Savegame_f (void)
 	strlcpy (name, Cmd_Argv(1), sizeof (name));
 	FS_DefaultExtension (name, ".sav", sizeof (name));
 
-	Host_Savegame_to(prog, name);
+	// an autosave to the same file might still be pending
+	SV_Savegame_WaitForAutosave();
+
+	if (sv_savegame_binary.integer)
+		SV_Savegame_Binary(prog, name);
+	else
+		Host_Savegame_to(prog, name);
 }
 
 
+/*
+===============
+Host_Loadgame_Finish
+
+Shared by text and binary savegames after the game state was loaded
+===============
+*/
+static void Host_Loadgame_Finish (prvm_prog_t *prog)
+{
+	int i, numbuffers;
+	prvm_stringbuffer_t *stringbuffer;
+
+	// remove all temporary flagged string buffers (ones created with BufStr_FindCreateReplace)
+	numbuffers = (int)Mem_ExpandableArray_IndexRange(&prog->stringbuffersarray);
+	for (i = 0; i < numbuffers; i++)
+	{
+		if ( (stringbuffer = (prvm_stringbuffer_t *)Mem_ExpandableArray_RecordAtIndex(&prog->stringbuffersarray, i)) )
+			if (stringbuffer->flags & STRINGBUFFER_TEMP)
+				BufStr_Del(prog, stringbuffer);
+	}
+
+	if(developer_entityparsing.integer)
+		Con_Printf("Host_Loadgame_f: finished\n");
+
+	// make sure we're connected to loopback
+	if (sv.active && cls.state == ca_disconnected)
+		CL_EstablishConnection("local:1", -2);
+}
+
 /*
 ===============
 Host_Loadgame_f
@@ -773,9 +819,10 @@ static void Host_Loadgame_f (void)
 	const char *t;
 	char *text;
 	prvm_edict_t *ent;
-	int i, k, numbuffers;
+	int i, k;
 	int entnum;
 	int version;
+	fs_offset_t filesize;
 	float spawn_parms[NUM_SPAWN_PARMS];
 	prvm_stringbuffer_t *stringbuffer;
 
@@ -803,13 +850,22 @@ static void Host_Loadgame_f (void)
 
 	cls.demonum = -1;		// stop demo loop in case this fails
 
-	t = text = (char *)FS_LoadFile (filename, tempmempool, false, NULL);
+	SV_Savegame_WaitForAutosave();
+	t = text = (char *)FS_LoadFile (filename, tempmempool, false, &filesize);
 	if (!text)
 	{
 		Con_Print("ERROR: couldn't open.\n");
 		return;
 	}
 
+	if (SV_Savegame_IsBinary((unsigned char *)text, filesize, NULL, 0))
+	{
+		SV_Loadgame_Binary(prog, (unsigned char *)text, filesize);
+		Mem_Free(text);
+		Host_Loadgame_Finish(prog);
+		return;
+	}
+
 	if(developer_entityparsing.integer)
 		Con_Printf("Host_Loadgame_f: loading version\n");
 
@@ -957,6 +1013,7 @@ static void Host_Loadgame_f (void)
 			ent = PRVM_EDICT_NUM(entnum);
 			memset(ent->fields.fp, 0, prog->entityfields * sizeof(prvm_vec_t));
 			ent->priv.server->free = false;
+			PRVM_ED_Touch(prog, entnum);
 
 			if(developer_entityparsing.integer)
 				Con_Printf("Host_Loadgame_f: loading edict %d\n", entnum);
@@ -1087,21 +1144,7 @@ static void Host_Loadgame_f (void)
 	}
 	Mem_Free(text);
 
-	// remove all temporary flagged string buffers (ones created with BufStr_FindCreateReplace)
-	numbuffers = (int)Mem_ExpandableArray_IndexRange(&prog->stringbuffersarray);
-	for (i = 0; i < numbuffers; i++)
-	{
-		if ( (stringbuffer = (prvm_stringbuffer_t *)Mem_ExpandableArray_RecordAtIndex(&prog->stringbuffersarray, i)) )
-			if (stringbuffer->flags & STRINGBUFFER_TEMP)
-				BufStr_Del(prog, stringbuffer);
-	}
-
-	if(developer_entityparsing.integer)
-		Con_Printf("Host_Loadgame_f: finished\n");
-
-	// make sure we're connected to loopback
-	if (sv.active && cls.state == ca_disconnected)
-		CL_EstablishConnection("local:1", -2);
+	Host_Loadgame_Finish(prog);
 }
 
 //============================================================================
@@ -1091,20 +1091,20 @@ unsigned char *loadimagepixelsbgra (const char *filename, qboolean complain, qbo
 	for (format = firstformat;format->formatstring;format++)
 	{
 		dpsnprintf (name, sizeof(name), format->formatstring, basename);
-		f = FS_LoadFile(name, tempmempool, true, &filesize);
+		f = FS_LoadFileView(name, tempmempool, true, &filesize);
 		if (f)
 		{
 			int mymiplevel = miplevel ? *miplevel : 0;
 			image_width = 0;
 			image_height = 0;
 			data = format->loadfunc(f, (int)filesize, &mymiplevel);
-			Mem_Free(f);
+			FS_FreeFileView(f);
 			if (data)
 			{
 				if(format->loadfunc == JPEG_LoadImage_BGRA) // jpeg can't do alpha, so let's simulate it by loading another jpeg
 				{
 					dpsnprintf (name2, sizeof(name2), format->formatstring, va(vabuf, sizeof(vabuf), "%s_alpha", basename));
-					f = FS_LoadFile(name2, tempmempool, true, &filesize);
+					f = FS_LoadFileView(name2, tempmempool, true, &filesize);
 					if(f)
 					{
 						int mymiplevel2 = miplevel ? *miplevel : 0;
@@ -1119,7 +1119,7 @@ unsigned char *loadimagepixelsbgra (const char *filename, qboolean complain, qbo
 						image_height = image_height_save;
 						if(data2)
 							Mem_Free(data2);
-						Mem_Free(f);
+						FS_FreeFileView(f);
 					}
 				}
 				if (developer_loading.integer)
@@ -1,6 +1,11 @@
 
 // Written by Forest Hale 2003-06-15 and placed into public domain.
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// for recvmmsg and sendmmsg
+#define _GNU_SOURCE
+#endif
+
 #ifdef WIN32
 #ifdef _MSC_VER
 #pragma comment(lib, "ws2_32.lib")
@@ -84,6 +89,11 @@
 #define SOCKLEN_T socklen_t
 #endif
 
+// Linux can receive and send many datagrams per system call
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define LHNET_MMSG
+#endif
+
 #ifdef MSG_DONTWAIT
 #define LHNET_RECVFROM_FLAGS MSG_DONTWAIT
 #define LHNET_SENDTO_FLAGS 0
@@ -727,11 +737,78 @@ static int lhnet_active;
 static lhnetsocket_t lhnet_socketlist;
 static lhnetpacket_t lhnet_packetlist;
 static int lhnet_default_dscp = 0;
+#ifdef LHNET_MMSG
+static int lhnet_batchio = 0;
+#endif
+// > 0 while inet writes are being queued for LHNET_FlushWrites
+static int lhnet_batchwrites = 0;
+
+static void LHNET_PrintError(lhnetsocket_t *lhnetsocket, int developer, const char *format, ...)
+{
+	va_list argptr;
+	char msg[256];
+	va_start(argptr, format);
+	dpvsnprintf(msg, sizeof(msg), format, argptr);
+	va_end(argptr);
+	if (lhnetsocket->printfunction)
+		lhnetsocket->printfunction(developer, msg);
+	else if (developer)
+		Con_DPrint(msg);
+	else
+		Con_Print(msg);
+}
 #ifdef WIN32
 static int lhnet_didWSAStartup = 0;
 static WSADATA lhnet_winsockdata;
 #endif
 
+#ifdef LHNET_MMSG
+#define LHNET_BATCHPACKETS 32
+// the biggest packet netconn reads, longer ones are truncated like by recvfrom
+#define LHNET_BATCHPACKETSIZE (NET_HEADERSIZE + NET_MAXMESSAGE)
+#define LHNET_BATCHSENDBUFFERSIZE 262144
+
+// packets received by one recvmmsg call that have not been returned by
+// LHNET_Read yet, and packets waiting for the next sendmmsg call, the data
+// buffers are allocated when reads or writes are first batched
+typedef struct lhnetbatch_s
+{
+	int recvcount;
+	int recvnext;
+	struct mmsghdr recvmsgs[LHNET_BATCHPACKETS];
+	struct iovec recviovecs[LHNET_BATCHPACKETS];
+	lhnetaddressnative_t recvaddresses[LHNET_BATCHPACKETS];
+	unsigned char (*recvdata)[LHNET_BATCHPACKETSIZE];
+
+	int sendcount;
+	size_t sendsize;
+	struct mmsghdr sendmsgs[LHNET_BATCHPACKETS];
+	struct iovec sendiovecs[LHNET_BATCHPACKETS];
+	lhnetaddressnative_t sendaddresses[LHNET_BATCHPACKETS];
+	unsigned char *senddata;
+}
+lhnetbatch_t;
+
+static lhnetbatch_t *LHNET_GetBatch(lhnetsocket_t *lhnetsocket)
+{
+	if (!lhnetsocket->batch)
+		lhnetsocket->batch = (lhnetbatch_t *)Z_Malloc(sizeof(lhnetbatch_t));
+	return lhnetsocket->batch;
+}
+
+static void LHNET_FreeBatch(lhnetsocket_t *lhnetsocket)
+{
+	if (!lhnetsocket->batch)
+		return;
+	if (lhnetsocket->batch->recvdata)
+		Z_Free(lhnetsocket->batch->recvdata);
+	if (lhnetsocket->batch->senddata)
+		Z_Free(lhnetsocket->batch->senddata);
+	Z_Free(lhnetsocket->batch);
+	lhnetsocket->batch = NULL;
+}
+#endif
+
 void LHNET_Init(void)
 {
 	if (lhnet_active)
@@ -870,6 +947,185 @@ void LHNET_SleepUntilPacket_Microseconds(int microseconds)
 #endif
 }
 
+int LHNET_BatchIO(int enable)
+{
+#ifdef LHNET_MMSG
+	int prev = lhnet_batchio;
+	if (enable >= 0)
+		lhnet_batchio = enable != 0;
+	return prev;
+#else
+	return -1;
+#endif
+}
+
+#ifdef LHNET_MMSG
+static void LHNET_FlushWrites_Socket(lhnetsocket_t *lhnetsocket)
+{
+	lhnetbatch_t *b = lhnetsocket->batch;
+	int i, sent = 0, value;
+	size_t offset;
+	while (sent < b->sendcount)
+	{
+		value = sendmmsg(lhnetsocket->inetsocket, b->sendmsgs + sent, b->sendcount - sent, LHNET_SENDTO_FLAGS);
+		if (value < 0)
+		{
+			if (SOCKETERRNO == EWOULDBLOCK)
+				break;
+			// same as a failed sendto, the packet is lost
+			LHNET_PrintError(lhnetsocket, true, "LHNET_FlushWrites: sendmmsg returned error: %s\n", LHNETPRIVATE_StrError());
+			value = 1;
+		}
+		sent += value;
+	}
+	if (sent >= b->sendcount)
+	{
+		b->sendcount = 0;
+		b->sendsize = 0;
+		return;
+	}
+	// the send buffer of the socket is full, what did not fit is moved to the
+	// front to go out with the next flush
+	offset = (unsigned char *)b->sendiovecs[sent].iov_base - b->senddata;
+	memmove(b->senddata, b->senddata + offset, b->sendsize - offset);
+	b->sendsize -= offset;
+	b->sendcount -= sent;
+	for (i = 0;i < b->sendcount;i++)
+	{
+		b->sendmsgs[i] = b->sendmsgs[i + sent];
+		b->sendiovecs[i] = b->sendiovecs[i + sent];
+		b->sendaddresses[i] = b->sendaddresses[i + sent];
+		b->sendiovecs[i].iov_base = (unsigned char *)b->sendiovecs[i].iov_base - offset;
+		b->sendmsgs[i].msg_hdr.msg_name = &b->sendaddresses[i].addr;
+		b->sendmsgs[i].msg_hdr.msg_iov = &b->sendiovecs[i];
+	}
+}
+
+// queues a copy of a packet to be sent by LHNET_FlushWrites, returns false
+// if the socket has no room for it even after a flush
+static qboolean LHNET_Write_Batch(lhnetsocket_t *lhnetsocket, const void *content, int contentlength, const lhnetaddressnative_t *address)
+{
+	lhnetbatch_t *b = LHNET_GetBatch(lhnetsocket);
+	int i;
+	if (!b->senddata)
+		b->senddata = (unsigned char *)Z_Malloc(LHNET_BATCHSENDBUFFERSIZE);
+	if (b->sendcount == LHNET_BATCHPACKETS || b->sendsize + contentlength > LHNET_BATCHSENDBUFFERSIZE)
+		LHNET_FlushWrites_Socket(lhnetsocket);
+	if (b->sendcount == LHNET_BATCHPACKETS || b->sendsize + contentlength > LHNET_BATCHSENDBUFFERSIZE)
+		return false;
+	i = b->sendcount++;
+	memcpy(b->senddata + b->sendsize, content, contentlength);
+	b->sendaddresses[i] = *address;
+	b->sendiovecs[i].iov_base = b->senddata + b->sendsize;
+	b->sendiovecs[i].iov_len = contentlength;
+	memset(&b->sendmsgs[i], 0, sizeof(b->sendmsgs[i]));
+	b->sendmsgs[i].msg_hdr.msg_name = &b->sendaddresses[i].addr;
+#ifndef NOSUPPORTIPV6
+	if (address->addresstype == LHNETADDRESSTYPE_INET6)
+		b->sendmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+	else
+#endif
+		b->sendmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	b->sendmsgs[i].msg_hdr.msg_iov = &b->sendiovecs[i];
+	b->sendmsgs[i].msg_hdr.msg_iovlen = 1;
+	b->sendsize += contentlength;
+	return true;
+}
+
+// reads a packet left from the last recvmmsg, returns -1 if there is none
+static int LHNET_Read_Batch(lhnetsocket_t *lhnetsocket, void *content, int maxcontentlength, lhnetaddressnative_t *address)
+{
+	lhnetbatch_t *b = lhnetsocket->batch;
+	int i, length;
+	// skip empty packets, returning 0 would make the caller stop reading
+	while (b->recvnext < b->recvcount && !b->recvmsgs[b->recvnext].msg_len)
+		b->recvnext++;
+	if (b->recvnext >= b->recvcount)
+		return -1;
+	i = b->recvnext++;
+	// truncated like recvfrom would
+	length = (int)b->recvmsgs[i].msg_len;
+	if (length > maxcontentlength)
+		length = maxcontentlength;
+	memcpy(content, b->recvdata[i], length);
+	*address = b->recvaddresses[i];
+	address->addresstype = lhnetsocket->address.addresstype;
+#ifndef NOSUPPORTIPV6
+	if (address->addresstype == LHNETADDRESSTYPE_INET6)
+		address->port = ntohs(address->addr.in6.sin6_port);
+	else
+#endif
+		address->port = ntohs(address->addr.in.sin_port);
+	return length;
+}
+
+// receives as many packets as are waiting (up to LHNET_BATCHPACKETS) with
+// one system call, returns the first of them like LHNET_Read
+static int LHNET_Read_Receive(lhnetsocket_t *lhnetsocket, void *content, int maxcontentlength, lhnetaddressnative_t *address)
+{
+	lhnetbatch_t *b = LHNET_GetBatch(lhnetsocket);
+	int i, value;
+	if (!b->recvdata)
+		b->recvdata = (unsigned char (*)[LHNET_BATCHPACKETSIZE])Z_Malloc(LHNET_BATCHPACKETS * LHNET_BATCHPACKETSIZE);
+	for (i = 0;i < LHNET_BATCHPACKETS;i++)
+	{
+		b->recviovecs[i].iov_base = b->recvdata[i];
+		b->recviovecs[i].iov_len = LHNET_BATCHPACKETSIZE;
+		memset(&b->recvmsgs[i], 0, sizeof(b->recvmsgs[i]));
+		b->recvmsgs[i].msg_hdr.msg_name = &b->recvaddresses[i].addr;
+		b->recvmsgs[i].msg_hdr.msg_namelen = sizeof(b->recvaddresses[i].addr);
+		b->recvmsgs[i].msg_hdr.msg_iov = &b->recviovecs[i];
+		b->recvmsgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	b->recvcount = 0;
+	b->recvnext = 0;
+	value = recvmmsg(lhnetsocket->inetsocket, b->recvmsgs, LHNET_BATCHPACKETS, MSG_DONTWAIT, NULL);
+	if (value < 0)
+	{
+		int e = SOCKETERRNO;
+		if (e == EWOULDBLOCK)
+			return 0;
+		switch (e)
+		{
+			case ECONNREFUSED:
+				LHNET_PrintError(lhnetsocket, false, "Connection refused\n");
+				return 0;
+		}
+		LHNET_PrintError(lhnetsocket, true, "LHNET_Read: recvmmsg returned error: %s\n", LHNETPRIVATE_StrError());
+		return -1;
+	}
+	b->recvcount = value;
+	value = LHNET_Read_Batch(lhnetsocket, content, maxcontentlength, address);
+	return value < 0 ? 0 : value;
+}
+#endif
+
+void LHNET_BeginWrites(void)
+{
+	lhnet_batchwrites++;
+}
+
+void LHNET_FlushWrites(void)
+{
+#ifdef LHNET_MMSG
+	lhnetsocket_t *s;
+	for (s = lhnet_socketlist.next;s != &lhnet_socketlist;s = s->next)
+		if (s->batch && s->batch->sendcount)
+			LHNET_FlushWrites_Socket(s);
+#endif
+	if (lhnet_batchwrites > 0)
+		lhnet_batchwrites--;
+}
+
+void LHNET_ResetWrites(void)
+{
+	if (!lhnet_batchwrites)
+		return;
+	// a Host_Error longjmp skipped the LHNET_FlushWrites of a frame
+	lhnet_batchwrites = 1;
+	LHNET_FlushWrites();
+}
+
 lhnetsocket_t *LHNET_OpenSocket_Connectionless(lhnetaddress_t *address)
 {
 	lhnetsocket_t *lhnetsocket, *s;
@@ -1071,8 +1327,15 @@ void LHNET_CloseSocket(lhnetsocket_t *lhnetsocket)
 		// no special close code for loopback, just inet
 		if (lhnetsocket->address.addresstype == LHNETADDRESSTYPE_INET4 || lhnetsocket->address.addresstype == LHNETADDRESSTYPE_INET6)
 		{
+#ifdef LHNET_MMSG
+			if (lhnetsocket->batch && lhnetsocket->batch->sendcount)
+				LHNET_FlushWrites_Socket(lhnetsocket);
+#endif
 			closesocket(lhnetsocket->inetsocket);
 		}
+#ifdef LHNET_MMSG
+		LHNET_FreeBatch(lhnetsocket);
+#endif
 		Z_Free(lhnetsocket);
 	}
 }
@@ -1091,6 +1354,16 @@ int LHNET_Read(lhnetsocket_t *lhnetsocket, void *content, int maxcontentlength,
 	int value = 0;
 	if (!lhnetsocket || !address || !content || maxcontentlength < 1)
 		return -1;
+#ifdef LHNET_MMSG
+	if (lhnetsocket->address.addresstype == LHNETADDRESSTYPE_INET4 || lhnetsocket->address.addresstype == LHNETADDRESSTYPE_INET6)
+	{
+		// packets left over from the last recvmmsg come first
+		if (lhnetsocket->batch && (value = LHNET_Read_Batch(lhnetsocket, content, maxcontentlength, address)) >= 0)
+			return value;
+		if (lhnet_batchio && lhnetsocket->batchio)
+			return LHNET_Read_Receive(lhnetsocket, content, maxcontentlength, address);
+	}
+#endif
 	if (lhnetsocket->address.addresstype == LHNETADDRESSTYPE_LOOP)
 	{
 		time_t currenttime;
@@ -1152,10 +1425,10 @@ int LHNET_Read(lhnetsocket_t *lhnetsocket, void *content, int maxcontentlength,
 			switch (e)
 			{
 				case ECONNREFUSED:
-					Con_Print("Connection refused\n");
+					LHNET_PrintError(lhnetsocket, false, "Connection refused\n");
 					return 0;
 			}
-			Con_DPrintf("LHNET_Read: recvfrom returned error: %s\n", LHNETPRIVATE_StrError());
+			LHNET_PrintError(lhnetsocket, true, "LHNET_Read: recvfrom returned error: %s\n", LHNETPRIVATE_StrError());
 		}
 	}
 #ifndef NOSUPPORTIPV6
@@ -1179,10 +1452,10 @@ int LHNET_Read(lhnetsocket_t *lhnetsocket, void *content, int maxcontentlength,
 			switch (e)
 			{
 				case ECONNREFUSED:
-					Con_Print("Connection refused\n");
+					LHNET_PrintError(lhnetsocket, false, "Connection refused\n");
 					return 0;
 			}
-			Con_DPrintf("LHNET_Read: recvfrom returned error: %s\n", LHNETPRIVATE_StrError());
+			LHNET_PrintError(lhnetsocket, true, "LHNET_Read: recvfrom returned error: %s\n", LHNETPRIVATE_StrError());
 		}
 	}
 #endif
@@ -1197,6 +1470,10 @@ int LHNET_Write(lhnetsocket_t *lhnetsocket, const void *content, int contentleng
 		return -1;
 	if (lhnetsocket->address.addresstype != address->addresstype)
 		return -1;
+#ifdef LHNET_MMSG
+	if (lhnet_batchio && lhnet_batchwrites && lhnetsocket->batchio && (lhnetsocket->address.addresstype == LHNETADDRESSTYPE_INET4 || lhnetsocket->address.addresstype == LHNETADDRESSTYPE_INET6) && LHNET_Write_Batch(lhnetsocket, content, contentlength, address))
+		return contentlength;
+#endif
 	if (lhnetsocket->address.addresstype == LHNETADDRESSTYPE_LOOP)
 	{
 		lhnetpacket_t *p;
@@ -1223,7 +1500,7 @@ int LHNET_Write(lhnetsocket_t *lhnetsocket, const void *content, int contentleng
 		{
 			if (SOCKETERRNO == EWOULDBLOCK)
 				return 0;
-			Con_DPrintf("LHNET_Write: sendto returned error: %s\n", LHNETPRIVATE_StrError());
+			LHNET_PrintError(lhnetsocket, true, "LHNET_Write: sendto returned error: %s\n", LHNETPRIVATE_StrError());
 		}
 	}
 #ifndef NOSUPPORTIPV6
@@ -1234,7 +1511,7 @@ int LHNET_Write(lhnetsocket_t *lhnetsocket, const void *content, int contentleng
 		{
 			if (SOCKETERRNO == EWOULDBLOCK)
 				return 0;
-			Con_DPrintf("LHNET_Write: sendto returned error: %s\n", LHNETPRIVATE_StrError());
+			LHNET_PrintError(lhnetsocket, true, "LHNET_Write: sendto returned error: %s\n", LHNETPRIVATE_StrError());
 		}
 	}
 #endif
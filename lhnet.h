@@ -35,18 +35,33 @@ typedef struct lhnetsocket_s
 	lhnetaddress_t address;
 	int inetsocket;
 	struct lhnetsocket_s *next, *prev;
+	// reads and writes go through recvmmsg and sendmmsg while LHNET_BatchIO
+	// is enabled, meant for server sockets which handle many packets a frame
+	qboolean batchio;
+	// buffers for batched reads and writes, NULL until first used
+	struct lhnetbatch_s *batch;
+	// gets the error messages of reads and writes instead of the console
+	// while set, for a network thread owning the socket which must not print
+	void (*printfunction)(int developer, const char *message);
 }
 lhnetsocket_t;
 
 void LHNET_Init(void);
 void LHNET_Shutdown(void);
 int LHNET_DefaultDSCP(int dscp); // < 0: query; >= 0: set (returns previous value)
+int LHNET_BatchIO(int enable); // < 0: query; >= 0: set (returns previous value, -1 if not supported)
 void LHNET_SleepUntilPacket_Microseconds(int microseconds);
 lhnetsocket_t *LHNET_OpenSocket_Connectionless(lhnetaddress_t *address);
 void LHNET_CloseSocket(lhnetsocket_t *lhnetsocket);
 lhnetaddress_t *LHNET_AddressFromSocket(lhnetsocket_t *sock);
 int LHNET_Read(lhnetsocket_t *lhnetsocket, void *content, int maxcontentlength, lhnetaddress_t *address);
 int LHNET_Write(lhnetsocket_t *lhnetsocket, const void *content, int contentlength, const lhnetaddress_t *address);
+// with batch io enabled, writes to inet sockets between these two calls are
+// queued and then sent with as few system calls as possible
+void LHNET_BeginWrites(void);
+void LHNET_FlushWrites(void);
+// sends what is still queued and ends all batches, called at frame start
+void LHNET_ResetWrites(void);
 
 #endif
 
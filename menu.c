@@ -21,6 +21,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "cdaudio.h"
 #include "image.h"
 #include "progsvm.h"
+#include "sv_save.h"
 
 #include "mprogdefs.h"
 
@@ -868,13 +869,16 @@ static void M_ScanSaves (void)
 		len = FS_Read(f, buf, sizeof(buf) - 1);
 		len = min(len, sizeof(buf)-1);
 		buf[len] = 0;
-		t = buf;
-		// version
-		COM_ParseToken_Simple(&t, false, false, true);
-		//version = atoi(com_token);
-		// description
-		COM_ParseToken_Simple(&t, false, false, true);
-		strlcpy (m_filenames[i], com_token, sizeof (m_filenames[i]));
+		if (!SV_Savegame_IsBinary((unsigned char *)buf, len, m_filenames[i], sizeof(m_filenames[i])))
+		{
+			t = buf;
+			// version
+			COM_ParseToken_Simple(&t, false, false, true);
+			//version = atoi(com_token);
+			// description
+			COM_ParseToken_Simple(&t, false, false, true);
+			strlcpy (m_filenames[i], com_token, sizeof (m_filenames[i]));
+		}
 
 	// change _ back to space
 		for (j=0 ; j<SAVEGAME_COMMENT_LENGTH ; j++)
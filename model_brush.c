@@ -24,6 +24,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "polygon.h"
 #include "curves.h"
 #include "wad.h"
+#include "taskqueue.h"
 
 
 //cvar_t r_subdivide_size = {CVAR_SAVE, "r_subdivide_size", "128", "how large water polygons should be (smaller values produce more polygons which give better warping effects)"};
@@ -62,6 +63,8 @@ cvar_t mod_q3shader_force_terrain_alphaflag = {0, "mod_q3shader_force_terrain_al
 
 cvar_t mod_q1bsp_polygoncollisions = {0, "mod_q1bsp_polygoncollisions", "0", "disables use of precomputed cliphulls and instead collides with polygons (uses Bounding Interval Hierarchy optimizations)"};
 cvar_t mod_collision_bih = {0, "mod_collision_bih", "1", "enables use of generated Bounding Interval Hierarchy tree instead of compiled bsp tree in collision code"};
+cvar_t mod_bih_sah = {0, "mod_bih_sah", "0", "build the collision and render trees with the surface area heuristic, takes longer but traces visit fewer nodes (see mod_bih_benchmark)"};
+cvar_t mod_bih_cache = {0, "mod_bih_cache", "1", "store the collision and render trees built for a map in maps/<name>.bihcache in the game directory, later loads of the unchanged map use them instead of building them again"};
 cvar_t mod_recalculatenodeboxes = {0, "mod_recalculatenodeboxes", "1", "enables use of generated node bounding boxes based on BSP tree portal reconstruction, rather than the node boxes supplied by the map compiler"};
 
 static texture_t mod_q1bsp_texture_solid;
@@ -71,6 +74,7 @@ static texture_t mod_q1bsp_texture_slime;
 static texture_t mod_q1bsp_texture_water;
 
 static qboolean Mod_Q3BSP_TraceLineOfSight(struct model_s *model, const vec3_t start, const vec3_t end, const vec3_t acceptmins, const vec3_t acceptmaxs);
+static void Mod_BIH_Benchmark_f(void);
 
 void Mod_BrushInit(void)
 {
@@ -110,6 +114,9 @@ void Mod_BrushInit(void)
 	Cvar_RegisterVariable(&mod_q1bsp_polygoncollisions);
 	Cvar_RegisterVariable(&mod_collision_bih);
 	Cvar_RegisterVariable(&mod_recalculatenodeboxes);
+	Cvar_RegisterVariable(&mod_bih_cache);
+	Cvar_RegisterVariable(&mod_bih_sah);
+	Cmd_AddCommand("mod_bih_benchmark", Mod_BIH_Benchmark_f, "reports the nodes visited per trace in the collision tree of a model built by each method, usage: mod_bih_benchmark <model> [numtraces]");
 
 	// these games were made for older DP engines and are no longer
 	// maintained; use this hack to show their textures properly
@@ -3854,8 +3861,252 @@ static void Mod_Q1BSP_RoundUpToHullSize(dp_model_t *cmodel, const vec3_t inmins,
 
 void Mod_CollisionBIH_TraceLineAgainstSurfaces(dp_model_t *model, const frameblend_t *frameblend, const skeleton_t *skeleton, trace_t *trace, const vec3_t start, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask);
 
+/*
+BIH cache
+
+The collision and render trees of a map are stored in maps/<name>.bihcache
+in the game directory after they were built.  Each tree is kept with a hash
+of the leafs it was built from, so a tree is only used again if the map,
+the shaders and the cvars that affect the leafs are unchanged.  Nodes refer
+to each other and to the leafs by index, so they are copied as they are.
+*/
+
+#define MOD_BIHCACHE_VERSION 2
+/// changes whenever BIH_Build produces different trees from the same leafs
+#define MOD_BIHCACHE_BUILDER 0
+
+typedef struct mod_bihcacheheader_s
+{
+	char id[8];
+	int version;
+	int builder;
+	int method; ///< bih_buildmethod_t
+	int nodesize; ///< sizeof(bih_node_t)
+	int leafsize; ///< sizeof(bih_leaf_t)
+	unsigned int crc; ///< of the map file
+	int numtrees;
+}
+mod_bihcacheheader_t;
+
+/// followed by numnodes bih_node_t
+typedef struct mod_bihcachetree_s
+{
+	unsigned long long leafhash;
+	int numleafs;
+	int numnodes; ///< 0 if the model had nothing to build a tree from
+	int rootnode;
+	int error;
+	float mins[3];
+	float maxs[3];
+}
+mod_bihcachetree_t;
+
+typedef struct mod_bihbuild_s
+{
+	taskqueue_task_t task;
+	mempool_t *mempool;
+	dp_model_t *model;
+	qboolean userendersurfaces;
+	bih_buildmethod_t method;
+	bih_t *out;
+	/// the tree is built here and copied to out by Mod_BIHBuilds_Finish, the
+	/// submodels cloned from the world meanwhile read the world's out
+	bih_t bih;
+	bih_t *fallback; ///< copied to out if the model has nothing to build from
+	bih_t *copyto; ///< receives a copy of out when it is done
+	const unsigned char *cached; ///< mod_bihcachetree_t to use if the leafs match
+	unsigned long long leafhash;
+	qboolean fromcache;
+	bih_t *result;
+}
+mod_bihbuild_t;
+
+typedef struct mod_bihbuilds_s
+{
+	int numbuilds;
+	int maxbuilds;
+	mod_bihbuild_t *builds;
+	bih_buildmethod_t method;
+	// the cache file
+	qboolean usecache;
+	char cachename[MAX_QPATH];
+	unsigned char *cachedata;
+	int numcachetrees;
+	const unsigned char **cachetrees;
+}
+mod_bihbuilds_t;
+
+static bih_t *Mod_MakeCollisionBIHInPool(mempool_t *mempool, dp_model_t *model, qboolean userendersurfaces, bih_buildmethod_t method, bih_t *out, const unsigned char *cached, unsigned long long *leafhash, qboolean *fromcache);
+
+static void Mod_BIHBuild_Task(taskqueue_task_t *t)
+{
+	mod_bihbuild_t *b = (mod_bihbuild_t *)t->p[0];
+	b->result = Mod_MakeCollisionBIHInPool(b->mempool, b->model, b->userendersurfaces, b->method, &b->bih, b->cached, &b->leafhash, &b->fromcache);
+}
+
+static void Mod_BIHBuilds_LoadCache(mod_bihbuilds_t *builds)
+{
+	fs_offset_t size, ofs;
+	mod_bihcacheheader_t header;
+	mod_bihcachetree_t tree;
+	int i;
+
+	builds->cachedata = FS_LoadFileView(builds->cachename, tempmempool, true, &size);
+	if (!builds->cachedata)
+		return;
+	if (size < (fs_offset_t)sizeof(header))
+		return;
+	memcpy(&header, builds->cachedata, sizeof(header));
+	if (memcmp(header.id, "DPBIHC", 7) || header.version != MOD_BIHCACHE_VERSION || header.builder != MOD_BIHCACHE_BUILDER || header.method != (int)builds->method
+	 || header.nodesize != (int)sizeof(bih_node_t) || header.leafsize != (int)sizeof(bih_leaf_t) || header.crc != loadmodel->crc
+	 || header.numtrees < 0 || header.numtrees > builds->maxbuilds)
+		return;
+	builds->cachetrees = (const unsigned char **)Mem_Alloc(tempmempool, header.numtrees * sizeof(*builds->cachetrees));
+	ofs = sizeof(header);
+	for (i = 0;i < header.numtrees;i++)
+	{
+		if (size - ofs < (fs_offset_t)sizeof(tree))
+			break;
+		memcpy(&tree, builds->cachedata + ofs, sizeof(tree));
+		if (tree.numnodes < 0 || tree.numnodes > tree.numleafs + 1 || size - ofs - (fs_offset_t)sizeof(tree) < (fs_offset_t)tree.numnodes * (fs_offset_t)sizeof(bih_node_t))
+			break;
+		builds->cachetrees[i] = builds->cachedata + ofs;
+		ofs += sizeof(tree) + tree.numnodes * sizeof(bih_node_t);
+	}
+	builds->numcachetrees = i;
+}
+
+static void Mod_BIHBuilds_SaveCache(mod_bihbuilds_t *builds)
+{
+	qfile_t *file;
+	mod_bihcacheheader_t header;
+	mod_bihcachetree_t tree;
+	mod_bihbuild_t *b;
+	int i;
+
+	file = FS_OpenRealFile(builds->cachename, "wb", false);
+	if (!file)
+		return;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.id, "DPBIHC", 7);
+	header.version = MOD_BIHCACHE_VERSION;
+	header.builder = MOD_BIHCACHE_BUILDER;
+	header.method = builds->method;
+	header.nodesize = sizeof(bih_node_t);
+	header.leafsize = sizeof(bih_leaf_t);
+	header.crc = loadmodel->crc;
+	header.numtrees = builds->numbuilds;
+	FS_Write(file, &header, sizeof(header));
+	for (i = 0, b = builds->builds;i < builds->numbuilds;i++, b++)
+	{
+		memset(&tree, 0, sizeof(tree));
+		if (b->result)
+		{
+			tree.leafhash = b->leafhash;
+			tree.numleafs = b->result->numleafs;
+			tree.numnodes = b->result->numnodes;
+			tree.rootnode = b->result->rootnode;
+			tree.error = b->result->error;
+			VectorCopy(b->result->mins, tree.mins);
+			VectorCopy(b->result->maxs, tree.maxs);
+		}
+		FS_Write(file, &tree, sizeof(tree));
+		if (tree.numnodes)
+			FS_Write(file, b->result->nodes, tree.numnodes * sizeof(bih_node_t));
+	}
+	FS_Close(file);
+}
+
+static void Mod_BIHBuilds_Begin(mod_bihbuilds_t *builds, int maxbuilds)
+{
+	memset(builds, 0, sizeof(*builds));
+	builds->maxbuilds = maxbuilds;
+	builds->builds = (mod_bihbuild_t *)Mem_Alloc(tempmempool, maxbuilds * sizeof(mod_bihbuild_t));
+	builds->method = mod_bih_sah.integer ? BIH_BUILD_SAH : BIH_BUILD_MIDPOINT;
+	// only the trees of maps are worth keeping
+	builds->usecache = mod_bih_cache.integer && !strncmp(loadmodel->name, "maps/", 5);
+	if (builds->usecache)
+	{
+		FS_StripExtension(loadmodel->name, builds->cachename, sizeof(builds->cachename));
+		strlcat(builds->cachename, ".bihcache", sizeof(builds->cachename));
+		Mod_BIHBuilds_LoadCache(builds);
+	}
+}
+
+/// builds the BIH of a (sub)model on a worker thread while the loader goes on
+/// with the next submodel, the result is only stored in out by
+/// Mod_BIHBuilds_Finish (a submodel without anything to build from gets the
+/// BIH of the world from fallback)
+static void Mod_BIHBuilds_Add(mod_bihbuilds_t *builds, dp_model_t *model, qboolean userendersurfaces, bih_t *out, bih_t *fallback, bih_t *copyto)
+{
+	mod_bihbuild_t *b;
+
+	if (builds->numbuilds >= builds->maxbuilds)
+	{
+		if (!Mod_MakeCollisionBIHInPool(loadmodel->mempool, model, userendersurfaces, builds->method, out, NULL, NULL, NULL) && fallback && fallback != out)
+			*out = *fallback;
+		if (copyto)
+			*copyto = *out;
+		return;
+	}
+	b = builds->builds + builds->numbuilds;
+	b->mempool = loadmodel->mempool;
+	b->model = model;
+	b->userendersurfaces = userendersurfaces;
+	b->method = builds->method;
+	b->out = out;
+	b->fallback = fallback != out ? fallback : NULL;
+	b->copyto = copyto;
+	b->cached = builds->numbuilds < builds->numcachetrees ? builds->cachetrees[builds->numbuilds] : NULL;
+	builds->numbuilds++;
+	TaskQueue_Setup(&b->task, NULL, Mod_BIHBuild_Task, 0, 0, b, NULL);
+	if (TaskQueue_NumThreads())
+		TaskQueue_Enqueue(1, &b->task);
+	else
+	{
+		Mod_BIHBuild_Task(&b->task);
+		b->task.done = 1;
+	}
+}
+
+static void Mod_BIHBuilds_Finish(mod_bihbuilds_t *builds)
+{
+	int i, numcached = 0;
+	mod_bihbuild_t *b;
+
+	// in the order they were added, so the world is done before the fallbacks
+	// of its submodels are copied from it
+	for (i = 0, b = builds->builds;i < builds->numbuilds;i++, b++)
+	{
+		TaskQueue_WaitForTaskDone(&b->task);
+		if (!b->result && b->fallback)
+			*b->out = *b->fallback;
+		else
+			*b->out = b->bih;
+		if (b->copyto)
+			*b->copyto = *b->out;
+		if (b->fromcache || !b->result)
+			numcached++;
+	}
+	if (builds->usecache)
+	{
+		if (numcached < builds->numbuilds || builds->numcachetrees != builds->numbuilds)
+			Mod_BIHBuilds_SaveCache(builds);
+		else
+			Con_DPrintf("Loaded %i BIH trees from %s\n", builds->numbuilds, builds->cachename);
+	}
+	if (builds->cachetrees)
+		Mem_Free((void *)builds->cachetrees);
+	if (builds->cachedata)
+		FS_FreeFileView(builds->cachedata);
+	if (builds->builds)
+		Mem_Free(builds->builds);
+	memset(builds, 0, sizeof(*builds));
+}
+
 void Mod_Q1BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 {
+	mod_bihbuilds_t bihbuilds;
 	int i, j, k;
 	sizebuf_t lumpsb[HEADER_LUMPS];
 	mmodel_t *bm;
@@ -4052,6 +4303,7 @@ void Mod_Q1BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 		}
 	}
 	datapointer = (unsigned char *)Mem_Alloc(mod->mempool, mod->num_surfaces * sizeof(int) + totalstyles * sizeof(model_brush_lightstyleinfo_t) + totalstylesurfaces * sizeof(int *));
+	Mod_BIHBuilds_Begin(&bihbuilds, mod->brush.numsubmodels);
 	for (i = 0;i < mod->brush.numsubmodels;i++)
 	{
 		// LordHavoc: this code was originally at the end of this loop, but
@@ -4065,6 +4317,10 @@ void Mod_Q1BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 			mod = Mod_FindName(name, loadmodel->name);
 			// copy the base model to this one
 			*mod = *loadmodel;
+			// the trees of the world are still being built, each submodel
+			// gets its own from Mod_BIHBuilds_Finish
+			memset(&mod->render_bih, 0, sizeof(mod->render_bih));
+			memset(&mod->collision_bih, 0, sizeof(mod->collision_bih));
 			// rename the clone back to its proper name
 			strlcpy(mod->name, name, sizeof(mod->name));
 			mod->brush.parentmodel = loadmodel;
@@ -4194,11 +4450,10 @@ void Mod_Q1BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 		//mod->brushq1.num_visleafs = bm->visleafs;
 
 		// build a Bounding Interval Hierarchy for culling triangles in light rendering
-		Mod_MakeCollisionBIH(mod, true, &mod->render_bih);
+		Mod_BIHBuilds_Add(&bihbuilds, mod, true, &mod->render_bih, &loadmodel->render_bih, mod_q1bsp_polygoncollisions.integer ? &mod->collision_bih : NULL);
 
 		if (mod_q1bsp_polygoncollisions.integer)
 		{
-			mod->collision_bih = mod->render_bih;
 			// point traces and contents checks still use the bsp tree
 			mod->TraceLine = Mod_CollisionBIH_TraceLine;
 			mod->TraceBox = Mod_CollisionBIH_TraceBox;
@@ -4214,6 +4469,7 @@ void Mod_Q1BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 			//Mod_Q1BSP_ProcessLightList();
 		}
 	}
+	Mod_BIHBuilds_Finish(&bihbuilds);
 
 	Con_DPrintf("Stats for q1bsp model \"%s\": %i faces, %i nodes, %i leafs, %i visleafs, %i visleafportals, mesh: %i vertices, %i triangles, %i surfaces\n", loadmodel->name, loadmodel->num_surfaces, loadmodel->brush.num_nodes, loadmodel->brush.num_leafs, mod->brush.num_pvsclusters, loadmodel->brush.num_portals, loadmodel->surfmesh.num_vertices, loadmodel->surfmesh.num_triangles, loadmodel->num_surfaces);
 }
@@ -4871,6 +5127,7 @@ static void Mod_Q2BSP_FindSubmodelBrushRange_r(dp_model_t *mod, mnode_t *node, i
 
 static void Mod_Q2BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 {
+	mod_bihbuilds_t bihbuilds;
 	int i, j, k;
 	sizebuf_t lumpsb[Q2HEADER_LUMPS];
 	mmodel_t *bm;
@@ -5024,6 +5281,7 @@ static void Mod_Q2BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 	// set up the world model, then on each submodel copy from the world model
 	// and set up the submodel with the respective model info.
 	mod = loadmodel;
+	Mod_BIHBuilds_Begin(&bihbuilds, loadmodel->brush.numsubmodels * 2);
 	for (i = 0;i < loadmodel->brush.numsubmodels;i++)
 	{
 		mnode_t *rootnode = NULL;
@@ -5036,6 +5294,10 @@ static void Mod_Q2BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 			mod = Mod_FindName(name, loadmodel->name);
 			// copy the base model to this one
 			*mod = *loadmodel;
+			// the trees of the world are still being built, each submodel
+			// gets its own from Mod_BIHBuilds_Finish
+			memset(&mod->render_bih, 0, sizeof(mod->render_bih));
+			memset(&mod->collision_bih, 0, sizeof(mod->collision_bih));
 			// rename the clone back to its proper name
 			strlcpy(mod->name, name, sizeof(mod->name));
 			mod->brush.parentmodel = loadmodel;
@@ -5170,15 +5432,16 @@ static void Mod_Q2BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 		//mod->brushq1.num_visleafs = bm->visleafs;
 
 		// build a Bounding Interval Hierarchy for culling triangles in light rendering
-		Mod_MakeCollisionBIH(mod, false, &mod->collision_bih);
+		Mod_BIHBuilds_Add(&bihbuilds, mod, false, &mod->collision_bih, &loadmodel->collision_bih, NULL);
 
 		// build a Bounding Interval Hierarchy for culling brushes in collision detection
-		Mod_MakeCollisionBIH(mod, true, &mod->render_bih);
+		Mod_BIHBuilds_Add(&bihbuilds, mod, true, &mod->render_bih, &loadmodel->render_bih, NULL);
 
 		// generate VBOs and other shared data before cloning submodels
 		if (i == 0)
 			Mod_BuildVBOs();
 	}
+	Mod_BIHBuilds_Finish(&bihbuilds);
 	mod = loadmodel;
 
 	Con_DPrintf("Stats for q2bsp model \"%s\": %i faces, %i nodes, %i leafs, %i clusters, %i clusterportals, mesh: %i vertices, %i triangles, %i surfaces\n", loadmodel->name, loadmodel->num_surfaces, loadmodel->brush.num_nodes, loadmodel->brush.num_leafs, mod->brush.num_pvsclusters, loadmodel->brush.num_portals, loadmodel->surfmesh.num_vertices, loadmodel->surfmesh.num_triangles, loadmodel->num_surfaces);
@@ -7628,6 +7891,266 @@ void Mod_CollisionBIH_TraceLineAgainstSurfaces(dp_model_t *model, const frameble
 
 
 bih_t *Mod_MakeCollisionBIH(dp_model_t *model, qboolean userendersurfaces, bih_t *out)
+{
+	return Mod_MakeCollisionBIHInPool(loadmodel->mempool, model, userendersurfaces, mod_bih_sah.integer ? BIH_BUILD_SAH : BIH_BUILD_MIDPOINT, out, NULL, NULL, NULL);
+}
+
+static float Mod_BIH_Benchmark_Random(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return ((*seed >> 8) & 0xFFFF) * (1.0f / 65535.0f);
+}
+
+#define MOD_BIH_BENCHMARK_PACKETLINES 8
+
+typedef struct mod_bih_benchmark_node_s
+{
+	int nodenum;
+	int mask; // lines that reach this node
+	float frac[MOD_BIH_BENCHMARK_PACKETLINES][2]; // part of each line that lies within the node
+}
+mod_bih_benchmark_node_t;
+
+// narrows the part of a line to where its coordinate on an axis is at most
+// (or with above set at least) dist, returns false if nothing is left
+static int Mod_BIH_Benchmark_ClipLineFraction(float start, float delta, float dist, int above, float *frac)
+{
+	float f;
+	if (delta == 0)
+		return above ? start >= dist : start <= dist;
+	f = (dist - start) / delta;
+	if ((delta > 0) != (above != 0))
+	{
+		if (frac[1] > f)
+			frac[1] = f;
+	}
+	else
+	{
+		if (frac[0] < f)
+			frac[0] = f;
+	}
+	return frac[0] <= frac[1];
+}
+
+static int Mod_BIH_Benchmark_ClipLineToBox(const float *start, const float *delta, const float *mins, const float *maxs, float *frac)
+{
+	return Mod_BIH_Benchmark_ClipLineFraction(start[0], delta[0], mins[0], 1, frac) && Mod_BIH_Benchmark_ClipLineFraction(start[0], delta[0], maxs[0], 0, frac)
+	    && Mod_BIH_Benchmark_ClipLineFraction(start[1], delta[1], mins[1], 1, frac) && Mod_BIH_Benchmark_ClipLineFraction(start[1], delta[1], maxs[1], 0, frac)
+	    && Mod_BIH_Benchmark_ClipLineFraction(start[2], delta[2], mins[2], 1, frac) && Mod_BIH_Benchmark_ClipLineFraction(start[2], delta[2], maxs[2], 0, frac);
+}
+
+/// walks the tree once for up to MOD_BIH_BENCHMARK_PACKETLINES lines, each
+/// line clipped to the part of it that reaches a child, nodestack must have
+/// room for one more entry than the tree has nodes, returns the number of
+/// leafs found (which may exceed maxleafs)
+static int Mod_BIH_Benchmark_LinePacket(const bih_t *bih, int numlines, const float *starts, const float *ends, int maxleafs, int *leaflist, mod_bih_benchmark_node_t *nodestack, int *nodevisits)
+{
+	int i;
+	int j;
+	int axis;
+	int mask;
+	int numleafs = 0;
+	int nodestackpos = 0;
+	float frac[2];
+	float delta[MOD_BIH_BENCHMARK_PACKETLINES][3];
+	mod_bih_benchmark_node_t entry;
+	mod_bih_benchmark_node_t *child;
+	const bih_node_t *node;
+	const bih_leaf_t *leaf;
+	if (!bih->nodes || numlines < 1)
+		return 0;
+	if (numlines > MOD_BIH_BENCHMARK_PACKETLINES)
+		numlines = MOD_BIH_BENCHMARK_PACKETLINES;
+	// the root gets the part of each line within the bounds of the tree
+	child = nodestack;
+	child->nodenum = bih->rootnode;
+	child->mask = 0;
+	for (i = 0;i < numlines;i++)
+	{
+		delta[i][0] = ends[i*3+0] - starts[i*3+0];
+		delta[i][1] = ends[i*3+1] - starts[i*3+1];
+		delta[i][2] = ends[i*3+2] - starts[i*3+2];
+		child->frac[i][0] = 0;
+		child->frac[i][1] = 1;
+		if (Mod_BIH_Benchmark_ClipLineToBox(starts + i*3, delta[i], bih->mins, bih->maxs, child->frac[i]))
+			child->mask |= 1<<i;
+	}
+	if (child->mask)
+		nodestackpos++;
+	while (nodestackpos)
+	{
+		entry = nodestack[--nodestackpos];
+		node = bih->nodes + entry.nodenum;
+		++*nodevisits;
+		if (node->type == BIH_UNORDERED)
+		{
+			for (j = 0;j < BIH_MAXUNORDEREDCHILDREN && node->children[j] >= 0;j++)
+			{
+				leaf = bih->leafs + node->children[j];
+				mask = 0;
+				for (i = 0;i < numlines;i++)
+				{
+					if (!(entry.mask & (1<<i)))
+						continue;
+					frac[0] = entry.frac[i][0];
+					frac[1] = entry.frac[i][1];
+					if (Mod_BIH_Benchmark_ClipLineToBox(starts + i*3, delta[i], leaf->mins, leaf->maxs, frac))
+						mask |= 1<<i;
+				}
+				if (!mask)
+					continue;
+				if (numleafs < maxleafs)
+					leaflist[numleafs] = node->children[j];
+				numleafs++;
+			}
+			continue;
+		}
+		// split each line into the parts reaching the back and front children,
+		// the front child is pushed last so it is visited first
+		axis = node->type - BIH_SPLITX;
+		child = nodestack + nodestackpos;
+		child->nodenum = node->back;
+		child->mask = 0;
+		for (i = 0;i < numlines;i++)
+		{
+			if (!(entry.mask & (1<<i)))
+				continue;
+			child->frac[i][0] = entry.frac[i][0];
+			child->frac[i][1] = entry.frac[i][1];
+			if (Mod_BIH_Benchmark_ClipLineFraction(starts[i*3+axis], delta[i][axis], node->backmax, 0, child->frac[i]))
+				child->mask |= 1<<i;
+		}
+		if (child->mask)
+			nodestackpos++;
+		child = nodestack + nodestackpos;
+		child->nodenum = node->front;
+		child->mask = 0;
+		for (i = 0;i < numlines;i++)
+		{
+			if (!(entry.mask & (1<<i)))
+				continue;
+			child->frac[i][0] = entry.frac[i][0];
+			child->frac[i][1] = entry.frac[i][1];
+			if (Mod_BIH_Benchmark_ClipLineFraction(starts[i*3+axis], delta[i][axis], node->frontmin, 1, child->frac[i]))
+				child->mask |= 1<<i;
+		}
+		if (child->mask)
+			nodestackpos++;
+	}
+	return numleafs;
+}
+
+/// builds the collision tree of a model with each method and walks the same
+/// random lines through both, one at a time and as packets sharing a start
+/// like the culling traces from an eye position do
+static void Mod_BIH_Benchmark_f(void)
+{
+	static const char *methodnames[2] = {"midpoint", "SAH"};
+	dp_model_t *mod;
+	const bih_t *bih;
+	bih_t tree;
+	bih_node_t *nodes;
+	int *leafsort, *leaflist;
+	mod_bih_benchmark_node_t *nodestack;
+	float *starts, *ends;
+	int i, j, k, method, numtraces, numleafs, nodevisits, packetvisits;
+	unsigned int seed = 1;
+	double t, buildtime, tracetime, packettime;
+
+	if (Cmd_Argc() < 2)
+	{
+		Con_Print("usage: mod_bih_benchmark <model> [numtraces]\n");
+		return;
+	}
+	mod = Mod_ForName(Cmd_Argv(1), false, true, NULL);
+	if (!mod)
+	{
+		Con_Print("No such model\n");
+		return;
+	}
+	bih = mod->collision_bih.nodes ? &mod->collision_bih : &mod->render_bih;
+	if (!bih->nodes || !bih->numleafs)
+	{
+		Con_Printf("%s has no BIH\n", mod->name);
+		return;
+	}
+	numtraces = Cmd_Argc() > 2 ? atoi(Cmd_Argv(2)) : 10000;
+	numtraces = (max(numtraces, 1) + MOD_BIH_BENCHMARK_PACKETLINES - 1) / MOD_BIH_BENCHMARK_PACKETLINES * MOD_BIH_BENCHMARK_PACKETLINES;
+
+	// each packet of lines starts at one random point within the model
+	starts = (float *)Mem_Alloc(tempmempool, numtraces * 6 * sizeof(float));
+	ends = starts + numtraces * 3;
+	for (i = 0;i < numtraces;i += MOD_BIH_BENCHMARK_PACKETLINES)
+	{
+		for (k = 0;k < 3;k++)
+			starts[i*3+k] = bih->mins[k] + (bih->maxs[k] - bih->mins[k]) * Mod_BIH_Benchmark_Random(&seed);
+		for (j = i;j < i + MOD_BIH_BENCHMARK_PACKETLINES;j++)
+		{
+			VectorCopy(starts + i*3, starts + j*3);
+			for (k = 0;k < 3;k++)
+				ends[j*3+k] = bih->mins[k] + (bih->maxs[k] - bih->mins[k]) * Mod_BIH_Benchmark_Random(&seed);
+		}
+	}
+	leaflist = (int *)Mem_Alloc(tempmempool, bih->numleafs * sizeof(int));
+	nodes = (bih_node_t *)Mem_Alloc(tempmempool, (bih->numleafs + 1) * sizeof(bih_node_t));
+	leafsort = (int *)Mem_Alloc(tempmempool, bih->numleafs * 2 * sizeof(int));
+	nodestack = (mod_bih_benchmark_node_t *)Mem_Alloc(tempmempool, (bih->numleafs + 2) * sizeof(mod_bih_benchmark_node_t));
+
+	Con_Printf("%i traces through the %i leafs of %s\n", numtraces, bih->numleafs, mod->name);
+	Con_Print("method    nodes build ms nodes/trace leafs/trace usec/trace | packet of 8: nodes/trace usec/trace\n");
+	for (method = BIH_BUILD_MIDPOINT;method <= BIH_BUILD_SAH;method++)
+	{
+		t = Sys_DirtyTime();
+		BIH_Build(&tree, bih->numleafs, bih->leafs, bih->numleafs + 1, nodes, leafsort, leafsort + bih->numleafs, (bih_buildmethod_t)method);
+		buildtime = Sys_DirtyTime() - t;
+
+		numleafs = 0;
+		nodevisits = 0;
+		t = Sys_DirtyTime();
+		for (i = 0;i < numtraces;i++)
+			numleafs += Mod_BIH_Benchmark_LinePacket(&tree, 1, starts + i*3, ends + i*3, bih->numleafs, leaflist, nodestack, &nodevisits);
+		tracetime = Sys_DirtyTime() - t;
+
+		packetvisits = 0;
+		t = Sys_DirtyTime();
+		for (i = 0;i < numtraces;i += MOD_BIH_BENCHMARK_PACKETLINES)
+			Mod_BIH_Benchmark_LinePacket(&tree, MOD_BIH_BENCHMARK_PACKETLINES, starts + i*3, ends + i*3, bih->numleafs, leaflist, nodestack, &packetvisits);
+		packettime = Sys_DirtyTime() - t;
+
+		Con_Printf("%-8s %6i %8.2f %11.2f %11.2f %10.3f |              %11.2f %10.3f\n", methodnames[method], tree.numnodes, buildtime * 1000.0, (double)nodevisits / numtraces, (double)numleafs / numtraces, tracetime * 1000000.0 / numtraces, (double)packetvisits / numtraces, packettime * 1000000.0 / numtraces);
+	}
+
+	Mem_Free(nodestack);
+	Mem_Free(leafsort);
+	Mem_Free(nodes);
+	Mem_Free(leaflist);
+	Mem_Free(starts);
+}
+
+/// checks that the nodes of a cached tree only refer forward to other nodes
+/// and to existing leafs, so a damaged cache file can not break traces
+static qboolean Mod_BIHCache_CheckNodes(const bih_node_t *nodes, int numnodes, int numleafs)
+{
+	int i, j;
+	const bih_node_t *node;
+
+	for (i = 0, node = nodes;i < numnodes;i++, node++)
+	{
+		if (node->type == BIH_UNORDERED)
+		{
+			for (j = 0;j < BIH_MAXUNORDEREDCHILDREN;j++)
+				if (node->children[j] < -1 || node->children[j] >= numleafs)
+					return false;
+		}
+		else if (node->type < BIH_SPLITX || node->type > BIH_SPLITZ || node->front <= i || node->front >= numnodes || node->back <= i || node->back >= numnodes)
+			return false;
+	}
+	return true;
+}
+
+/// with leafhash set the leafs are hashed for the cache, and if they are the
+/// ones cached is built from, the nodes are taken from there
+static bih_t *Mod_MakeCollisionBIHInPool(mempool_t *mempool, dp_model_t *model, qboolean userendersurfaces, bih_buildmethod_t method, bih_t *out, const unsigned char *cached, unsigned long long *leafhash, qboolean *fromcache)
 {
 	int j;
 	int bihnumleafs;
@@ -7674,7 +8197,7 @@ bih_t *Mod_MakeCollisionBIH(dp_model_t *model, qboolean userendersurfaces, bih_t
 		return NULL;
 
 	// allocate the memory for the BIH leaf nodes
-	bihleafs = (bih_leaf_t *)Mem_Alloc(loadmodel->mempool, sizeof(bih_leaf_t) * bihnumleafs);
+	bihleafs = (bih_leaf_t *)Mem_Alloc(mempool, sizeof(bih_leaf_t) * bihnumleafs);
 
 	// now populate the BIH leaf nodes
 	bihleafindex = 0;
@@ -7740,14 +8263,50 @@ bih_t *Mod_MakeCollisionBIH(dp_model_t *model, qboolean userendersurfaces, bih_t
 		}
 	}
 
+	if (leafhash)
+	{
+		// FNV-1a over the words of the leafs
+		const unsigned int *words = (const unsigned int *)bihleafs;
+		size_t k, numwords = bihnumleafs * sizeof(bih_leaf_t) / sizeof(unsigned int);
+		unsigned long long hash = 14695981039346656037ULL;
+		mod_bihcachetree_t tree;
+		for (k = 0;k < numwords;k++)
+			hash = (hash ^ words[k]) * 1099511628211ULL;
+		*leafhash = hash;
+		if (cached)
+		{
+			memcpy(&tree, cached, sizeof(tree));
+			if (tree.leafhash == hash && tree.numleafs == bihnumleafs && tree.numnodes > 0 && tree.rootnode == 0)
+			{
+				bihnodes = (bih_node_t *)Mem_Alloc(mempool, sizeof(bih_node_t) * tree.numnodes);
+				memcpy(bihnodes, cached + sizeof(tree), sizeof(bih_node_t) * tree.numnodes);
+				if (Mod_BIHCache_CheckNodes(bihnodes, tree.numnodes, bihnumleafs))
+				{
+					memset(out, 0, sizeof(*out));
+					out->numleafs = bihnumleafs;
+					out->leafs = bihleafs;
+					out->numnodes = out->maxnodes = tree.numnodes;
+					out->nodes = bihnodes;
+					out->rootnode = tree.rootnode;
+					out->error = tree.error;
+					VectorCopy(tree.mins, out->mins);
+					VectorCopy(tree.maxs, out->maxs);
+					*fromcache = true;
+					return out;
+				}
+				Mem_Free(bihnodes);
+			}
+		}
+	}
+
 	// allocate buffers for the produced and temporary data
 	bihmaxnodes = bihnumleafs + 1;
-	bihnodes = (bih_node_t *)Mem_Alloc(loadmodel->mempool, sizeof(bih_node_t) * bihmaxnodes);
-	temp_leafsort = (int *)Mem_Alloc(loadmodel->mempool, sizeof(int) * bihnumleafs * 2);
+	bihnodes = (bih_node_t *)Mem_Alloc(mempool, sizeof(bih_node_t) * bihmaxnodes);
+	temp_leafsort = (int *)Mem_Alloc(mempool, sizeof(int) * bihnumleafs * 2);
 	temp_leafsortscratch = temp_leafsort + bihnumleafs;
 
 	// now build it
-	BIH_Build(out, bihnumleafs, bihleafs, bihmaxnodes, bihnodes, temp_leafsort, temp_leafsortscratch);
+	BIH_Build(out, bihnumleafs, bihleafs, bihmaxnodes, bihnodes, temp_leafsort, temp_leafsortscratch, method);
 
 	// we're done with the temporary data
 	Mem_Free(temp_leafsort);
@@ -7756,7 +8315,7 @@ bih_t *Mod_MakeCollisionBIH(dp_model_t *model, qboolean userendersurfaces, bih_t
 	if (out->maxnodes > out->numnodes)
 	{
 		out->maxnodes = out->numnodes;
-		out->nodes = (bih_node_t *)Mem_Realloc(loadmodel->mempool, out->nodes, out->numnodes * sizeof(bih_node_t));
+		out->nodes = (bih_node_t *)Mem_Realloc(mempool, out->nodes, out->numnodes * sizeof(bih_node_t));
 	}
 
 	return out;
@@ -7837,6 +8396,7 @@ static void Mod_Q3BSP_RecursiveFindNumLeafs(mnode_t *node)
 
 static void Mod_Q3BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 {
+	mod_bihbuilds_t bihbuilds;
 	int i, j, lumps;
 	q3dheader_t *header;
 	float corner[3], yawradius, modelradius;
@@ -7970,6 +8530,7 @@ static void Mod_Q3BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 		loadmodel->brush.submodels = (dp_model_t **)Mem_Alloc(loadmodel->mempool, loadmodel->brush.numsubmodels * sizeof(dp_model_t *));
 
 	mod = loadmodel;
+	Mod_BIHBuilds_Begin(&bihbuilds, loadmodel->brush.numsubmodels * 2);
 	for (i = 0;i < loadmodel->brush.numsubmodels;i++)
 	{
 		if (i > 0)
@@ -7980,6 +8541,10 @@ static void Mod_Q3BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 			mod = Mod_FindName(name, loadmodel->name);
 			// copy the base model to this one
 			*mod = *loadmodel;
+			// the trees of the world are still being built, each submodel
+			// gets its own from Mod_BIHBuilds_Finish
+			memset(&mod->render_bih, 0, sizeof(mod->render_bih));
+			memset(&mod->collision_bih, 0, sizeof(mod->collision_bih));
 			// rename the clone back to its proper name
 			strlcpy(mod->name, name, sizeof(mod->name));
 			mod->brush.parentmodel = loadmodel;
@@ -8063,13 +8628,14 @@ static void Mod_Q3BSP_Load(dp_model_t *mod, void *buffer, void *bufferend)
 		if (j < mod->nummodelsurfaces)
 			mod->DrawAddWaterPlanes = R_Q1BSP_DrawAddWaterPlanes;
 
-		Mod_MakeCollisionBIH(mod, false, &mod->collision_bih);
-		Mod_MakeCollisionBIH(mod, true, &mod->render_bih);
+		Mod_BIHBuilds_Add(&bihbuilds, mod, false, &mod->collision_bih, &loadmodel->collision_bih, NULL);
+		Mod_BIHBuilds_Add(&bihbuilds, mod, true, &mod->render_bih, &loadmodel->render_bih, NULL);
 
 		// generate VBOs and other shared data before cloning submodels
 		if (i == 0)
 			Mod_BuildVBOs();
 	}
+	Mod_BIHBuilds_Finish(&bihbuilds);
 
 	if (mod_q3bsp_sRGBlightmaps.integer)
 	{
@@ -8129,6 +8695,7 @@ static unsigned char nobsp_pvs[1] = {1};
 
 void Mod_OBJ_Load(dp_model_t *mod, void *buffer, void *bufferend)
 {
+	mod_bihbuilds_t bihbuilds;
 	const char *textbase = (char *)buffer, *text = textbase;
 	char *s;
 	char *argv[512];
@@ -8617,6 +9184,7 @@ void Mod_OBJ_Load(dp_model_t *mod, void *buffer, void *bufferend)
 		loadmodel->brush.submodels = (dp_model_t **)Mem_Alloc(loadmodel->mempool, loadmodel->brush.numsubmodels * sizeof(dp_model_t *));
 
 	mod = loadmodel;
+	Mod_BIHBuilds_Begin(&bihbuilds, loadmodel->brush.numsubmodels);
 	for (i = 0;i < loadmodel->brush.numsubmodels;i++)
 	{
 		if (i > 0)
@@ -8627,6 +9195,10 @@ void Mod_OBJ_Load(dp_model_t *mod, void *buffer, void *bufferend)
 			mod = Mod_FindName(name, loadmodel->name);
 			// copy the base model to this one
 			*mod = *loadmodel;
+			// the trees of the world are still being built, each submodel
+			// gets its own from Mod_BIHBuilds_Finish
+			memset(&mod->render_bih, 0, sizeof(mod->render_bih));
+			memset(&mod->collision_bih, 0, sizeof(mod->collision_bih));
 			// rename the clone back to its proper name
 			strlcpy(mod->name, name, sizeof(mod->name));
 			mod->brush.parentmodel = loadmodel;
@@ -8710,13 +9282,13 @@ void Mod_OBJ_Load(dp_model_t *mod, void *buffer, void *bufferend)
 		if (j < mod->nummodelsurfaces)
 			mod->DrawAddWaterPlanes = R_Q1BSP_DrawAddWaterPlanes;
 
-		Mod_MakeCollisionBIH(mod, true, &mod->collision_bih);
-		mod->render_bih = mod->collision_bih;
+		Mod_BIHBuilds_Add(&bihbuilds, mod, true, &mod->collision_bih, &loadmodel->collision_bih, &mod->render_bih);
 
 		// generate VBOs and other shared data before cloning submodels
 		if (i == 0)
 			Mod_BuildVBOs();
 	}
+	Mod_BIHBuilds_Finish(&bihbuilds);
 	mod = loadmodel;
 	Mem_Free(submodelfirstsurface);
 
@@ -437,7 +437,7 @@ dp_model_t *Mod_LoadModel(dp_model_t *mod, qboolean crash, qboolean checkdisk)
 	{
 		if (checkdisk && mod->loaded)
 			Con_DPrintf("checking model %s\n", mod->name);
-		buf = FS_LoadFile (mod->name, tempmempool, false, &filesize);
+		buf = FS_LoadFileView (mod->name, tempmempool, false, &filesize);
 		if (buf)
 		{
 			crc = CRC_Block((unsigned char *)buf, filesize);
@@ -451,7 +451,7 @@ dp_model_t *Mod_LoadModel(dp_model_t *mod, qboolean crash, qboolean checkdisk)
 	if (mod->loaded)
 	{
 		if (buf)
-			Mem_Free(buf);
+			FS_FreeFileView(buf);
 		return mod;
 	}
 
@@ -512,7 +512,7 @@ dp_model_t *Mod_LoadModel(dp_model_t *mod, qboolean crash, qboolean checkdisk)
 		else if (strlen(mod->name) >= 4 && !strcmp(mod->name + strlen(mod->name) - 4, ".map")) Mod_MAP_Load(mod, buf, bufend);
 		else if (num == BSPVERSION || num == 30 || !memcmp(buf, "BSP2", 4) || !memcmp(buf, "2PSB", 4)) Mod_Q1BSP_Load(mod, buf, bufend);
 		else Con_Printf("Mod_LoadModel: model \"%s\" is of unknown/unsupported type\n", mod->name);
-		Mem_Free(buf);
+		FS_FreeFileView(buf);
 
 		Mod_FindPotentialDeforms(mod);
 
@@ -96,6 +96,8 @@ static cvar_t net_slist_pause = {0, "net_slist_pause", "0", "when set to 1, the
 static cvar_t net_slist_maxtries = {0, "net_slist_maxtries", "3", "how many times to ask the same server for information (more times gives better ping reports but takes longer)"};
 static cvar_t net_slist_favorites = {CVAR_SAVE | CVAR_NQUSERINFOHACK, "net_slist_favorites", "", "contains a list of IP addresses and ports to always query explicitly"};
 static cvar_t net_tos_dscp = {CVAR_SAVE, "net_tos_dscp", "32", "DiffServ Codepoint for network sockets (may need game restart to apply)"};
+static cvar_t net_batchio = {CVAR_SAVE, "net_batchio", "1", "receive and send many packets per system call (recvmmsg/sendmmsg), reduces overhead on busy servers"};
+static cvar_t net_thread = {CVAR_SAVE, "net_thread", "0", "receive and send internet packets on a separate thread, so they are timestamped when they arrive instead of waiting for the next frame (not used with a threaded server)"};
 static cvar_t gameversion = {0, "gameversion", "0", "version of game data (mod-specific) to be sent to querying clients"};
 static cvar_t gameversion_min = {0, "gameversion_min", "-1", "minimum version of game data (mod-specific), when client and server gameversion mismatch in the server browser the server is shown as incompatible; if -1, gameversion is used alone"};
 static cvar_t gameversion_max = {0, "gameversion_max", "-1", "maximum version of game data (mod-specific), when client and server gameversion mismatch in the server browser the server is shown as incompatible; if -1, gameversion is used alone"};
@@ -606,17 +608,366 @@ void ServerList_QueryList(qboolean resetcache, qboolean querydp, qboolean queryq
 }
 #endif
 
+// network thread
+//
+// when net_thread is on a separate thread reads all internet sockets as soon
+// as packets arrive and sends the queued outgoing packets, the game side only
+// touches the lock-free rings below (loopback sockets are not affected)
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define NetConn_MemoryBarrier() MemoryBarrier()
+#else
+#define NetConn_MemoryBarrier() __sync_synchronize()
+#endif
+
+#define NETTHREAD_MAXSOCKETS 32
+#define NETTHREAD_RINGSIZE 524288
+// align packets in the rings so the headers are never misaligned
+#define NETTHREAD_ALIGN(n) (((n) + 15) & ~15)
+// how long the thread waits for packets before checking the outgoing rings
+#define NETTHREAD_WAITMICROSECONDS 500
+// error messages the thread keeps for the main thread, later ones are lost
+#define NETTHREAD_MAXMESSAGES 16
+
+// single producer, single consumer queue of packets
+typedef struct netthread_ring_s
+{
+	// total bytes ever written, only changed by the producer
+	volatile unsigned int head;
+	// total bytes ever read, only changed by the consumer
+	volatile unsigned int tail;
+	unsigned char *data;
+}
+netthread_ring_t;
+
+typedef struct netthread_packet_s
+{
+	// -1 means the rest of the ring was skipped
+	int length;
+	// Sys_DirtyTime when the packet arrived
+	double time;
+	lhnetaddress_t peeraddress;
+}
+netthread_packet_t;
+
+#define NETTHREAD_PACKETHEADERSIZE NETTHREAD_ALIGN(sizeof(netthread_packet_t))
+
+typedef struct netthread_socket_s
+{
+	lhnetsocket_t *mysocket;
+	// written by the network thread, read by NetConn_Read
+	netthread_ring_t incoming;
+	// written by NetConn_Write, read by the network thread
+	netthread_ring_t outgoing;
+}
+netthread_socket_t;
+
+typedef struct netthread_state_s
+{
+	void *thread;
+	// held by the network thread while it uses the sockets, and by the game
+	// while adding or removing them
+	void *mutex;
+	volatile qboolean quit;
+	int numsockets;
+	netthread_socket_t sockets[NETTHREAD_MAXSOCKETS];
+	// packets thrown away because a ring was full
+	unsigned int droppedincoming;
+	unsigned int droppedoutgoing;
+	// lhnet error messages, written by the network thread while it holds the
+	// mutex and printed by NetThread_PrintMessages
+	volatile int nummessages;
+	qboolean messagedeveloper[NETTHREAD_MAXMESSAGES];
+	char messages[NETTHREAD_MAXMESSAGES][256];
+}
+netthread_state_t;
+
+static netthread_state_t netthread;
+
+double netconn_readage;
+
+// returns false if there is not enough room
+static qboolean NetThread_Ring_Write(netthread_ring_t *ring, const void *data, int length, const lhnetaddress_t *peeraddress, double time)
+{
+	unsigned int head = ring->head, tail = ring->tail, size = NETTHREAD_ALIGN(NETTHREAD_PACKETHEADERSIZE + length), offset, skip;
+	netthread_packet_t *p;
+	// the consumer is done with everything before tail
+	NetConn_MemoryBarrier();
+	offset = head & (NETTHREAD_RINGSIZE - 1);
+	// packets are never split, if it does not fit before the end of the
+	// buffer the rest of it is skipped
+	skip = NETTHREAD_RINGSIZE - offset;
+	if (skip >= size)
+		skip = 0;
+	if (NETTHREAD_RINGSIZE - (head - tail) < skip + size)
+		return false;
+	if (skip)
+	{
+		if (skip >= NETTHREAD_PACKETHEADERSIZE)
+			((netthread_packet_t *)(ring->data + offset))->length = -1;
+		offset = 0;
+	}
+	p = (netthread_packet_t *)(ring->data + offset);
+	p->length = length;
+	p->time = time;
+	p->peeraddress = *peeraddress;
+	memcpy(ring->data + offset + NETTHREAD_PACKETHEADERSIZE, data, length);
+	// make the packet visible before moving head
+	NetConn_MemoryBarrier();
+	ring->head = head + skip + size;
+	return true;
+}
+
+// returns NULL if the ring is empty, the packet stays valid until
+// NetThread_Ring_Pop is called
+static netthread_packet_t *NetThread_Ring_Peek(netthread_ring_t *ring)
+{
+	unsigned int tail = ring->tail, offset;
+	netthread_packet_t *p;
+	for (;;)
+	{
+		if (ring->head == tail)
+			return NULL;
+		NetConn_MemoryBarrier();
+		offset = tail & (NETTHREAD_RINGSIZE - 1);
+		p = (netthread_packet_t *)(ring->data + offset);
+		if (NETTHREAD_RINGSIZE - offset >= NETTHREAD_PACKETHEADERSIZE && p->length >= 0)
+			return p;
+		// skip to the start of the buffer
+		tail += NETTHREAD_RINGSIZE - offset;
+		NetConn_MemoryBarrier();
+		ring->tail = tail;
+	}
+}
+
+static void NetThread_Ring_Pop(netthread_ring_t *ring, netthread_packet_t *p)
+{
+	unsigned int tail = ring->tail + NETTHREAD_ALIGN(NETTHREAD_PACKETHEADERSIZE + p->length);
+	// done reading the packet before the producer may overwrite it
+	NetConn_MemoryBarrier();
+	ring->tail = tail;
+}
+
+static netthread_socket_t *NetThread_FindSocket(lhnetsocket_t *mysocket)
+{
+	int i;
+	for (i = 0;i < netthread.numsockets;i++)
+		if (netthread.sockets[i].mysocket == mysocket)
+			return netthread.sockets + i;
+	return NULL;
+}
+
+// sends everything queued on the socket, must be called by the thread that
+// owns the socket (the network thread while it runs)
+static void NetThread_SendOutgoing(netthread_socket_t *s)
+{
+	netthread_packet_t *p;
+	while ((p = NetThread_Ring_Peek(&s->outgoing)))
+	{
+		LHNET_Write(s->mysocket, (unsigned char *)p + NETTHREAD_PACKETHEADERSIZE, p->length, &p->peeraddress);
+		NetThread_Ring_Pop(&s->outgoing, p);
+	}
+}
+
+static int NetThread_Thread(void *unused)
+{
+	int i, length;
+	double time;
+	lhnetaddress_t peeraddress;
+	unsigned char readbuffer[NET_HEADERSIZE+NET_MAXMESSAGE];
+	netthread_socket_t *s;
+	while (!netthread.quit)
+	{
+		Thread_LockMutex(netthread.mutex);
+		LHNET_SleepUntilPacket_Microseconds(NETTHREAD_WAITMICROSECONDS);
+		time = Sys_DirtyTime();
+		for (i = 0;i < netthread.numsockets;i++)
+		{
+			s = netthread.sockets + i;
+			while ((length = LHNET_Read(s->mysocket, readbuffer, sizeof(readbuffer), &peeraddress)) > 0)
+				if (!NetThread_Ring_Write(&s->incoming, readbuffer, length, &peeraddress, time))
+					netthread.droppedincoming++;
+		}
+		LHNET_BeginWrites();
+		for (i = 0;i < netthread.numsockets;i++)
+			NetThread_SendOutgoing(netthread.sockets + i);
+		LHNET_FlushWrites();
+		Thread_UnlockMutex(netthread.mutex);
+	}
+	return 0;
+}
+
+// the console is not thread safe
+static void NetThread_QueueMessage(int developer, const char *message)
+{
+	int n = netthread.nummessages;
+	if (n >= NETTHREAD_MAXMESSAGES)
+		return;
+	netthread.messagedeveloper[n] = developer != 0;
+	strlcpy(netthread.messages[n], message, sizeof(netthread.messages[n]));
+	NetConn_MemoryBarrier();
+	netthread.nummessages = n + 1;
+}
+
+static void NetThread_AddSocket(lhnetsocket_t *mysocket)
+{
+	netthread_socket_t *s;
+	lhnetaddresstype_t addresstype = LHNETADDRESS_GetAddressType(LHNET_AddressFromSocket(mysocket));
+	if (addresstype != LHNETADDRESSTYPE_INET4 && addresstype != LHNETADDRESSTYPE_INET6)
+		return;
+	if (netthread.numsockets >= NETTHREAD_MAXSOCKETS)
+		return;
+	if (netthread.mutex)
+		Thread_LockMutex(netthread.mutex);
+	s = netthread.sockets + netthread.numsockets;
+	memset(s, 0, sizeof(*s));
+	s->mysocket = mysocket;
+	mysocket->printfunction = NetThread_QueueMessage;
+	s->incoming.data = (unsigned char *)Mem_Alloc(netconn_mempool, NETTHREAD_RINGSIZE);
+	s->outgoing.data = (unsigned char *)Mem_Alloc(netconn_mempool, NETTHREAD_RINGSIZE);
+	netthread.numsockets++;
+	if (netthread.mutex)
+		Thread_UnlockMutex(netthread.mutex);
+}
+
+static void NetThread_RemoveSocket(lhnetsocket_t *mysocket)
+{
+	netthread_socket_t *s = NetThread_FindSocket(mysocket);
+	if (!s)
+		return;
+	if (netthread.mutex)
+		Thread_LockMutex(netthread.mutex);
+	// the net thread is done with the socket, errors from here on are
+	// printed by the main thread itself
+	mysocket->printfunction = NULL;
+	// anything not sent yet still goes out, unread packets are lost
+	NetThread_SendOutgoing(s);
+	Mem_Free(s->incoming.data);
+	Mem_Free(s->outgoing.data);
+	*s = netthread.sockets[--netthread.numsockets];
+	if (netthread.mutex)
+		Thread_UnlockMutex(netthread.mutex);
+}
+
+static void NetThread_PrintMessages(void)
+{
+	int i, n;
+	qboolean developer[NETTHREAD_MAXMESSAGES];
+	char messages[NETTHREAD_MAXMESSAGES][256];
+	if (!netthread.nummessages)
+		return;
+	if (netthread.mutex)
+		Thread_LockMutex(netthread.mutex);
+	n = netthread.nummessages;
+	memcpy(developer, netthread.messagedeveloper, n * sizeof(qboolean));
+	memcpy(messages, netthread.messages, sizeof(messages[0]) * n);
+	netthread.nummessages = 0;
+	if (netthread.mutex)
+		Thread_UnlockMutex(netthread.mutex);
+	for (i = 0;i < n;i++)
+	{
+		if (developer[i])
+			Con_DPrint(messages[i]);
+		else
+			Con_Print(messages[i]);
+	}
+}
+
+static void NetThread_Stop(void)
+{
+	if (!netthread.thread)
+		return;
+	netthread.quit = true;
+	Thread_WaitThread(netthread.thread, 0);
+	Thread_DestroyMutex(netthread.mutex);
+	netthread.thread = NULL;
+	netthread.mutex = NULL;
+	NetThread_PrintMessages();
+	while (netthread.numsockets > 0)
+		NetThread_RemoveSocket(netthread.sockets[netthread.numsockets - 1].mysocket);
+}
+
+static void NetThread_Start(void)
+{
+	int i;
+	if (netthread.thread || !Thread_HasThreads())
+		return;
+	netthread.numsockets = 0;
+	for (i = 0;i < cl_numsockets;i++)
+		if (cl_sockets[i])
+			NetThread_AddSocket(cl_sockets[i]);
+	for (i = 0;i < sv_numsockets;i++)
+		if (sv_sockets[i])
+			NetThread_AddSocket(sv_sockets[i]);
+	netthread.quit = false;
+	netthread.mutex = Thread_CreateMutex();
+	netthread.thread = Thread_CreateThread(NetThread_Thread, NULL);
+	if (!netthread.thread)
+	{
+		// do not try again every frame
+		Con_Printf("Failed to start the network thread, net_thread disabled\n");
+		Cvar_SetValueQuick(&net_thread, 0);
+		Thread_DestroyMutex(netthread.mutex);
+		netthread.mutex = NULL;
+		while (netthread.numsockets > 0)
+			NetThread_RemoveSocket(netthread.sockets[netthread.numsockets - 1].mysocket);
+	}
+}
+
+static void NetConn_CloseSocket(lhnetsocket_t *mysocket)
+{
+	NetThread_RemoveSocket(mysocket);
+	LHNET_CloseSocket(mysocket);
+}
+
+void NetConn_BeginWrites(void)
+{
+	// the network thread sends in batches on its own
+	if (!netthread.thread)
+		LHNET_BeginWrites();
+}
+
+void NetConn_FlushWrites(void)
+{
+	if (!netthread.thread)
+		LHNET_FlushWrites();
+}
+
+static void NetConn_ResetWrites(void)
+{
+	if (!netthread.thread)
+		LHNET_ResetWrites();
+}
+
 // rest
 
 int NetConn_Read(lhnetsocket_t *mysocket, void *data, int maxlength, lhnetaddress_t *peeraddress)
 {
 	int length;
 	int i;
-	if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
-		Thread_LockMutex(netconn_mutex);
-	length = LHNET_Read(mysocket, data, maxlength, peeraddress);
-	if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
-		Thread_UnlockMutex(netconn_mutex);
+	netthread_socket_t *s;
+	netthread_packet_t *p;
+	netconn_readage = 0;
+	if ((s = NetThread_FindSocket(mysocket)))
+	{
+		if (!(p = NetThread_Ring_Peek(&s->incoming)))
+			return 0;
+		// truncated like recvfrom would
+		length = min(p->length, maxlength);
+		memcpy(data, (unsigned char *)p + NETTHREAD_PACKETHEADERSIZE, length);
+		*peeraddress = p->peeraddress;
+		netconn_readage = max(Sys_DirtyTime() - p->time, 0);
+		NetThread_Ring_Pop(&s->incoming, p);
+	}
+	else
+	{
+		if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
+			Thread_LockMutex(netconn_mutex);
+		length = LHNET_Read(mysocket, data, maxlength, peeraddress);
+		if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
+			Thread_UnlockMutex(netconn_mutex);
+	}
 	if (length == 0)
 		return 0;
 	if (cl_netpacketloss_receive.integer)
@@ -643,15 +994,30 @@ int NetConn_Write(lhnetsocket_t *mysocket, const void *data, int length, const l
 {
 	int ret;
 	int i;
+	netthread_socket_t *s;
 	if (cl_netpacketloss_send.integer)
 		for (i = 0;i < cl_numsockets;i++)
 			if (cl_sockets[i] == mysocket && (rand() % 100) < cl_netpacketloss_send.integer)
 				return length;
-	if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
-		Thread_LockMutex(netconn_mutex);
-	ret = LHNET_Write(mysocket, data, length, peeraddress);
-	if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
-		Thread_UnlockMutex(netconn_mutex);
+	if ((s = NetThread_FindSocket(mysocket)))
+	{
+		// sent by the network thread, a full ring is like a full socket buffer
+		if (length > 0 && NetThread_Ring_Write(&s->outgoing, data, length, peeraddress, 0))
+			ret = length;
+		else
+		{
+			netthread.droppedoutgoing++;
+			ret = -1;
+		}
+	}
+	else
+	{
+		if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
+			Thread_LockMutex(netconn_mutex);
+		ret = LHNET_Write(mysocket, data, length, peeraddress);
+		if (mysocket->address.addresstype == LHNETADDRESSTYPE_LOOP && netconn_mutex)
+			Thread_UnlockMutex(netconn_mutex);
+	}
 	if (developer_networking.integer)
 	{
 		char addressstring[128], addressstring2[128];
@@ -946,7 +1312,7 @@ void NetConn_CloseClientPorts(void)
 {
 	for (;cl_numsockets > 0;cl_numsockets--)
 		if (cl_sockets[cl_numsockets - 1])
-			LHNET_CloseSocket(cl_sockets[cl_numsockets - 1]);
+			NetConn_CloseSocket(cl_sockets[cl_numsockets - 1]);
 }
 
 static void NetConn_OpenClientPort(const char *addressstring, lhnetaddresstype_t addresstype, int defaultport)
@@ -964,6 +1330,8 @@ static void NetConn_OpenClientPort(const char *addressstring, lhnetaddresstype_t
 		if ((s = LHNET_OpenSocket_Connectionless(&address)))
 		{
 			cl_sockets[cl_numsockets++] = s;
+			if (netthread.thread)
+				NetThread_AddSocket(s);
 			LHNETADDRESS_ToString(LHNET_AddressFromSocket(s), addressstring2, sizeof(addressstring2), true);
 			if (addresstype != LHNETADDRESSTYPE_LOOP)
 				Con_Printf("Client opened a socket on address %s\n", addressstring2);
@@ -1005,7 +1373,7 @@ void NetConn_CloseServerPorts(void)
 {
 	for (;sv_numsockets > 0;sv_numsockets--)
 		if (sv_sockets[sv_numsockets - 1])
-			LHNET_CloseSocket(sv_sockets[sv_numsockets - 1]);
+			NetConn_CloseSocket(sv_sockets[sv_numsockets - 1]);
 }
 
 static qboolean NetConn_OpenServerPort(const char *addressstring, lhnetaddresstype_t addresstype, int defaultport, int range)
@@ -1027,6 +1395,9 @@ static qboolean NetConn_OpenServerPort(const char *addressstring, lhnetaddressty
 			if ((s = LHNET_OpenSocket_Connectionless(&address)))
 			{
 				sv_sockets[sv_numsockets++] = s;
+				s->batchio = true;
+				if (netthread.thread)
+					NetThread_AddSocket(s);
 				LHNETADDRESS_ToString(LHNET_AddressFromSocket(s), addressstring2, sizeof(addressstring2), true);
 				if (addresstype != LHNETADDRESSTYPE_LOOP)
 					Con_Printf("Server listening on address %s\n", addressstring2);
@@ -1154,6 +1525,14 @@ void NetConn_UpdateSockets(void)
 
 	// TODO add logic to automatically close sockets if needed
 	LHNET_DefaultDSCP(net_tos_dscp.integer);
+	LHNET_BatchIO(net_batchio.integer);
+	// the rings have a single producer, a threaded server would write to
+	// them from both threads
+	if (net_thread.integer && !svs.threaded)
+		NetThread_Start();
+	else
+		NetThread_Stop();
+	NetThread_PrintMessages();
 
 	if (cls.state != ca_dedicated)
 	{
@@ -2426,6 +2805,7 @@ void NetConn_ClientFrame(void)
 	int i, length;
 	lhnetaddress_t peeraddress;
 	unsigned char readbuffer[NET_HEADERSIZE+NET_MAXMESSAGE];
+	NetConn_ResetWrites();
 	NetConn_UpdateSockets();
 	if (cls.connect_trying && cls.connect_nextsendtime < realtime)
 	{
@@ -3606,6 +3986,7 @@ void NetConn_ServerFrame(void)
 	int i, length;
 	lhnetaddress_t peeraddress;
 	unsigned char readbuffer[NET_HEADERSIZE+NET_MAXMESSAGE];
+	NetConn_ResetWrites();
 	for (i = 0;i < sv_numsockets;i++)
 		while (sv_sockets[i] && (length = NetConn_Read(sv_sockets[i], readbuffer, sizeof(readbuffer), &peeraddress)) > 0)
 			NetConn_ServerParsePacket(sv_sockets[i], readbuffer, length, &peeraddress);
@@ -3622,7 +4003,25 @@ void NetConn_ServerFrame(void)
 
 void NetConn_SleepMicroseconds(int microseconds)
 {
-	LHNET_SleepUntilPacket_Microseconds(microseconds);
+	int i;
+	double endtime;
+	if (!netthread.thread)
+	{
+		LHNET_SleepUntilPacket_Microseconds(microseconds);
+		return;
+	}
+	// the network thread reads the sockets, so wait for its rings instead
+	endtime = Sys_DirtyTime() + microseconds * 0.000001;
+	for (;;)
+	{
+		for (i = 0;i < netthread.numsockets;i++)
+			if (netthread.sockets[i].incoming.head != netthread.sockets[i].incoming.tail)
+				return;
+		microseconds = (int)((endtime - Sys_DirtyTime()) * 1000000.0);
+		if (microseconds <= 0)
+			return;
+		Sys_Sleep(min(microseconds, NETTHREAD_WAITMICROSECONDS));
+	}
 }
 
 #ifdef CONFIG_MENU
@@ -3825,6 +4224,11 @@ void Net_Stats_f(void)
 	Con_Print("connections                =\n");
 	for (conn = netconn_list;conn;conn = conn->next)
 		PrintStats(conn);
+	if (netthread.thread)
+	{
+		Con_Printf("net_thread dropped incoming = %u\n", netthread.droppedincoming);
+		Con_Printf("net_thread dropped outgoing = %u\n", netthread.droppedoutgoing);
+	}
 }
 
 #ifdef CONFIG_MENU
@@ -3892,6 +4296,9 @@ void NetConn_Init(void)
 	Cvar_RegisterVariable(&net_slist_pause);
 	if(LHNET_DefaultDSCP(-1) >= 0) // register cvar only if supported
 		Cvar_RegisterVariable(&net_tos_dscp);
+	if(LHNET_BatchIO(-1) >= 0) // register cvar only if supported
+		Cvar_RegisterVariable(&net_batchio);
+	Cvar_RegisterVariable(&net_thread);
 	Cvar_RegisterVariable(&net_messagetimeout);
 	Cvar_RegisterVariable(&net_connecttimeout);
 	Cvar_RegisterVariable(&net_connectfloodblockingtimeout);
@@ -3953,6 +4360,7 @@ void NetConn_Init(void)
 
 void NetConn_Shutdown(void)
 {
+	NetThread_Stop();
 	NetConn_CloseClientPorts();
 	NetConn_CloseServerPorts();
 	LHNET_Shutdown();
@@ -429,6 +429,9 @@ extern cvar_t net_address;
 extern cvar_t net_address_ipv6;
 extern cvar_t net_usesizelimit;
 extern cvar_t net_burstreserve;
+/// seconds between the arrival of the packet last returned by NetConn_Read
+/// and the call, only nonzero when the network thread received it
+extern double netconn_readage;
 
 qboolean NetConn_CanSend(netconn_t *conn);
 int NetConn_SendUnreliableMessage(netconn_t *conn, sizebuf_t *data, protocolversion_t protocol, int rate, int burstsize, qboolean quakesignon_suppressreliables);
@@ -449,6 +452,9 @@ void NetConn_Listen(qboolean state);
 int NetConn_Read(lhnetsocket_t *mysocket, void *data, int maxlength, lhnetaddress_t *peeraddress);
 int NetConn_Write(lhnetsocket_t *mysocket, const void *data, int length, const lhnetaddress_t *peeraddress);
 int NetConn_WriteString(lhnetsocket_t *mysocket, const char *string, const lhnetaddress_t *peeraddress);
+/// packets written between these are sent together (see LHNET_BeginWrites)
+void NetConn_BeginWrites(void);
+void NetConn_FlushWrites(void);
 int NetConn_IsLocalGame(void);
 void NetConn_ClientFrame(void);
 void NetConn_ServerFrame(void);
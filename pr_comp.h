@@ -122,6 +122,31 @@ typedef enum opcode_e
 }
 opcode_t;
 
+// engine only superinstructions, chosen when loading progs, each executes
+// one statement and continues with the next one without a dispatch
+typedef enum superop_e
+{
+	OP_SUPER_ADDRESS_STOREP = OP_BITOR + 1, // ADDRESS, STOREP_F/S/ENT/FLD/FNC
+	OP_SUPER_ADDRESS_STOREP_V,
+	OP_SUPER_LOAD_STORE, // LOAD_F/S/ENT/FLD/FNC, STORE_F/S/ENT/FLD/FNC
+	OP_SUPER_LOAD_IF, // LOAD_F/S/ENT/FLD/FNC, IF
+	OP_SUPER_LOAD_IFNOT,
+	OP_SUPER_LOAD_ADD_F, // LOAD_F, ADD_F
+	OP_SUPER_LOAD_MUL_F,
+	OP_SUPER_EQ_F_IFNOT,
+	OP_SUPER_NE_F_IFNOT,
+	OP_SUPER_LE_IFNOT,
+	OP_SUPER_GE_IFNOT,
+	OP_SUPER_LT_IFNOT,
+	OP_SUPER_GT_IFNOT,
+	OP_SUPER_EQ_E_IFNOT,
+	OP_SUPER_NE_E_IFNOT,
+	OP_SUPER_AND_IFNOT,
+	OP_SUPER_OR_IFNOT,
+	OP_JIT // enters native code, see prvm_jit.c
+}
+superop_t;
+
 
 typedef struct statement_s
 {
@@ -189,6 +214,7 @@ typedef struct mstatement_s
 	opcode_t	op;
 	int			operand[3]; // always a global or -1 for unused
 	int			jumpabsolute; // only used by IF, IFNOT, GOTO
+	int			execop; // op or a superop_t, used by the fast interpreter
 }
 mstatement_t;
 
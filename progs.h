@@ -84,6 +84,9 @@ typedef struct edict_engineprivate_s
 	vec3_t cullmins, cullmaxs;
 	int pvs_numclusters;
 	int pvs_clusterlist[MAX_ENTITYCLUSTERS];
+	// cluster containing the center of the culling box, -1 if unknown
+	// (used by the line of sight culling cache)
+	int pvs_centercluster;
 
 	// physics grid areas this edict is linked into
 	link_t areagrid[ENTITYGRIDAREAS];
@@ -92,6 +95,12 @@ typedef struct edict_engineprivate_s
 	int areagridmarknumber;
 	// mins/maxs passed to World_LinkEdict
 	vec3_t areamins, areamaxs;
+	// leaf node index + 1 in the area bvh of areabvhworld, 0 if not linked
+	int areabvhnode;
+	struct world_s *areabvhworld;
+	// index + 1 of the world collision precomputed for this frame's move by
+	// sv_threadedphysics, 0 if none
+	int premove;
 
 	// PROTOCOL_QUAKE, PROTOCOL_QUAKEDP, PROTOCOL_NEHAHRAMOVIE, PROTOCOL_QUAKEWORLD
 	// baseline values
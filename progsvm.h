@@ -489,6 +489,49 @@ typedef struct prvm_stringbuffer_s
 }
 prvm_stringbuffer_t;
 
+// strzone strings up to PRVM_STRINGSLAB_MAXSIZE bytes are carved out of big
+// chunks in power of two size classes starting at PRVM_STRINGSLAB_MINSIZE,
+// freed blocks are kept on a list per size class for reuse
+#define PRVM_STRINGSLAB_CLASSES 8
+#define PRVM_STRINGSLAB_MINSIZE 16
+#define PRVM_STRINGSLAB_MAXSIZE (PRVM_STRINGSLAB_MINSIZE << (PRVM_STRINGSLAB_CLASSES - 1))
+#define PRVM_STRINGSLAB_CHUNKSIZE 65536
+typedef struct prvm_stringslab_s
+{
+	void *freeblocks[PRVM_STRINGSLAB_CLASSES];
+	// unused end of the last chunk
+	unsigned char *chunk;
+	size_t chunkremaining;
+	int numchunks;
+	int numblocks[PRVM_STRINGSLAB_CLASSES]; // in use
+	int numfreeblocks[PRVM_STRINGSLAB_CLASSES];
+}
+prvm_stringslab_t;
+
+// counters reported by prvm_stringstats
+typedef struct prvm_stringstats_s
+{
+	double enginelookups; // PRVM_SetEngineString calls
+	double enginehashprobes; // knownstrings compared by those
+	double engineadded; // new engine strings
+	double zoneallocs;
+	double zonefrees;
+	double tempstrings;
+	int tempstringspeak; // most bytes of tempstringsbuf used at once
+}
+prvm_stringstats_t;
+
+// name lookup of the fielddefs, globaldefs or functions, built by
+// PRVM_Prog_Load, see PRVM_ED_FindField
+typedef struct prvm_namehash_s
+{
+	int size; // power of two, buckets are -1 when empty
+	int count; // entries hashed, lookups scan all of them if this is not the current number
+	int *buckets;
+	int *next; // chains the entries of a bucket, lowest index first
+}
+prvm_namehash_t;
+
 // [INIT] variables flagged with this token can be initialized by 'you'
 // NOTE: external code has to create and free the mempools but everything else is done by prvm !
 typedef struct prvm_prog_s
@@ -502,6 +545,9 @@ typedef struct prvm_prog_s
 	int					stringssize;
 	ddef_t				*fielddefs;
 	ddef_t				*globaldefs;
+	prvm_namehash_t		fielddefs_hash;
+	prvm_namehash_t		globaldefs_hash;
+	prvm_namehash_t		functions_hash;
 	mstatement_t		*statements;
 	int					entityfields;			// number of vec_t fields in progs (some variables are 3)
 	int					entityfieldsarea;		// LordHavoc: equal to max_edicts * entityfields (for bounds checking)
@@ -525,6 +571,18 @@ typedef struct prvm_prog_s
 	int					numstrings;
 	int					numglobals;
 
+	struct prvm_jit_s	*jit; // native code of hot functions, see prvm_jit.c
+	// PRVM_TRACK_ bits of each entity field, OP_ADDRESS checks them to tell
+	// the engine code keeping copies of the field about stores into it
+	unsigned char		*trackfields;
+	// set when QC takes the address of a PRVM_TRACK_EDICT field of the
+	// edict (or runs OP_STATE on it) and by PRVM_ED_Touch, cleared by the
+	// engine code that copied the fields (see SV_Physics)
+	unsigned char		*touchededicts;
+	struct prvm_findindex_s	*findindex;
+	double				findindex_hits; // find builtin calls answered from the index, reported by prvm_profile
+	double				findindex_scans; // find builtin calls that had to check every edict
+
 	int					*statement_linenums; // NULL if not available
 	int					*statement_columnnums; // NULL if not available
 
@@ -543,13 +601,19 @@ typedef struct prvm_prog_s
 
 	int					maxknownstrings;
 	int					numknownstrings;
-	// this is updated whenever a string is removed or added
-	// (simple optimization of the free string search)
-	int					firstfreeknownstring;
 	const char			**knownstrings;
-	unsigned char		*knownstrings_freeable;
+	unsigned char		*knownstrings_freeable; // 0 = engine owned, 1 = zone allocation, 2 + size class = stringslab block
 	const char          **knownstrings_origin;
-	const char			***stringshash;
+	// knownstrings are hashed by address so PRVM_SetEngineString can find
+	// them, knownstrings_hashnext chains the slots of a hash bucket
+	int					knownstrings_hashsize; // power of two, buckets are -1 when empty
+	int					*knownstrings_hash;
+	int					*knownstrings_hashnext;
+	// stack of slots that were freed and can be reused
+	int					numfreeknownstrings;
+	int					*freeknownstrings;
+	prvm_stringslab_t	stringslab;
+	prvm_stringstats_t	stringstats;
 
 	memexpandablearray_t	stringbuffersarray;
 
@@ -783,6 +847,13 @@ qboolean PRVM_ED_CanAlloc(prvm_prog_t *prog, prvm_edict_t *e);
 prvm_edict_t *PRVM_ED_Alloc(prvm_prog_t *prog);
 void PRVM_ED_Free(prvm_prog_t *prog, prvm_edict_t *ed);
 void PRVM_ED_ClearEdict(prvm_prog_t *prog, prvm_edict_t *e);
+// bits of prog->trackfields
+#define PRVM_TRACK_FINDINDEX 1 // kept in the find index, see prvm_findindex.c
+#define PRVM_TRACK_EDICT 2 // sets prog->touchededicts
+/// the engine changed the fields or the free state of an edict
+void PRVM_ED_Touch(prvm_prog_t *prog, int num);
+/// QC took the address of a watched field, the store comes later
+void PRVM_ED_TouchAddress(prvm_prog_t *prog, int num, int track);
 
 void PRVM_PrintFunctionStatements(prvm_prog_t *prog, const char *name);
 void PRVM_ED_Print(prvm_prog_t *prog, prvm_edict_t *ed, const char *wildcard_fieldname);
@@ -833,6 +904,9 @@ void PRVM_Init_Exec(prvm_prog_t *prog);
 void PRVM_ED_PrintEdicts_f (void);
 void PRVM_ED_PrintNum (prvm_prog_t *prog, int ent, const char *wildcard_fieldname);
 
+// string_t values with this bit are knownstrings slots
+#define PRVM_KNOWNSTRINGBASE 0x40000000
+
 const char *PRVM_GetString(prvm_prog_t *prog, int num);
 int PRVM_SetEngineString(prvm_prog_t *prog, const char *s);
 const char *PRVM_ChangeEngineString(prvm_prog_t *prog, int i, const char *s);
@@ -1,4 +1,5 @@
 #include "quakedef.h"
+#include "thread.h"
 
 #define ENTITYSIZEPROFILING_START(msg, num, flags) \
 	int entityprofiling_startsize = msg->cursize
@@ -2832,7 +2833,133 @@ void EntityFrame5_AckFrame(entityframe5_database_t *d, int framenum)
 			d->packetlog[i].packetnumber = 0;
 }
 
-qboolean EntityFrame5_WriteFrame(sizebuf_t *msg, int maxsize, entityframe5_database_t *d, int numstates, const entity_state_t **states, int viewentnum, unsigned int movesequence, qboolean need_empty)
+// EntityState5_WriteUpdate results for the current server frame, an entity
+// that many clients need the same update for is only encoded once
+// (only entities that look the same to all clients are cached, the
+// EntityFrame5_WriteFrame calls for different clients may run in parallel
+// so the cache is split into shards that each have their own lock)
+#define ENTITYFRAME5_UPDATECACHE_SHARDS 64
+#define ENTITYFRAME5_UPDATECACHE_MAXENTRIES 512
+#define ENTITYFRAME5_UPDATECACHE_MAXDATA 32768
+
+typedef struct entityframe5_updatecacheentry_s
+{
+	int bits;
+	int next;
+	int offset;
+	int size;
+}
+entityframe5_updatecacheentry_t;
+
+typedef struct entityframe5_updatecacheshard_s
+{
+	void *mutex;
+	int numentries;
+	int datasize;
+	entityframe5_updatecacheentry_t entries[ENTITYFRAME5_UPDATECACHE_MAXENTRIES];
+	unsigned char data[ENTITYFRAME5_UPDATECACHE_MAXDATA];
+}
+entityframe5_updatecacheshard_t;
+
+typedef struct entityframe5_updatecache_s
+{
+	// entities beyond this were not prepared this frame
+	int numentities;
+	// first entry for each entity number (in the shard for that number)
+	int first[MAX_EDICTS];
+	entityframe5_updatecacheshard_t shards[ENTITYFRAME5_UPDATECACHE_SHARDS];
+}
+entityframe5_updatecache_t;
+
+static entityframe5_updatecache_t *entityframe5_updatecache;
+
+void EntityFrame5_ClearUpdateCache(void)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	int i;
+	entityframe5_updatecache_t *c = entityframe5_updatecache;
+	if (!c)
+	{
+		c = entityframe5_updatecache = (entityframe5_updatecache_t *)Mem_Alloc(sv_mempool, sizeof(*c));
+		if (Thread_HasThreads())
+			for (i = 0;i < ENTITYFRAME5_UPDATECACHE_SHARDS;i++)
+				c->shards[i].mutex = Thread_CreateMutex();
+	}
+	for (i = 0;i < ENTITYFRAME5_UPDATECACHE_SHARDS;i++)
+	{
+		c->shards[i].numentries = 0;
+		c->shards[i].datasize = 0;
+	}
+	c->numentities = prog->num_edicts;
+	memset(c->first, -1, c->numentities * sizeof(*c->first));
+}
+
+static void EntityState5_WriteUpdateCached(int number, const entity_state_t *s, int changedbits, sizebuf_t *msg)
+{
+	int i, start, size;
+	entityframe5_updatecache_t *c = entityframe5_updatecache;
+	entityframe5_updatecacheshard_t *shard;
+	entityframe5_updatecacheentry_t *e;
+
+	// the states of customized entities differ between clients, and the size
+	// profiling wants to see every update
+	if (!c || !sv_entityupdatecache.integer || developer_networkentities.integer >= 2 || s->active != ACTIVE_NETWORK || number >= c->numentities || !sv.sendentitiesindex[number] || sv.sendentitiesclientstate[number] >= 0)
+	{
+		EntityState5_WriteUpdate(number, s, changedbits, msg);
+		return;
+	}
+
+	shard = c->shards + (number % ENTITYFRAME5_UPDATECACHE_SHARDS);
+	if (shard->mutex) Thread_LockMutex(shard->mutex);
+	for (i = c->first[number];i >= 0;i = e->next)
+	{
+		e = shard->entries + i;
+		if (e->bits == changedbits)
+		{
+			SZ_Write(msg, shard->data + e->offset, e->size);
+			if (shard->mutex) Thread_UnlockMutex(shard->mutex);
+			return;
+		}
+	}
+	if (shard->mutex) Thread_UnlockMutex(shard->mutex);
+
+	start = msg->cursize;
+	EntityState5_WriteUpdate(number, s, changedbits, msg);
+	size = msg->cursize - start;
+
+	// if another thread added the same update meanwhile there will be two
+	// identical entries, which does no harm
+	if (shard->mutex) Thread_LockMutex(shard->mutex);
+	if (shard->numentries < ENTITYFRAME5_UPDATECACHE_MAXENTRIES && shard->datasize + size <= ENTITYFRAME5_UPDATECACHE_MAXDATA)
+	{
+		e = shard->entries + shard->numentries;
+		e->bits = changedbits;
+		e->offset = shard->datasize;
+		e->size = size;
+		e->next = c->first[number];
+		memcpy(shard->data + e->offset, msg->data + start, size);
+		shard->datasize += size;
+		c->first[number] = shard->numentries++;
+	}
+	if (shard->mutex) Thread_UnlockMutex(shard->mutex);
+}
+
+void EntityFrame5_ResetFullPacketLog(entityframe5_database_t *d)
+{
+	int packetlognumber;
+
+	// if packet log is full, mark all frames as lost, this will cause
+	// it to send the lost data again
+	for (packetlognumber = 0;packetlognumber < ENTITYFRAME5_MAXPACKETLOGS;packetlognumber++)
+		if (d->packetlog[packetlognumber].packetnumber == 0)
+			return;
+	Con_DPrintf("EntityFrame5_WriteFrame: packetlog overflow for a client, resetting\n");
+	EntityFrame5_LostFrame(d, d->latestframenum + 1);
+}
+
+// this does not touch any shared state if EntityFrame5_ResetFullPacketLog
+// was called first, so it can run on worker threads for different clients
+qboolean EntityFrame5_WriteFrame(client_t *client, sizebuf_t *msg, int maxsize, entityframe5_database_t *d, int numstates, const entity_state_t **states, int viewentnum, unsigned int movesequence, qboolean need_empty)
 {
 	prvm_prog_t *prog = SVVM_prog;
 	const entity_state_t *n;
@@ -2847,17 +2974,11 @@ qboolean EntityFrame5_WriteFrame(sizebuf_t *msg, int maxsize, entityframe5_datab
 	framenum = d->latestframenum + 1;
 	d->viewentnum = viewentnum;
 
-	// if packet log is full, mark all frames as lost, this will cause
-	// it to send the lost data again
+	// find a free packet log slot
+	EntityFrame5_ResetFullPacketLog(d);
 	for (packetlognumber = 0;packetlognumber < ENTITYFRAME5_MAXPACKETLOGS;packetlognumber++)
 		if (d->packetlog[packetlognumber].packetnumber == 0)
 			break;
-	if (packetlognumber == ENTITYFRAME5_MAXPACKETLOGS)
-	{
-		Con_DPrintf("EntityFrame5_WriteFrame: packetlog overflow for a client, resetting\n");
-		EntityFrame5_LostFrame(d, framenum);
-		packetlognumber = 0;
-	}
 
 	// prepare the buffer
 	memset(&buf, 0, sizeof(buf));
@@ -2945,9 +3066,9 @@ qboolean EntityFrame5_WriteFrame(sizebuf_t *msg, int maxsize, entityframe5_datab
 	{
 		for (i = 0;i < MAX_CL_STATS && msg->cursize + 6 + 11 <= maxsize;i++)
 		{
-			if (host_client->statsdeltabits[i>>3] & (1<<(i&7)))
+			if (client->statsdeltabits[i>>3] & (1<<(i&7)))
 			{
-				host_client->statsdeltabits[i>>3] &= ~(1<<(i&7));
+				client->statsdeltabits[i>>3] &= ~(1<<(i&7));
 				// add packetlog entry now that we have something for it
 				if (!packetlog)
 				{
@@ -2957,18 +3078,18 @@ qboolean EntityFrame5_WriteFrame(sizebuf_t *msg, int maxsize, entityframe5_datab
 					memset(packetlog->statsdeltabits, 0, sizeof(packetlog->statsdeltabits));
 				}
 				packetlog->statsdeltabits[i>>3] |= (1<<(i&7));
-				if (host_client->stats[i] >= 0 && host_client->stats[i] < 256)
+				if (client->stats[i] >= 0 && client->stats[i] < 256)
 				{
 					MSG_WriteByte(msg, svc_updatestatubyte);
 					MSG_WriteByte(msg, i);
-					MSG_WriteByte(msg, host_client->stats[i]);
+					MSG_WriteByte(msg, client->stats[i]);
 					l = 1;
 				}
 				else
 				{
 					MSG_WriteByte(msg, svc_updatestat);
 					MSG_WriteByte(msg, i);
-					MSG_WriteLong(msg, host_client->stats[i]);
+					MSG_WriteLong(msg, client->stats[i]);
 					l = 1;
 				}
 			}
@@ -3005,7 +3126,7 @@ qboolean EntityFrame5_WriteFrame(sizebuf_t *msg, int maxsize, entityframe5_datab
 			if (d->deltabits[num] & E5_FULLUPDATE)
 				d->deltabits[num] = E5_FULLUPDATE | EntityState5_DeltaBits(&defaultstate, n);
 			buf.cursize = 0;
-			EntityState5_WriteUpdate(num, n, d->deltabits[num], &buf);
+			EntityState5_WriteUpdateCached(num, n, d->deltabits[num], &buf);
 			// if the entity won't fit, try the next one
 			if (msg->cursize + buf.cursize + 2 > maxsize)
 				continue;
@@ -15,6 +15,9 @@
 #include "csprogs.h"
 #include "ft2.h"
 #include "mdfour.h"
+#if defined(SSE2_PRESENT) && defined(PRVM_64)
+#include <emmintrin.h>
+#endif
 
 extern cvar_t prvm_backtraceforwarnings;
 #ifdef USEODE
@@ -1019,6 +1022,8 @@ void VM_find(prvm_prog_t *prog)
 	int		f;
 	const char	*s, *t;
 	prvm_edict_t	*ed;
+	const int	*list;
+	int		i, n;
 
 	VM_SAFEPARMCOUNT(3,VM_find);
 
@@ -1030,6 +1035,29 @@ void VM_find(prvm_prog_t *prog)
 	// expects it to find all the monsters, so we must be careful to support
 	// searching for ""
 
+	// only check the edicts the index has for this value
+	n = PRVM_FindIndex_String(prog, f, s, e, &list);
+	if (n >= 0)
+	{
+		for (i = 0;i < n && list[i] < prog->num_edicts;i++)
+		{
+			prog->xfunction->builtinsprofile++;
+			ed = PRVM_EDICT_NUM(list[i]);
+			if (ed->priv.required->free)
+				continue;
+			t = PRVM_E_STRING(ed,f);
+			if (!t)
+				t = "";
+			if (!strcmp(t,s))
+			{
+				VM_RETURN_EDICT(ed);
+				return;
+			}
+		}
+		VM_RETURN_EDICT(prog->edicts);
+		return;
+	}
+
 	for (e++ ; e < prog->num_edicts ; e++)
 	{
 		prog->xfunction->builtinsprofile++;
@@ -1064,6 +1092,8 @@ void VM_findfloat(prvm_prog_t *prog)
 	int		f;
 	float	s;
 	prvm_edict_t	*ed;
+	const int	*list;
+	int		i, n;
 
 	VM_SAFEPARMCOUNT(3,VM_findfloat);
 
@@ -1071,6 +1101,25 @@ void VM_findfloat(prvm_prog_t *prog)
 	f = PRVM_G_INT(OFS_PARM1);
 	s = PRVM_G_FLOAT(OFS_PARM2);
 
+	n = PRVM_FindIndex_Float(prog, f, s, e, &list);
+	if (n >= 0)
+	{
+		for (i = 0;i < n && list[i] < prog->num_edicts;i++)
+		{
+			prog->xfunction->builtinsprofile++;
+			ed = PRVM_EDICT_NUM(list[i]);
+			if (ed->priv.required->free)
+				continue;
+			if (PRVM_E_FLOAT(ed,f) == s)
+			{
+				VM_RETURN_EDICT(ed);
+				return;
+			}
+		}
+		VM_RETURN_EDICT(prog->edicts);
+		return;
+	}
+
 	for (e++ ; e < prog->num_edicts ; e++)
 	{
 		prog->xfunction->builtinsprofile++;
@@ -1103,6 +1152,8 @@ void VM_findchain(prvm_prog_t *prog)
 	const char	*s, *t;
 	prvm_edict_t	*ent, *chain;
 	int chainfield;
+	const int	*list;
+	int		n;
 
 	VM_SAFEPARMCOUNTRANGE(2,3,VM_findchain);
 
@@ -1122,6 +1173,28 @@ void VM_findchain(prvm_prog_t *prog)
 	// expects it to find all the monsters, so we must be careful to support
 	// searching for ""
 
+	n = PRVM_FindIndex_String(prog, f, s, 0, &list);
+	if (n >= 0)
+	{
+		for (i = 0;i < n && list[i] < prog->num_edicts;i++)
+		{
+			prog->xfunction->builtinsprofile++;
+			ent = PRVM_EDICT_NUM(list[i]);
+			if (ent->priv.required->free)
+				continue;
+			t = PRVM_E_STRING(ent,f);
+			if (!t)
+				t = "";
+			if (strcmp(t,s))
+				continue;
+
+			PRVM_EDICTFIELDEDICT(ent,chainfield) = PRVM_NUM_FOR_EDICT(chain);
+			chain = ent;
+		}
+		VM_RETURN_EDICT(chain);
+		return;
+	}
+
 	ent = PRVM_NEXT_EDICT(prog->edicts);
 	for (i = 1;i < prog->num_edicts;i++, ent = PRVM_NEXT_EDICT(ent))
 	{
@@ -1158,6 +1231,8 @@ void VM_findchainfloat(prvm_prog_t *prog)
 	float	s;
 	prvm_edict_t	*ent, *chain;
 	int chainfield;
+	const int	*list;
+	int		n;
 
 	VM_SAFEPARMCOUNTRANGE(2, 3, VM_findchainfloat);
 
@@ -1173,6 +1248,25 @@ void VM_findchainfloat(prvm_prog_t *prog)
 	f = PRVM_G_INT(OFS_PARM0);
 	s = PRVM_G_FLOAT(OFS_PARM1);
 
+	n = PRVM_FindIndex_Float(prog, f, s, 0, &list);
+	if (n >= 0)
+	{
+		for (i = 0;i < n && list[i] < prog->num_edicts;i++)
+		{
+			prog->xfunction->builtinsprofile++;
+			ent = PRVM_EDICT_NUM(list[i]);
+			if (ent->priv.required->free)
+				continue;
+			if (PRVM_E_FLOAT(ent,f) != s)
+				continue;
+
+			PRVM_EDICTFIELDEDICT(ent,chainfield) = PRVM_EDICT_TO_PROG(chain);
+			chain = ent;
+		}
+		VM_RETURN_EDICT(chain);
+		return;
+	}
+
 	ent = PRVM_NEXT_EDICT(prog->edicts);
 	for (i = 1;i < prog->num_edicts;i++, ent = PRVM_NEXT_EDICT(ent))
 	{
@@ -1203,6 +1297,8 @@ void VM_findflags(prvm_prog_t *prog)
 	prvm_int_t	f;
 	prvm_int_t	s;
 	prvm_edict_t	*ed;
+	const int	*list;
+	int		i, n;
 
 	VM_SAFEPARMCOUNT(3, VM_findflags);
 
@@ -1211,6 +1307,27 @@ void VM_findflags(prvm_prog_t *prog)
 	f = PRVM_G_INT(OFS_PARM1);
 	s = (prvm_int_t)PRVM_G_FLOAT(OFS_PARM2);
 
+	n = PRVM_FindIndex_Flags(prog, (int)f, s, (int)e, &list);
+	if (n >= 0)
+	{
+		for (i = 0;i < n && list[i] < prog->num_edicts;i++)
+		{
+			prog->xfunction->builtinsprofile++;
+			ed = PRVM_EDICT_NUM(list[i]);
+			if (ed->priv.required->free)
+				continue;
+			if (!PRVM_E_FLOAT(ed,f))
+				continue;
+			if ((prvm_int_t)PRVM_E_FLOAT(ed,f) & s)
+			{
+				VM_RETURN_EDICT(ed);
+				return;
+			}
+		}
+		VM_RETURN_EDICT(prog->edicts);
+		return;
+	}
+
 	for (e++ ; e < prog->num_edicts ; e++)
 	{
 		prog->xfunction->builtinsprofile++;
@@ -1244,6 +1361,8 @@ void VM_findchainflags(prvm_prog_t *prog)
 	prvm_int_t		s;
 	prvm_edict_t	*ent, *chain;
 	int chainfield;
+	const int	*list;
+	int		n;
 
 	VM_SAFEPARMCOUNTRANGE(2, 3, VM_findchainflags);
 
@@ -1259,6 +1378,27 @@ void VM_findchainflags(prvm_prog_t *prog)
 	f = PRVM_G_INT(OFS_PARM0);
 	s = (prvm_int_t)PRVM_G_FLOAT(OFS_PARM1);
 
+	n = PRVM_FindIndex_Flags(prog, (int)f, s, 0, &list);
+	if (n >= 0)
+	{
+		for (i = 0;i < n && list[i] < prog->num_edicts;i++)
+		{
+			prog->xfunction->builtinsprofile++;
+			ent = PRVM_EDICT_NUM(list[i]);
+			if (ent->priv.required->free)
+				continue;
+			if (!PRVM_E_FLOAT(ent,f))
+				continue;
+			if (!((prvm_int_t)PRVM_E_FLOAT(ent,f) & s))
+				continue;
+
+			PRVM_EDICTFIELDEDICT(ent,chainfield) = PRVM_EDICT_TO_PROG(chain);
+			chain = ent;
+		}
+		VM_RETURN_EDICT(chain);
+		return;
+	}
+
 	ent = PRVM_NEXT_EDICT(prog->edicts);
 	for (i = 1;i < prog->num_edicts;i++, ent = PRVM_NEXT_EDICT(ent))
 	{
@@ -1277,6 +1417,158 @@ void VM_findchainflags(prvm_prog_t *prog)
 	VM_RETURN_EDICT(chain);
 }
 
+/*
+========================
+VM_FindRadius_Filter
+
+shared by the findradius builtins of server and client qc, keeps the edicts
+within radius of org (by the distance to their box with distancetobox, else
+to their center) and returns how many there are, nearest first if sorted
+========================
+*/
+// distance the same way the scalar code of findradius always computed it,
+// the field values are converted to float in the same places
+static float VM_FindRadius_Distance2(prvm_prog_t *prog, prvm_edict_t *ent, const vec3_t org, qboolean distancetobox)
+{
+	vec3_t eorg;
+	VectorSubtract(org, PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.origin), eorg);
+	if (distancetobox)
+	{
+		eorg[0] -= bound(PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.mins)[0], eorg[0], PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.maxs)[0]);
+		eorg[1] -= bound(PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.mins)[1], eorg[1], PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.maxs)[1]);
+		eorg[2] -= bound(PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.mins)[2], eorg[2], PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.maxs)[2]);
+	}
+	else
+		VectorMAMAM(1, eorg, -0.5f, PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.mins), -0.5f, PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.maxs), eorg);
+	return DotProduct(eorg, eorg);
+}
+
+#if defined(SSE2_PRESENT) && defined(PRVM_64)
+// candidates are copied to these in blocks so four at a time can be tested
+#define FINDRADIUS_BLOCK 256
+typedef struct vm_findradius_block_s
+{
+	prvm_vec_t origin[3][FINDRADIUS_BLOCK];
+	prvm_vec_t mins[3][FINDRADIUS_BLOCK];
+	prvm_vec_t maxs[3][FINDRADIUS_BLOCK];
+}
+vm_findradius_block_t;
+
+// one axis of eorg for two candidates, rounded to float like the vec3_t of
+// the scalar code
+static __m128 VM_FindRadius_Axis(const vm_findradius_block_t *b, int axis, int i, __m128d o, qboolean distancetobox)
+{
+	__m128d e, mins, maxs, inner, ge;
+	e = _mm_cvtps_pd(_mm_cvtpd_ps(_mm_sub_pd(o, _mm_loadu_pd(b->origin[axis] + i))));
+	mins = _mm_loadu_pd(b->mins[axis] + i);
+	maxs = _mm_loadu_pd(b->maxs[axis] + i);
+	if (distancetobox)
+	{
+		// bound(mins, e, maxs) with the same comparisons as the macro
+		inner = _mm_cmplt_pd(e, maxs);
+		inner = _mm_or_pd(_mm_and_pd(inner, e), _mm_andnot_pd(inner, maxs));
+		ge = _mm_cmpge_pd(e, mins);
+		e = _mm_sub_pd(e, _mm_or_pd(_mm_and_pd(ge, inner), _mm_andnot_pd(ge, mins)));
+	}
+	else
+	{
+		e = _mm_add_pd(e, _mm_mul_pd(_mm_set1_pd(-0.5), mins));
+		e = _mm_add_pd(e, _mm_mul_pd(_mm_set1_pd(-0.5), maxs));
+	}
+	return _mm_cvtpd_ps(e);
+}
+#endif
+
+static float vm_findradius_dist2[MAX_EDICTS];
+
+static int VM_FindRadius_CompareDist(const void *a, const void *b)
+{
+	int i = *(const int *)a, j = *(const int *)b;
+	if (vm_findradius_dist2[i] != vm_findradius_dist2[j])
+		return vm_findradius_dist2[i] < vm_findradius_dist2[j] ? -1 : 1;
+	return i - j;
+}
+
+int VM_FindRadius_Filter(prvm_prog_t *prog, const vec3_t org, vec_t radius, qboolean distancetobox, qboolean sorted, prvm_edict_t **edicts, int numedicts)
+{
+	static int order[MAX_EDICTS];
+	static prvm_edict_t *sortededicts[MAX_EDICTS];
+	vec_t radius2 = radius * radius;
+	int i, numkept = 0, numsimd = 0;
+	float dist2;
+#if defined(SSE2_PRESENT) && defined(PRVM_64)
+	static vm_findradius_block_t block;
+	__m128d o[3];
+	__m128 x, y, z, d, r2;
+	int start, end, j, k, mask;
+	float d4[4];
+	prvm_edict_t *ent;
+#endif
+
+	numedicts = min(numedicts, MAX_EDICTS);
+#if defined(SSE2_PRESENT) && defined(PRVM_64)
+	numsimd = numedicts & ~3;
+	for (k = 0;k < 3;k++)
+		o[k] = _mm_set1_pd(org[k]);
+	r2 = _mm_set1_ps(radius2);
+	for (start = 0;start < numsimd;start = end)
+	{
+		end = min(start + FINDRADIUS_BLOCK, numsimd);
+		// gather the fields of the block, the edicts are all over memory
+		for (i = start, j = 0;i < end;i++, j++)
+		{
+			ent = edicts[i];
+			for (k = 0;k < 3;k++)
+			{
+				block.origin[k][j] = PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.origin)[k];
+				block.mins[k][j] = PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.mins)[k];
+				block.maxs[k][j] = PRVM_EDICTFIELDVECTOR(ent, prog->fieldoffsets.maxs)[k];
+			}
+		}
+		for (i = start, j = 0;i < end;i += 4, j += 4)
+		{
+			x = _mm_movelh_ps(VM_FindRadius_Axis(&block, 0, j, o[0], distancetobox), VM_FindRadius_Axis(&block, 0, j + 2, o[0], distancetobox));
+			y = _mm_movelh_ps(VM_FindRadius_Axis(&block, 1, j, o[1], distancetobox), VM_FindRadius_Axis(&block, 1, j + 2, o[1], distancetobox));
+			z = _mm_movelh_ps(VM_FindRadius_Axis(&block, 2, j, o[2], distancetobox), VM_FindRadius_Axis(&block, 2, j + 2, o[2], distancetobox));
+			d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+			mask = _mm_movemask_ps(_mm_cmplt_ps(d, r2));
+			if (!mask)
+				continue;
+			_mm_storeu_ps(d4, d);
+			for (k = 0;k < 4;k++)
+			{
+				if (mask & (1 << k))
+				{
+					vm_findradius_dist2[numkept] = d4[k];
+					edicts[numkept++] = edicts[i + k];
+				}
+			}
+		}
+	}
+#endif
+	// the last few (or all without SSE2)
+	for (i = numsimd;i < numedicts;i++)
+	{
+		dist2 = VM_FindRadius_Distance2(prog, edicts[i], org, distancetobox);
+		if (dist2 < radius2)
+		{
+			vm_findradius_dist2[numkept] = dist2;
+			edicts[numkept++] = edicts[i];
+		}
+	}
+
+	if (sorted && numkept > 1)
+	{
+		for (i = 0;i < numkept;i++)
+			order[i] = i;
+		qsort(order, numkept, sizeof(int), VM_FindRadius_CompareDist);
+		for (i = 0;i < numkept;i++)
+			sortededicts[i] = edicts[order[i]];
+		memcpy(edicts, sortededicts, numkept * sizeof(prvm_edict_t *));
+	}
+	return numkept;
+}
+
 /*
 =========
 VM_precache_sound
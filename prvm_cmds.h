@@ -194,6 +194,7 @@ float	getserverlistindexforkey(string key)
 #include "quakedef.h"
 #include "progdefs.h"
 #include "progsvm.h"
+#include "prvm_findindex.h"
 #include "clprogdefs.h"
 #include "mprogdefs.h"
 
@@ -263,6 +264,7 @@ void VM_findchain (prvm_prog_t *prog);
 void VM_findchainfloat (prvm_prog_t *prog);
 void VM_findflags (prvm_prog_t *prog);
 void VM_findchainflags (prvm_prog_t *prog);
+int VM_FindRadius_Filter(prvm_prog_t *prog, const vec3_t org, vec_t radius, qboolean distancetobox, qboolean sorted, prvm_edict_t **edicts, int numedicts);
 void VM_precache_file (prvm_prog_t *prog);
 void VM_precache_sound (prvm_prog_t *prog);
 void VM_coredump (prvm_prog_t *prog);
@@ -22,6 +22,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "quakedef.h"
 #include "progsvm.h"
 #include "csprogs.h"
+#include "prvm_jit.h"
+#include "prvm_findindex.h"
 
 prvm_prog_t prvm_prog_list[PRVM_PROG_MAX];
 
@@ -44,6 +46,7 @@ cvar_t prvm_errordump = {0, "prvm_errordump", "0", "write a savegame on crash to
 cvar_t prvm_breakpointdump = {0, "prvm_breakpointdump", "0", "write a savegame on breakpoint to breakpoint-server.dmp"};
 cvar_t prvm_reuseedicts_startuptime = {0, "prvm_reuseedicts_startuptime", "2", "allows immediate re-use of freed entity slots during start of new level (value in seconds)"};
 cvar_t prvm_reuseedicts_neverinsameframe = {0, "prvm_reuseedicts_neverinsameframe", "1", "never allows re-use of freed entity slots during same frame"};
+cvar_t prvm_superinstructions = {0, "prvm_superinstructions", "1", "lets the interpreter execute common pairs of QuakeC statements in one step (takes effect when progs are loaded)"};
 
 static double prvm_reuseedicts_always_allow = 0;
 qboolean prvm_runawaycheck = true;
@@ -74,6 +77,9 @@ static void PRVM_MEM_Alloc(prvm_prog_t *prog)
 	// alloc edict private space
 	prog->edictprivate = Mem_Alloc(prog->progs_mempool, prog->max_edicts * prog->edictprivate_size);
 
+	// sized for all edicts that can exist so it never moves
+	prog->touchededicts = (unsigned char *)Mem_Alloc(prog->progs_mempool, prog->limit_edicts);
+
 	// alloc edict fields
 	prog->entityfieldsarea = prog->entityfields * prog->max_edicts;
 	prog->edictsfields = (prvm_vec_t *)Mem_Alloc(prog->progs_mempool, prog->entityfieldsarea * sizeof(prvm_vec_t));
@@ -207,6 +213,23 @@ void PRVM_ED_ClearEdict(prvm_prog_t *prog, prvm_edict_t *e)
 
 	// AK: Let the init_edict function determine if something needs to be initialized
 	prog->init_edict(prog, e);
+	PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(e));
+}
+
+void PRVM_ED_Touch(prvm_prog_t *prog, int num)
+{
+	if (prog->touchededicts && num >= 0 && num < prog->limit_edicts)
+		prog->touchededicts[num] = true;
+	PRVM_FindIndex_Touch(prog, num);
+}
+
+void PRVM_ED_TouchAddress(prvm_prog_t *prog, int num, int track)
+{
+	// OP_ADDRESS already checked num against max_edicts
+	if (track & PRVM_TRACK_EDICT)
+		prog->touchededicts[num] = true;
+	if (track & PRVM_TRACK_FINDINDEX)
+		PRVM_FindIndex_TouchAddress(prog, num);
 }
 
 const char *PRVM_AllocationOrigin(prvm_prog_t *prog)
@@ -310,6 +333,7 @@ void PRVM_ED_Free(prvm_prog_t *prog, prvm_edict_t *ed)
 		Mem_Free((char *)ed->priv.required->allocation_origin);
 		ed->priv.required->allocation_origin = NULL;
 	}
+	PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(ed));
 }
 
 //===========================================================================
@@ -352,23 +376,74 @@ ddef_t *PRVM_ED_FieldAtOfs (prvm_prog_t *prog, int ofs)
 	return NULL;
 }
 
+static unsigned int PRVM_ED_HashName(const char *name)
+{
+	unsigned int h = 2166136261u;
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+#define PRVM_ED_NAME(array, stride, nameoffset, i) PRVM_GetString(prog, *(const int *)((const unsigned char *)(array) + (size_t)(i) * (stride) + (nameoffset)))
+
 /*
 ============
-PRVM_ED_FindField
+PRVM_ED_BuildNameHash
+
+hashes the s_name of the count entries of array (the fielddefs, globaldefs or
+functions), done once by PRVM_Prog_Load because map and savegame loading
+look up a name for every key of every entity
 ============
 */
-ddef_t *PRVM_ED_FindField (prvm_prog_t *prog, const char *name)
+static void PRVM_ED_BuildNameHash(prvm_prog_t *prog, prvm_namehash_t *hash, const void *array, size_t stride, size_t nameoffset, int count)
+{
+	int i, h;
+
+	for (hash->size = 16;hash->size < count;hash->size *= 2)
+		;
+	hash->buckets = (int *)PRVM_Alloc(hash->size * sizeof(int));
+	hash->next = (int *)PRVM_Alloc(max(count, 1) * sizeof(int));
+	memset(hash->buckets, -1, hash->size * sizeof(int));
+	// linked from the end so the first entry of a name comes first in its
+	// chain, names like IMMEDIATE are shared by many globaldefs and the
+	// lookups always returned the first one
+	for (i = count - 1;i >= 0;i--)
+	{
+		h = PRVM_ED_HashName(PRVM_ED_NAME(array, stride, nameoffset, i)) & (hash->size - 1);
+		hash->next[i] = hash->buckets[h];
+		hash->buckets[h] = i;
+	}
+	hash->count = count;
+}
+
+// returns the index of the first entry named name, or -1
+static int PRVM_ED_LookupName(prvm_prog_t *prog, const prvm_namehash_t *hash, const void *array, size_t stride, size_t nameoffset, int count, const char *name)
 {
-	ddef_t *def;
 	int i;
 
-	for (i = 0;i < prog->numfielddefs;i++)
+	// while loading, before the hash is built
+	if (hash->count != count || !hash->buckets)
 	{
-		def = &prog->fielddefs[i];
-		if (!strcmp(PRVM_GetString(prog, def->s_name), name))
-			return def;
+		for (i = 0;i < count;i++)
+			if (!strcmp(PRVM_ED_NAME(array, stride, nameoffset, i), name))
+				return i;
+		return -1;
 	}
-	return NULL;
+	for (i = hash->buckets[PRVM_ED_HashName(name) & (hash->size - 1)];i >= 0;i = hash->next[i])
+		if (!strcmp(PRVM_ED_NAME(array, stride, nameoffset, i), name))
+			return i;
+	return -1;
+}
+
+/*
+============
+PRVM_ED_FindField
+============
+*/
+ddef_t *PRVM_ED_FindField (prvm_prog_t *prog, const char *name)
+{
+	int i = PRVM_ED_LookupName(prog, &prog->fielddefs_hash, prog->fielddefs, sizeof(ddef_t), offsetof(ddef_t, s_name), prog->numfielddefs, name);
+	return i >= 0 ? prog->fielddefs + i : NULL;
 }
 
 /*
@@ -378,16 +453,8 @@ PRVM_ED_FindGlobal
 */
 ddef_t *PRVM_ED_FindGlobal (prvm_prog_t *prog, const char *name)
 {
-	ddef_t *def;
-	int i;
-
-	for (i = 0;i < prog->numglobaldefs;i++)
-	{
-		def = &prog->globaldefs[i];
-		if (!strcmp(PRVM_GetString(prog, def->s_name), name))
-			return def;
-	}
-	return NULL;
+	int i = PRVM_ED_LookupName(prog, &prog->globaldefs_hash, prog->globaldefs, sizeof(ddef_t), offsetof(ddef_t, s_name), prog->numglobaldefs, name);
+	return i >= 0 ? prog->globaldefs + i : NULL;
 }
 
 
@@ -398,16 +465,8 @@ PRVM_ED_FindFunction
 */
 mfunction_t *PRVM_ED_FindFunction (prvm_prog_t *prog, const char *name)
 {
-	mfunction_t		*func;
-	int				i;
-
-	for (i = 0;i < prog->numfunctions;i++)
-	{
-		func = &prog->functions[i];
-		if (!strcmp(PRVM_GetString(prog, func->s_name), name))
-			return func;
-	}
-	return NULL;
+	int i = PRVM_ED_LookupName(prog, &prog->functions_hash, prog->functions, sizeof(mfunction_t), offsetof(mfunction_t, s_name), prog->numfunctions, name);
+	return i >= 0 ? prog->functions + i : NULL;
 }
 
 
@@ -843,6 +902,49 @@ static void PRVM_ED_Count_f (void)
 	prog->count_edicts(prog);
 }
 
+static void PRVM_StringStats_f (void)
+{
+	prvm_prog_t *prog;
+	int i, c;
+	int numengine = 0, numzone = 0, numlarge = 0;
+	size_t largebytes = 0;
+
+	if(Cmd_Argc() != 2)
+	{
+		Con_Print("prvm_stringstats <program name>\n");
+		return;
+	}
+
+	if (!(prog = PRVM_FriendlyProgFromString(Cmd_Argv(1))))
+		return;
+
+	for (i = 0;i < prog->numknownstrings;i++)
+	{
+		if (!prog->knownstrings[i])
+			continue;
+		if (!prog->knownstrings_freeable[i])
+			numengine++;
+		else
+		{
+			numzone++;
+			if (prog->knownstrings_freeable[i] == 1)
+			{
+				numlarge++;
+				largebytes += strlen(prog->knownstrings[i]) + 1;
+			}
+		}
+	}
+
+	Con_Printf("%s: %i of %i known string slots used (%i on the free list), %i hash buckets\n", prog->name, prog->numknownstrings - prog->numfreeknownstrings, prog->maxknownstrings, prog->numfreeknownstrings, prog->knownstrings_hashsize);
+	Con_Printf("engine strings: %i, %.0f lookups with %.2f compares each, %.0f added\n", numengine, prog->stringstats.enginelookups, prog->stringstats.enginelookups ? prog->stringstats.enginehashprobes / prog->stringstats.enginelookups : 0, prog->stringstats.engineadded);
+	Con_Printf("zone strings: %i, %.0f allocated, %.0f freed, %i over %i bytes (%lu bytes)\n", numzone, prog->stringstats.zoneallocs, prog->stringstats.zonefrees, numlarge, PRVM_STRINGSLAB_MAXSIZE, (unsigned long)largebytes);
+	Con_Printf("%i slab chunks (%iKB)\n", prog->stringslab.numchunks, prog->stringslab.numchunks * (PRVM_STRINGSLAB_CHUNKSIZE / 1024));
+	Con_Printf("  size   used   free\n");
+	for (c = 0;c < PRVM_STRINGSLAB_CLASSES;c++)
+		Con_Printf("%6i %6i %6i\n", PRVM_STRINGSLAB_MINSIZE << c, prog->stringslab.numblocks[c], prog->stringslab.numfreeblocks[c]);
+	Con_Printf("temp strings: %.0f created, %i bytes in use at most, %iKB buffer\n", prog->stringstats.tempstrings, prog->stringstats.tempstringspeak, prog->tempstringsbuf.maxsize / 1024);
+}
+
 /*
 ==============================================================================
 
@@ -956,7 +1058,10 @@ qboolean PRVM_ED_ParseEpair(prvm_prog_t *prog, prvm_edict_t *ent, ddef_t *key, c
 	mfunction_t *func;
 
 	if (ent)
+	{
 		val = (prvm_eval_t *)(ent->fields.fp + key->ofs);
+		PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(ent));
+	}
 	else
 		val = (prvm_eval_t *)(prog->globals.fp + key->ofs);
 	switch (key->type & ~DEF_SAVEGLOBAL)
@@ -1326,6 +1431,7 @@ const char *PRVM_ED_ParseEdict (prvm_prog_t *prog, const char *data, prvm_edict_
 	if (!init) {
 		ent->priv.required->free = true;
 		ent->priv.required->freetime = realtime;
+		PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(ent));
 	}
 
 	return data;
@@ -1843,6 +1949,7 @@ void PRVM_Prog_Reset(prvm_prog_t *prog)
 	{
 		PRVM_LeakTest(prog);
 		prog->reset_cmd(prog);
+		PRVM_JIT_Free(prog);
 		Mem_FreePool(&prog->progs_mempool);
 		if(prog->po)
 			PRVM_PO_Destroy((po_t *) prog->po);
@@ -1908,6 +2015,96 @@ static void PRVM_LoadLNO( prvm_prog_t *prog, const char *progname ) {
 	Mem_Free( lno );
 }
 
+/*
+===============
+PRVM_LoadProgs_ChooseSuperOps
+
+Sets execop of every statement, either to its own op or to a superop_t that
+also executes the statement after it.  The first statement of every pair never
+jumps, so the second one always follows it, and the second statement keeps its
+own op for jumps that land on it.
+===============
+*/
+static void PRVM_LoadProgs_ChooseSuperOps(prvm_prog_t *prog)
+{
+	int i, numsuperops = 0;
+	mstatement_t *st;
+	for (i = 0, st = prog->statements;i < prog->numstatements;i++, st++)
+	{
+		st->execop = st->op;
+		if (!prvm_superinstructions.integer || i + 1 >= prog->numstatements)
+			continue;
+		switch (st->op)
+		{
+		case OP_ADDRESS:
+			switch (st[1].op)
+			{
+			case OP_STOREP_F:
+			case OP_STOREP_S:
+			case OP_STOREP_ENT:
+			case OP_STOREP_FLD:
+			case OP_STOREP_FNC:
+				st->execop = OP_SUPER_ADDRESS_STOREP;
+				break;
+			case OP_STOREP_V:
+				st->execop = OP_SUPER_ADDRESS_STOREP_V;
+				break;
+			default:
+				break;
+			}
+			break;
+		case OP_LOAD_F:
+		case OP_LOAD_S:
+		case OP_LOAD_ENT:
+		case OP_LOAD_FLD:
+		case OP_LOAD_FNC:
+			switch (st[1].op)
+			{
+			case OP_STORE_F:
+			case OP_STORE_S:
+			case OP_STORE_ENT:
+			case OP_STORE_FLD:
+			case OP_STORE_FNC:
+				st->execop = OP_SUPER_LOAD_STORE;
+				break;
+			case OP_IF:
+				st->execop = OP_SUPER_LOAD_IF;
+				break;
+			case OP_IFNOT:
+				st->execop = OP_SUPER_LOAD_IFNOT;
+				break;
+			case OP_ADD_F:
+				if (st->op == OP_LOAD_F)
+					st->execop = OP_SUPER_LOAD_ADD_F;
+				break;
+			case OP_MUL_F:
+				if (st->op == OP_LOAD_F)
+					st->execop = OP_SUPER_LOAD_MUL_F;
+				break;
+			default:
+				break;
+			}
+			break;
+		case OP_EQ_F: if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_EQ_F_IFNOT;break;
+		case OP_NE_F: if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_NE_F_IFNOT;break;
+		case OP_LE:   if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_LE_IFNOT;break;
+		case OP_GE:   if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_GE_IFNOT;break;
+		case OP_LT:   if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_LT_IFNOT;break;
+		case OP_GT:   if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_GT_IFNOT;break;
+		case OP_EQ_E: if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_EQ_E_IFNOT;break;
+		case OP_NE_E: if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_NE_E_IFNOT;break;
+		case OP_AND:  if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_AND_IFNOT;break;
+		case OP_OR:   if (st[1].op == OP_IFNOT) st->execop = OP_SUPER_OR_IFNOT;break;
+		default:
+			break;
+		}
+		if (st->execop != (int)st->op)
+			numsuperops++;
+	}
+	if (developer_extra.integer)
+		Con_DPrintf("%s: %i of %i statements start a superinstruction\n", prog->name, numsuperops, prog->numstatements);
+}
+
 /*
 ===============
 PRVM_LoadProgs
@@ -2006,6 +2203,13 @@ void PRVM_Prog_Load(prvm_prog_t *prog, const char * filename, unsigned char * da
 	prog->maxknownstrings = 0;
 	prog->knownstrings = NULL;
 	prog->knownstrings_freeable = NULL;
+	prog->knownstrings_hashsize = 0;
+	prog->knownstrings_hash = NULL;
+	prog->knownstrings_hashnext = NULL;
+	prog->numfreeknownstrings = 0;
+	prog->freeknownstrings = NULL;
+	memset(&prog->stringslab, 0, sizeof(prog->stringslab));
+	memset(&prog->stringstats, 0, sizeof(prog->stringstats));
 
 	Mem_ExpandableArray_NewArray(&prog->stringbuffersarray, prog->progs_mempool, sizeof(prvm_stringbuffer_t), 64);
 
@@ -2084,6 +2288,11 @@ void PRVM_Prog_Load(prvm_prog_t *prog, const char * filename, unsigned char * da
 		prog->numfielddefs++;
 	}
 
+	// all names are known now
+	PRVM_ED_BuildNameHash(prog, &prog->fielddefs_hash, prog->fielddefs, sizeof(ddef_t), offsetof(ddef_t, s_name), prog->numfielddefs);
+	PRVM_ED_BuildNameHash(prog, &prog->globaldefs_hash, prog->globaldefs, sizeof(ddef_t), offsetof(ddef_t, s_name), prog->numglobaldefs);
+	PRVM_ED_BuildNameHash(prog, &prog->functions_hash, prog->functions, sizeof(mfunction_t), offsetof(mfunction_t, s_name), prog->numfunctions);
+
 	// LordHavoc: TODO: reorder globals to match engine struct
 	// LordHavoc: TODO: reorder fields to match engine struct
 #define remapglobal(index) (index)
@@ -2251,6 +2460,7 @@ void PRVM_Prog_Load(prvm_prog_t *prog, const char * filename, unsigned char * da
 			break;
 		}
 	}
+	PRVM_LoadProgs_ChooseSuperOps(prog);
 	if(prog->numstatements < 1)
 	{
 		prog->error_cmd("PRVM_LoadProgs: empty program in %s", prog->name);
@@ -2448,6 +2658,10 @@ fail:
 		;
 	}
 
+	// engine code marks the fields it keeps copies of, see PRVM_TRACK_
+	prog->trackfields = (unsigned char *)PRVM_Alloc(prog->entityfields);
+	PRVM_FindIndex_Setup(prog);
+
 	prog->loaded = TRUE;
 
 	PRVM_UpdateBreakpoints(prog);
@@ -2902,6 +3116,7 @@ void PRVM_Init (void)
 	Cmd_AddCommand ("prvm_profile", PRVM_Profile_f, "prints execution statistics about the most used QuakeC functions in the selected VM (server, client, menu)");
 	Cmd_AddCommand ("prvm_childprofile", PRVM_ChildProfile_f, "prints execution statistics about the most used QuakeC functions in the selected VM (server, client, menu), sorted by time taken in function with child calls");
 	Cmd_AddCommand ("prvm_callprofile", PRVM_CallProfile_f, "prints execution statistics about the most time consuming QuakeC calls from the engine in the selected VM (server, client, menu)");
+	Cmd_AddCommand ("prvm_stringstats", PRVM_StringStats_f, "prints statistics about the engine, zone and temp strings of the selected VM (server, client, menu)");
 	Cmd_AddCommand ("prvm_fields", PRVM_Fields_f, "prints usage statistics on properties (how many entities have non-zero values) in the selected VM (server, client, menu)");
 	Cmd_AddCommand ("prvm_globals", PRVM_Globals_f, "prints all global variables in the selected VM (server, client, menu)");
 	Cmd_AddCommand ("prvm_global", PRVM_Global_f, "prints value of a specified global variable in the selected VM (server, client, menu)");
@@ -2931,6 +3146,9 @@ void PRVM_Init (void)
 	Cvar_RegisterVariable (&prvm_breakpointdump);
 	Cvar_RegisterVariable (&prvm_reuseedicts_startuptime);
 	Cvar_RegisterVariable (&prvm_reuseedicts_neverinsameframe);
+	Cvar_RegisterVariable (&prvm_superinstructions);
+	PRVM_JIT_Init();
+	PRVM_FindIndex_Init();
 
 	// COMMANDLINEOPTION: PRVM: -norunaway disables the runaway loop check (it might be impossible to exit DarkPlaces if used!)
 	prvm_runawaycheck = !COM_CheckParm("-norunaway");
@@ -2956,8 +3174,6 @@ unsigned int PRVM_EDICT_NUM_ERROR(prvm_prog_t *prog, unsigned int n, const char
 	return 0;
 }
 
-#define PRVM_KNOWNSTRINGBASE 0x40000000
-
 const char *PRVM_GetString(prvm_prog_t *prog, int num)
 {
 	if (num < 0)
@@ -3010,6 +3226,92 @@ const char *PRVM_GetString(prvm_prog_t *prog, int num)
 	}
 }
 
+static int PRVM_KnownStringHash(prvm_prog_t *prog, const char *s)
+{
+	unsigned long long h = (unsigned long long)(size_t)s * 0x9E3779B97F4A7C15ull;
+	return (int)(h >> 40) & (prog->knownstrings_hashsize - 1);
+}
+
+static void PRVM_KnownStringLink(prvm_prog_t *prog, int i)
+{
+	int h = PRVM_KnownStringHash(prog, prog->knownstrings[i]);
+	prog->knownstrings_hashnext[i] = prog->knownstrings_hash[h];
+	prog->knownstrings_hash[h] = i;
+}
+
+static void PRVM_KnownStringUnlink(prvm_prog_t *prog, int i)
+{
+	int *link = &prog->knownstrings_hash[PRVM_KnownStringHash(prog, prog->knownstrings[i])];
+	while (*link >= 0)
+	{
+		if (*link == i)
+		{
+			*link = prog->knownstrings_hashnext[i];
+			return;
+		}
+		link = &prog->knownstrings_hashnext[*link];
+	}
+}
+
+// returns a free knownstrings slot, growing the arrays if there are none
+static int PRVM_NewKnownString(prvm_prog_t *prog)
+{
+	int i;
+	if (prog->numfreeknownstrings)
+		return prog->freeknownstrings[--prog->numfreeknownstrings];
+	if (prog->numknownstrings >= prog->maxknownstrings)
+	{
+		const char **oldstrings = prog->knownstrings;
+		const unsigned char *oldstrings_freeable = prog->knownstrings_freeable;
+		const char **oldstrings_origin = prog->knownstrings_origin;
+		int *oldhashnext = prog->knownstrings_hashnext;
+		prog->maxknownstrings = max(prog->maxknownstrings * 2, 128);
+		prog->knownstrings = (const char **)PRVM_Alloc(prog->maxknownstrings * sizeof(char *));
+		prog->knownstrings_freeable = (unsigned char *)PRVM_Alloc(prog->maxknownstrings * sizeof(unsigned char));
+		if(prog->leaktest_active)
+			prog->knownstrings_origin = (const char **)PRVM_Alloc(prog->maxknownstrings * sizeof(char *));
+		prog->knownstrings_hashnext = (int *)PRVM_Alloc(prog->maxknownstrings * sizeof(int));
+		if (prog->numknownstrings)
+		{
+			memcpy((char **)prog->knownstrings, oldstrings, prog->numknownstrings * sizeof(char *));
+			memcpy((char **)prog->knownstrings_freeable, oldstrings_freeable, prog->numknownstrings * sizeof(unsigned char));
+			if(prog->leaktest_active)
+				memcpy((char **)prog->knownstrings_origin, oldstrings_origin, prog->numknownstrings * sizeof(char *));
+		}
+		if (oldstrings)
+			Mem_Free((char **)oldstrings);
+		if (oldstrings_freeable)
+			Mem_Free((unsigned char *)oldstrings_freeable);
+		if (oldstrings_origin)
+			Mem_Free((char **)oldstrings_origin);
+		if (oldhashnext)
+			Mem_Free(oldhashnext);
+		// the free slot stack can never hold more than all of the slots
+		if (prog->freeknownstrings)
+			Mem_Free(prog->freeknownstrings);
+		prog->freeknownstrings = (int *)PRVM_Alloc(prog->maxknownstrings * sizeof(int));
+		// rebuild the hash with a bucket per slot
+		if (prog->knownstrings_hash)
+			Mem_Free(prog->knownstrings_hash);
+		prog->knownstrings_hashsize = prog->maxknownstrings;
+		prog->knownstrings_hash = (int *)PRVM_Alloc(prog->knownstrings_hashsize * sizeof(int));
+		memset(prog->knownstrings_hash, -1, prog->knownstrings_hashsize * sizeof(int));
+		for (i = 0;i < prog->numknownstrings;i++)
+			if (prog->knownstrings[i])
+				PRVM_KnownStringLink(prog, i);
+	}
+	return prog->numknownstrings++;
+}
+
+// releases a slot that PRVM_NewKnownString returned
+static void PRVM_FreeKnownString(prvm_prog_t *prog, int i)
+{
+	PRVM_KnownStringUnlink(prog, i);
+	prog->knownstrings[i] = NULL;
+	prog->knownstrings_freeable[i] = false;
+	prog->freeknownstrings[prog->numfreeknownstrings++] = i;
+}
+
 const char *PRVM_ChangeEngineString(prvm_prog_t *prog, int i, const char *s)
 {
 	const char *old;
@@ -3017,7 +3319,11 @@ const char *PRVM_ChangeEngineString(prvm_prog_t *prog, int i, const char *s)
 	if(i < 0 || i >= prog->numknownstrings)
 		prog->error_cmd("PRVM_ChangeEngineString: s is not an engine string");
 	old = prog->knownstrings[i];
+	if (old)
+		PRVM_KnownStringUnlink(prog, i);
 	prog->knownstrings[i] = s;
+	if (s)
+		PRVM_KnownStringLink(prog, i);
 	return old;
 }
 
@@ -3033,42 +3339,26 @@ int PRVM_SetEngineString(prvm_prog_t *prog, const char *s)
 	if (s >= (char *)prog->tempstringsbuf.data && s < (char *)prog->tempstringsbuf.data + prog->tempstringsbuf.maxsize)
 		return prog->stringssize + (s - (char *)prog->tempstringsbuf.data);
 	// see if it's a known string address
-	for (i = 0;i < prog->numknownstrings;i++)
-		if (prog->knownstrings[i] == s)
-			return PRVM_KNOWNSTRINGBASE + i;
-	// new unknown engine string
-	if (developer_insane.integer)
-		Con_DPrintf("new engine string %p = \"%s\"\n", s, s);
-	for (i = prog->firstfreeknownstring;i < prog->numknownstrings;i++)
-		if (!prog->knownstrings[i])
-			break;
-	if (i >= prog->numknownstrings)
+	prog->stringstats.enginelookups++;
+	if (prog->knownstrings_hashsize)
 	{
-		if (i >= prog->maxknownstrings)
+		for (i = prog->knownstrings_hash[PRVM_KnownStringHash(prog, s)];i >= 0;i = prog->knownstrings_hashnext[i])
 		{
-			const char **oldstrings = prog->knownstrings;
-			const unsigned char *oldstrings_freeable = prog->knownstrings_freeable;
-			const char **oldstrings_origin = prog->knownstrings_origin;
-			prog->maxknownstrings += 128;
-			prog->knownstrings = (const char **)PRVM_Alloc(prog->maxknownstrings * sizeof(char *));
-			prog->knownstrings_freeable = (unsigned char *)PRVM_Alloc(prog->maxknownstrings * sizeof(unsigned char));
-			if(prog->leaktest_active)
-				prog->knownstrings_origin = (const char **)PRVM_Alloc(prog->maxknownstrings * sizeof(char *));
-			if (prog->numknownstrings)
-			{
-				memcpy((char **)prog->knownstrings, oldstrings, prog->numknownstrings * sizeof(char *));
-				memcpy((char **)prog->knownstrings_freeable, oldstrings_freeable, prog->numknownstrings * sizeof(unsigned char));
-				if(prog->leaktest_active)
-					memcpy((char **)prog->knownstrings_origin, oldstrings_origin, prog->numknownstrings * sizeof(char *));
-			}
+			prog->stringstats.enginehashprobes++;
+			if (prog->knownstrings[i] == s)
+				return PRVM_KNOWNSTRINGBASE + i;
 		}
-		prog->numknownstrings++;
 	}
-	prog->firstfreeknownstring = i + 1;
+	// new unknown engine string
+	if (developer_insane.integer)
+		Con_DPrintf("new engine string %p = \"%s\"\n", s, s);
+	prog->stringstats.engineadded++;
+	i = PRVM_NewKnownString(prog);
 	prog->knownstrings[i] = s;
 	prog->knownstrings_freeable[i] = false;
 	if(prog->leaktest_active)
 		prog->knownstrings_origin[i] = NULL;
+	PRVM_KnownStringLink(prog, i);
 	return PRVM_KNOWNSTRINGBASE + i;
 }
 
@@ -3113,56 +3403,105 @@ int PRVM_SetTempString(prvm_prog_t *prog, const char *s)
 	t = (char *)prog->tempstringsbuf.data + prog->tempstringsbuf.cursize;
 	memcpy(t, s, size);
 	prog->tempstringsbuf.cursize += size;
-	return PRVM_SetEngineString(prog, t);
+	prog->stringstats.tempstrings++;
+	if (prog->stringstats.tempstringspeak < prog->tempstringsbuf.cursize)
+		prog->stringstats.tempstringspeak = prog->tempstringsbuf.cursize;
+	// this is always in the tempstrings range
+	return prog->stringssize + (int)(t - (char *)prog->tempstringsbuf.data);
+}
+
+// returns the stringslab size class for a zoned string of this size, or -1
+// if it is too big and gets its own allocation
+static int PRVM_StringSlab_Class(size_t bufferlength)
+{
+	int c;
+	if (bufferlength > PRVM_STRINGSLAB_MAXSIZE)
+		return -1;
+	for (c = 0;(size_t)(PRVM_STRINGSLAB_MINSIZE << c) < bufferlength;c++)
+		;
+	return c;
+}
+
+static char *PRVM_StringSlab_Alloc(prvm_prog_t *prog, int c)
+{
+	prvm_stringslab_t *slab = &prog->stringslab;
+	size_t size = PRVM_STRINGSLAB_MINSIZE << c;
+	unsigned char *block;
+	if (!slab->freeblocks[c] && slab->chunkremaining < size)
+	{
+		// hand out the rest of the old chunk as blocks of the largest sizes
+		// that fit, then start a new one
+		while (slab->chunkremaining >= PRVM_STRINGSLAB_MINSIZE)
+		{
+			int k = PRVM_STRINGSLAB_CLASSES - 1;
+			while ((size_t)(PRVM_STRINGSLAB_MINSIZE << k) > slab->chunkremaining)
+				k--;
+			*(void **)slab->chunk = slab->freeblocks[k];
+			slab->freeblocks[k] = slab->chunk;
+			slab->numfreeblocks[k]++;
+			slab->chunk += PRVM_STRINGSLAB_MINSIZE << k;
+			slab->chunkremaining -= PRVM_STRINGSLAB_MINSIZE << k;
+		}
+		slab->chunk = (unsigned char *)PRVM_Alloc(PRVM_STRINGSLAB_CHUNKSIZE);
+		slab->chunkremaining = PRVM_STRINGSLAB_CHUNKSIZE;
+		slab->numchunks++;
+	}
+	if (slab->freeblocks[c])
+	{
+		block = (unsigned char *)slab->freeblocks[c];
+		slab->freeblocks[c] = *(void **)block;
+		slab->numfreeblocks[c]--;
+	}
+	else
+	{
+		block = slab->chunk;
+		slab->chunk += size;
+		slab->chunkremaining -= size;
+	}
+	slab->numblocks[c]++;
+	return (char *)block;
+}
+
+static void PRVM_StringSlab_Free(prvm_prog_t *prog, int c, char *block)
+{
+	prvm_stringslab_t *slab = &prog->stringslab;
+	*(void **)block = slab->freeblocks[c];
+	slab->freeblocks[c] = block;
+	slab->numblocks[c]--;
+	slab->numfreeblocks[c]++;
 }
 
 int PRVM_AllocString(prvm_prog_t *prog, size_t bufferlength, char **pointer)
 {
 	int i;
+	int c;
+	char *s;
 	if (!bufferlength)
 	{
 		if (pointer)
 			*pointer = NULL;
 		return 0;
 	}
-	for (i = prog->firstfreeknownstring;i < prog->numknownstrings;i++)
-		if (!prog->knownstrings[i])
-			break;
-	if (i >= prog->numknownstrings)
+	prog->stringstats.zoneallocs++;
+	i = PRVM_NewKnownString(prog);
+	c = PRVM_StringSlab_Class(bufferlength);
+	if (c >= 0)
 	{
-		if (i >= prog->maxknownstrings)
-		{
-			const char **oldstrings = prog->knownstrings;
-			const unsigned char *oldstrings_freeable = prog->knownstrings_freeable;
-			const char **oldstrings_origin = prog->knownstrings_origin;
-			prog->maxknownstrings += 128;
-			prog->knownstrings = (const char **)PRVM_Alloc(prog->maxknownstrings * sizeof(char *));
-			prog->knownstrings_freeable = (unsigned char *)PRVM_Alloc(prog->maxknownstrings * sizeof(unsigned char));
-			if(prog->leaktest_active)
-				prog->knownstrings_origin = (const char **)PRVM_Alloc(prog->maxknownstrings * sizeof(char *));
-			if (prog->numknownstrings)
-			{
-				memcpy((char **)prog->knownstrings, oldstrings, prog->numknownstrings * sizeof(char *));
-				memcpy((char **)prog->knownstrings_freeable, oldstrings_freeable, prog->numknownstrings * sizeof(unsigned char));
-				if(prog->leaktest_active)
-					memcpy((char **)prog->knownstrings_origin, oldstrings_origin, prog->numknownstrings * sizeof(char *));
-			}
-			if (oldstrings)
-				Mem_Free((char **)oldstrings);
-			if (oldstrings_freeable)
-				Mem_Free((unsigned char *)oldstrings_freeable);
-			if (oldstrings_origin)
-				Mem_Free((char **)oldstrings_origin);
-		}
-		prog->numknownstrings++;
-	}
-	prog->firstfreeknownstring = i + 1;
-	prog->knownstrings[i] = (char *)PRVM_Alloc(bufferlength);
-	prog->knownstrings_freeable[i] = true;
+		s = PRVM_StringSlab_Alloc(prog, c);
+		memset(s, 0, bufferlength);
+		prog->knownstrings_freeable[i] = 2 + c;
+	}
+	else
+	{
+		s = (char *)PRVM_Alloc(bufferlength);
+		prog->knownstrings_freeable[i] = true;
+	}
+	prog->knownstrings[i] = s;
 	if(prog->leaktest_active)
 		prog->knownstrings_origin[i] = PRVM_AllocationOrigin(prog);
+	PRVM_KnownStringLink(prog, i);
 	if (pointer)
-		*pointer = (char *)(prog->knownstrings[i]);
+		*pointer = s;
 	return PRVM_KNOWNSTRINGBASE + i;
 }
 
@@ -3179,13 +3518,16 @@ void PRVM_FreeString(prvm_prog_t *prog, int num)
 			prog->error_cmd("PRVM_FreeString: attempt to free a non-existent or already freed string");
 		if (!prog->knownstrings_freeable[num])
 			prog->error_cmd("PRVM_FreeString: attempt to free a string owned by the engine");
-		PRVM_Free((char *)prog->knownstrings[num]);
+		PRVM_FindIndex_FreeString(prog, PRVM_KNOWNSTRINGBASE + num);
+		prog->stringstats.zonefrees++;
+		if (prog->knownstrings_freeable[num] >= 2)
+			PRVM_StringSlab_Free(prog, prog->knownstrings_freeable[num] - 2, (char *)prog->knownstrings[num]);
+		else
+			PRVM_Free((char *)prog->knownstrings[num]);
 		if(prog->leaktest_active)
 			if(prog->knownstrings_origin[num])
 				PRVM_Free((char *)prog->knownstrings_origin[num]);
-		prog->knownstrings[num] = NULL;
-		prog->knownstrings_freeable[num] = false;
-		prog->firstfreeknownstring = min(prog->firstfreeknownstring, num);
+		PRVM_FreeKnownString(prog, num);
 	}
 	else
 		prog->error_cmd("PRVM_FreeString: invalid string offset %i", num);
@@ -20,6 +20,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "quakedef.h"
 #include "progsvm.h"
+#include "prvm_jit.h"
+#include "prvm_findindex.h"
 
 const char *prvm_opnames[] =
 {
@@ -425,6 +427,11 @@ void PRVM_Profile (prvm_prog_t *prog, int maxfunctions, double mintime, int sort
 			best->callcount = 0;
 		}
 	} while (best);
+
+	if (prog->findindex_hits || prog->findindex_scans)
+		Con_Printf("%.0f find builtin calls answered from the find index, %.0f checked every entity\n", prog->findindex_hits, prog->findindex_scans);
+	prog->findindex_hits = 0;
+	prog->findindex_scans = 0;
 }
 
 /*
@@ -616,6 +623,8 @@ static int PRVM_EnterFunction (prvm_prog_t *prog, mfunction_t *f)
 
 	++f->recursion;
 	prog->xfunction = f;
+	if (prvm_jit.integer && f->first_statement >= 0)
+		PRVM_JIT_EnterFunction(prog, f);
 	return f->first_statement - 1;	// offset the s++
 }
 
@@ -758,6 +767,7 @@ void MVM_ExecuteProgram (prvm_prog_t *prog, func_t fnum, const char *errormessag
 	mstatement_t *cached_statements = prog->statements;
 	qboolean cached_allowworldwrites = prog->allowworldwrites;
 	unsigned int cached_flag = prog->flag;
+	unsigned char *cached_trackfields = prog->trackfields;
 
 	calltime = Sys_DirtyTime();
 
@@ -828,6 +838,10 @@ cleanup:
 	// delete tempstrings created by this function
 	prog->tempstringsbuf.cursize = restorevm_tempstringsbuf_cursize;
 
+	// back in the engine, any field address QC took has been stored to
+	if (!exitdepth)
+		PRVM_FindIndex_EndExecute(prog);
+
 	tm = Sys_DirtyTime() - calltime;if (tm < 0 || tm >= 1800) tm = 0;
 	func->totaltime += tm;
 
@@ -865,6 +879,7 @@ void CLVM_ExecuteProgram (prvm_prog_t *prog, func_t fnum, const char *errormessa
 	mstatement_t *cached_statements = prog->statements;
 	qboolean cached_allowworldwrites = prog->allowworldwrites;
 	unsigned int cached_flag = prog->flag;
+	unsigned char *cached_trackfields = prog->trackfields;
 
 	calltime = Sys_DirtyTime();
 
@@ -935,6 +950,10 @@ cleanup:
 	// delete tempstrings created by this function
 	prog->tempstringsbuf.cursize = restorevm_tempstringsbuf_cursize;
 
+	// back in the engine, any field address QC took has been stored to
+	if (!exitdepth)
+		PRVM_FindIndex_EndExecute(prog);
+
 	tm = Sys_DirtyTime() - calltime;if (tm < 0 || tm >= 1800) tm = 0;
 	func->totaltime += tm;
 
@@ -976,6 +995,7 @@ void PRVM_ExecuteProgram (prvm_prog_t *prog, func_t fnum, const char *errormessa
 	mstatement_t *cached_statements = prog->statements;
 	qboolean cached_allowworldwrites = prog->allowworldwrites;
 	unsigned int cached_flag = prog->flag;
+	unsigned char *cached_trackfields = prog->trackfields;
 
 	calltime = Sys_DirtyTime();
 
@@ -1046,6 +1066,10 @@ cleanup:
 	// delete tempstrings created by this function
 	prog->tempstringsbuf.cursize = restorevm_tempstringsbuf_cursize;
 
+	// back in the engine, any field address QC took has been stored to
+	if (!exitdepth)
+		PRVM_FindIndex_EndExecute(prog);
+
 	tm = Sys_DirtyTime() - calltime;if (tm < 0 || tm >= 1800) tm = 0;
 	func->totaltime += tm;
 
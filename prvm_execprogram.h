@@ -110,10 +110,30 @@
 	&&handle_OP_OR,
 
 	&&handle_OP_BITAND,
-	&&handle_OP_BITOR
+	&&handle_OP_BITOR,
+
+	// superop_t
+	&&handle_OP_SUPER_ADDRESS_STOREP,
+	&&handle_OP_SUPER_ADDRESS_STOREP_V,
+	&&handle_OP_SUPER_LOAD_STORE,
+	&&handle_OP_SUPER_LOAD_IF,
+	&&handle_OP_SUPER_LOAD_IFNOT,
+	&&handle_OP_SUPER_LOAD_ADD_F,
+	&&handle_OP_SUPER_LOAD_MUL_F,
+	&&handle_OP_SUPER_EQ_F_IFNOT,
+	&&handle_OP_SUPER_NE_F_IFNOT,
+	&&handle_OP_SUPER_LE_IFNOT,
+	&&handle_OP_SUPER_GE_IFNOT,
+	&&handle_OP_SUPER_LT_IFNOT,
+	&&handle_OP_SUPER_GT_IFNOT,
+	&&handle_OP_SUPER_EQ_E_IFNOT,
+	&&handle_OP_SUPER_NE_E_IFNOT,
+	&&handle_OP_SUPER_AND_IFNOT,
+	&&handle_OP_SUPER_OR_IFNOT,
+	&&handle_OP_JIT
 	    };
 #define DISPATCH_OPCODE() \
-    goto *dispatchtable[(++st)->op]
+    goto *dispatchtable[(++st)->execop]
 #define HANDLE_OPCODE(opcode) handle_##opcode
 
     DISPATCH_OPCODE(); // jump to first opcode
@@ -356,6 +376,10 @@
 				}
 #endif
 				OPC->_int = OPA->edict * cached_entityfields + OPB->_int;
+				// the store through the pointer can come after a builtin
+				// call that searches the find index
+				if (cached_trackfields[OPB->_int])
+					PRVM_ED_TouchAddress(prog, OPA->edict, cached_trackfields[OPB->_int]);
 				DISPATCH_OPCODE();
 
 			HANDLE_OPCODE(OP_LOAD_F):
@@ -552,6 +576,7 @@
 					PRVM_gameedictfloat(ed,nextthink) = PRVM_gameglobalfloat(time) + 0.1;
 					PRVM_gameedictfloat(ed,frame) = OPA->_float;
 					PRVM_gameedictfunction(ed,think) = OPB->function;
+					prog->touchededicts[PRVM_NUM_FOR_EDICT(ed)] = true;
 				}
 				else
 				{
@@ -830,6 +855,121 @@
 
 */
 
+#if USE_COMPUTED_GOTOS
+		// superinstructions, these do the first statement and then go
+		// straight to the handler of the second one (st is advanced in
+		// between so errors, profiling and jumps see the right statement)
+#define SUPER_ADDRESS() \
+				if ((prvm_uint_t)OPA->edict >= cached_max_edicts) \
+				{ \
+					PRE_ERROR(); \
+					prog->error_cmd("%s Progs attempted to address an out of bounds edict number", prog->name); \
+					goto cleanup; \
+				} \
+				if ((prvm_uint_t)OPB->_int >= cached_entityfields) \
+				{ \
+					PRE_ERROR(); \
+					prog->error_cmd("%s attempted to address an invalid field (%i) in an edict", prog->name, (int)OPB->_int); \
+					goto cleanup; \
+				} \
+				OPC->_int = OPA->edict * cached_entityfields + OPB->_int; \
+				if (cached_trackfields[OPB->_int]) \
+					PRVM_ED_Touch(prog, OPA->edict); \
+				++st
+#define SUPER_LOAD() \
+				if ((prvm_uint_t)OPA->edict >= cached_max_edicts) \
+				{ \
+					PRE_ERROR(); \
+					prog->error_cmd("%s Progs attempted to read an out of bounds edict number", prog->name); \
+					goto cleanup; \
+				} \
+				if ((prvm_uint_t)OPB->_int >= cached_entityfields) \
+				{ \
+					PRE_ERROR(); \
+					prog->error_cmd("%s attempted to read an invalid field in an edict (%i)", prog->name, (int)OPB->_int); \
+					goto cleanup; \
+				} \
+				ed = PRVM_PROG_TO_EDICT(OPA->edict); \
+				OPC->_int = ((prvm_eval_t *)(ed->fields.ip + OPB->_int))->_int; \
+				++st
+			HANDLE_OPCODE(OP_SUPER_ADDRESS_STOREP):
+				SUPER_ADDRESS();
+				goto HANDLE_OPCODE(OP_STOREP_F);
+			HANDLE_OPCODE(OP_SUPER_ADDRESS_STOREP_V):
+				SUPER_ADDRESS();
+				goto HANDLE_OPCODE(OP_STOREP_V);
+			HANDLE_OPCODE(OP_SUPER_LOAD_STORE):
+				SUPER_LOAD();
+				goto HANDLE_OPCODE(OP_STORE_F);
+			HANDLE_OPCODE(OP_SUPER_LOAD_IF):
+				SUPER_LOAD();
+				goto HANDLE_OPCODE(OP_IF);
+			HANDLE_OPCODE(OP_SUPER_LOAD_IFNOT):
+				SUPER_LOAD();
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_LOAD_ADD_F):
+				SUPER_LOAD();
+				goto HANDLE_OPCODE(OP_ADD_F);
+			HANDLE_OPCODE(OP_SUPER_LOAD_MUL_F):
+				SUPER_LOAD();
+				goto HANDLE_OPCODE(OP_MUL_F);
+			HANDLE_OPCODE(OP_SUPER_EQ_F_IFNOT):
+				OPC->_float = OPA->_float == OPB->_float;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_NE_F_IFNOT):
+				OPC->_float = OPA->_float != OPB->_float;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_LE_IFNOT):
+				OPC->_float = OPA->_float <= OPB->_float;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_GE_IFNOT):
+				OPC->_float = OPA->_float >= OPB->_float;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_LT_IFNOT):
+				OPC->_float = OPA->_float < OPB->_float;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_GT_IFNOT):
+				OPC->_float = OPA->_float > OPB->_float;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_EQ_E_IFNOT):
+				OPC->_float = OPA->_int == OPB->_int;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_NE_E_IFNOT):
+				OPC->_float = OPA->_int != OPB->_int;
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_AND_IFNOT):
+				OPC->_float = FLOAT_IS_TRUE_FOR_INT(OPA->_int) && FLOAT_IS_TRUE_FOR_INT(OPB->_int);
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_SUPER_OR_IFNOT):
+				OPC->_float = FLOAT_IS_TRUE_FOR_INT(OPA->_int) || FLOAT_IS_TRUE_FOR_INT(OPB->_int);
+				++st;
+				goto HANDLE_OPCODE(OP_IFNOT);
+			HANDLE_OPCODE(OP_JIT):
+				if (!prvm_jit.integer || prvm_statementprofiling.integer || (prvm_coverage.integer & 4))
+					goto *dispatchtable[st->op];
+				prog->xfunction->profile += (st - 1) - startst;
+				st = cached_statements + PRVM_JIT_Run(prog, st - cached_statements, &jumpcount);
+				startst = st - 1;
+				if (jumpcount == 10000000 && prvm_runawaycheck)
+				{
+					prog->xstatement = st - cached_statements;
+					PRVM_Profile(prog, 1<<30, 0.01, 0);
+					prog->error_cmd("%s runaway loop counter hit limit of %d jumps\ntip: read above for list of most-executed functions", prog->name, jumpcount);
+				}
+				goto *dispatchtable[st->op];
+#undef SUPER_ADDRESS
+#undef SUPER_LOAD
+#endif
+
 #if !USE_COMPUTED_GOTOS
 			default:
 				PRE_ERROR();
@@ -0,0 +1,579 @@
+// field value indexes for the find builtins
+//
+// find, findfloat, findflags and their findchain variants normally walk all
+// edicts.  for a few fields that QC searches all the time (classname,
+// targetname, flags...) each value is mapped to the sorted list of edicts
+// having it, and each bit of the flags fields to a bitmap of edicts.
+// the index is built on the first search and kept up to date lazily: every
+// write to an indexed field marks the edict dirty (QC stores are caught at
+// OP_ADDRESS, engine writes call PRVM_ED_Touch) and dirty edicts are
+// indexed again before the next search.  the builtins still check every
+// candidate, so the index only has to avoid missing an edict.
+
+#include "quakedef.h"
+#include "progsvm.h"
+#include "prvm_findindex.h"
+
+cvar_t prvm_findindex = {0, "prvm_findindex", "1", "answer find, findfloat, findflags and the findchain builtins from indexes of the classname, targetname, target, killtarget, flags and spawnflags fields instead of checking every entity"};
+
+#define FINDINDEX_MAXFIELDS 8
+// flag bits kept in bitmaps, findflags with other bits scans
+#define FINDINDEX_FLAGBITS 24
+#define FINDINDEX_FLAGMASK ((1 << FINDINDEX_FLAGBITS) - 1)
+// bits of .flags the engine sets and clears by itself without telling the
+// index, findflags on them always scans
+#define FINDINDEX_ENGINEFLAGS (FL_GODMODE | FL_NOTARGET | FL_ONGROUND | FL_PARTIALGROUND | FL_WATERJUMP)
+
+// dirtyflags
+#define FINDINDEX_DIRTY 1
+#define FINDINDEX_PENDING 2
+
+typedef struct findindex_key_s
+{
+	struct findindex_key_s *next; // hash chain
+	unsigned int hash;
+	prvm_vec_t value; // float fields
+	char *string; // string fields
+	int numedicts;
+	int maxedicts;
+	int *edicts; // sorted
+}
+findindex_key_t;
+
+typedef struct findindex_field_s
+{
+	int ofs;
+	etype_t type;
+	// FINDINDEX_ENGINEFLAGS bits of this field are not kept up to date
+	qboolean engineflags;
+	int numkeys;
+	int hashsize; // power of two
+	findindex_key_t **hash;
+	// key of each edict, NULL if it is free or the value can not be indexed
+	findindex_key_t **edictkey;
+	// string fields: edicts whose value is a tempstring or a freed string,
+	// their contents can change without a store so the field is scanned
+	// while there are any
+	unsigned char *edictvolatile;
+	int numvolatile;
+	// float fields: FINDINDEX_FLAGMASK bits of each edict and a bitmap of
+	// the edicts having each bit
+	unsigned int *edictbits;
+	unsigned int *bits[FINDINDEX_FLAGBITS];
+}
+findindex_field_t;
+
+typedef struct prvm_findindex_s
+{
+	mempool_t *mempool; // emptied when the index is built again
+	int numfields;
+	findindex_field_t fields[FINDINDEX_MAXFIELDS];
+	qboolean built;
+	int max_edicts; // size of the per edict arrays
+	int num_edicts; // edicts that have been indexed
+	// edicts that have to be indexed again before the next search
+	unsigned char *dirtyflags;
+	int *dirty;
+	int numdirty;
+	int numpending;
+	// QC took a field address the index could not record (before it was
+	// built or beyond max_edicts), searches scan until the program returns
+	qboolean stale;
+	int *results; // candidates of findflags
+}
+prvm_findindex_t;
+
+static const char *findindex_stringfields[] = {"classname", "targetname", "target", "killtarget"};
+static const char *findindex_floatfields[] = {"flags", "spawnflags"};
+
+void PRVM_FindIndex_Init(void)
+{
+	Cvar_RegisterVariable(&prvm_findindex);
+}
+
+static void PRVM_FindIndex_AddField(prvm_prog_t *prog, prvm_findindex_t *fi, const char *name, etype_t type)
+{
+	findindex_field_t *fld;
+	ddef_t *d = PRVM_ED_FindField(prog, name);
+	if (!d || (d->type & ~DEF_SAVEGLOBAL) != type || d->ofs >= prog->entityfields || fi->numfields >= FINDINDEX_MAXFIELDS)
+		return;
+	fld = fi->fields + fi->numfields++;
+	fld->ofs = d->ofs;
+	fld->type = type;
+	fld->engineflags = !strcmp(name, "flags") && (prog == SVVM_prog || prog == CLVM_prog);
+	prog->trackfields[d->ofs] |= PRVM_TRACK_FINDINDEX;
+}
+
+void PRVM_FindIndex_Setup(prvm_prog_t *prog)
+{
+	prvm_findindex_t *fi;
+	int i;
+	fi = (prvm_findindex_t *)PRVM_Alloc(sizeof(prvm_findindex_t));
+	fi->mempool = Mem_AllocPool("find index", 0, prog->progs_mempool);
+	for (i = 0;i < (int)(sizeof(findindex_stringfields) / sizeof(findindex_stringfields[0]));i++)
+		PRVM_FindIndex_AddField(prog, fi, findindex_stringfields[i], ev_string);
+	for (i = 0;i < (int)(sizeof(findindex_floatfields) / sizeof(findindex_floatfields[0]));i++)
+		PRVM_FindIndex_AddField(prog, fi, findindex_floatfields[i], ev_float);
+	prog->findindex = fi;
+}
+
+static unsigned int PRVM_FindIndex_HashString(const char *s)
+{
+	unsigned int h = 2166136261u;
+	for (;*s;s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static unsigned int PRVM_FindIndex_HashFloat(prvm_vec_t v)
+{
+	unsigned char b[sizeof(prvm_vec_t)];
+	unsigned int h = 2166136261u;
+	size_t i;
+	memcpy(b, &v, sizeof(b));
+	for (i = 0;i < sizeof(b);i++)
+		h = (h ^ b[i]) * 16777619u;
+	return h;
+}
+
+// returns the string of a field value if it stays the same until the field
+// is written to, NULL for tempstrings and invalid or freed strings
+static const char *PRVM_FindIndex_StableString(prvm_prog_t *prog, prvm_int_t num)
+{
+	if (num < 0)
+		return NULL;
+	if (num < prog->stringssize)
+		return prog->strings + num;
+	if (num <= prog->stringssize + prog->tempstringsbuf.maxsize)
+		return NULL;
+	if (num & PRVM_KNOWNSTRINGBASE)
+	{
+		num -= PRVM_KNOWNSTRINGBASE;
+		if (num < prog->numknownstrings)
+			return prog->knownstrings[num];
+	}
+	return NULL;
+}
+
+static findindex_key_t *PRVM_FindIndex_FindKey(findindex_field_t *fld, unsigned int hash, prvm_vec_t value, const char *string)
+{
+	findindex_key_t *key;
+	if (!fld->hashsize)
+		return NULL;
+	for (key = fld->hash[hash & (fld->hashsize - 1)];key;key = key->next)
+		if (key->hash == hash && (string ? !strcmp(key->string, string) : key->value == value))
+			return key;
+	return NULL;
+}
+
+static void PRVM_FindIndex_GrowHash(prvm_findindex_t *fi, findindex_field_t *fld)
+{
+	findindex_key_t **oldhash = fld->hash, *key, *next;
+	int oldsize = fld->hashsize, i;
+	fld->hashsize = oldsize ? oldsize * 2 : 64;
+	fld->hash = (findindex_key_t **)Mem_Alloc(fi->mempool, fld->hashsize * sizeof(*fld->hash));
+	for (i = 0;i < oldsize;i++)
+	{
+		for (key = oldhash[i];key;key = next)
+		{
+			next = key->next;
+			key->next = fld->hash[key->hash & (fld->hashsize - 1)];
+			fld->hash[key->hash & (fld->hashsize - 1)] = key;
+		}
+	}
+	if (oldhash)
+		Mem_Free(oldhash);
+}
+
+static findindex_key_t *PRVM_FindIndex_AddKey(prvm_findindex_t *fi, findindex_field_t *fld, unsigned int hash, prvm_vec_t value, const char *string)
+{
+	findindex_key_t *key;
+	size_t len;
+	if (fld->numkeys >= fld->hashsize)
+		PRVM_FindIndex_GrowHash(fi, fld);
+	if (string)
+	{
+		len = strlen(string) + 1;
+		key = (findindex_key_t *)Mem_Alloc(fi->mempool, sizeof(findindex_key_t) + len);
+		key->string = (char *)(key + 1);
+		memcpy(key->string, string, len);
+	}
+	else
+	{
+		key = (findindex_key_t *)Mem_Alloc(fi->mempool, sizeof(findindex_key_t));
+		key->value = value;
+	}
+	key->hash = hash;
+	key->next = fld->hash[hash & (fld->hashsize - 1)];
+	fld->hash[hash & (fld->hashsize - 1)] = key;
+	fld->numkeys++;
+	return key;
+}
+
+// first position in the sorted edict list of a key that is above num
+static int PRVM_FindIndex_Search(const int *edicts, int numedicts, int num)
+{
+	int lo = 0, hi = numedicts, mid;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (edicts[mid] <= num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void PRVM_FindIndex_Link(prvm_findindex_t *fi, findindex_field_t *fld, findindex_key_t *key, int num)
+{
+	int i;
+	if (key->numedicts >= key->maxedicts)
+	{
+		key->maxedicts = key->maxedicts ? key->maxedicts * 2 : 4;
+		key->edicts = (int *)Mem_Realloc(fi->mempool, key->edicts, key->maxedicts * sizeof(int));
+	}
+	// edicts are mostly added in order
+	if (!key->numedicts || key->edicts[key->numedicts - 1] < num)
+		i = key->numedicts;
+	else
+	{
+		i = PRVM_FindIndex_Search(key->edicts, key->numedicts, num);
+		memmove(key->edicts + i + 1, key->edicts + i, (key->numedicts - i) * sizeof(int));
+	}
+	key->edicts[i] = num;
+	key->numedicts++;
+	fld->edictkey[num] = key;
+}
+
+static void PRVM_FindIndex_Unlink(findindex_field_t *fld, findindex_key_t *key, int num)
+{
+	findindex_key_t **link;
+	int i = PRVM_FindIndex_Search(key->edicts, key->numedicts, num) - 1;
+	if (i >= 0 && key->edicts[i] == num)
+	{
+		key->numedicts--;
+		memmove(key->edicts + i, key->edicts + i + 1, (key->numedicts - i) * sizeof(int));
+	}
+	fld->edictkey[num] = NULL;
+	if (key->numedicts)
+		return;
+	// values such as generated targetnames come and go, do not keep them
+	for (link = &fld->hash[key->hash & (fld->hashsize - 1)];*link;link = &(*link)->next)
+	{
+		if (*link == key)
+		{
+			*link = key->next;
+			break;
+		}
+	}
+	fld->numkeys--;
+	if (key->edicts)
+		Mem_Free(key->edicts);
+	Mem_Free(key);
+}
+
+static void PRVM_FindIndex_IndexString(prvm_prog_t *prog, prvm_findindex_t *fi, findindex_field_t *fld, int num, prvm_edict_t *ed)
+{
+	findindex_key_t *key = fld->edictkey[num];
+	const char *s = NULL;
+	qboolean isvolatile = false;
+	unsigned int hash;
+	if (!ed->priv.required->free)
+	{
+		s = PRVM_FindIndex_StableString(prog, ed->fields.ip[fld->ofs]);
+		isvolatile = !s;
+	}
+	if (fld->edictvolatile[num] != isvolatile)
+	{
+		fld->edictvolatile[num] = isvolatile;
+		fld->numvolatile += isvolatile ? 1 : -1;
+	}
+	if (key && s && !strcmp(key->string, s))
+		return;
+	if (key)
+		PRVM_FindIndex_Unlink(fld, key, num);
+	if (!s)
+		return;
+	hash = PRVM_FindIndex_HashString(s);
+	key = PRVM_FindIndex_FindKey(fld, hash, 0, s);
+	if (!key)
+		key = PRVM_FindIndex_AddKey(fi, fld, hash, 0, s);
+	PRVM_FindIndex_Link(fi, fld, key, num);
+}
+
+static void PRVM_FindIndex_IndexFloat(prvm_prog_t *prog, prvm_findindex_t *fi, findindex_field_t *fld, int num, prvm_edict_t *ed)
+{
+	findindex_key_t *key = fld->edictkey[num];
+	prvm_vec_t v = 0, limit = (prvm_vec_t)((prvm_uint_t)1 << (sizeof(prvm_int_t) * 8 - 1));
+	qboolean alive = !ed->priv.required->free;
+	unsigned int bits = 0, changed, hash;
+	int b;
+	if (alive)
+	{
+		v = ed->fields.fp[fld->ofs];
+		// -0 (and denormals if they are flushed to zero) compare equal to 0
+		if (v == 0)
+			v = 0;
+		// same conversion as findflags, values it can not convert have
+		// none of the low bits set
+		if (v >= -limit && v < limit)
+			bits = (unsigned int)(prvm_int_t)v & FINDINDEX_FLAGMASK;
+	}
+	changed = bits ^ fld->edictbits[num];
+	if (changed)
+	{
+		fld->edictbits[num] = bits;
+		for (b = 0;b < FINDINDEX_FLAGBITS;b++)
+			if (changed & (1u << b))
+				fld->bits[b][num >> 5] ^= 1u << (num & 31);
+	}
+	if (key && alive && key->value == v)
+		return;
+	if (key)
+		PRVM_FindIndex_Unlink(fld, key, num);
+	// NaN does not match anything
+	if (!alive || v != v)
+		return;
+	hash = PRVM_FindIndex_HashFloat(v);
+	key = PRVM_FindIndex_FindKey(fld, hash, v, NULL);
+	if (!key)
+		key = PRVM_FindIndex_AddKey(fi, fld, hash, v, NULL);
+	PRVM_FindIndex_Link(fi, fld, key, num);
+}
+
+static void PRVM_FindIndex_IndexEdict(prvm_prog_t *prog, prvm_findindex_t *fi, int num)
+{
+	prvm_edict_t *ed = prog->edicts + num;
+	int i;
+	for (i = 0;i < fi->numfields;i++)
+	{
+		if (fi->fields[i].type == ev_string)
+			PRVM_FindIndex_IndexString(prog, fi, fi->fields + i, num, ed);
+		else
+			PRVM_FindIndex_IndexFloat(prog, fi, fi->fields + i, num, ed);
+	}
+}
+
+static void PRVM_FindIndex_Build(prvm_prog_t *prog, prvm_findindex_t *fi)
+{
+	findindex_field_t *fld;
+	int i, b, num, numpending = 0, *pending = NULL;
+	// keep the edicts QC is still going to store to
+	if (fi->numpending)
+	{
+		pending = (int *)Mem_Alloc(tempmempool, fi->numpending * sizeof(int));
+		for (i = 0;i < fi->numdirty;i++)
+			if (fi->dirtyflags[fi->dirty[i]] & FINDINDEX_PENDING)
+				pending[numpending++] = fi->dirty[i];
+	}
+	Mem_EmptyPool(fi->mempool);
+	fi->max_edicts = prog->max_edicts;
+	fi->dirtyflags = (unsigned char *)Mem_Alloc(fi->mempool, fi->max_edicts);
+	fi->dirty = (int *)Mem_Alloc(fi->mempool, fi->max_edicts * sizeof(int));
+	fi->results = (int *)Mem_Alloc(fi->mempool, fi->max_edicts * sizeof(int));
+	fi->numdirty = 0;
+	fi->numpending = 0;
+	for (i = 0, fld = fi->fields;i < fi->numfields;i++, fld++)
+	{
+		fld->numkeys = 0;
+		fld->hashsize = 0;
+		fld->hash = NULL;
+		fld->numvolatile = 0;
+		fld->edictkey = (findindex_key_t **)Mem_Alloc(fi->mempool, fi->max_edicts * sizeof(*fld->edictkey));
+		if (fld->type == ev_string)
+			fld->edictvolatile = (unsigned char *)Mem_Alloc(fi->mempool, fi->max_edicts);
+		else
+		{
+			fld->edictbits = (unsigned int *)Mem_Alloc(fi->mempool, fi->max_edicts * sizeof(unsigned int));
+			for (b = 0;b < FINDINDEX_FLAGBITS;b++)
+				fld->bits[b] = (unsigned int *)Mem_Alloc(fi->mempool, ((fi->max_edicts + 31) >> 5) * sizeof(unsigned int));
+		}
+	}
+	// world is never returned by a search
+	fi->num_edicts = min(prog->num_edicts, fi->max_edicts);
+	for (num = 1;num < fi->num_edicts;num++)
+		PRVM_FindIndex_IndexEdict(prog, fi, num);
+	fi->built = true;
+	if (pending)
+	{
+		for (i = 0;i < numpending;i++)
+			PRVM_FindIndex_TouchAddress(prog, pending[i]);
+		Mem_Free(pending);
+	}
+}
+
+// brings the index up to date before a search, returns NULL if the field is
+// not indexed
+static findindex_field_t *PRVM_FindIndex_Update(prvm_prog_t *prog, int field, etype_t type)
+{
+	prvm_findindex_t *fi = prog->findindex;
+	findindex_field_t *fld;
+	int i, j, num;
+	if (!fi || !prvm_findindex.integer || field < 0 || field >= prog->entityfields || !(prog->trackfields[field] & PRVM_TRACK_FINDINDEX))
+		return NULL;
+	for (i = 0, fld = fi->fields;i < fi->numfields;i++, fld++)
+		if (fld->ofs == field)
+			break;
+	if (i == fi->numfields || fld->type != type || fi->stale)
+		return NULL;
+
+	if (!fi->built || fi->max_edicts != prog->max_edicts)
+	{
+		PRVM_FindIndex_Build(prog, fi);
+		return fld;
+	}
+	// edicts counted in by the engine without allocating them one by one
+	if (fi->num_edicts > prog->num_edicts)
+		fi->num_edicts = prog->num_edicts;
+	for (num = fi->num_edicts;num < prog->num_edicts;num++)
+		PRVM_FindIndex_IndexEdict(prog, fi, num);
+	fi->num_edicts = prog->num_edicts;
+	// index the dirty edicts, the ones QC took a field address of stay in
+	// the list until the program returns
+	for (i = 0, j = 0;i < fi->numdirty;i++)
+	{
+		num = fi->dirty[i];
+		PRVM_FindIndex_IndexEdict(prog, fi, num);
+		if (fi->dirtyflags[num] & FINDINDEX_PENDING)
+			fi->dirty[j++] = num;
+		else
+			fi->dirtyflags[num] = 0;
+	}
+	fi->numdirty = j;
+	return fld;
+}
+
+void PRVM_FindIndex_Touch(prvm_prog_t *prog, int num)
+{
+	prvm_findindex_t *fi = prog->findindex;
+	if (!fi || !fi->built || num < 1 || num >= fi->max_edicts)
+		return;
+	if (!fi->dirtyflags[num])
+		fi->dirty[fi->numdirty++] = num;
+	fi->dirtyflags[num] |= FINDINDEX_DIRTY;
+}
+
+void PRVM_FindIndex_TouchAddress(prvm_prog_t *prog, int num)
+{
+	prvm_findindex_t *fi = prog->findindex;
+	if (!fi || num < 1)
+		return;
+	if (!fi->built || num >= fi->max_edicts)
+	{
+		fi->stale = true;
+		return;
+	}
+	if (!fi->dirtyflags[num])
+		fi->dirty[fi->numdirty++] = num;
+	if (!(fi->dirtyflags[num] & FINDINDEX_PENDING))
+		fi->numpending++;
+	fi->dirtyflags[num] |= FINDINDEX_DIRTY | FINDINDEX_PENDING;
+}
+
+void PRVM_FindIndex_FreeString(prvm_prog_t *prog, prvm_int_t num)
+{
+	prvm_findindex_t *fi = prog->findindex;
+	findindex_field_t *fld;
+	findindex_key_t *key;
+	const char *s;
+	int i, j;
+	if (!fi || !fi->built || !(s = PRVM_FindIndex_StableString(prog, num)))
+		return;
+	// the slot gets reused by the next strzone, so the fields still holding
+	// this string change without a store
+	for (i = 0, fld = fi->fields;i < fi->numfields;i++, fld++)
+	{
+		if (fld->type != ev_string || !(key = PRVM_FindIndex_FindKey(fld, PRVM_FindIndex_HashString(s), 0, s)))
+			continue;
+		for (j = 0;j < key->numedicts;j++)
+			if (prog->edicts[key->edicts[j]].fields.ip[fld->ofs] == num)
+				PRVM_FindIndex_Touch(prog, key->edicts[j]);
+	}
+}
+
+void PRVM_FindIndex_EndExecute(prvm_prog_t *prog)
+{
+	prvm_findindex_t *fi = prog->findindex;
+	int i;
+	if (!fi)
+		return;
+	fi->stale = false;
+	if (!fi->numpending)
+		return;
+	// every store has happened now, the next search indexes them once more
+	for (i = 0;i < fi->numdirty;i++)
+		fi->dirtyflags[fi->dirty[i]] &= ~FINDINDEX_PENDING;
+	fi->numpending = 0;
+}
+
+static int PRVM_FindIndex_Candidates(prvm_prog_t *prog, findindex_key_t *key, int start, const int **edicts)
+{
+	int i;
+	prog->findindex_hits++;
+	if (!key)
+	{
+		*edicts = NULL;
+		return 0;
+	}
+	i = PRVM_FindIndex_Search(key->edicts, key->numedicts, start);
+	*edicts = key->edicts + i;
+	return key->numedicts - i;
+}
+
+int PRVM_FindIndex_String(prvm_prog_t *prog, int field, const char *s, int start, const int **edicts)
+{
+	findindex_field_t *fld = PRVM_FindIndex_Update(prog, field, ev_string);
+	if (!fld || fld->numvolatile || start < 0)
+	{
+		prog->findindex_scans++;
+		return -1;
+	}
+	return PRVM_FindIndex_Candidates(prog, PRVM_FindIndex_FindKey(fld, PRVM_FindIndex_HashString(s), 0, s), start, edicts);
+}
+
+int PRVM_FindIndex_Float(prvm_prog_t *prog, int field, prvm_vec_t f, int start, const int **edicts)
+{
+	findindex_field_t *fld = PRVM_FindIndex_Update(prog, field, ev_float);
+	// the whole value of a flags field is stale when the engine changed one
+	// of its bits
+	if (!fld || start < 0 || fld->engineflags)
+	{
+		prog->findindex_scans++;
+		return -1;
+	}
+	if (f == 0)
+		f = 0;
+	return PRVM_FindIndex_Candidates(prog, f != f ? NULL : PRVM_FindIndex_FindKey(fld, PRVM_FindIndex_HashFloat(f), f, NULL), start, edicts);
+}
+
+int PRVM_FindIndex_Flags(prvm_prog_t *prog, int field, prvm_int_t mask, int start, const int **edicts)
+{
+	prvm_findindex_t *fi = prog->findindex;
+	findindex_field_t *fld = PRVM_FindIndex_Update(prog, field, ev_float);
+	unsigned int *bits[FINDINDEX_FLAGBITS], m;
+	int numbits = 0, numresults = 0, b, w, endw, num;
+	if (!fld || start < 0 || (mask & ~(prvm_int_t)FINDINDEX_FLAGMASK) || (fld->engineflags && (mask & FINDINDEX_ENGINEFLAGS)))
+	{
+		prog->findindex_scans++;
+		return -1;
+	}
+	prog->findindex_hits++;
+	for (b = 0;b < FINDINDEX_FLAGBITS;b++)
+		if (mask & (1 << b))
+			bits[numbits++] = fld->bits[b];
+	start++;
+	endw = (fi->num_edicts + 31) >> 5;
+	for (w = start >> 5;w < endw && numbits;w++)
+	{
+		for (b = 0, m = 0;b < numbits;b++)
+			m |= bits[b][w];
+		if (w == start >> 5)
+			m &= ~0u << (start & 31);
+		for (num = w << 5;m;m >>= 1, num++)
+			if (m & 1)
+				fi->results[numresults++] = num;
+	}
+	*edicts = fi->results;
+	return numresults;
+}
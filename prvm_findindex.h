@@ -0,0 +1,30 @@
+#ifndef PRVM_FINDINDEX_H
+#define PRVM_FINDINDEX_H
+
+extern cvar_t prvm_findindex;
+
+void PRVM_FindIndex_Init(void);
+/// picks the fields of a progs that get indexed, called when it is loaded
+void PRVM_FindIndex_Setup(prvm_prog_t *prog);
+/// the engine changed the fields or the free state of an edict, called by
+/// PRVM_ED_Touch
+void PRVM_FindIndex_Touch(prvm_prog_t *prog, int num);
+/// QC took the address of an indexed field of an edict, the store through it
+/// may come later (after other builtins ran), so the edict stays dirty until
+/// the program returns to the engine
+void PRVM_FindIndex_TouchAddress(prvm_prog_t *prog, int num);
+/// a zoned string is about to be freed, called by PRVM_FreeString before its
+/// slot can be reused
+void PRVM_FindIndex_FreeString(prvm_prog_t *prog, prvm_int_t num);
+/// called when the outermost QC function returns to the engine
+void PRVM_FindIndex_EndExecute(prvm_prog_t *prog);
+/// candidate edicts after start for find and findchain, sorted by number;
+/// the caller still has to check each one, returns -1 if the field is not
+/// indexed and the caller has to scan all edicts
+int PRVM_FindIndex_String(prvm_prog_t *prog, int field, const char *s, int start, const int **edicts);
+/// same for findfloat
+int PRVM_FindIndex_Float(prvm_prog_t *prog, int field, prvm_vec_t f, int start, const int **edicts);
+/// same for findflags
+int PRVM_FindIndex_Flags(prvm_prog_t *prog, int field, prvm_int_t mask, int start, const int **edicts);
+
+#endif
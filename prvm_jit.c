@@ -0,0 +1,912 @@
+// native code compiler for QuakeC functions
+//
+// functions that are called often are translated to x86-64 code, one native
+// block per statement, working directly on the globals and edict fields.
+// statements it does not handle (calls, returns, string ops, OP_STATE) are
+// left to the interpreter: native code returns to it at that statement and
+// the interpreter enters native code again at the next one (OP_JIT).  any
+// check that would print a warning or an error also returns to the
+// interpreter, which then executes the statement itself.
+
+#include "quakedef.h"
+#include "progsvm.h"
+#include "prvm_jit.h"
+
+#if defined(PRVM_64) && (defined(__x86_64__) || defined(_M_X64))
+#define PRVM_JIT_X64 1
+#endif
+
+#ifdef PRVM_JIT_X64
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+cvar_t prvm_jit = {0, "prvm_jit", "0", "compiles frequently called QuakeC functions to native code (x86-64 only), not used while statement profiling or statement coverage is on"};
+cvar_t prvm_jit_threshold = {0, "prvm_jit_threshold", "100", "how many calls a QuakeC function needs before prvm_jit compiles it"};
+
+extern qboolean prvm_runawaycheck;
+
+// passed to the native code in a register, the layout is used by the emitter
+typedef struct prvm_jitstate_s
+{
+	prvm_vec_t *globals;
+	prvm_vec_t *edictsfields;
+	prvm_uint_t entityfields;
+	prvm_uint_t entityfields_3;
+	prvm_uint_t max_edicts;
+	prvm_uint_t entityfieldsarea_entityfields;
+	prvm_uint_t entityfieldsarea_entityfields_3;
+	prvm_vec_t one;
+	// in: jumps allowed before returning, out: jumps left
+	prvm_int_t jumpbudget;
+	// out: statements executed
+	prvm_int_t statements;
+	// in: native code to start at
+	void *entry;
+	// prog->trackfields and prog->touchededicts
+	unsigned char *trackfields;
+	unsigned char *touchededicts;
+}
+prvm_jitstate_t;
+
+typedef struct prvm_jitfunction_s
+{
+	// calls counted towards prvm_jit_threshold
+	int calls;
+	// 1 when native code exists, -1 if the function is not worth compiling
+	int compiled;
+	int numstatements;
+	int numnative;
+	size_t codesize;
+	void *code;
+	// native code of each statement of the function, NULL if not handled
+	void **entries;
+	// times native code was entered and statements it executed
+	double runs;
+	double nativestatements;
+}
+prvm_jitfunction_t;
+
+typedef struct prvm_jit_s
+{
+	prvm_jitfunction_t *functions;
+	// true for statements that start a function
+	unsigned char *functionstart;
+}
+prvm_jit_t;
+
+// functions with fewer native statements than this stay interpreted
+#define PRVM_JIT_MINSTATEMENTS 4
+
+#ifdef PRVM_JIT_X64
+
+typedef int (*prvm_jitcode_t)(prvm_jitstate_t *state);
+
+typedef struct prvm_jitfixup_s
+{
+	// position of a rel32 to patch
+	int pos;
+	// statement to jump to, or value to return (exit fixups)
+	int value;
+}
+prvm_jitfixup_t;
+
+typedef struct prvm_jitemit_s
+{
+	unsigned char *code;
+	int size;
+	int maxsize;
+	int epilogue;
+	// jumps to the native code of a statement
+	prvm_jitfixup_t *jumps;
+	int numjumps;
+	int maxjumps;
+	// jumps to a stub returning to the interpreter
+	prvm_jitfixup_t *exits;
+	int numexits;
+	int maxexits;
+	// something did not fit, nothing more is written and the function is
+	// left to the interpreter
+	qboolean overflow;
+}
+prvm_jitemit_t;
+
+// registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+// rbx = globals, r12 = edictsfields, r13 = statements executed,
+// r14 = prvm_jitstate_t, r15 = jump budget
+
+#define STATE(field) ((int)offsetof(prvm_jitstate_t, field))
+
+static qboolean JIT_Room(prvm_jitemit_t *e, int n)
+{
+	if (e->size + n > e->maxsize)
+		e->overflow = true;
+	return !e->overflow;
+}
+
+static void JIT_Byte(prvm_jitemit_t *e, int b)
+{
+	if (!JIT_Room(e, 1))
+		return;
+	e->code[e->size++] = (unsigned char)b;
+}
+
+static void JIT_Bytes(prvm_jitemit_t *e, int n, const unsigned char *b)
+{
+	if (!JIT_Room(e, n))
+		return;
+	memcpy(e->code + e->size, b, n);
+	e->size += n;
+}
+
+static void JIT_Int32(prvm_jitemit_t *e, int v)
+{
+	if (!JIT_Room(e, 4))
+		return;
+	e->code[e->size++] = (unsigned char)(v);
+	e->code[e->size++] = (unsigned char)(v >> 8);
+	e->code[e->size++] = (unsigned char)(v >> 16);
+	e->code[e->size++] = (unsigned char)(v >> 24);
+}
+
+#define JIT_EMIT(e, ...) do { static const unsigned char b_[] = { __VA_ARGS__ }; JIT_Bytes(e, sizeof(b_), b_); } while (0)
+
+// modrm and displacement for [rbx + global * 8]
+static void JIT_Global(prvm_jitemit_t *e, int reg, int global)
+{
+	JIT_Byte(e, 0x80 | (reg << 3) | 3);
+	JIT_Int32(e, global * (int)sizeof(prvm_vec_t));
+}
+
+// modrm and displacement for [r14 + offset] (needs REX.B)
+static void JIT_State(prvm_jitemit_t *e, int reg, int offset)
+{
+	JIT_Byte(e, 0x40 | (reg << 3) | 6);
+	JIT_Byte(e, offset);
+}
+
+// mov reg, [global]
+static void JIT_LoadInt(prvm_jitemit_t *e, int reg, int global)
+{
+	JIT_EMIT(e, 0x48, 0x8B);
+	JIT_Global(e, reg, global);
+}
+
+// mov [global], reg
+static void JIT_StoreInt(prvm_jitemit_t *e, int reg, int global)
+{
+	JIT_EMIT(e, 0x48, 0x89);
+	JIT_Global(e, reg, global);
+}
+
+// movsd xmm, [global]
+static void JIT_LoadFloat(prvm_jitemit_t *e, int xmm, int global)
+{
+	JIT_EMIT(e, 0xF2, 0x0F, 0x10);
+	JIT_Global(e, xmm, global);
+}
+
+// movsd [global], xmm
+static void JIT_StoreFloat(prvm_jitemit_t *e, int xmm, int global)
+{
+	JIT_EMIT(e, 0xF2, 0x0F, 0x11);
+	JIT_Global(e, xmm, global);
+}
+
+// addsd (0x58), mulsd (0x59), subsd (0x5C), divsd (0x5E) xmm, [global]
+static void JIT_FloatOp(prvm_jitemit_t *e, int op, int xmm, int global)
+{
+	JIT_EMIT(e, 0xF2, 0x0F);
+	JIT_Byte(e, op);
+	JIT_Global(e, xmm, global);
+}
+
+// same as JIT_FloatOp with a register source
+static void JIT_FloatOpReg(prvm_jitemit_t *e, int op, int xmm, int xmmsrc)
+{
+	JIT_EMIT(e, 0xF2, 0x0F);
+	JIT_Byte(e, op);
+	JIT_Byte(e, 0xC0 | (xmm << 3) | xmmsrc);
+}
+
+// cmpsd xmm, [global], predicate (0 = eq, 1 = lt, 2 = le, 4 = neq)
+static void JIT_CompareFloat(prvm_jitemit_t *e, int xmm, int global, int predicate)
+{
+	JIT_EMIT(e, 0xF2, 0x0F, 0xC2);
+	JIT_Global(e, xmm, global);
+	JIT_Byte(e, predicate);
+}
+
+// turns the compare mask in xmm0 into 1.0 or 0.0 and stores it
+static void JIT_StoreMask(prvm_jitemit_t *e, int global)
+{
+	// movsd xmm1, [r14 + one]; andpd xmm0, xmm1
+	JIT_EMIT(e, 0xF2, 0x41, 0x0F, 0x10);
+	JIT_State(e, 1, STATE(one));
+	JIT_EMIT(e, 0x66, 0x0F, 0x54, 0xC1);
+	JIT_StoreFloat(e, 0, global);
+}
+
+// stores the condition code (0x94 = e, 0x95 = ne) as 1.0 or 0.0
+static void JIT_StoreCondition(prvm_jitemit_t *e, int setcc, int global)
+{
+	// setcc al; movzx eax, al; cvtsi2sd xmm0, eax
+	JIT_EMIT(e, 0x0F);
+	JIT_Byte(e, setcc);
+	JIT_EMIT(e, 0xC0, 0x0F, 0xB6, 0xC0, 0xF2, 0x0F, 0x2A, 0xC0);
+	JIT_StoreFloat(e, 0, global);
+}
+
+// inc r13
+static void JIT_CountStatement(prvm_jitemit_t *e)
+{
+	JIT_EMIT(e, 0x49, 0xFF, 0xC5);
+}
+
+// jcc rel32 (0x82 = b, 0x83 = ae, 0x84 = e, 0x85 = ne, 0x87 = a) to a stub that returns
+// value to the interpreter
+static void JIT_ExitIf(prvm_jitemit_t *e, int jcc, int value)
+{
+	JIT_EMIT(e, 0x0F);
+	JIT_Byte(e, jcc);
+	if (e->numexits >= e->maxexits)
+		e->overflow = true;
+	if (e->overflow)
+		return;
+	e->exits[e->numexits].pos = e->size;
+	e->exits[e->numexits++].value = value;
+	JIT_Int32(e, 0);
+}
+
+// mov eax, value; jmp epilogue
+static void JIT_Exit(prvm_jitemit_t *e, int value)
+{
+	JIT_Byte(e, 0xB8);
+	JIT_Int32(e, value);
+	JIT_Byte(e, 0xE9);
+	JIT_Int32(e, e->epilogue - (e->size + 4));
+}
+
+// taken jump from a statement to target, counted against the jump budget
+static void JIT_Jump(prvm_jitemit_t *e, int target, int first, int end)
+{
+	// dec r15; jz exit
+	JIT_EMIT(e, 0x49, 0xFF, 0xCF);
+	JIT_ExitIf(e, 0x84, target);
+	if (target < first || target >= end)
+	{
+		JIT_Exit(e, target);
+		return;
+	}
+	// jmp target
+	JIT_Byte(e, 0xE9);
+	if (e->numjumps >= e->maxjumps)
+		e->overflow = true;
+	if (e->overflow)
+		return;
+	e->jumps[e->numjumps].pos = e->size;
+	e->jumps[e->numjumps++].value = target;
+	JIT_Int32(e, 0);
+}
+
+// checks OPA (edict) and OPB (field) like the interpreter, and leaves the
+// index into edictsfields in rax
+static void JIT_FieldIndex(prvm_jitemit_t *e, mstatement_t *st, int statement, int vector)
+{
+	// mov rax, [a]; cmp rax, [r14 + max_edicts]; jae exit
+	JIT_LoadInt(e, RAX, st->operand[0]);
+	JIT_EMIT(e, 0x49, 0x3B);
+	JIT_State(e, RAX, STATE(max_edicts));
+	JIT_ExitIf(e, 0x83, statement);
+	// mov rcx, [b]; cmp rcx, [r14 + entityfields]; jae exit
+	// or for vectors cmp rcx, [r14 + entityfields_3]; ja exit
+	JIT_LoadInt(e, RCX, st->operand[1]);
+	JIT_EMIT(e, 0x49, 0x3B);
+	JIT_State(e, RCX, vector ? STATE(entityfields_3) : STATE(entityfields));
+	JIT_ExitIf(e, vector ? 0x87 : 0x83, statement);
+	// imul rax, [r14 + entityfields]; add rax, rcx
+	JIT_EMIT(e, 0x49, 0x0F, 0xAF);
+	JIT_State(e, RAX, STATE(entityfields));
+	JIT_EMIT(e, 0x48, 0x01, 0xC8);
+}
+
+// checks the pointer in OPB like the interpreter (any write to world or out
+// of bounds goes back to it) and leaves it in rax
+static void JIT_Pointer(prvm_jitemit_t *e, mstatement_t *st, int statement, int vector)
+{
+	// mov rax, [b]; mov rcx, rax; sub rcx, [r14 + entityfields]
+	JIT_LoadInt(e, RAX, st->operand[1]);
+	JIT_EMIT(e, 0x48, 0x89, 0xC1, 0x49, 0x2B);
+	JIT_State(e, RCX, STATE(entityfields));
+	// cmp rcx, [r14 + entityfieldsarea_entityfields]; jae exit
+	// or for vectors cmp rcx, [r14 + entityfieldsarea_entityfields_3]; ja exit
+	JIT_EMIT(e, 0x49, 0x3B);
+	JIT_State(e, RCX, vector ? STATE(entityfieldsarea_entityfields_3) : STATE(entityfieldsarea_entityfields));
+	JIT_ExitIf(e, vector ? 0x87 : 0x83, statement);
+}
+
+static qboolean PRVM_JIT_Supported(int op)
+{
+	switch (op)
+	{
+	case OP_ADD_F: case OP_SUB_F: case OP_MUL_F: case OP_DIV_F:
+	case OP_ADD_V: case OP_SUB_V: case OP_MUL_V: case OP_MUL_FV: case OP_MUL_VF:
+	case OP_BITAND: case OP_BITOR:
+	case OP_EQ_F: case OP_NE_F: case OP_LE: case OP_GE: case OP_LT: case OP_GT:
+	case OP_EQ_V: case OP_NE_V:
+	case OP_EQ_E: case OP_NE_E: case OP_EQ_FNC: case OP_NE_FNC:
+	case OP_NOT_F: case OP_NOT_V: case OP_NOT_ENT: case OP_NOT_FNC:
+	case OP_AND: case OP_OR:
+	case OP_STORE_F: case OP_STORE_ENT: case OP_STORE_FLD: case OP_STORE_S: case OP_STORE_FNC: case OP_STORE_V:
+	case OP_LOAD_F: case OP_LOAD_FLD: case OP_LOAD_ENT: case OP_LOAD_S: case OP_LOAD_FNC: case OP_LOAD_V:
+	case OP_ADDRESS:
+	case OP_STOREP_F: case OP_STOREP_ENT: case OP_STOREP_FLD: case OP_STOREP_S: case OP_STOREP_FNC: case OP_STOREP_V:
+	case OP_IF: case OP_IFNOT: case OP_GOTO:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// emits the native code of one statement
+static void PRVM_JIT_EmitStatement(prvm_jitemit_t *e, mstatement_t *st, int statement, int first, int end)
+{
+	int a = st->operand[0], b = st->operand[1], c = st->operand[2], i, skip;
+	switch (st->op)
+	{
+	case OP_ADD_F:
+	case OP_SUB_F:
+	case OP_MUL_F:
+		JIT_LoadFloat(e, 0, a);
+		JIT_FloatOp(e, st->op == OP_ADD_F ? 0x58 : st->op == OP_SUB_F ? 0x5C : 0x59, 0, b);
+		JIT_StoreFloat(e, 0, c);
+		break;
+	case OP_DIV_F:
+		// division by zero warns in the interpreter
+		// movsd xmm1, [b]; xorpd xmm2, xmm2; ucomisd xmm1, xmm2; jp over (nan); je exit
+		JIT_LoadFloat(e, 1, b);
+		JIT_EMIT(e, 0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xCA, 0x7A, 0x06);
+		JIT_ExitIf(e, 0x84, statement);
+		JIT_LoadFloat(e, 0, a);
+		JIT_FloatOpReg(e, 0x5E, 0, 1);
+		JIT_StoreFloat(e, 0, c);
+		break;
+	case OP_ADD_V:
+	case OP_SUB_V:
+		for (i = 0;i < 3;i++)
+		{
+			JIT_LoadFloat(e, 0, a + i);
+			JIT_FloatOp(e, st->op == OP_ADD_V ? 0x58 : 0x5C, 0, b + i);
+			JIT_StoreFloat(e, 0, c + i);
+		}
+		break;
+	case OP_MUL_V:
+		JIT_LoadFloat(e, 0, a);
+		JIT_FloatOp(e, 0x59, 0, b);
+		for (i = 1;i < 3;i++)
+		{
+			JIT_LoadFloat(e, 1, a + i);
+			JIT_FloatOp(e, 0x59, 1, b + i);
+			JIT_FloatOpReg(e, 0x58, 0, 1);
+		}
+		JIT_StoreFloat(e, 0, c);
+		break;
+	case OP_MUL_FV:
+	case OP_MUL_VF:
+		JIT_LoadFloat(e, 2, st->op == OP_MUL_FV ? a : b);
+		for (i = 0;i < 3;i++)
+		{
+			JIT_LoadFloat(e, 0, (st->op == OP_MUL_FV ? b : a) + i);
+			JIT_FloatOpReg(e, 0x59, 0, 2);
+			JIT_StoreFloat(e, 0, c + i);
+		}
+		break;
+	case OP_BITAND:
+	case OP_BITOR:
+		// cvttsd2si rax, [a]; cvttsd2si rcx, [b]; and/or rax, rcx; cvtsi2sd xmm0, rax
+		JIT_EMIT(e, 0xF2, 0x48, 0x0F, 0x2C);
+		JIT_Global(e, RAX, a);
+		JIT_EMIT(e, 0xF2, 0x48, 0x0F, 0x2C);
+		JIT_Global(e, RCX, b);
+		if (st->op == OP_BITAND)
+			JIT_EMIT(e, 0x48, 0x21, 0xC8);
+		else
+			JIT_EMIT(e, 0x48, 0x09, 0xC8);
+		JIT_EMIT(e, 0xF2, 0x48, 0x0F, 0x2A, 0xC0);
+		JIT_StoreFloat(e, 0, c);
+		break;
+	case OP_EQ_F:
+	case OP_NE_F:
+	case OP_LT:
+	case OP_LE:
+		JIT_LoadFloat(e, 0, a);
+		JIT_CompareFloat(e, 0, b, st->op == OP_EQ_F ? 0 : st->op == OP_NE_F ? 4 : st->op == OP_LT ? 1 : 2);
+		JIT_StoreMask(e, c);
+		break;
+	case OP_GT:
+	case OP_GE:
+		// a > b is b < a
+		JIT_LoadFloat(e, 0, b);
+		JIT_CompareFloat(e, 0, a, st->op == OP_GT ? 1 : 2);
+		JIT_StoreMask(e, c);
+		break;
+	case OP_EQ_V:
+	case OP_NE_V:
+		JIT_LoadFloat(e, 0, a);
+		JIT_CompareFloat(e, 0, b, st->op == OP_EQ_V ? 0 : 4);
+		for (i = 1;i < 3;i++)
+		{
+			JIT_LoadFloat(e, 1, a + i);
+			JIT_CompareFloat(e, 1, b + i, st->op == OP_EQ_V ? 0 : 4);
+			// andpd or orpd xmm0, xmm1
+			if (st->op == OP_EQ_V)
+				JIT_EMIT(e, 0x66, 0x0F, 0x54, 0xC1);
+			else
+				JIT_EMIT(e, 0x66, 0x0F, 0x56, 0xC1);
+		}
+		JIT_StoreMask(e, c);
+		break;
+	case OP_EQ_E:
+	case OP_NE_E:
+	case OP_EQ_FNC:
+	case OP_NE_FNC:
+		// mov rax, [a]; cmp rax, [b]
+		JIT_LoadInt(e, RAX, a);
+		JIT_EMIT(e, 0x48, 0x3B);
+		JIT_Global(e, RAX, b);
+		JIT_StoreCondition(e, (st->op == OP_EQ_E || st->op == OP_EQ_FNC) ? 0x94 : 0x95, c);
+		break;
+	case OP_NOT_F:
+		// mov rax, [a]; shl rax, 1 (FLOAT_IS_TRUE_FOR_INT)
+		JIT_LoadInt(e, RAX, a);
+		JIT_EMIT(e, 0x48, 0xD1, 0xE0);
+		JIT_StoreCondition(e, 0x94, c);
+		break;
+	case OP_NOT_ENT:
+	case OP_NOT_FNC:
+		// mov rax, [a]; test rax, rax
+		JIT_LoadInt(e, RAX, a);
+		JIT_EMIT(e, 0x48, 0x85, 0xC0);
+		JIT_StoreCondition(e, 0x94, c);
+		break;
+	case OP_NOT_V:
+		// xorpd xmm2, xmm2, then each component cmpeqsd with it
+		JIT_EMIT(e, 0x66, 0x0F, 0x57, 0xD2);
+		JIT_LoadFloat(e, 0, a);
+		JIT_EMIT(e, 0xF2, 0x0F, 0xC2, 0xC2, 0x00);
+		for (i = 1;i < 3;i++)
+		{
+			JIT_LoadFloat(e, 1, a + i);
+			JIT_EMIT(e, 0xF2, 0x0F, 0xC2, 0xCA, 0x00, 0x66, 0x0F, 0x54, 0xC1);
+		}
+		JIT_StoreMask(e, c);
+		break;
+	case OP_AND:
+	case OP_OR:
+		// mov rax, [a]; shl rax, 1; setnz dl; mov rax, [b]; shl rax, 1
+		JIT_LoadInt(e, RAX, a);
+		JIT_EMIT(e, 0x48, 0xD1, 0xE0, 0x0F, 0x95, 0xC2);
+		JIT_LoadInt(e, RAX, b);
+		JIT_EMIT(e, 0x48, 0xD1, 0xE0);
+		// setnz al; and/or al, dl; test al, al
+		JIT_EMIT(e, 0x0F, 0x95, 0xC0);
+		if (st->op == OP_AND)
+			JIT_EMIT(e, 0x20, 0xD0);
+		else
+			JIT_EMIT(e, 0x08, 0xD0);
+		JIT_EMIT(e, 0x84, 0xC0);
+		JIT_StoreCondition(e, 0x95, c);
+		break;
+	case OP_STORE_F:
+	case OP_STORE_ENT:
+	case OP_STORE_FLD:
+	case OP_STORE_S:
+	case OP_STORE_FNC:
+		JIT_LoadInt(e, RAX, a);
+		JIT_StoreInt(e, RAX, b);
+		break;
+	case OP_STORE_V:
+		for (i = 0;i < 3;i++)
+		{
+			JIT_LoadInt(e, RAX, a + i);
+			JIT_StoreInt(e, RAX, b + i);
+		}
+		break;
+	case OP_LOAD_F:
+	case OP_LOAD_FLD:
+	case OP_LOAD_ENT:
+	case OP_LOAD_S:
+	case OP_LOAD_FNC:
+		// mov rdx, [r12 + rax * 8]
+		JIT_FieldIndex(e, st, statement, false);
+		JIT_EMIT(e, 0x49, 0x8B, 0x14, 0xC4);
+		JIT_StoreInt(e, RDX, c);
+		break;
+	case OP_LOAD_V:
+		// mov rdx, [r12 + rax * 8 + i * 8]
+		JIT_FieldIndex(e, st, statement, true);
+		JIT_EMIT(e, 0x49, 0x8B, 0x14, 0xC4);
+		JIT_StoreInt(e, RDX, c);
+		JIT_EMIT(e, 0x49, 0x8B, 0x54, 0xC4, 0x08);
+		JIT_StoreInt(e, RDX, c + 1);
+		JIT_EMIT(e, 0x49, 0x8B, 0x54, 0xC4, 0x10);
+		JIT_StoreInt(e, RDX, c + 2);
+		break;
+	case OP_ADDRESS:
+		JIT_FieldIndex(e, st, statement, false);
+		// the interpreter marks edicts dirty for the find index, the other
+		// tracked fields only need the edict flagged
+		// mov rdx, [r14 + trackfields]; movzx edx, byte [rdx + rcx]
+		JIT_EMIT(e, 0x49, 0x8B);
+		JIT_State(e, RDX, STATE(trackfields));
+		JIT_EMIT(e, 0x0F, 0xB6, 0x14, 0x0A);
+		// test dl, PRVM_TRACK_FINDINDEX; jnz exit
+		JIT_EMIT(e, 0xF6, 0xC2, PRVM_TRACK_FINDINDEX);
+		JIT_ExitIf(e, 0x85, statement);
+		// test dl, dl; jz skip
+		JIT_EMIT(e, 0x84, 0xD2, 0x74, 0x00);
+		skip = e->size;
+		// mov rdx, [r14 + touchededicts]; mov rcx, [a]; mov byte [rdx + rcx], 1
+		JIT_EMIT(e, 0x49, 0x8B);
+		JIT_State(e, RDX, STATE(touchededicts));
+		JIT_LoadInt(e, RCX, a);
+		JIT_EMIT(e, 0xC6, 0x04, 0x0A, 0x01);
+		e->code[skip - 1] = (unsigned char)(e->size - skip);
+		JIT_StoreInt(e, RAX, c);
+		break;
+	case OP_STOREP_F:
+	case OP_STOREP_ENT:
+	case OP_STOREP_FLD:
+	case OP_STOREP_S:
+	case OP_STOREP_FNC:
+		// mov rdx, [a]; mov [r12 + rax * 8], rdx
+		JIT_Pointer(e, st, statement, false);
+		JIT_LoadInt(e, RDX, a);
+		JIT_EMIT(e, 0x49, 0x89, 0x14, 0xC4);
+		break;
+	case OP_STOREP_V:
+		JIT_Pointer(e, st, statement, true);
+		JIT_LoadInt(e, RDX, a);
+		JIT_EMIT(e, 0x49, 0x89, 0x14, 0xC4);
+		JIT_LoadInt(e, RDX, a + 1);
+		JIT_EMIT(e, 0x49, 0x89, 0x54, 0xC4, 0x08);
+		JIT_LoadInt(e, RDX, a + 2);
+		JIT_EMIT(e, 0x49, 0x89, 0x54, 0xC4, 0x10);
+		break;
+	case OP_IF:
+	case OP_IFNOT:
+		JIT_CountStatement(e);
+		// mov rax, [a]; shl rax, 1; jz/jnz over the jump
+		JIT_LoadInt(e, RAX, a);
+		JIT_EMIT(e, 0x48, 0xD1, 0xE0);
+		JIT_Byte(e, st->op == OP_IF ? 0x74 : 0x75);
+		JIT_Byte(e, 0);
+		i = e->size;
+		JIT_Jump(e, st->jumpabsolute, first, end);
+		e->code[i - 1] = (unsigned char)(e->size - i);
+		return;
+	case OP_GOTO:
+		JIT_CountStatement(e);
+		JIT_Jump(e, st->jumpabsolute, first, end);
+		return;
+	default:
+		// PRVM_JIT_Supported returned false
+		JIT_Exit(e, statement);
+		return;
+	}
+	JIT_CountStatement(e);
+}
+
+static void *PRVM_JIT_AllocCode(size_t size)
+{
+#ifdef WIN32
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static qboolean PRVM_JIT_ProtectCode(void *code, size_t size)
+{
+#ifdef WIN32
+	DWORD old;
+	return VirtualProtect(code, size, PAGE_EXECUTE_READ, &old) != 0;
+#else
+	return mprotect(code, size, PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void PRVM_JIT_FreeCode(void *code, size_t size)
+{
+#ifdef WIN32
+	VirtualFree(code, 0, MEM_RELEASE);
+#else
+	munmap(code, size);
+#endif
+}
+
+static void PRVM_JIT_Compile(prvm_prog_t *prog, mfunction_t *f)
+{
+	prvm_jit_t *jit = (prvm_jit_t *)prog->jit;
+	prvm_jitfunction_t *j = jit->functions + (f - prog->functions);
+	prvm_jitemit_t e;
+	mstatement_t *st;
+	int first = f->first_statement, end, i, numnative = 0, *offsets;
+	size_t codesize;
+
+	j->compiled = -1;
+	for (end = first + 1;end < prog->numstatements && !jit->functionstart[end];end++)
+		;
+	for (i = first;i < end;i++)
+		if (PRVM_JIT_Supported(prog->statements[i].op))
+			numnative++;
+	if (numnative < PRVM_JIT_MINSTATEMENTS)
+		return;
+
+	// no statement should need more than 160 bytes or more than three exits,
+	// the emitter stops at the end of the buffers anyway
+	memset(&e, 0, sizeof(e));
+	e.maxsize = 256 + (end - first) * 160;
+	e.maxjumps = end - first;
+	e.maxexits = (end - first) * 3;
+	e.code = (unsigned char *)Mem_Alloc(tempmempool, e.maxsize);
+	e.jumps = (prvm_jitfixup_t *)Mem_Alloc(tempmempool, e.maxjumps * sizeof(*e.jumps));
+	e.exits = (prvm_jitfixup_t *)Mem_Alloc(tempmempool, e.maxexits * sizeof(*e.exits));
+	offsets = (int *)Mem_Alloc(tempmempool, (end - first) * sizeof(*offsets));
+
+	// prologue: push rbx, r12-r15 and load the registers from the state
+	JIT_EMIT(&e, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+#ifdef WIN32
+	JIT_EMIT(&e, 0x49, 0x89, 0xCE); // mov r14, rcx
+#else
+	JIT_EMIT(&e, 0x49, 0x89, 0xFE); // mov r14, rdi
+#endif
+	JIT_EMIT(&e, 0x49, 0x8B); // mov rbx, [r14 + globals]
+	JIT_State(&e, 3, STATE(globals));
+	JIT_EMIT(&e, 0x4D, 0x8B); // mov r12, [r14 + edictsfields]
+	JIT_State(&e, 4, STATE(edictsfields));
+	JIT_EMIT(&e, 0x45, 0x31, 0xED); // xor r13d, r13d
+	JIT_EMIT(&e, 0x4D, 0x8B); // mov r15, [r14 + jumpbudget]
+	JIT_State(&e, 7, STATE(jumpbudget));
+	JIT_EMIT(&e, 0x41, 0xFF); // jmp [r14 + entry]
+	JIT_State(&e, 4, STATE(entry));
+
+	// epilogue: eax is the statement to continue at
+	e.epilogue = e.size;
+	JIT_EMIT(&e, 0x4D, 0x89); // mov [r14 + statements], r13
+	JIT_State(&e, 5, STATE(statements));
+	JIT_EMIT(&e, 0x4D, 0x89); // mov [r14 + jumpbudget], r15
+	JIT_State(&e, 7, STATE(jumpbudget));
+	JIT_EMIT(&e, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+
+	for (i = first, st = prog->statements + first;i < end && !e.overflow;i++, st++)
+	{
+		offsets[i - first] = e.size;
+		if (PRVM_JIT_Supported(st->op))
+			PRVM_JIT_EmitStatement(&e, st, i, first, end);
+		else
+			JIT_Exit(&e, i);
+	}
+	// falling off the end of the function
+	JIT_Exit(&e, end);
+
+	if (!e.overflow)
+	{
+		for (i = 0;i < e.numjumps;i++)
+			*(int *)(e.code + e.jumps[i].pos) = offsets[e.jumps[i].value - first] - (e.jumps[i].pos + 4);
+		// the stubs go after the code, each takes 10 bytes
+		if (JIT_Room(&e, e.numexits * 10))
+		{
+			for (i = 0;i < e.numexits;i++)
+			{
+				*(int *)(e.code + e.exits[i].pos) = e.size - (e.exits[i].pos + 4);
+				JIT_Exit(&e, e.exits[i].value);
+			}
+		}
+	}
+	if (e.overflow)
+	{
+		Con_DPrintf("PRVM_JIT_Compile: %s is too large to compile\n", PRVM_GetString(prog, f->s_name));
+		Mem_Free(offsets);
+		Mem_Free(e.exits);
+		Mem_Free(e.jumps);
+		Mem_Free(e.code);
+		return;
+	}
+
+	codesize = e.size;
+	j->code = PRVM_JIT_AllocCode(codesize);
+	if (j->code)
+	{
+		memcpy(j->code, e.code, codesize);
+		if (PRVM_JIT_ProtectCode(j->code, codesize))
+		{
+			j->compiled = 1;
+			j->codesize = codesize;
+			j->numstatements = end - first;
+			j->numnative = numnative;
+			j->entries = (void **)Mem_Alloc(prog->progs_mempool, (end - first) * sizeof(void *));
+			for (i = first, st = prog->statements + first;i < end;i++, st++)
+			{
+				if (!PRVM_JIT_Supported(st->op))
+					continue;
+				j->entries[i - first] = (unsigned char *)j->code + offsets[i - first];
+				st->execop = OP_JIT;
+			}
+		}
+		else
+		{
+			PRVM_JIT_FreeCode(j->code, codesize);
+			j->code = NULL;
+		}
+	}
+	if (!j->code)
+		Con_Printf("PRVM_JIT_Compile: could not allocate executable memory\n");
+
+	Mem_Free(offsets);
+	Mem_Free(e.exits);
+	Mem_Free(e.jumps);
+	Mem_Free(e.code);
+}
+
+int PRVM_JIT_Run(prvm_prog_t *prog, int statement, int *jumpcount)
+{
+	prvm_jit_t *jit = (prvm_jit_t *)prog->jit;
+	mfunction_t *f = prog->xfunction;
+	prvm_jitfunction_t *j;
+	prvm_jitstate_t state;
+	prvm_int_t jumpbudget;
+	prvm_jitcode_t code;
+
+	if (!jit || !f || f->first_statement < 0)
+		return statement;
+	j = jit->functions + (f - prog->functions);
+	if (j->compiled != 1 || statement < f->first_statement || statement >= f->first_statement + j->numstatements || !j->entries[statement - f->first_statement])
+		return statement;
+
+	if (prvm_runawaycheck && *jumpcount < 10000000)
+		jumpbudget = 10000000 - *jumpcount;
+	else
+		jumpbudget = (prvm_int_t)1 << 62;
+	state.globals = prog->globals.fp;
+	state.edictsfields = prog->edictsfields;
+	// same (unsigned int) values as the interpreter compares against
+	state.entityfields = (unsigned int)prog->entityfields;
+	state.entityfields_3 = (unsigned int)(prog->entityfields - 3);
+	state.max_edicts = (unsigned int)prog->max_edicts;
+	state.entityfieldsarea_entityfields = (unsigned int)(prog->entityfieldsarea - prog->entityfields);
+	state.entityfieldsarea_entityfields_3 = (unsigned int)(prog->entityfieldsarea - prog->entityfields - 3);
+	state.one = 1;
+	state.jumpbudget = jumpbudget;
+	state.statements = 0;
+	state.entry = j->entries[statement - f->first_statement];
+	state.trackfields = prog->trackfields;
+	state.touchededicts = prog->touchededicts;
+
+	code = (prvm_jitcode_t)j->code;
+	statement = code(&state);
+
+	*jumpcount += (int)(jumpbudget - state.jumpbudget);
+	f->profile += state.statements;
+	j->runs++;
+	j->nativestatements += state.statements;
+	return statement;
+}
+
+void PRVM_JIT_EnterFunction(prvm_prog_t *prog, mfunction_t *f)
+{
+	prvm_jit_t *jit = (prvm_jit_t *)prog->jit;
+	prvm_jitfunction_t *j;
+	int i;
+	if (!jit)
+	{
+		jit = (prvm_jit_t *)Mem_Alloc(prog->progs_mempool, sizeof(prvm_jit_t));
+		jit->functions = (prvm_jitfunction_t *)Mem_Alloc(prog->progs_mempool, prog->numfunctions * sizeof(prvm_jitfunction_t));
+		jit->functionstart = (unsigned char *)Mem_Alloc(prog->progs_mempool, prog->numstatements);
+		for (i = 0;i < prog->numfunctions;i++)
+			if (prog->functions[i].first_statement >= 0 && prog->functions[i].first_statement < prog->numstatements)
+				jit->functionstart[prog->functions[i].first_statement] = true;
+		prog->jit = jit;
+	}
+	j = jit->functions + (f - prog->functions);
+	if (!j->compiled && ++j->calls >= prvm_jit_threshold.integer)
+		PRVM_JIT_Compile(prog, f);
+}
+
+void PRVM_JIT_Free(prvm_prog_t *prog)
+{
+	prvm_jit_t *jit = (prvm_jit_t *)prog->jit;
+	int i;
+	if (!jit)
+		return;
+	for (i = 0;i < prog->numfunctions;i++)
+		if (jit->functions[i].code)
+			PRVM_JIT_FreeCode(jit->functions[i].code, jit->functions[i].codesize);
+	// the rest is in progs_mempool
+	prog->jit = NULL;
+}
+
+#else
+
+int PRVM_JIT_Run(prvm_prog_t *prog, int statement, int *jumpcount)
+{
+	return statement;
+}
+
+void PRVM_JIT_EnterFunction(prvm_prog_t *prog, mfunction_t *f)
+{
+}
+
+void PRVM_JIT_Free(prvm_prog_t *prog)
+{
+}
+
+#endif
+
+static int PRVM_JIT_SortFunctions(const void *pa, const void *pb)
+{
+	const prvm_jitfunction_t *a = *(const prvm_jitfunction_t **)pa;
+	const prvm_jitfunction_t *b = *(const prvm_jitfunction_t **)pb;
+	if (a->nativestatements != b->nativestatements)
+		return a->nativestatements < b->nativestatements ? 1 : -1;
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static void PRVM_JIT_Stats_f(void)
+{
+	prvm_prog_t *prog;
+	prvm_jit_t *jit;
+	prvm_jitfunction_t **sorted;
+	int i, num, howmany;
+	double nativestatements = 0;
+	size_t codesize = 0;
+
+	howmany = 1<<30;
+	if (Cmd_Argc() == 3)
+		howmany = atoi(Cmd_Argv(2));
+	else if (Cmd_Argc() != 2)
+	{
+		Con_Print("prvm_jitstats <program name> [howmany]\n");
+		return;
+	}
+	if (!(prog = PRVM_FriendlyProgFromString(Cmd_Argv(1))))
+		return;
+#ifndef PRVM_JIT_X64
+	Con_Print("prvm_jit is not supported on this platform\n");
+#endif
+	if (!(jit = (prvm_jit_t *)prog->jit))
+	{
+		Con_Printf("%s has no compiled functions\n", prog->name);
+		return;
+	}
+
+	sorted = (prvm_jitfunction_t **)Mem_Alloc(tempmempool, prog->numfunctions * sizeof(*sorted));
+	for (i = 0, num = 0;i < prog->numfunctions;i++)
+	{
+		if (jit->functions[i].compiled != 1)
+			continue;
+		sorted[num++] = jit->functions + i;
+		nativestatements += jit->functions[i].nativestatements;
+		codesize += jit->functions[i].codesize;
+	}
+	qsort(sorted, num, sizeof(*sorted), PRVM_JIT_SortFunctions);
+	Con_Printf("%s JIT: %i functions compiled to %i bytes, %.0f statements run natively\n", prog->name, num, (int)codesize, nativestatements);
+	Con_Print("[NativeStmt] [Entries] [Native/Total] [Bytes] function\n");
+	for (i = 0;i < num && i < howmany;i++)
+		Con_Printf("%12.0f %9.0f %6i/%-6i %7i %s\n", sorted[i]->nativestatements, sorted[i]->runs, sorted[i]->numnative, sorted[i]->numstatements, (int)sorted[i]->codesize, PRVM_GetString(prog, prog->functions[sorted[i] - jit->functions].s_name));
+	Mem_Free(sorted);
+}
+
+void PRVM_JIT_Init(void)
+{
+	Cvar_RegisterVariable(&prvm_jit);
+	Cvar_RegisterVariable(&prvm_jit_threshold);
+	Cmd_AddCommand("prvm_jitstats", PRVM_JIT_Stats_f, "prints which QuakeC functions prvm_jit compiled and how many statements they ran natively in the selected VM (server, client, menu)");
+}
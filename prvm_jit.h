@@ -0,0 +1,15 @@
+#ifndef PRVM_JIT_H
+#define PRVM_JIT_H
+
+extern cvar_t prvm_jit;
+
+void PRVM_JIT_Init(void);
+/// frees the native code of a progs, called when it is unloaded
+void PRVM_JIT_Free(prvm_prog_t *prog);
+/// counts calls to a function and compiles it once it is called often enough
+void PRVM_JIT_EnterFunction(prvm_prog_t *prog, mfunction_t *f);
+/// runs native code of prog->xfunction starting at statement, adds the taken
+/// jumps to jumpcount and returns the first statement it did not execute
+int PRVM_JIT_Run(prvm_prog_t *prog, int statement, int *jumpcount);
+
+#endif
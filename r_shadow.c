@@ -3,8 +3,16 @@
 #include "cl_collision.h"
 #include "portals.h"
 #include "image.h"
+#include "taskqueue.h"
+#ifdef SSE_PRESENT
+#include <xmmintrin.h>
+#endif
+#ifdef SSE2_PRESENT
+#include <emmintrin.h>
+#endif
 
 static void R_Shadow_EditLights_Init(void);
+static void R_Shadow_BounceGrid_FreePhotonBatches(void);
 
 typedef enum r_shadow_rendermode_e
 {
@@ -220,6 +228,7 @@ cvar_t r_shadow_bouncegrid_particleintensity = {CVAR_SAVE, "r_shadow_bouncegrid_
 cvar_t r_shadow_bouncegrid_rng_seed = { CVAR_SAVE, "r_shadow_bouncegrid_rng_seed", "0", "0+ = use this number as RNG seed, -1 = use time instead for disco-like craziness in dynamic mode" };
 cvar_t r_shadow_bouncegrid_rng_type = { CVAR_SAVE, "r_shadow_bouncegrid_rng_type", "0", "0 = Lehmer 128bit RNG (slow but high quality), 1 = lhcheeserand 32bit RNG (quick)" };
 cvar_t r_shadow_bouncegrid_sortlightpaths = {CVAR_SAVE, "r_shadow_bouncegrid_sortlightpaths", "1", "sort light paths before accumulating them into the bouncegrid texture, this reduces cpu cache misses"};
+cvar_t r_shadow_bouncegrid_threaded = {CVAR_SAVE, "r_shadow_bouncegrid_threaded", "1", "trace photons, accumulate light paths and blur the bouncegrid texture on the task queue threads (see taskqueue_maxthreads), results are identical to doing it on the main thread"};
 cvar_t r_shadow_bouncegrid_static = {CVAR_SAVE, "r_shadow_bouncegrid_static", "1", "use static radiosity solution (high quality) rather than dynamic (splotchy)"};
 cvar_t r_shadow_bouncegrid_static_bounceminimumintensity = { CVAR_SAVE, "r_shadow_bouncegrid_static_bounceminimumintensity", "0.01", "stop bouncing once intensity drops below this fraction of the original particle color" };
 cvar_t r_shadow_bouncegrid_static_directionalshading = {CVAR_SAVE, "r_shadow_bouncegrid_static_directionalshading", "1", "whether to use directionalshading when in static mode"};
@@ -496,6 +505,7 @@ static void r_shadow_shutdown(void)
 	if (r_shadow_bouncegrid_state.fp16pixels) Mem_Free(r_shadow_bouncegrid_state.fp16pixels); r_shadow_bouncegrid_state.fp16pixels = NULL;
 	if (r_shadow_bouncegrid_state.splatpaths) Mem_Free(r_shadow_bouncegrid_state.splatpaths); r_shadow_bouncegrid_state.splatpaths = NULL;
 	r_shadow_bouncegrid_state.maxsplatpaths = 0;
+	R_Shadow_BounceGrid_FreePhotonBatches();
 	memset(&r_shadow_bouncegrid_state, 0, sizeof(r_shadow_bouncegrid_state));
 	r_shadow_attenuationgradienttexture = NULL;
 	R_FreeTexturePool(&r_shadow_texturepool);
@@ -569,6 +579,7 @@ static void r_shadow_newmap(void)
 	if (r_shadow_bouncegrid_state.fp16pixels) Mem_Free(r_shadow_bouncegrid_state.fp16pixels); r_shadow_bouncegrid_state.fp16pixels = NULL;
 	if (r_shadow_bouncegrid_state.splatpaths) Mem_Free(r_shadow_bouncegrid_state.splatpaths); r_shadow_bouncegrid_state.splatpaths = NULL;
 	r_shadow_bouncegrid_state.maxsplatpaths = 0;
+	R_Shadow_BounceGrid_FreePhotonBatches();
 	if (r_shadow_bouncegrid_state.texture)    R_FreeTexture(r_shadow_bouncegrid_state.texture);r_shadow_bouncegrid_state.texture = NULL;
 	if (r_shadow_lightcorona)                 R_SkinFrame_MarkUsed(r_shadow_lightcorona);
 	if (r_editlights_sprcursor)               R_SkinFrame_MarkUsed(r_editlights_sprcursor);
@@ -668,6 +679,7 @@ void R_Shadow_Init(void)
 	Cvar_RegisterVariable(&r_shadow_bouncegrid_rng_seed);
 	Cvar_RegisterVariable(&r_shadow_bouncegrid_rng_type);
 	Cvar_RegisterVariable(&r_shadow_bouncegrid_sortlightpaths);
+	Cvar_RegisterVariable(&r_shadow_bouncegrid_threaded);
 	Cvar_RegisterVariable(&r_shadow_bouncegrid_static);
 	Cvar_RegisterVariable(&r_shadow_bouncegrid_static_bounceminimumintensity);
 	Cvar_RegisterVariable(&r_shadow_bouncegrid_static_directionalshading);
@@ -1676,7 +1688,52 @@ typedef struct r_shadow_bouncegrid_splatpath_s
 }
 r_shadow_bouncegrid_splatpath_t;
 
-static void R_Shadow_BounceGrid_AddSplatPath(vec3_t originalstart, vec3_t originalend, vec3_t color, vec_t distancetraveled)
+// photons of a light are traced in batches of this many, each batch is a task
+#define BOUNCEGRID_PHOTONBATCHSIZE 1024
+// the splatting, blurring and conversion are split into at most this many
+// tasks, each of them owns a range of Z layers of the texture
+#define BOUNCEGRID_MAXSLABS 64
+
+// a batch of photons shot from one light, it records its light paths and
+// statistics separately so that they can be merged in the same order
+// regardless of which thread ran it
+typedef struct r_shadow_bouncegrid_photonbatch_s
+{
+	taskqueue_task_t task;
+	rtlight_t *rtlight;
+	int numphotons;
+	vec3_t baseshotcolor;
+	vec_t radius;
+	float bounceminimumintensity2;
+	randomseed_t randomseed;
+	unsigned int seed;
+
+	// results
+	int numsplatpaths;
+	int maxsplatpaths;
+	r_shadow_bouncegrid_splatpath_t *splatpaths;
+	int traces;
+	int hits;
+	int bounces;
+	collision_cachestats_t cachestats;
+	vec_t effectiveradius;
+}
+r_shadow_bouncegrid_photonbatch_t;
+
+static void R_Shadow_BounceGrid_FreePhotonBatches(void)
+{
+	int i;
+	for (i = 0;i < r_shadow_bouncegrid_state.maxphotonbatches;i++)
+		if (r_shadow_bouncegrid_state.photonbatches[i].splatpaths)
+			Mem_Free(r_shadow_bouncegrid_state.photonbatches[i].splatpaths);
+	if (r_shadow_bouncegrid_state.photonbatches)
+		Mem_Free(r_shadow_bouncegrid_state.photonbatches);
+	r_shadow_bouncegrid_state.photonbatches = NULL;
+	r_shadow_bouncegrid_state.maxphotonbatches = 0;
+	r_shadow_bouncegrid_state.numphotonbatches = 0;
+}
+
+static void R_Shadow_BounceGrid_AddSplatPath(r_shadow_bouncegrid_photonbatch_t *batch, vec3_t originalstart, vec3_t originalend, vec3_t color, vec_t distancetraveled)
 {
 	int bestaxis;
 	int numsplats;
@@ -1723,15 +1780,15 @@ static void R_Shadow_BounceGrid_AddSplatPath(vec3_t originalstart, vec3_t origin
 	end[1] = (end[1] - r_shadow_bouncegrid_state.mins[1]) * r_shadow_bouncegrid_state.ispacing[1];
 	end[2] = (end[2] - r_shadow_bouncegrid_state.mins[2]) * r_shadow_bouncegrid_state.ispacing[2];
 
-	// check if we need to grow the splatpaths array
-	if (r_shadow_bouncegrid_state.maxsplatpaths <= r_shadow_bouncegrid_state.numsplatpaths)
+	// check if we need to grow the splatpaths array of this batch
+	if (batch->maxsplatpaths <= batch->numsplatpaths)
 	{
 		// double the limit, this will persist from frame to frame so we don't
 		// make the same mistake each time
-		r_shadow_bouncegrid_state.maxsplatpaths *= 2;
-		if (r_shadow_bouncegrid_state.maxsplatpaths < 16384)
-			r_shadow_bouncegrid_state.maxsplatpaths = 16384;
-		r_shadow_bouncegrid_state.splatpaths = (r_shadow_bouncegrid_splatpath_t *)Mem_Realloc(r_main_mempool, r_shadow_bouncegrid_state.splatpaths, sizeof(r_shadow_bouncegrid_splatpath_t) * r_shadow_bouncegrid_state.maxsplatpaths);
+		batch->maxsplatpaths *= 2;
+		if (batch->maxsplatpaths < 1024)
+			batch->maxsplatpaths = 1024;
+		batch->splatpaths = (r_shadow_bouncegrid_splatpath_t *)Mem_Realloc(r_main_mempool, batch->splatpaths, sizeof(r_shadow_bouncegrid_splatpath_t) * batch->maxsplatpaths);
 	}
 
 	// divide a series of splats along the length using the maximum axis
@@ -1751,7 +1808,7 @@ static void R_Shadow_BounceGrid_AddSplatPath(vec3_t originalstart, vec3_t origin
 	VectorSubtract(originalstart, originalend, originaldir);
 	VectorNormalize(originaldir);
 
-	path = r_shadow_bouncegrid_state.splatpaths + r_shadow_bouncegrid_state.numsplatpaths++;
+	path = batch->splatpaths + batch->numsplatpaths++;
 	VectorCopy(start, path->point);
 	VectorScale(diff, ilen, path->step);
 	VectorCopy(color, path->splatcolor);
@@ -1981,6 +2038,7 @@ static void R_Shadow_BounceGrid_UpdateSpacing(void)
 		if (r_shadow_bouncegrid_state.fp16pixels) Mem_Free(r_shadow_bouncegrid_state.fp16pixels); r_shadow_bouncegrid_state.fp16pixels = NULL;
 		if (r_shadow_bouncegrid_state.splatpaths) Mem_Free(r_shadow_bouncegrid_state.splatpaths); r_shadow_bouncegrid_state.splatpaths = NULL;
 		r_shadow_bouncegrid_state.maxsplatpaths = 0;
+		R_Shadow_BounceGrid_FreePhotonBatches();
 		r_shadow_bouncegrid_state.numpixels = numpixels;
 	}
 
@@ -2163,13 +2221,19 @@ static void R_Shadow_BounceGrid_ClearPixels(void)
 	memset(r_shadow_bouncegrid_state.highpixels, 0, r_shadow_bouncegrid_state.numpixels * sizeof(float[4]));
 }
 
-static void R_Shadow_BounceGrid_PerformSplats(void)
+// accumulates the light paths into the Z layers t->i[0] to t->i[1]-1 of the
+// texture, every task goes through all the paths in the same order so the
+// sums are the same as if a single thread did all of them
+static void R_Shadow_BounceGrid_PerformSplats_Task(taskqueue_task_t *t)
 {
 	r_shadow_bouncegrid_splatpath_t *splatpaths = r_shadow_bouncegrid_state.splatpaths;
 	r_shadow_bouncegrid_splatpath_t *splatpath;
 	float *highpixels = r_shadow_bouncegrid_state.highpixels;
 	int numsplatpaths = r_shadow_bouncegrid_state.numsplatpaths;
 	int splatindex;
+	int zfirst = (int)t->i[0];
+	int zlast = (int)t->i[1];
+	size_t numsplats = 0;
 	vec3_t steppos;
 	vec3_t stepdelta;
 	vec3_t dir;
@@ -2188,13 +2252,12 @@ static void R_Shadow_BounceGrid_PerformSplats(void)
 	// we use this a lot, so get a local copy
 	VectorCopy(r_shadow_bouncegrid_state.resolution, resolution);
 
-	// sort the splats before we execute them, to reduce cache misses
-	if (r_shadow_bouncegrid_sortlightpaths.integer)
-		qsort(splatpaths, numsplatpaths, sizeof(*splatpaths), R_Shadow_BounceGrid_SplatPathCompare);
-
 	splatpath = splatpaths;
 	for (splatindex = 0;splatindex < numsplatpaths;splatindex++, splatpath++)
 	{
+		// skip paths that can not reach our layers, point is the lowest end
+		if (splatpath->point[2] - MAXBOUNCEGRIDSPLATSIZE1 >= zlast || splatpath->point[2] + splatpath->step[2] * splatpath->remainingsplats + MAXBOUNCEGRIDSPLATSIZE1 < zfirst)
+			continue;
 		// calculate second order spherical harmonics values (average, slopeX, slopeY, slopeZ)
 		// accumulate average shotcolor
 		VectorCopy(splatpath->splatdir, dir);
@@ -2266,9 +2329,12 @@ static void R_Shadow_BounceGrid_PerformSplats(void)
 				float w;
 				float *p;
 				float colorscale = 1.0f / lightpathsize_current;
-				r_refdef.stats[r_stat_bouncegrid_splats]++;
+				// count each splat once, in the task that owns its first layer
+				zi = (int)floor(splatmins[2]);
+				if (zi >= zfirst && zi < zlast)
+					numsplats++;
 				// accumulate light onto the pixels
-				for (zi = (int)floor(splatmins[2]);zi < splatmaxs[2];zi++)
+				for (zi = max(zi, zfirst);zi < splatmaxs[2] && zi < zlast;zi++)
 				{
 					pixelpos[2] = zi + 0.5f;
 					for (yi = (int)floor(splatmins[1]); yi < splatmaxs[1]; yi++)
@@ -2303,21 +2369,75 @@ static void R_Shadow_BounceGrid_PerformSplats(void)
 			lightpathsize_current += lightpathsize_perstep;
 		}
 	}
+	t->i[2] = numsplats;
 }
 
-static void R_Shadow_BounceGrid_BlurPixelsInDirection(const float *inpixels, float *outpixels, int off)
+// decides whether the bouncegrid update may use the task queue threads
+static qboolean R_Shadow_BounceGrid_Threaded(void)
+{
+	return r_shadow_bouncegrid_threaded.integer && TaskQueue_NumThreads() > 0;
+}
+
+// runs func on slabs of Z layers of the texture, which it gets in i[0] and
+// i[1], p0, p1 and i3 are passed along and the i[2] results are summed up
+static size_t R_Shadow_BounceGrid_RunSlabTasks(void (*func)(taskqueue_task_t *), void *p0, void *p1, size_t i3)
+{
+	taskqueue_task_t tasks[BOUNCEGRID_MAXSLABS];
+	int resolution2 = r_shadow_bouncegrid_state.resolution[2];
+	int numslabs = 1;
+	int slab;
+	size_t total = 0;
+
+	if (R_Shadow_BounceGrid_Threaded())
+		numslabs = bound(1, (TaskQueue_NumThreads() + 1) * 2, min(resolution2, BOUNCEGRID_MAXSLABS));
+	for (slab = 0;slab < numslabs;slab++)
+	{
+		TaskQueue_Setup(&tasks[slab], NULL, func, resolution2 * slab / numslabs, resolution2 * (slab + 1) / numslabs, p0, p1);
+		tasks[slab].i[3] = i3;
+	}
+	if (numslabs > 1)
+		TaskQueue_RunTasks(numslabs, tasks);
+	else
+		func(&tasks[0]);
+	for (slab = 0;slab < numslabs;slab++)
+		total += tasks[slab].i[2];
+	return total;
+}
+
+static void R_Shadow_BounceGrid_PerformSplats(void)
 {
+	// sort the splats before we execute them, to reduce cache misses
+	if (r_shadow_bouncegrid_sortlightpaths.integer)
+		qsort(r_shadow_bouncegrid_state.splatpaths, r_shadow_bouncegrid_state.numsplatpaths, sizeof(*r_shadow_bouncegrid_state.splatpaths), R_Shadow_BounceGrid_SplatPathCompare);
+
+	r_refdef.stats[r_stat_bouncegrid_splats] += (int)R_Shadow_BounceGrid_RunSlabTasks(R_Shadow_BounceGrid_PerformSplats_Task, NULL, NULL, 0);
+}
+
+
+// blurs the Z layers t->i[0] to t->i[1]-1 of p[0] into p[1] along the pixel
+// offset i[3] (in floats)
+static void R_Shadow_BounceGrid_BlurPixelsInDirection_Task(taskqueue_task_t *t)
+{
+	const float *inpixels = (const float *)t->p[0];
+	float *outpixels = (float *)t->p[1];
+	int off = (int)t->i[3];
 	const float *inpixel;
 	float *outpixel;
 	int pixelbands = r_shadow_bouncegrid_state.pixelbands;
 	int pixelband;
 	unsigned int index;
 	unsigned int x, y, z;
+	unsigned int zfirst = (unsigned int)max(t->i[0], 1);
+	unsigned int zlast;
 	unsigned int resolution[3];
+#ifdef SSE_PRESENT
+	__m128 third = _mm_set1_ps(1.0f / 3.0f);
+#endif
 	VectorCopy(r_shadow_bouncegrid_state.resolution, resolution);
+	zlast = (unsigned int)min(t->i[1], resolution[2]-1);
 	for (pixelband = 0;pixelband < pixelbands;pixelband++)
 	{
-		for (z = 1;z < resolution[2]-1;z++)
+		for (z = zfirst;z < zlast;z++)
 		{
 			for (y = 1;y < resolution[1]-1;y++)
 			{
@@ -2327,16 +2447,25 @@ static void R_Shadow_BounceGrid_BlurPixelsInDirection(const float *inpixels, flo
 				outpixel = outpixels + 4*index;
 				for (;x < resolution[0]-1;x++, inpixel += 4, outpixel += 4)
 				{
+#ifdef SSE_PRESENT
+					_mm_storeu_ps(outpixel, _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_loadu_ps(inpixel), _mm_loadu_ps(inpixel + off)), _mm_loadu_ps(inpixel - off)), third));
+#else
 					outpixel[0] = (inpixel[0] + inpixel[  off] + inpixel[0-off]) * (1.0f / 3.0);
 					outpixel[1] = (inpixel[1] + inpixel[1+off] + inpixel[1-off]) * (1.0f / 3.0);
 					outpixel[2] = (inpixel[2] + inpixel[2+off] + inpixel[2-off]) * (1.0f / 3.0);
 					outpixel[3] = (inpixel[3] + inpixel[3+off] + inpixel[3-off]) * (1.0f / 3.0);
+#endif
 				}
 			}
 		}
 	}
 }
 
+static void R_Shadow_BounceGrid_BlurPixelsInDirection(const float *inpixels, float *outpixels, int off)
+{
+	R_Shadow_BounceGrid_RunSlabTasks(R_Shadow_BounceGrid_BlurPixelsInDirection_Task, (void *)inpixels, outpixels, off);
+}
+
 static void R_Shadow_BounceGrid_BlurPixels(void)
 {
 	float *pixels[4];
@@ -2364,14 +2493,15 @@ static void R_Shadow_BounceGrid_BlurPixels(void)
 	r_shadow_bouncegrid_state.highpixels = r_shadow_bouncegrid_state.blurpixels[r_shadow_bouncegrid_state.highpixels_index];
 }
 
-static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
+// normalizes the bentnormals and converts the Z layers t->i[0] to t->i[1]-1
+// of highpixels to the output format given by i[3] (the floatcolors setting)
+static void R_Shadow_BounceGrid_ConvertPixels_Task(taskqueue_task_t *t)
 {
-	int floatcolors = r_shadow_bouncegrid_state.settings.floatcolors;
-	unsigned char *pixelsbgra8 = NULL;
+	int floatcolors = (int)t->i[3];
+	unsigned char *pixelsbgra8 = r_shadow_bouncegrid_state.u8pixels;
 	unsigned char *pixelbgra8;
-	unsigned short *pixelsrgba16f = NULL;
+	unsigned short *pixelsrgba16f = r_shadow_bouncegrid_state.fp16pixels;
 	unsigned short *pixelrgba16f;
-	float *pixelsrgba32f = NULL;
 	float *highpixels = r_shadow_bouncegrid_state.highpixels;
 	float *highpixel;
 	float *bandpixel;
@@ -2379,22 +2509,25 @@ static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
 	unsigned int pixelbands = r_shadow_bouncegrid_state.pixelbands;
 	unsigned int pixelband;
 	unsigned int x, y, z;
+	unsigned int zfirst = (unsigned int)t->i[0];
+	unsigned int zlast;
 	unsigned int index, bandindex;
 	unsigned int resolution[3];
 	int c[4];
+#ifdef SSE2_PRESENT
+	__m128 scale256 = _mm_set1_ps(256.0f);
+	__m128i fp16bias = _mm_set1_epi32(0x38000000);
+	__m128i c4;
+	__m128 v;
+#endif
 	VectorCopy(r_shadow_bouncegrid_state.resolution, resolution);
-
-	if (r_shadow_bouncegrid_state.createtexture && r_shadow_bouncegrid_state.texture)
-	{
-		R_FreeTexture(r_shadow_bouncegrid_state.texture);
-		r_shadow_bouncegrid_state.texture = NULL;
-	}
+	zlast = (unsigned int)min(t->i[1], resolution[2]-1);
 
 	// if bentnormals exist, we need to normalize and bias them for the shader
 	if (pixelbands > 1)
 	{
 		pixelband = 1;
-		for (z = 0;z < resolution[2]-1;z++)
+		for (z = zfirst;z < zlast;z++)
 		{
 			for (y = 0;y < resolution[1]-1;y++)
 			{
@@ -2413,24 +2546,14 @@ static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
 		}
 	}
 
-	// start by clearing the pixels array - we won't be writing to all of it
-	//
-	// then process only the pixels that have at least some color, skipping
-	// the higher bands for speed on pixels that are black
+	// process only the pixels that have at least some color, skipping the
+	// higher bands for speed on pixels that are black
+	if (zfirst < 1)
+		zfirst = 1;
 	switch (floatcolors)
 	{
 	case 0:
-		if (r_shadow_bouncegrid_state.u8pixels == NULL)
-			r_shadow_bouncegrid_state.u8pixels = (unsigned char *)Mem_Alloc(r_main_mempool, r_shadow_bouncegrid_state.numpixels * sizeof(unsigned char[4]));
-		pixelsbgra8 = r_shadow_bouncegrid_state.u8pixels;
-		for (pixelband = 0;pixelband < pixelbands;pixelband++)
-		{
-			if (pixelband == 1)
-				memset(pixelsbgra8 + pixelband * r_shadow_bouncegrid_state.bytesperband, 128, r_shadow_bouncegrid_state.bytesperband);
-			else
-				memset(pixelsbgra8 + pixelband * r_shadow_bouncegrid_state.bytesperband, 0, r_shadow_bouncegrid_state.bytesperband);
-		}
-		for (z = 1;z < resolution[2]-1;z++)
+		for (z = zfirst;z < zlast;z++)
 		{
 			for (y = 1;y < resolution[1]-1;y++)
 			{
@@ -2454,6 +2577,15 @@ static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
 						{
 							pixelbgra8 = pixelsbgra8 + 4*bandindex;
 							bandpixel = highpixels + 4*bandindex;
+#ifdef SSE2_PRESENT
+							// swizzle to BGRA, the saturating packs do the clamping
+							v = _mm_loadu_ps(bandpixel);
+							c4 = _mm_cvttps_epi32(_mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 1, 2)), scale256));
+							c4 = _mm_packs_epi32(c4, c4);
+							c4 = _mm_packus_epi16(c4, c4);
+							c[0] = _mm_cvtsi128_si32(c4);
+							memcpy(pixelbgra8, &c[0], 4);
+#else
 							c[0] = (int)(bandpixel[0]*256.0f);
 							c[1] = (int)(bandpixel[1]*256.0f);
 							c[2] = (int)(bandpixel[2]*256.0f);
@@ -2462,23 +2594,15 @@ static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
 							pixelbgra8[1] = (unsigned char)bound(0, c[1], 255);
 							pixelbgra8[0] = (unsigned char)bound(0, c[2], 255);
 							pixelbgra8[3] = (unsigned char)bound(0, c[3], 255);
+#endif
 						}
 					}
 				}
 			}
 		}
-
-		if (!r_shadow_bouncegrid_state.createtexture)
-			R_UpdateTexture(r_shadow_bouncegrid_state.texture, pixelsbgra8, 0, 0, 0, resolution[0], resolution[1], resolution[2]*pixelbands);
-		else
-			r_shadow_bouncegrid_state.texture = R_LoadTexture3D(r_shadow_texturepool, "bouncegrid", resolution[0], resolution[1], resolution[2]*pixelbands, pixelsbgra8, TEXTYPE_BGRA, TEXF_CLAMP | TEXF_ALPHA | TEXF_FORCELINEAR, 0, NULL);
 		break;
 	case 1:
-		if (r_shadow_bouncegrid_state.fp16pixels == NULL)
-			r_shadow_bouncegrid_state.fp16pixels = (unsigned short *)Mem_Alloc(r_main_mempool, r_shadow_bouncegrid_state.numpixels * sizeof(unsigned short[4]));
-		pixelsrgba16f = r_shadow_bouncegrid_state.fp16pixels;
-		memset(pixelsrgba16f, 0, r_shadow_bouncegrid_state.numpixels * sizeof(unsigned short[4]));
-		for (z = 1;z < resolution[2]-1;z++)
+		for (z = zfirst;z < zlast;z++)
 		{
 			for (y = 1;y < resolution[1]-1;y++)
 			{
@@ -2494,31 +2618,98 @@ static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
 						// process all of the pixelbands for this pixel
 						for (pixelband = 0, bandindex = index;pixelband < pixelbands;pixelband++, bandindex += pixelsperband)
 						{
-							// time to have fun with IEEE 754 bit hacking...
-							union {
-								float f[4];
-								unsigned int raw[4];
-							} u;
 							pixelrgba16f = pixelsrgba16f + 4*bandindex;
 							bandpixel = highpixels + 4*bandindex;
-							VectorCopy4(bandpixel, u.f);
-							VectorCopy4(u.raw, c);
-							// this math supports negative numbers, snaps denormals to zero
-							//pixelrgba16f[0] = (unsigned short)(((c[0] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[0] - 0x38000000) >> 13) & 0x7FFF) | ((c[0] >> 16) & 0x8000));
-							//pixelrgba16f[1] = (unsigned short)(((c[1] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[1] - 0x38000000) >> 13) & 0x7FFF) | ((c[1] >> 16) & 0x8000));
-							//pixelrgba16f[2] = (unsigned short)(((c[2] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[2] - 0x38000000) >> 13) & 0x7FFF) | ((c[2] >> 16) & 0x8000));
-							//pixelrgba16f[3] = (unsigned short)(((c[3] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[3] - 0x38000000) >> 13) & 0x7FFF) | ((c[3] >> 16) & 0x8000));
-							// this math does not support negative
-							pixelrgba16f[0] = (unsigned short)((c[0] < 0x38000000) ? 0 : ((c[0] - 0x38000000) >> 13));
-							pixelrgba16f[1] = (unsigned short)((c[1] < 0x38000000) ? 0 : ((c[1] - 0x38000000) >> 13));
-							pixelrgba16f[2] = (unsigned short)((c[2] < 0x38000000) ? 0 : ((c[2] - 0x38000000) >> 13));
-							pixelrgba16f[3] = (unsigned short)((c[3] < 0x38000000) ? 0 : ((c[3] - 0x38000000) >> 13));
+#ifdef SSE2_PRESENT
+							// same math as below, the shifts keep the low 16 bits
+							// of each value through the saturating pack
+							c4 = _mm_castps_si128(_mm_loadu_ps(bandpixel));
+							c4 = _mm_andnot_si128(_mm_cmplt_epi32(c4, fp16bias), _mm_srai_epi32(_mm_sub_epi32(c4, fp16bias), 13));
+							c4 = _mm_srai_epi32(_mm_slli_epi32(c4, 16), 16);
+							_mm_storel_epi64((__m128i *)pixelrgba16f, _mm_packs_epi32(c4, c4));
+#else
+							{
+								// time to have fun with IEEE 754 bit hacking...
+								union {
+									float f[4];
+									unsigned int raw[4];
+								} u;
+								VectorCopy4(bandpixel, u.f);
+								VectorCopy4(u.raw, c);
+								// this math supports negative numbers, snaps denormals to zero
+								//pixelrgba16f[0] = (unsigned short)(((c[0] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[0] - 0x38000000) >> 13) & 0x7FFF) | ((c[0] >> 16) & 0x8000));
+								//pixelrgba16f[1] = (unsigned short)(((c[1] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[1] - 0x38000000) >> 13) & 0x7FFF) | ((c[1] >> 16) & 0x8000));
+								//pixelrgba16f[2] = (unsigned short)(((c[2] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[2] - 0x38000000) >> 13) & 0x7FFF) | ((c[2] >> 16) & 0x8000));
+								//pixelrgba16f[3] = (unsigned short)(((c[3] & 0x7FFFFFFF) < 0x38000000) ? 0 : (((c[3] - 0x38000000) >> 13) & 0x7FFF) | ((c[3] >> 16) & 0x8000));
+								// this math does not support negative
+								pixelrgba16f[0] = (unsigned short)((c[0] < 0x38000000) ? 0 : ((c[0] - 0x38000000) >> 13));
+								pixelrgba16f[1] = (unsigned short)((c[1] < 0x38000000) ? 0 : ((c[1] - 0x38000000) >> 13));
+								pixelrgba16f[2] = (unsigned short)((c[2] < 0x38000000) ? 0 : ((c[2] - 0x38000000) >> 13));
+								pixelrgba16f[3] = (unsigned short)((c[3] < 0x38000000) ? 0 : ((c[3] - 0x38000000) >> 13));
+							}
+#endif
 						}
 					}
 				}
 			}
 		}
+		break;
+	}
+}
+
+static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
+{
+	int floatcolors = r_shadow_bouncegrid_state.settings.floatcolors;
+	unsigned char *pixelsbgra8 = NULL;
+	unsigned short *pixelsrgba16f = NULL;
+	float *pixelsrgba32f = NULL;
+	float *highpixels = r_shadow_bouncegrid_state.highpixels;
+	unsigned int pixelbands = r_shadow_bouncegrid_state.pixelbands;
+	unsigned int pixelband;
+	unsigned int resolution[3];
+	VectorCopy(r_shadow_bouncegrid_state.resolution, resolution);
+
+	if (r_shadow_bouncegrid_state.createtexture && r_shadow_bouncegrid_state.texture)
+	{
+		R_FreeTexture(r_shadow_bouncegrid_state.texture);
+		r_shadow_bouncegrid_state.texture = NULL;
+	}
+
+	// start by clearing the pixels array - we won't be writing to all of it
+	switch (floatcolors)
+	{
+	case 0:
+		if (r_shadow_bouncegrid_state.u8pixels == NULL)
+			r_shadow_bouncegrid_state.u8pixels = (unsigned char *)Mem_Alloc(r_main_mempool, r_shadow_bouncegrid_state.numpixels * sizeof(unsigned char[4]));
+		pixelsbgra8 = r_shadow_bouncegrid_state.u8pixels;
+		for (pixelband = 0;pixelband < pixelbands;pixelband++)
+		{
+			if (pixelband == 1)
+				memset(pixelsbgra8 + pixelband * r_shadow_bouncegrid_state.bytesperband, 128, r_shadow_bouncegrid_state.bytesperband);
+			else
+				memset(pixelsbgra8 + pixelband * r_shadow_bouncegrid_state.bytesperband, 0, r_shadow_bouncegrid_state.bytesperband);
+		}
+		break;
+	case 1:
+		if (r_shadow_bouncegrid_state.fp16pixels == NULL)
+			r_shadow_bouncegrid_state.fp16pixels = (unsigned short *)Mem_Alloc(r_main_mempool, r_shadow_bouncegrid_state.numpixels * sizeof(unsigned short[4]));
+		pixelsrgba16f = r_shadow_bouncegrid_state.fp16pixels;
+		memset(pixelsrgba16f, 0, r_shadow_bouncegrid_state.numpixels * sizeof(unsigned short[4]));
+		break;
+	}
 
+	// then process the pixels
+	R_Shadow_BounceGrid_RunSlabTasks(R_Shadow_BounceGrid_ConvertPixels_Task, NULL, NULL, floatcolors);
+
+	switch (floatcolors)
+	{
+	case 0:
+		if (!r_shadow_bouncegrid_state.createtexture)
+			R_UpdateTexture(r_shadow_bouncegrid_state.texture, pixelsbgra8, 0, 0, 0, resolution[0], resolution[1], resolution[2]*pixelbands);
+		else
+			r_shadow_bouncegrid_state.texture = R_LoadTexture3D(r_shadow_texturepool, "bouncegrid", resolution[0], resolution[1], resolution[2]*pixelbands, pixelsbgra8, TEXTYPE_BGRA, TEXF_CLAMP | TEXF_ALPHA | TEXF_FORCELINEAR, 0, NULL);
+		break;
+	case 1:
 		if (!r_shadow_bouncegrid_state.createtexture)
 			R_UpdateTexture(r_shadow_bouncegrid_state.texture, (const unsigned char *)pixelsrgba16f, 0, 0, 0, resolution[0], resolution[1], resolution[2]*pixelbands);
 		else
@@ -2538,40 +2729,39 @@ static void R_Shadow_BounceGrid_ConvertPixelsAndUpload(void)
 	r_shadow_bouncegrid_state.lastupdatetime = realtime;
 }
 
-static void R_Shadow_BounceGrid_TracePhotons(r_shadow_bouncegrid_settings_t settings, unsigned int range, unsigned int range1, unsigned int range2, int flag)
+// traces the photons of one batch, this may run on any thread so the light
+// paths and statistics go into the batch rather than the global state
+static void R_Shadow_BounceGrid_TracePhotons_Task(taskqueue_task_t *t)
 {
+	r_shadow_bouncegrid_photonbatch_t *batch = (r_shadow_bouncegrid_photonbatch_t *)t->p[0];
+	r_shadow_bouncegrid_settings_t settings = r_shadow_bouncegrid_state.settings;
+	rtlight_t *rtlight = batch->rtlight;
 	vec3_t bouncerandom[10];
-	dlight_t *light;
 	int bouncecount;
 	int hitsupercontentsmask;
 	int skipsupercontentsmask;
 	int skipmaterialflagsmask;
 	int maxbounce;
-	int shootparticles;
 	int shotparticles;
-	float bounceminimumintensity2;
 	trace_t cliptrace;
 	//trace_t cliptrace2;
 	//trace_t cliptrace3;
-	unsigned int lightindex;
-	unsigned int seed;
-	randomseed_t randomseed;
+	unsigned int seed = batch->seed;
+	randomseed_t randomseed = batch->randomseed;
 	vec3_t shotcolor;
-	vec3_t baseshotcolor;
 	vec3_t surfcolor;
 	vec3_t clipend;
 	vec3_t clipstart;
 	vec3_t clipdiff;
-	vec_t radius;
 	vec_t distancetraveled;
 	vec_t s;
-	rtlight_t *rtlight;
 
-	// compute a seed for the unstable random modes
-	Math_RandomSeed_FromInts(&randomseed, 0, 0, 0, realtime * 1000.0);
-	seed = realtime * 1000.0;
-
-	r_shadow_bouncegrid_state.numsplatpaths = 0;
+	batch->numsplatpaths = 0;
+	batch->traces = 0;
+	batch->hits = 0;
+	memset(&batch->cachestats, 0, sizeof(batch->cachestats));
+	batch->bounces = 0;
+	batch->effectiveradius = 0;
 
 	// figure out what we want to interact with
 	if (settings.hitmodels)
@@ -2582,6 +2772,124 @@ static void R_Shadow_BounceGrid_TracePhotons(r_shadow_bouncegrid_settings_t sett
 	skipmaterialflagsmask = MATERIALFLAGMASK_TRANSLUCENT;
 	maxbounce = settings.maxbounce;
 
+	for (shotparticles = 0;shotparticles < batch->numphotons;shotparticles++)
+	{
+		VectorCopy(batch->baseshotcolor, shotcolor);
+		VectorCopy(rtlight->shadoworigin, clipstart);
+		switch (settings.rng_type)
+		{
+		default:
+		case 0:
+			VectorLehmerRandom(&randomseed, clipend);
+			if (settings.bounceanglediffuse)
+			{
+				// we want random to be stable, so we still have to do all the random we would have done
+				for (bouncecount = 0; bouncecount < maxbounce; bouncecount++)
+					VectorLehmerRandom(&randomseed, bouncerandom[bouncecount]);
+			}
+			break;
+		case 1:
+			VectorCheeseRandom(seed, clipend);
+			if (settings.bounceanglediffuse)
+			{
+				// we want random to be stable, so we still have to do all the random we would have done
+				for (bouncecount = 0; bouncecount < maxbounce; bouncecount++)
+					VectorCheeseRandom(seed, bouncerandom[bouncecount]);
+			}
+			break;
+		}
+
+		// we want a uniform distribution spherically, not merely within the sphere
+		if (settings.normalizevectors)
+			VectorNormalize(clipend);
+
+		VectorMA(clipstart, batch->radius, clipend, clipend);
+		distancetraveled = 0.0f;
+		for (bouncecount = 0;;bouncecount++)
+		{
+			batch->traces++;
+			//r_refdef.scene.worldmodel->TraceLineAgainstSurfaces(r_refdef.scene.worldmodel, NULL, NULL, &cliptrace, clipstart, clipend, hitsupercontentsmask);
+			//r_refdef.scene.worldmodel->TraceLine(r_refdef.scene.worldmodel, NULL, NULL, &cliptrace2, clipstart, clipend, hitsupercontentsmask);
+			if (settings.staticmode || settings.rng_seed < 0)
+			{
+				// static mode fires a LOT of rays but none of them are identical, so they are not cached
+				// non-stable random in dynamic mode also never reuses a direction, so there's no reason to cache it
+				cliptrace = CL_TraceLine(clipstart, clipend, settings.staticmode ? MOVE_WORLDONLY : (settings.hitmodels ? MOVE_HITMODEL : MOVE_NOMONSTERS), NULL, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, collision_extendmovelength.value, true, false, NULL, true, true);
+			}
+			else
+			{
+				// dynamic mode fires many rays and most will match the cache from the previous frame
+				cliptrace = CL_Cache_TraceLineSurfaces(clipstart, clipend, settings.staticmode ? MOVE_WORLDONLY : (settings.hitmodels ? MOVE_HITMODEL : MOVE_NOMONSTERS), hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, &batch->cachestats);
+			}
+			if (bouncecount > 0 || settings.includedirectlighting)
+			{
+				vec3_t hitpos;
+				VectorCopy(cliptrace.endpos, hitpos);
+				R_Shadow_BounceGrid_AddSplatPath(batch, clipstart, hitpos, shotcolor, distancetraveled);
+			}
+			distancetraveled += VectorDistance(clipstart, cliptrace.endpos);
+			s = VectorDistance(rtlight->shadoworigin, cliptrace.endpos);
+			if (batch->effectiveradius < s)
+				batch->effectiveradius = s;
+			if (cliptrace.fraction >= 1.0f)
+				break;
+			batch->hits++;
+			if (bouncecount >= maxbounce)
+				break;
+			// scale down shot color by bounce intensity and texture color (or 50% if no texture reported)
+			// also clamp the resulting color to never add energy, even if the user requests extreme values
+			if (cliptrace.hittexture && cliptrace.hittexture->currentskinframe)
+				VectorCopy(cliptrace.hittexture->currentskinframe->avgcolor, surfcolor);
+			else
+				VectorSet(surfcolor, 0.5f, 0.5f, 0.5f);
+			VectorScale(surfcolor, settings.particlebounceintensity, surfcolor);
+			surfcolor[0] = min(surfcolor[0], 1.0f);
+			surfcolor[1] = min(surfcolor[1], 1.0f);
+			surfcolor[2] = min(surfcolor[2], 1.0f);
+			VectorMultiply(shotcolor, surfcolor, shotcolor);
+			if (VectorLength2(shotcolor) <= batch->bounceminimumintensity2)
+				break;
+			batch->bounces++;
+			if (settings.bounceanglediffuse)
+			{
+				// random direction, primarily along plane normal
+				s = VectorDistance(cliptrace.endpos, clipend);
+				VectorMA(cliptrace.plane.normal, 0.95f, bouncerandom[bouncecount], clipend);
+				VectorNormalize(clipend);
+				VectorScale(clipend, s, clipend);
+			}
+			else
+			{
+				// reflect the remaining portion of the line across plane normal
+				VectorSubtract(clipend, cliptrace.endpos, clipdiff);
+				VectorReflect(clipdiff, 1.0, cliptrace.plane.normal, clipend);
+			}
+			// calculate the new line start and end
+			VectorCopy(cliptrace.endpos, clipstart);
+			VectorAdd(clipstart, clipend, clipend);
+		}
+	}
+}
+
+static void R_Shadow_BounceGrid_TracePhotons(r_shadow_bouncegrid_settings_t settings, unsigned int range, unsigned int range1, unsigned int range2, int flag)
+{
+	dlight_t *light;
+	int shootparticles;
+	int shotparticles;
+	int numbatches;
+	int batchindex;
+	float bounceminimumintensity2;
+	unsigned int lightindex;
+	vec3_t baseshotcolor;
+	vec_t radius;
+	rtlight_t *rtlight;
+	r_shadow_bouncegrid_photonbatch_t *batch;
+	r_shadow_bouncegrid_splatpath_t *splatpaths;
+	qboolean threaded;
+
+	// split the photons of each light into batches, each with its own
+	// random seed so that the result does not depend on how they are run
+	numbatches = 0;
 	for (lightindex = 0;lightindex < range2;lightindex++)
 	{
 		if (lightindex < range)
@@ -2611,132 +2919,105 @@ static void R_Shadow_BounceGrid_TracePhotons(r_shadow_bouncegrid_settings_t sett
 		// we stop caring about bounces once the brightness goes below this fraction of the original intensity
 		bounceminimumintensity2 = VectorLength(baseshotcolor) * settings.bounceminimumintensity2;
 
-		// for seeded random we start the RNG with the position of the light
-		if (settings.rng_seed >= 0)
+		for (shotparticles = 0, batchindex = 0;shotparticles < shootparticles;shotparticles += BOUNCEGRID_PHOTONBATCHSIZE, batchindex++)
 		{
-			union
+			if (r_shadow_bouncegrid_state.maxphotonbatches <= numbatches)
 			{
-				unsigned int i[4];
-				float f[4];
+				r_shadow_bouncegrid_state.maxphotonbatches = max(r_shadow_bouncegrid_state.maxphotonbatches * 2, 64);
+				r_shadow_bouncegrid_state.photonbatches = (r_shadow_bouncegrid_photonbatch_t *)Mem_Realloc(r_main_mempool, r_shadow_bouncegrid_state.photonbatches, sizeof(r_shadow_bouncegrid_photonbatch_t) * r_shadow_bouncegrid_state.maxphotonbatches);
 			}
-			u;
-			u.f[0] = rtlight->shadoworigin[0];
-			u.f[1] = rtlight->shadoworigin[1];
-			u.f[2] = rtlight->shadoworigin[2];
-			u.f[3] = 1;
-			switch (settings.rng_type)
+			batch = r_shadow_bouncegrid_state.photonbatches + numbatches++;
+			batch->rtlight = rtlight;
+			batch->numphotons = min(shootparticles - shotparticles, BOUNCEGRID_PHOTONBATCHSIZE);
+			VectorCopy(baseshotcolor, batch->baseshotcolor);
+			batch->radius = radius;
+			batch->bounceminimumintensity2 = bounceminimumintensity2;
+
+			// for seeded random we start the RNG with the position of the light
+			// and the number of the batch
+			if (settings.rng_seed >= 0)
 			{
-			default:
-			case 0:
-				// we have to shift the seed provided by the user because the result must be odd
-				Math_RandomSeed_FromInts(&randomseed, u.i[0], u.i[1], u.i[2], u.i[3] ^ (settings.rng_seed << 1));
-				break;
-			case 1:
-				seed = u.i[0] ^ u.i[1] ^ u.i[2] ^ u.i[3] ^ settings.rng_seed;
-				break;
-			}
-		}
-
-		for (shotparticles = 0;shotparticles < shootparticles;shotparticles++)
-		{
-			VectorCopy(baseshotcolor, shotcolor);
-			VectorCopy(rtlight->shadoworigin, clipstart);
-			switch (settings.rng_type)
-			{
-			default:
-			case 0:
-				VectorLehmerRandom(&randomseed, clipend);
-				if (settings.bounceanglediffuse)
+				union
 				{
-					// we want random to be stable, so we still have to do all the random we would have done
-					for (bouncecount = 0; bouncecount < maxbounce; bouncecount++)
-						VectorLehmerRandom(&randomseed, bouncerandom[bouncecount]);
+					unsigned int i[4];
+					float f[4];
 				}
-				break;
-			case 1:
-				VectorCheeseRandom(seed, clipend);
-				if (settings.bounceanglediffuse)
+				u;
+				u.f[0] = rtlight->shadoworigin[0];
+				u.f[1] = rtlight->shadoworigin[1];
+				u.f[2] = rtlight->shadoworigin[2];
+				u.f[3] = 1 + batchindex;
+				switch (settings.rng_type)
 				{
-					// we want random to be stable, so we still have to do all the random we would have done
-					for (bouncecount = 0; bouncecount < maxbounce; bouncecount++)
-						VectorCheeseRandom(seed, bouncerandom[bouncecount]);
-				}
-				break;
-			}
-
-			// we want a uniform distribution spherically, not merely within the sphere
-			if (settings.normalizevectors)
-				VectorNormalize(clipend);
-
-			VectorMA(clipstart, radius, clipend, clipend);
-			distancetraveled = 0.0f;
-			for (bouncecount = 0;;bouncecount++)
-			{
-				r_refdef.stats[r_stat_bouncegrid_traces]++;
-				rtlight->bouncegrid_traces++;
-				//r_refdef.scene.worldmodel->TraceLineAgainstSurfaces(r_refdef.scene.worldmodel, NULL, NULL, &cliptrace, clipstart, clipend, hitsupercontentsmask);
-				//r_refdef.scene.worldmodel->TraceLine(r_refdef.scene.worldmodel, NULL, NULL, &cliptrace2, clipstart, clipend, hitsupercontentsmask);
-				if (settings.staticmode || settings.rng_seed < 0)
-				{
-					// static mode fires a LOT of rays but none of them are identical, so they are not cached
-					// non-stable random in dynamic mode also never reuses a direction, so there's no reason to cache it
-					cliptrace = CL_TraceLine(clipstart, clipend, settings.staticmode ? MOVE_WORLDONLY : (settings.hitmodels ? MOVE_HITMODEL : MOVE_NOMONSTERS), NULL, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, collision_extendmovelength.value, true, false, NULL, true, true);
-				}
-				else
-				{
-					// dynamic mode fires many rays and most will match the cache from the previous frame
-					cliptrace = CL_Cache_TraceLineSurfaces(clipstart, clipend, settings.staticmode ? MOVE_WORLDONLY : (settings.hitmodels ? MOVE_HITMODEL : MOVE_NOMONSTERS), hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask);
-				}
-				if (bouncecount > 0 || settings.includedirectlighting)
-				{
-					vec3_t hitpos;
-					VectorCopy(cliptrace.endpos, hitpos);
-					R_Shadow_BounceGrid_AddSplatPath(clipstart, hitpos, shotcolor, distancetraveled);
-				}
-				distancetraveled += VectorDistance(clipstart, cliptrace.endpos);
-				s = VectorDistance(rtlight->shadoworigin, cliptrace.endpos);
-				if (rtlight->bouncegrid_effectiveradius < s)
-					rtlight->bouncegrid_effectiveradius = s;
-				if (cliptrace.fraction >= 1.0f)
-					break;
-				r_refdef.stats[r_stat_bouncegrid_hits]++;
-				rtlight->bouncegrid_hits++;
-				if (bouncecount >= maxbounce)
+				default:
+				case 0:
+					// we have to shift the seed provided by the user because the result must be odd
+					Math_RandomSeed_FromInts(&batch->randomseed, u.i[0], u.i[1], u.i[2], u.i[3] ^ (settings.rng_seed << 1));
 					break;
-				// scale down shot color by bounce intensity and texture color (or 50% if no texture reported)
-				// also clamp the resulting color to never add energy, even if the user requests extreme values
-				if (cliptrace.hittexture && cliptrace.hittexture->currentskinframe)
-					VectorCopy(cliptrace.hittexture->currentskinframe->avgcolor, surfcolor);
-				else
-					VectorSet(surfcolor, 0.5f, 0.5f, 0.5f);
-				VectorScale(surfcolor, settings.particlebounceintensity, surfcolor);
-				surfcolor[0] = min(surfcolor[0], 1.0f);
-				surfcolor[1] = min(surfcolor[1], 1.0f);
-				surfcolor[2] = min(surfcolor[2], 1.0f);
-				VectorMultiply(shotcolor, surfcolor, shotcolor);
-				if (VectorLength2(shotcolor) <= bounceminimumintensity2)
+				case 1:
+					batch->seed = u.i[0] ^ u.i[1] ^ u.i[2] ^ u.i[3] ^ settings.rng_seed;
 					break;
-				r_refdef.stats[r_stat_bouncegrid_bounces]++;
-				if (settings.bounceanglediffuse)
-				{
-					// random direction, primarily along plane normal
-					s = VectorDistance(cliptrace.endpos, clipend);
-					VectorMA(cliptrace.plane.normal, 0.95f, bouncerandom[bouncecount], clipend);
-					VectorNormalize(clipend);
-					VectorScale(clipend, s, clipend);
 				}
-				else
-				{
-					// reflect the remaining portion of the line across plane normal
-					VectorSubtract(clipend, cliptrace.endpos, clipdiff);
-					VectorReflect(clipdiff, 1.0, cliptrace.plane.normal, clipend);
-				}
-				// calculate the new line start and end
-				VectorCopy(cliptrace.endpos, clipstart);
-				VectorAdd(clipstart, clipend, clipend);
+			}
+			else
+			{
+				// compute a seed for the unstable random modes
+				Math_RandomSeed_FromInts(&batch->randomseed, 0, 0, numbatches, realtime * 1000.0);
+				batch->seed = (unsigned int)(realtime * 1000.0) ^ (numbatches * 0x9E3779B9u);
 			}
 		}
 	}
+	r_shadow_bouncegrid_state.numphotonbatches = numbatches;
+
+	// the traces of csqc entities share state that is not safe to use from
+	// several threads, only the world and network brush models are
+	threaded = R_Shadow_BounceGrid_Threaded() && numbatches > 1 && (settings.staticmode || CLVM_prog->num_edicts < 1);
+	for (batchindex = 0;batchindex < numbatches;batchindex++)
+	{
+		batch = r_shadow_bouncegrid_state.photonbatches + batchindex;
+		TaskQueue_Setup(&batch->task, NULL, R_Shadow_BounceGrid_TracePhotons_Task, 0, 0, batch, NULL);
+		if (threaded)
+			TaskQueue_Enqueue(1, &batch->task);
+		else
+			R_Shadow_BounceGrid_TracePhotons_Task(&batch->task);
+	}
+
+	// merge the results in batch order
+	r_shadow_bouncegrid_state.numsplatpaths = 0;
+	for (batchindex = 0;batchindex < numbatches;batchindex++)
+	{
+		batch = r_shadow_bouncegrid_state.photonbatches + batchindex;
+		if (threaded)
+			TaskQueue_WaitForTaskDone(&batch->task);
+		r_refdef.stats[r_stat_bouncegrid_traces] += batch->traces;
+		r_refdef.stats[r_stat_bouncegrid_hits] += batch->hits;
+		r_refdef.stats[r_stat_bouncegrid_bounces] += batch->bounces;
+		r_refdef.stats[r_stat_photoncache_cached] += batch->cachestats.cached;
+		r_refdef.stats[r_stat_photoncache_traced] += batch->cachestats.traced;
+		batch->rtlight->bouncegrid_traces += batch->traces;
+		batch->rtlight->bouncegrid_hits += batch->hits;
+		if (batch->rtlight->bouncegrid_effectiveradius < batch->effectiveradius)
+			batch->rtlight->bouncegrid_effectiveradius = batch->effectiveradius;
+		r_shadow_bouncegrid_state.numsplatpaths += batch->numsplatpaths;
+	}
+	if (r_shadow_bouncegrid_state.maxsplatpaths < r_shadow_bouncegrid_state.numsplatpaths)
+	{
+		// this will persist from frame to frame so we don't make the same
+		// mistake each time
+		r_shadow_bouncegrid_state.maxsplatpaths = max(r_shadow_bouncegrid_state.numsplatpaths, 16384);
+		if (r_shadow_bouncegrid_state.splatpaths)
+			Mem_Free(r_shadow_bouncegrid_state.splatpaths);
+		r_shadow_bouncegrid_state.splatpaths = (r_shadow_bouncegrid_splatpath_t *)Mem_Alloc(r_main_mempool, sizeof(r_shadow_bouncegrid_splatpath_t) * r_shadow_bouncegrid_state.maxsplatpaths);
+	}
+	splatpaths = r_shadow_bouncegrid_state.splatpaths;
+	for (batchindex = 0;batchindex < numbatches;batchindex++)
+	{
+		batch = r_shadow_bouncegrid_state.photonbatches + batchindex;
+		if (!batch->numsplatpaths)
+			continue;
+		memcpy(splatpaths, batch->splatpaths, sizeof(*splatpaths) * batch->numsplatpaths);
+		splatpaths += batch->numsplatpaths;
+	}
 }
 
 void R_Shadow_UpdateBounceGridTexture(void)
@@ -2774,6 +3055,7 @@ void R_Shadow_UpdateBounceGridTexture(void)
 		if (r_shadow_bouncegrid_state.fp16pixels) Mem_Free(r_shadow_bouncegrid_state.fp16pixels); r_shadow_bouncegrid_state.fp16pixels = NULL;
 		if (r_shadow_bouncegrid_state.splatpaths) Mem_Free(r_shadow_bouncegrid_state.splatpaths); r_shadow_bouncegrid_state.splatpaths = NULL;
 		r_shadow_bouncegrid_state.maxsplatpaths = 0;
+		R_Shadow_BounceGrid_FreePhotonBatches();
 		r_shadow_bouncegrid_state.numpixels = 0;
 		r_shadow_bouncegrid_state.directional = false;
 
@@ -2826,6 +3108,7 @@ void R_Shadow_UpdateBounceGridTexture(void)
 		if (r_shadow_bouncegrid_state.fp16pixels) Mem_Free(r_shadow_bouncegrid_state.fp16pixels); r_shadow_bouncegrid_state.fp16pixels = NULL;
 		if (r_shadow_bouncegrid_state.splatpaths) Mem_Free(r_shadow_bouncegrid_state.splatpaths); r_shadow_bouncegrid_state.splatpaths = NULL;
 		r_shadow_bouncegrid_state.maxsplatpaths = 0;
+		R_Shadow_BounceGrid_FreePhotonBatches();
 	}
 }
 
@@ -4512,7 +4795,7 @@ static void R_DrawCorona(rtlight_t *rtlight, float cscale, float scale)
 	}
 	else
 	{
-		if (CL_Cache_TraceLineSurfaces(r_refdef.view.origin, rtlight->shadoworigin, MOVE_NORMAL, SUPERCONTENTS_SOLID, 0, MATERIALFLAGMASK_TRANSLUCENT).fraction < 1)
+		if (CL_Cache_TraceLineSurfaces(r_refdef.view.origin, rtlight->shadoworigin, MOVE_NORMAL, SUPERCONTENTS_SOLID, 0, MATERIALFLAGMASK_TRANSLUCENT, NULL).fraction < 1)
 			return;
 	}
 	VectorScale(rtlight->currentcolor, cscale, color);
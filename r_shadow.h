@@ -81,10 +81,15 @@ typedef struct r_shadow_bouncegrid_state_s
 	vec3_t maxs;
 	vec3_t size;
 	int maxsplatpaths;
+	// photons are traced in batches on the task queue, each batch keeps its
+	// splat path buffer from frame to frame like splatpaths does
+	int maxphotonbatches;
+	struct r_shadow_bouncegrid_photonbatch_s *photonbatches;
 
 	// per-frame data that is very temporary
 	int numsplatpaths;
 	struct r_shadow_bouncegrid_splatpath_s *splatpaths;
+	int numphotonbatches;
 	int highpixels_index; // which one is active - this toggles when doing blur
 	float *highpixels; // equals blurpixels[highpixels_index]
 	float *blurpixels[2];
@@ -83,6 +83,8 @@ typedef struct server_s
 	double pausedstart;
 	/// handle connections specially
 	qboolean loadgame;
+	/// sv.time of the next sv_autosave, 0 until the first frame
+	double autosavetime;
 
 	/// one of the PROTOCOL_ values
 	protocolversion_t protocol;
@@ -91,6 +93,9 @@ typedef struct server_s
 
 	double frametime;
 
+	/// counts SV_SendClientMessages calls, seeds the per client trace culling
+	unsigned int framenum;
+
 	// used by PF_checkclient
 	int lastcheck;
 	double lastchecktime;
@@ -144,32 +149,54 @@ typedef struct server_s
 	qboolean particleeffectnamesloaded;
 	char particleeffectname[MAX_PARTICLEEFFECTNAME][MAX_QPATH];
 
-	int writeentitiestoclient_stats_culled_pvs;
-	int writeentitiestoclient_stats_culled_trace;
-	int writeentitiestoclient_stats_visibleentities;
-	int writeentitiestoclient_stats_totalentities;
+	/// client whose entities are being written (for QC and csqc entities)
 	int writeentitiestoclient_cliententitynumber;
 	int writeentitiestoclient_clientnumber;
 	sizebuf_t *writeentitiestoclient_msg;
-	vec3_t writeentitiestoclient_eyes[MAX_CLIENTNETWORKEYES];
-	int writeentitiestoclient_numeyes;
-	int writeentitiestoclient_pvsbytes;
-	unsigned char writeentitiestoclient_pvs[MAX_MAP_LEAFS/8];
-	const entity_state_t *writeentitiestoclient_sendstates[MAX_EDICTS];
-	unsigned short writeentitiestoclient_csqcsendstates[MAX_EDICTS];
 
 	int numsendentities;
 	entity_state_t sendentities[MAX_EDICTS];
 	entity_state_t *sendentitiesindex[MAX_EDICTS];
-
-	int sententitiesmark;
-	int sententities[MAX_EDICTS];
-	int sententitiesconsideration[MAX_EDICTS];
+	/// entities that look different to each client (customizeentityforclient
+	/// or exteriormodelforclient), each client gets a copy of their states
+	int numclientstateentities;
+	unsigned short clientstateentities[MAX_EDICTS];
+	/// index into clientstateentities for each entity in sendentities, or -1
+	int sendentitiesclientstate[MAX_EDICTS];
+
+	/// entities that can block line of sight for the entity culling traces
+	int numoccluders;
+	prvm_edict_t *occluders[MAX_EDICTS];
+	/// sv_cullentities_trace_cache statistics for sv_areastats
+	int visibilitycache_stats_hits;
+	int visibilitycache_stats_misses;
 
 	/// legacy support for self.Version based csqc entity networking
 	unsigned char csqcentityversion[MAX_EDICTS]; // legacy
+
+	/// structure of arrays copy of the little SV_Physics needs to know to
+	/// skip an entity that has nothing to do this frame (see sv_hotfields),
+	/// an entry is only valid while prog->touchededicts is clear for it
+	unsigned char hotstate[MAX_EDICTS];
+	prvm_vec_t hotnextthink[MAX_EDICTS];
 } server_t;
 
+// server_t::hotstate
+#define HOTSTATE_UNKNOWN 0 // has to be looked at
+#define HOTSTATE_FREE 1
+#define HOTSTATE_IDLE 2 // MOVETYPE_NONE, only thinks at hotnextthink
+
+/// result of the line of sight culling of an entity for one client, valid
+/// until expiretime as long as the eye and the entity stay in the same clusters
+typedef struct entityvisibilitycache_s
+{
+	int eyecluster;
+	int entitycluster;
+	float expiretime;
+	qboolean visible;
+}
+entityvisibilitycache_t;
+
 #define NUM_CSQCENTITIES_PER_FRAME 256
 typedef struct csqcentityframedb_s
 {
@@ -253,6 +280,9 @@ typedef struct client_s
 
 	/// visibility state
 	float visibletime[MAX_EDICTS];
+	/// sv_cullentities_trace_cache, MAX_EDICTS entries allocated by
+	/// SV_SendClientMessages while the cache is enabled, freed on level change
+	entityvisibilitycache_t *visibilitycache;
 
 	// scope is whether an entity is currently being networked to this client
 	// sendflags is what properties have changed on the entity since the last
@@ -423,6 +453,7 @@ extern cvar_t sv_allowdownloads_archive;
 extern cvar_t sv_allowdownloads_config;
 extern cvar_t sv_allowdownloads_dlcache;
 extern cvar_t sv_allowdownloads_inarchive;
+extern cvar_t sv_areabvh;
 extern cvar_t sv_areagrid_mingridsize;
 extern cvar_t sv_checkforpacketsduringsleep;
 extern cvar_t sv_clmovement_enable;
@@ -434,6 +465,7 @@ extern cvar_t sv_cullentities_nevercullbmodels;
 extern cvar_t sv_cullentities_pvs;
 extern cvar_t sv_cullentities_stats;
 extern cvar_t sv_cullentities_trace;
+extern cvar_t sv_cullentities_trace_cache;
 extern cvar_t sv_cullentities_trace_delay;
 extern cvar_t sv_cullentities_trace_enlarge;
 extern cvar_t sv_cullentities_trace_prediction;
@@ -442,6 +474,7 @@ extern cvar_t sv_cullentities_trace_samples_extra;
 extern cvar_t sv_debugmove;
 extern cvar_t sv_echobprint;
 extern cvar_t sv_edgefriction;
+extern cvar_t sv_entityupdatecache;
 extern cvar_t sv_entpatch;
 extern cvar_t sv_fixedframeratesingleplayer;
 extern cvar_t sv_freezenonclients;
@@ -475,6 +508,7 @@ extern cvar_t sv_gameplayfix_unstickplayers;
 extern cvar_t sv_gameplayfix_unstickentities;
 extern cvar_t sv_gameplayfix_fixedcheckwatertransition;
 extern cvar_t sv_gravity;
+extern cvar_t sv_hotfields;
 extern cvar_t sv_idealpitchscale;
 extern cvar_t sv_jumpstep;
 extern cvar_t sv_jumpvelocity;
@@ -492,6 +526,7 @@ extern cvar_t sv_sound_land;
 extern cvar_t sv_sound_watersplash;
 extern cvar_t sv_stepheight;
 extern cvar_t sv_stopspeed;
+extern cvar_t sv_threadedphysics;
 extern cvar_t sv_wallfriction;
 extern cvar_t sv_wateraccelerate;
 extern cvar_t sv_waterfriction;
@@ -550,6 +585,8 @@ void SV_BroadcastPrint(const char *msg);
 void SV_BroadcastPrintf(const char *fmt, ...) DP_FUNC_PRINTF(1);
 
 void SV_Physics (void);
+void SV_HotFields_Setup (void);
+void SV_HotFields_Benchmark_f (void);
 void SV_Physics_ClientMove (void);
 //void SV_Physics_ClientEntity (prvm_edict_t *ent);
 
@@ -580,6 +617,21 @@ int SV_GenericHitSuperContentsMask(const prvm_edict_t *edict);
 trace_t SV_TraceBox(const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int type, prvm_edict_t *passedict, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask, float extend);
 trace_t SV_TraceLine(const vec3_t start, const vec3_t end, int type, prvm_edict_t *passedict, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask, float extend);
 trace_t SV_TracePoint(const vec3_t start, int type, prvm_edict_t *passedict, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask);
+
+/// one trace of a batch, the parameters are the same as SV_TraceBox
+typedef struct sv_tracebatch_s
+{
+	vec3_t start, mins, maxs, end;
+	int type;
+	prvm_edict_t *passedict;
+	int hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask;
+	float extend;
+	/// result, filled in by SV_TraceBatch
+	trace_t trace;
+}
+sv_tracebatch_t;
+/// runs several traces sharing one area grid query for all of them
+void SV_TraceBatch(int numtraces, sv_tracebatch_t *traces);
 int SV_EntitiesInBox(const vec3_t mins, const vec3_t maxs, int maxedicts, prvm_edict_t **resultedicts);
 
 qboolean SV_CanSeeBox(int numsamples, vec_t eyejitter, vec_t enlarge, vec_t entboxexpand, vec3_t eye, vec3_t entboxmins, vec3_t entboxmaxs);
@@ -612,6 +664,7 @@ void SV_StopThread(void);
 void VM_CustomStats_Clear(void);
 void VM_SV_UpdateCustomStats(client_t *client, prvm_edict_t *ent, sizebuf_t *msg, int *stats);
 void Host_Savegame_to(prvm_prog_t *prog, const char *name);
+void Host_Savegame_Comment(prvm_prog_t *prog, char *comment);
 void SV_SendServerinfo(client_t *client);
 
 #endif
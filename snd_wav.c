@@ -279,14 +279,14 @@ qboolean S_LoadWavFile (const char *filename, sfx_t *sfx)
 		return true;
 
 	// Load the file
-	data = FS_LoadFile(filename, snd_mempool, false, &filesize);
+	data = FS_LoadFileView(filename, snd_mempool, false, &filesize);
 	if (!data)
 		return false;
 
 	// Don't try to load it if it's not a WAV file
 	if (memcmp (data, "RIFF", 4) || memcmp (data + 8, "WAVE", 4))
 	{
-		Mem_Free(data);
+		FS_FreeFileView(data);
 		return false;
 	}
 
@@ -297,7 +297,7 @@ qboolean S_LoadWavFile (const char *filename, sfx_t *sfx)
 	if (info.channels < 1 || info.channels > 2)  // Stereo sounds are allowed (intended for music)
 	{
 		Con_Printf("%s has an unsupported number of channels (%i)\n",sfx->name, info.channels);
-		Mem_Free(data);
+		FS_FreeFileView(data);
 		return false;
 	}
 	//if (info.channels == 2)
@@ -344,5 +344,7 @@ qboolean S_LoadWavFile (const char *filename, sfx_t *sfx)
 	sfx->loopstart = min(sfx->loopstart, sfx->total_length);
 	sfx->flags &= ~SFXFLAG_STREAMED;
 
+	FS_FreeFileView(data);
+
 	return true;
 }
@@ -21,9 +21,11 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "quakedef.h"
 #include "sv_demo.h"
+#include "sv_save.h"
 #include "libcurl.h"
 #include "csprogs.h"
 #include "thread.h"
+#include "taskqueue.h"
 
 static void SV_SaveEntFile_f(void);
 static void SV_StartDownload_f(void);
@@ -68,6 +70,7 @@ cvar_t sv_allowdownloads_archive = {0, "sv_allowdownloads_archive", "0", "whethe
 cvar_t sv_allowdownloads_config = {0, "sv_allowdownloads_config", "0", "whether to allow downloads of config files (cfg)"};
 cvar_t sv_allowdownloads_dlcache = {0, "sv_allowdownloads_dlcache", "0", "whether to allow downloads of dlcache files (dlcache/)"};
 cvar_t sv_allowdownloads_inarchive = {0, "sv_allowdownloads_inarchive", "0", "whether to allow downloads from archives (pak/pk3)"};
+cvar_t sv_areabvh = {CVAR_NOTIFY, "sv_areabvh", "0", "use a dynamic bounding volume tree instead of the areagrid to find entities in an area, scales better on huge maps and with lots of small objects crowded together (takes effect on next map, compare the two with sv_areastats)"};
 cvar_t sv_areagrid_mingridsize = {CVAR_NOTIFY, "sv_areagrid_mingridsize", "128", "minimum areagrid cell size, smaller values work better for lots of small objects, higher values for large objects"};
 cvar_t sv_checkforpacketsduringsleep = {0, "sv_checkforpacketsduringsleep", "0", "uses select() function to wait between frames which can be interrupted by packets being received, instead of Sleep()/usleep()/SDL_Sleep() functions which do not check for packets"};
 cvar_t sv_clmovement_enable = {0, "sv_clmovement_enable", "1", "whether to allow clients to use cl_movement prediction, which can cause choppy movement on the server which may annoy other players"};
@@ -78,6 +81,7 @@ cvar_t sv_cullentities_nevercullbmodels = {0, "sv_cullentities_nevercullbmodels"
 cvar_t sv_cullentities_pvs = {0, "sv_cullentities_pvs", "1", "fast but loose culling of hidden entities"};
 cvar_t sv_cullentities_stats = {0, "sv_cullentities_stats", "0", "displays stats on network entities culled by various methods for each client"};
 cvar_t sv_cullentities_trace = {0, "sv_cullentities_trace", "0", "somewhat slow but very tight culling of hidden entities, minimizes network traffic and makes wallhack cheats useless"};
+cvar_t sv_cullentities_trace_cache = {0, "sv_cullentities_trace_cache", "0.1", "reuse the result of the culling traces for an entity for this many seconds as long as the eye and the entity stay in the same pvs clusters (0 = trace every frame)"};
 cvar_t sv_cullentities_trace_delay = {0, "sv_cullentities_trace_delay", "1", "number of seconds until the entity gets actually culled"};
 cvar_t sv_cullentities_trace_delay_players = {0, "sv_cullentities_trace_delay_players", "0.2", "number of seconds until the entity gets actually culled if it is a player entity"};
 cvar_t sv_cullentities_trace_enlarge = {0, "sv_cullentities_trace_enlarge", "0", "box enlargement for entity culling"};
@@ -125,6 +129,7 @@ cvar_t sv_gameplayfix_unstickplayers = {0, "sv_gameplayfix_unstickplayers", "1",
 cvar_t sv_gameplayfix_unstickentities = {0, "sv_gameplayfix_unstickentities", "1", "hack to check if entities are crossing world collision hull and try to move them to the right position"};
 cvar_t sv_gameplayfix_fixedcheckwatertransition = {0, "sv_gameplayfix_fixedcheckwatertransition", "1", "fix two very stupid bugs in SV_CheckWaterTransition when watertype is CONTENTS_EMPTY (the bugs causes waterlevel to be 1 on first frame, -1 on second frame - the fix makes it 0 on both frames)"};
 cvar_t sv_gravity = {CVAR_NOTIFY, "sv_gravity","800", "how fast you fall (512 = roughly earth gravity)"};
+cvar_t sv_hotfields = {0, "sv_hotfields", "1", "keep the free state, movetype and nextthink of all entities in compact arrays so physics can skip idle entities without touching their fields (compare with sv_hotfields_benchmark)"};
 cvar_t sv_init_frame_count = {0, "sv_init_frame_count", "2", "number of frames to run to allow everything to settle before letting clients connect"};
 cvar_t sv_idealpitchscale = {0, "sv_idealpitchscale","0.8", "how much to look up/down slopes and stairs when not using freelook"};
 cvar_t sv_jumpstep = {CVAR_NOTIFY, "sv_jumpstep", "0", "whether you can step up while jumping"};
@@ -157,6 +162,9 @@ cvar_t sys_ticrate = {CVAR_SAVE, "sys_ticrate","0.0138889", "how long a server f
 cvar_t teamplay = {CVAR_NOTIFY, "teamplay","0", "teamplay mode, values depend on mod but typically 0 = no teams, 1 = no team damage no self damage, 2 = team damage and self damage, some mods support 3 = no team damage but can damage self"};
 cvar_t timelimit = {CVAR_NOTIFY, "timelimit","0", "ends level at this time (in minutes)"};
 cvar_t sv_threaded = {0, "sv_threaded", "0", "enables a separate thread for server code, improving performance, especially when hosting a game while playing, EXPERIMENTAL, may be crashy"};
+cvar_t sv_threadedphysics = {0, "sv_threadedphysics", "0", "clip the moves of flying and bouncing entities (MOVETYPE_TOSS and similar) against the world using the taskqueue worker threads before running them, gives exactly the same results as without it"};
+cvar_t sv_threadedsend = {0, "sv_threadedsend", "0", "cull entities and write entity frames for all clients in parallel using the taskqueue worker threads (customizeentityforclient and SendEntity functions then run for all clients before any packets are written)"};
+cvar_t sv_entityupdatecache = {0, "sv_entityupdatecache", "1", "encode each entity update only once per frame and share it between all clients that need the same update (PROTOCOL_DARKPLACES5 and later)"};
 
 cvar_t saved1 = {CVAR_SAVE, "saved1", "0", "unused cvar in quake that is saved to config.cfg on exit, can be used by mods"};
 cvar_t saved2 = {CVAR_SAVE, "saved2", "0", "unused cvar in quake that is saved to config.cfg on exit, can be used by mods"};
@@ -195,6 +203,11 @@ cvar_t sv_autodemo_perclient = {CVAR_SAVE, "sv_autodemo_perclient", "0", "set to
 cvar_t sv_autodemo_perclient_nameformat = {CVAR_SAVE, "sv_autodemo_perclient_nameformat", "sv_autodemos/%Y-%m-%d_%H-%M", "The format of the sv_autodemo_perclient filename, followed by the map name, the client number and the IP address + port number, separated by underscores (the date is encoded using strftime escapes)" };
 cvar_t sv_autodemo_perclient_discardable = {CVAR_SAVE, "sv_autodemo_perclient_discardable", "0", "Allow game code to decide whether a demo should be kept or discarded."};
 
+cvar_t sv_autosave = {CVAR_SAVE, "sv_autosave", "0", "writes a binary savegame every this many seconds of game time, the game state is copied during the frame and compressed on a worker thread (0 = disabled)"};
+cvar_t sv_autosave_name = {CVAR_SAVE, "sv_autosave_name", "autosave", "savegame name sv_autosave writes to"};
+cvar_t sv_savegame_binary = {CVAR_SAVE, "sv_savegame_binary", "0", "makes the save command write the binary savegame format, which is much faster to save and load than the text format (load reads both)"};
+cvar_t sv_savegame_compress = {CVAR_SAVE, "sv_savegame_compress", "1", "compress binary savegames with deflate (needs zlib)"};
+
 cvar_t halflifebsp = {0, "halflifebsp", "0", "indicates the current map is hlbsp format (useful to know because of different bounding box sizes)"};
 cvar_t sv_mapformat_is_quake2 = {0, "sv_mapformat_is_quake2", "0", "indicates the current map is q2bsp format (useful to know because of different entity behaviors, .frame on submodels and other things)"};
 cvar_t sv_mapformat_is_quake3 = {0, "sv_mapformat_is_quake3", "0", "indicates the current map is q2bsp format (useful to know because of different entity behaviors)"};
@@ -419,7 +432,11 @@ prvm_required_field_t sv_reqglobals[] =
 
 static void SV_AreaStats_f(void)
 {
+	int lookups = sv.visibilitycache_stats_hits + sv.visibilitycache_stats_misses;
 	World_PrintAreaStats(&sv.world, "server");
+	Con_Printf("server visibility cache stats: %d lookups %d hits %d misses (%f%% hit rate)\n", lookups, sv.visibilitycache_stats_hits, sv.visibilitycache_stats_misses, lookups ? 100.0 * sv.visibilitycache_stats_hits / lookups : 0.0);
+	sv.visibilitycache_stats_hits = 0;
+	sv.visibilitycache_stats_misses = 0;
 }
 
 /*
@@ -448,6 +465,7 @@ void SV_Init (void)
 
 	Cmd_AddCommand("sv_saveentfile", SV_SaveEntFile_f, "save map entities to .ent file (to allow external editing)");
 	Cmd_AddCommand("sv_areastats", SV_AreaStats_f, "prints statistics on entity culling during collision traces");
+	Cmd_AddCommand("sv_hotfields_benchmark", SV_HotFields_Benchmark_f, "adds idle entities and times server physics frames with and without sv_hotfields (optional arguments: number of entities to add, default 4096, and number of frames, default 100), the game runs on during the frames");
 	Cmd_AddCommand_WithClientCommand("sv_startdownload", NULL, SV_StartDownload_f, "begins sending a file to the client (network protocol use only)");
 	Cmd_AddCommand_WithClientCommand("download", NULL, SV_Download_f, "downloads a specified file from the server");
 
@@ -482,6 +500,7 @@ void SV_Init (void)
 	Cvar_RegisterVariable (&sv_allowdownloads_config);
 	Cvar_RegisterVariable (&sv_allowdownloads_dlcache);
 	Cvar_RegisterVariable (&sv_allowdownloads_inarchive);
+	Cvar_RegisterVariable (&sv_areabvh);
 	Cvar_RegisterVariable (&sv_areagrid_mingridsize);
 	Cvar_RegisterVariable (&sv_checkforpacketsduringsleep);
 	Cvar_RegisterVariable (&sv_clmovement_enable);
@@ -492,6 +511,7 @@ void SV_Init (void)
 	Cvar_RegisterVariable (&sv_cullentities_pvs);
 	Cvar_RegisterVariable (&sv_cullentities_stats);
 	Cvar_RegisterVariable (&sv_cullentities_trace);
+	Cvar_RegisterVariable (&sv_cullentities_trace_cache);
 	Cvar_RegisterVariable (&sv_cullentities_trace_delay);
 	Cvar_RegisterVariable (&sv_cullentities_trace_delay_players);
 	Cvar_RegisterVariable (&sv_cullentities_trace_enlarge);
@@ -539,6 +559,7 @@ void SV_Init (void)
 	Cvar_RegisterVariable (&sv_gameplayfix_unstickentities);
 	Cvar_RegisterVariable (&sv_gameplayfix_fixedcheckwatertransition);
 	Cvar_RegisterVariable (&sv_gravity);
+	Cvar_RegisterVariable (&sv_hotfields);
 	Cvar_RegisterVariable (&sv_init_frame_count);
 	Cvar_RegisterVariable (&sv_idealpitchscale);
 	Cvar_RegisterVariable (&sv_jumpstep);
@@ -571,6 +592,9 @@ void SV_Init (void)
 	Cvar_RegisterVariable (&teamplay);
 	Cvar_RegisterVariable (&timelimit);
 	Cvar_RegisterVariable (&sv_threaded);
+	Cvar_RegisterVariable (&sv_threadedphysics);
+	Cvar_RegisterVariable (&sv_threadedsend);
+	Cvar_RegisterVariable (&sv_entityupdatecache);
 
 	Cvar_RegisterVariable (&saved1);
 	Cvar_RegisterVariable (&saved2);
@@ -610,6 +634,11 @@ void SV_Init (void)
 	Cvar_RegisterVariable (&sv_autodemo_perclient_nameformat);
 	Cvar_RegisterVariable (&sv_autodemo_perclient_discardable);
 
+	Cvar_RegisterVariable (&sv_autosave);
+	Cvar_RegisterVariable (&sv_autosave_name);
+	Cvar_RegisterVariable (&sv_savegame_binary);
+	Cvar_RegisterVariable (&sv_savegame_compress);
+
 	Cvar_RegisterVariable (&halflifebsp);
 	Cvar_RegisterVariable (&sv_mapformat_is_quake2);
 	Cvar_RegisterVariable (&sv_mapformat_is_quake3);
@@ -905,6 +934,9 @@ void SV_SendServerinfo (client_t *client)
 		EntityFrame4_FreeDatabase(client->entitydatabase4);
 	if (client->entitydatabase5)
 		EntityFrame5_FreeDatabase(client->entitydatabase5);
+	if (client->visibilitycache)
+		Mem_Free(client->visibilitycache);
+	client->visibilitycache = NULL;
 
 	memset(client->stats, 0, sizeof(client->stats));
 	memset(client->statsdeltabits, 0, sizeof(client->statsdeltabits));
@@ -1441,6 +1473,9 @@ static qboolean SV_PrepareEntityForSending (prvm_edict_t *ent, entity_state_t *c
 			if (i <= MAX_ENTITYCLUSTERS)
 				ent->priv.server->pvs_numclusters = i;
 		}
+		ent->priv.server->pvs_centercluster = -1;
+		if (sv.worldmodel && sv.worldmodel->brush.PointInLeaf)
+			ent->priv.server->pvs_centercluster = sv.worldmodel->brush.PointInLeaf(sv.worldmodel, cs->netcenter)->clusterindex;
 	}
 
 	// we need to do some csqc entity upkeep here
@@ -1468,32 +1503,191 @@ static qboolean SV_PrepareEntityForSending (prvm_edict_t *ent, entity_state_t *c
 	return true;
 }
 
+// per client copy of an entity that looks different to each client
+// (customizeentityforclient or exteriormodelforclient)
+typedef struct sv_sendclientstate_s
+{
+	// false if customizeentityforclient rejected the entity for this client
+	qboolean valid;
+	entity_state_t state;
+	// the culling box is recalculated when the entity is customized
+	vec3_t cullmins, cullmaxs;
+	int pvs_numclusters;
+	int pvs_clusterlist[MAX_ENTITYCLUSTERS];
+	int pvs_centercluster;
+}
+sv_sendclientstate_t;
+
+// marks in sv_sendclient_t::entitymarks
+#define SV_SENDMARK_CONSIDERED 1
+#define SV_SENDMARK_VISIBLE 2
+
+// everything needed to build the packet for one client, the entity culling
+// and entity frame writing only touch this (and read shared server state) so
+// they can run on worker threads, see SV_SendClientMessages
+typedef struct sv_sendclient_s
+{
+	client_t *client;
+	// NetConn_CanSend allowed a packet this frame
+	qboolean send;
+	// there is room for entities in the packet
+	qboolean writeentities;
+	// the entity frame was written (or did not need to be)
+	qboolean success;
+	qboolean need_empty;
+
+	int clientrate;
+	int maxsize;
+	int maxsize2;
+	sizebuf_t msg;
+	unsigned char msgbuf[NET_MAXMESSAGE];
+
+	int cliententitynumber;
+	vec3_t eyes[MAX_CLIENTNETWORKEYES];
+	int numeyes;
+	int pvsbytes;
+	unsigned char pvs[MAX_MAP_LEAFS/8];
+	// cluster of the first eye for sv_cullentities_trace_cache, -1 if unknown
+	int eyecluster;
+	// private random sequence for the trace culling
+	unsigned int randomseed;
+
+	int stats_culled_pvs;
+	int stats_culled_trace;
+	int stats_visibleentities;
+	int stats_totalentities;
+	int stats_visibilitycache_hits;
+	int stats_visibilitycache_misses;
+
+	// arrays indexed by entity number, sized by sv_sendclients_maxedicts
+	unsigned char *entitymarks;
+	const entity_state_t **sendstates;
+	unsigned short *csqcsendstates;
+	int numsendstates;
+	int numcsqcsendstates;
+
+	// one entry for each of sv.clientstateentities
+	int maxclientstates;
+	sv_sendclientstate_t *clientstates;
+
+	taskqueue_task_t task;
+}
+sv_sendclient_t;
+
+static sv_sendclient_t *sv_sendclients;
+static int sv_sendclients_numclients;
+static int sv_sendclients_maxedicts;
+
+static void SV_SendClients_Alloc(void)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	int i;
+	unsigned char *data;
+	sv_sendclient_t *sc;
+
+	if (sv_sendclients_numclients >= svs.maxclients && sv_sendclients_maxedicts >= prog->max_edicts)
+		return;
+
+	if (sv_sendclients)
+	{
+		for (i = 0, sc = sv_sendclients;i < sv_sendclients_numclients;i++, sc++)
+		{
+			// sendstates is the start of the per entity allocation
+			Mem_Free((void *)sc->sendstates);
+			if (sc->clientstates)
+				Mem_Free(sc->clientstates);
+		}
+		Mem_Free(sv_sendclients);
+	}
+
+	sv_sendclients_numclients = svs.maxclients;
+	sv_sendclients_maxedicts = prog->max_edicts;
+	sv_sendclients = (sv_sendclient_t *)Mem_Alloc(sv_mempool, sv_sendclients_numclients * sizeof(*sv_sendclients));
+	for (i = 0, sc = sv_sendclients;i < sv_sendclients_numclients;i++, sc++)
+	{
+		data = (unsigned char *)Mem_Alloc(sv_mempool, sv_sendclients_maxedicts * (sizeof(*sc->sendstates) + sizeof(*sc->csqcsendstates) + sizeof(*sc->entitymarks)));
+		sc->sendstates = (const entity_state_t **)data;data += sv_sendclients_maxedicts * sizeof(*sc->sendstates);
+		sc->csqcsendstates = (unsigned short *)data;data += sv_sendclients_maxedicts * sizeof(*sc->csqcsendstates);
+		sc->entitymarks = data;
+	}
+}
+
+// entities that can block line of sight for SV_CanSeeBox
+static qboolean SV_IsOccluder(prvm_edict_t *ent)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	float alpha;
+	dp_model_t *model;
+	if (PRVM_serveredictfloat(ent, solid) != SOLID_BSP)
+		return false;
+	model = SV_GetModelFromEdict(ent);
+	if (!model || !model->brush.TraceLineOfSight)
+		return false;
+	// skip obviously transparent entities
+	alpha = PRVM_serveredictfloat(ent, alpha);
+	if (alpha && alpha < 1)
+		return false;
+	if ((int)PRVM_serveredictfloat(ent, effects) & EF_ADDITIVE)
+		return false;
+	return true;
+}
+
 static void SV_PrepareEntitiesForSending(void)
 {
 	prvm_prog_t *prog = SVVM_prog;
 	int e;
 	prvm_edict_t *ent;
+	entity_state_t *s;
 	// send all entities that touch the pvs
 	sv.numsendentities = 0;
+	sv.numclientstateentities = 0;
+	sv.numoccluders = 0;
 	sv.sendentitiesindex[0] = NULL;
 	memset(sv.sendentitiesindex, 0, prog->num_edicts * sizeof(*sv.sendentitiesindex));
+	EntityFrame5_ClearUpdateCache();
 	for (e = 1, ent = PRVM_NEXT_EDICT(prog->edicts);e < prog->num_edicts;e++, ent = PRVM_NEXT_EDICT(ent))
 	{
-		if (!ent->priv.server->free && SV_PrepareEntityForSending(ent, sv.sendentities + sv.numsendentities, e))
+		// free entities the physics saw are skipped without touching them
+		if ((sv_hotfields.integer && sv.hotstate[e] == HOTSTATE_FREE && !prog->touchededicts[e]) || ent->priv.server->free)
+			continue;
+		s = sv.sendentities + sv.numsendentities;
+		if (SV_PrepareEntityForSending(ent, s, e))
 		{
-			sv.sendentitiesindex[e] = sv.sendentities + sv.numsendentities;
+			sv.sendentitiesindex[e] = s;
 			sv.numsendentities++;
+			// entities that look different to each client get a copy per client
+			sv.sendentitiesclientstate[e] = -1;
+			if (s->customizeentityforclient || s->exteriormodelforclient)
+			{
+				sv.sendentitiesclientstate[e] = sv.numclientstateentities;
+				sv.clientstateentities[sv.numclientstateentities++] = e;
+			}
 		}
+		// the culling traces test against this list rather than querying the
+		// area grid, so they do not touch any shared state
+		if (sv_cullentities_trace_entityocclusion.integer && (ent->priv.server->areagrid[0].prev || ent->priv.server->areabvhnode) && SV_IsOccluder(ent))
+			sv.occluders[sv.numoccluders++] = ent;
 	}
 }
 
 #define MAX_LINEOFSIGHTTRACES 64
 
-qboolean SV_CanSeeBox(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entboxexpand, vec3_t eye, vec3_t entboxmins, vec3_t entboxmaxs)
+// random numbers for SV_CanSeeBox, uses rand() if there is no seed, otherwise
+// a private sequence so the results do not depend on which thread runs the
+// test or on what the other clients did
+static float SV_CanSeeBox_Random(unsigned int *seed, float mins, float maxs)
+{
+	if (!seed)
+		return lhrandom(mins, maxs);
+	*seed = *seed * 1103515245 + 12345;
+	return mins + (maxs - mins) * (((*seed >> 8) & 0xFFFFFF) + 0.5f) * (1.0f / 16777216.0f);
+}
+
+// if occluders is NULL the area grid is searched for occluding entities
+static qboolean SV_CanSeeBox_Occluders(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entboxexpand, const vec3_t eye, const vec3_t entboxmins, const vec3_t entboxmaxs, unsigned int *randomseed, int numoccluders, prvm_edict_t **occluders)
 {
 	prvm_prog_t *prog = SVVM_prog;
 	float pitchsign;
-	float alpha;
 	float starttransformed[3], endtransformed[3];
 	float boxminstransformed[3], boxmaxstransformed[3];
 	float localboxcenter[3], localboxextents[3], localboxmins[3], localboxmaxs[3];
@@ -1530,7 +1724,7 @@ qboolean SV_CanSeeBox(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entbo
 
 	VectorMAM(0.5f, boxmins, 0.5f, boxmaxs, endpoints[0]);
 	for (traceindex = 1;traceindex < numtraces;traceindex++)
-		VectorSet(endpoints[traceindex], lhrandom(boxmins[0], boxmaxs[0]), lhrandom(boxmins[1], boxmaxs[1]), lhrandom(boxmins[2], boxmaxs[2]));
+		VectorSet(endpoints[traceindex], SV_CanSeeBox_Random(randomseed, boxmins[0], boxmaxs[0]), SV_CanSeeBox_Random(randomseed, boxmins[1], boxmaxs[1]), SV_CanSeeBox_Random(randomseed, boxmins[2], boxmaxs[2]));
 
 	// calculate sweep box for the entire swarm of traces
 	VectorCopy(eyemins, clipboxmins);
@@ -1545,33 +1739,25 @@ qboolean SV_CanSeeBox(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entbo
 		clipboxmaxs[2] = max(clipboxmaxs[2], endpoints[traceindex][2]);
 	}
 
-	// get the list of entities in the sweep box
-	if (sv_cullentities_trace_entityocclusion.integer)
-		numtouchedicts = SV_EntitiesInBox(clipboxmins, clipboxmaxs, MAX_EDICTS, touchedicts);
-	if (numtouchedicts > MAX_EDICTS)
-	{
-		// this never happens
-		Con_Printf("SV_EntitiesInBox returned %i edicts, max was %i\n", numtouchedicts, MAX_EDICTS);
-		numtouchedicts = MAX_EDICTS;
-	}
-	// iterate the entities found in the sweep box and filter them
-	originalnumtouchedicts = numtouchedicts;
-	numtouchedicts = 0;
-	for (touchindex = 0;touchindex < originalnumtouchedicts;touchindex++)
+	if (!occluders)
 	{
-		touch = touchedicts[touchindex];
-		if (PRVM_serveredictfloat(touch, solid) != SOLID_BSP)
-			continue;
-		model = SV_GetModelFromEdict(touch);
-		if (!model || !model->brush.TraceLineOfSight)
-			continue;
-		// skip obviously transparent entities
-		alpha = PRVM_serveredictfloat(touch, alpha);
-		if (alpha && alpha < 1)
-			continue;
-		if ((int)PRVM_serveredictfloat(touch, effects) & EF_ADDITIVE)
-			continue;
-		touchedicts[numtouchedicts++] = touch;
+		// get the list of entities in the sweep box
+		if (sv_cullentities_trace_entityocclusion.integer)
+			numtouchedicts = SV_EntitiesInBox(clipboxmins, clipboxmaxs, MAX_EDICTS, touchedicts);
+		if (numtouchedicts > MAX_EDICTS)
+		{
+			// this never happens
+			Con_Printf("SV_EntitiesInBox returned %i edicts, max was %i\n", numtouchedicts, MAX_EDICTS);
+			numtouchedicts = MAX_EDICTS;
+		}
+		// iterate the entities found in the sweep box and filter them
+		originalnumtouchedicts = numtouchedicts;
+		numtouchedicts = 0;
+		for (touchindex = 0;touchindex < originalnumtouchedicts;touchindex++)
+			if (SV_IsOccluder(touchedicts[touchindex]))
+				touchedicts[numtouchedicts++] = touchedicts[touchindex];
+		occluders = touchedicts;
+		numoccluders = numtouchedicts;
 	}
 
 	// now that we have a filtered list of "interesting" entities, fire each
@@ -1580,14 +1766,17 @@ qboolean SV_CanSeeBox(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entbo
 
 	for (traceindex = 0;traceindex < numtraces;traceindex++)
 	{
-		VectorSet(start, lhrandom(eyemins[0], eyemaxs[0]), lhrandom(eyemins[1], eyemaxs[1]), lhrandom(eyemins[2], eyemaxs[2]));
+		VectorSet(start, SV_CanSeeBox_Random(randomseed, eyemins[0], eyemaxs[0]), SV_CanSeeBox_Random(randomseed, eyemins[1], eyemaxs[1]), SV_CanSeeBox_Random(randomseed, eyemins[2], eyemaxs[2]));
 		// check world occlusion
 		if (sv.worldmodel && sv.worldmodel->brush.TraceLineOfSight)
 			if (!sv.worldmodel->brush.TraceLineOfSight(sv.worldmodel, start, endpoints[traceindex], boxmins, boxmaxs))
 				continue;
-		for (touchindex = 0;touchindex < numtouchedicts;touchindex++)
+		for (touchindex = 0;touchindex < numoccluders;touchindex++)
 		{
-			touch = touchedicts[touchindex];
+			touch = occluders[touchindex];
+			// a prebuilt list covers the whole level
+			if (!BoxesOverlap(clipboxmins, clipboxmaxs, touch->priv.server->areamins, touch->priv.server->areamaxs))
+				continue;
 			model = SV_GetModelFromEdict(touch);
 			if(model && model->brush.TraceLineOfSight)
 			{
@@ -1619,7 +1808,7 @@ qboolean SV_CanSeeBox(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entbo
 			}
 		}
 		// check if the ray was blocked
-		if (touchindex < numtouchedicts)
+		if (touchindex < numoccluders)
 			continue;
 		// return if the ray was not blocked
 		return true;
@@ -1629,34 +1818,51 @@ qboolean SV_CanSeeBox(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entbo
 	return false;
 }
 
-static void SV_MarkWriteEntityStateToClient(entity_state_t *s)
+qboolean SV_CanSeeBox(int numtraces, vec_t eyejitter, vec_t enlarge, vec_t entboxexpand, vec3_t eye, vec3_t entboxmins, vec3_t entboxmaxs)
+{
+	return SV_CanSeeBox_Occluders(numtraces, eyejitter, enlarge, entboxexpand, eye, entboxmins, entboxmaxs, NULL, 0, NULL);
+}
+
+// returns the state of a sv.sendentities entry as this client sees it
+static const entity_state_t *SV_SendClientEntityState(sv_sendclient_t *sc, const entity_state_t *s)
+{
+	int i = sv.sendentitiesclientstate[s->number];
+	return i >= 0 ? &sc->clientstates[i].state : s;
+}
+
+// this runs on worker threads, it must not change anything outside of sc
+static void SV_MarkWriteEntityStateToClient(sv_sendclient_t *sc, const entity_state_t *s)
 {
 	prvm_prog_t *prog = SVVM_prog;
 	int isbmodel;
 	dp_model_t *model;
 	prvm_edict_t *ed;
-	if (sv.sententitiesconsideration[s->number] == sv.sententitiesmark)
+	const sv_sendclientstate_t *cs = NULL;
+	const vec_t *cullmins, *cullmaxs;
+	const int *pvs_clusterlist;
+	int pvs_numclusters;
+	int pvs_centercluster;
+	if (sc->entitymarks[s->number])
 		return;
-	sv.sententitiesconsideration[s->number] = sv.sententitiesmark;
-	sv.writeentitiestoclient_stats_totalentities++;
+	sc->entitymarks[s->number] = SV_SENDMARK_CONSIDERED;
+	sc->stats_totalentities++;
 
-	if (s->customizeentityforclient)
+	// customizeentityforclient already ran in SV_WriteEntitiesToClient_ClientStates
+	if (sv.sendentitiesclientstate[s->number] >= 0)
 	{
-		PRVM_serverglobalfloat(time) = sv.time;
-		PRVM_serverglobaledict(self) = s->number;
-		PRVM_serverglobaledict(other) = sv.writeentitiestoclient_cliententitynumber;
-		prog->ExecuteProgram(prog, s->customizeentityforclient, "customizeentityforclient: NULL function");
-		if(!PRVM_G_FLOAT(OFS_RETURN) || !SV_PrepareEntityForSending(PRVM_EDICT_NUM(s->number), s, s->number))
+		cs = sc->clientstates + sv.sendentitiesclientstate[s->number];
+		if (!cs->valid)
 			return;
+		s = &cs->state;
 	}
 
 	// never reject player
-	if (s->number != sv.writeentitiestoclient_cliententitynumber)
+	if (s->number != sc->cliententitynumber)
 	{
 		// check various rejection conditions
-		if (s->nodrawtoclient == sv.writeentitiestoclient_cliententitynumber)
+		if (s->nodrawtoclient == sc->cliententitynumber)
 			return;
-		if (s->drawonlytoclient && s->drawonlytoclient != sv.writeentitiestoclient_cliententitynumber)
+		if (s->drawonlytoclient && s->drawonlytoclient != sc->cliententitynumber)
 			return;
 		if (s->effects & EF_NODRAW)
 			return;
@@ -1668,7 +1874,7 @@ static void SV_MarkWriteEntityStateToClient(entity_state_t *s)
 		// viewmodels don't have visibility checking
 		if (s->viewmodelforclient)
 		{
-			if (s->viewmodelforclient != sv.writeentitiestoclient_cliententitynumber)
+			if (s->viewmodelforclient != sc->cliententitynumber)
 				return;
 		}
 		else if (s->tagentity)
@@ -1676,8 +1882,8 @@ static void SV_MarkWriteEntityStateToClient(entity_state_t *s)
 			// tag attached entities simply check their parent
 			if (!sv.sendentitiesindex[s->tagentity])
 				return;
-			SV_MarkWriteEntityStateToClient(sv.sendentitiesindex[s->tagentity]);
-			if (sv.sententities[s->tagentity] != sv.sententitiesmark)
+			SV_MarkWriteEntityStateToClient(sc, sv.sendentitiesindex[s->tagentity]);
+			if (sc->entitymarks[s->tagentity] != SV_SENDMARK_VISIBLE)
 				return;
 		}
 		// always send world submodels in newer protocols because they don't
@@ -1687,16 +1893,32 @@ static void SV_MarkWriteEntityStateToClient(entity_state_t *s)
 		{
 			// entity has survived every check so far, check if visible
 			ed = PRVM_EDICT_NUM(s->number);
+			if (cs)
+			{
+				cullmins = cs->cullmins;
+				cullmaxs = cs->cullmaxs;
+				pvs_numclusters = cs->pvs_numclusters;
+				pvs_clusterlist = cs->pvs_clusterlist;
+				pvs_centercluster = cs->pvs_centercluster;
+			}
+			else
+			{
+				cullmins = ed->priv.server->cullmins;
+				cullmaxs = ed->priv.server->cullmaxs;
+				pvs_numclusters = ed->priv.server->pvs_numclusters;
+				pvs_clusterlist = ed->priv.server->pvs_clusterlist;
+				pvs_centercluster = ed->priv.server->pvs_centercluster;
+			}
 
 			// if not touching a visible leaf
-			if (sv_cullentities_pvs.integer && !r_novis.integer && !r_trippy.integer && sv.writeentitiestoclient_pvsbytes)
+			if (sv_cullentities_pvs.integer && !r_novis.integer && !r_trippy.integer && sc->pvsbytes)
 			{
-				if (ed->priv.server->pvs_numclusters < 0)
+				if (pvs_numclusters < 0)
 				{
 					// entity too big for clusters list
-					if (sv.worldmodel && sv.worldmodel->brush.BoxTouchingPVS && !sv.worldmodel->brush.BoxTouchingPVS(sv.worldmodel, sv.writeentitiestoclient_pvs, ed->priv.server->cullmins, ed->priv.server->cullmaxs))
+					if (sv.worldmodel && sv.worldmodel->brush.BoxTouchingPVS && !sv.worldmodel->brush.BoxTouchingPVS(sv.worldmodel, sc->pvs, cullmins, cullmaxs))
 					{
-						sv.writeentitiestoclient_stats_culled_pvs++;
+						sc->stats_culled_pvs++;
 						return;
 					}
 				}
@@ -1704,12 +1926,12 @@ static void SV_MarkWriteEntityStateToClient(entity_state_t *s)
 				{
 					int i;
 					// check cached clusters list
-					for (i = 0;i < ed->priv.server->pvs_numclusters;i++)
-						if (CHECKPVSBIT(sv.writeentitiestoclient_pvs, ed->priv.server->pvs_clusterlist[i]))
+					for (i = 0;i < pvs_numclusters;i++)
+						if (CHECKPVSBIT(sc->pvs, pvs_clusterlist[i]))
 							break;
-					if (i == ed->priv.server->pvs_numclusters)
+					if (i == pvs_numclusters)
 					{
-						sv.writeentitiestoclient_stats_culled_pvs++;
+						sc->stats_culled_pvs++;
 						return;
 					}
 				}
@@ -1730,19 +1952,40 @@ static void SV_MarkWriteEntityStateToClient(entity_state_t *s)
 				if(samples > 0)
 				{
 					int eyeindex;
-					for (eyeindex = 0;eyeindex < sv.writeentitiestoclient_numeyes;eyeindex++)
-						if(SV_CanSeeBox(samples, sv_cullentities_trace_eyejitter.value, enlarge, sv_cullentities_trace_expand.value, sv.writeentitiestoclient_eyes[eyeindex], ed->priv.server->cullmins, ed->priv.server->cullmaxs))
-							break;
-					if(eyeindex < sv.writeentitiestoclient_numeyes)
-						svs.clients[sv.writeentitiestoclient_clientnumber].visibletime[s->number] =
+					qboolean visible;
+					entityvisibilitycache_t *cache = sc->client->visibilitycache + s->number;
+					qboolean usecache = sc->client->visibilitycache && sv_cullentities_trace_cache.value > 0 && sc->eyecluster >= 0 && pvs_centercluster >= 0;
+					if (usecache && realtime < cache->expiretime && cache->eyecluster == sc->eyecluster && cache->entitycluster == pvs_centercluster)
+					{
+						// neither the eye nor the entity moved far, reuse the result
+						visible = cache->visible;
+						sc->stats_visibilitycache_hits++;
+					}
+					else
+					{
+						for (eyeindex = 0;eyeindex < sc->numeyes;eyeindex++)
+							if(SV_CanSeeBox_Occluders(samples, sv_cullentities_trace_eyejitter.value, enlarge, sv_cullentities_trace_expand.value, sc->eyes[eyeindex], cullmins, cullmaxs, &sc->randomseed, sv.numoccluders, sv.occluders))
+								break;
+						visible = eyeindex < sc->numeyes;
+						if (usecache)
+						{
+							cache->eyecluster = sc->eyecluster;
+							cache->entitycluster = pvs_centercluster;
+							cache->expiretime = realtime + sv_cullentities_trace_cache.value;
+							cache->visible = visible;
+							sc->stats_visibilitycache_misses++;
+						}
+					}
+					if(visible)
+						sc->client->visibletime[s->number] =
 							realtime + (
 								s->number <= svs.maxclients
 									? sv_cullentities_trace_delay_players.value
 									: sv_cullentities_trace_delay.value
 							);
-					else if (realtime > svs.clients[sv.writeentitiestoclient_clientnumber].visibletime[s->number])
+					else if (realtime > sc->client->visibletime[s->number])
 					{
-						sv.writeentitiestoclient_stats_culled_trace++;
+						sc->stats_culled_trace++;
 						return;
 					}
 				}
@@ -1753,13 +1996,13 @@ static void SV_MarkWriteEntityStateToClient(entity_state_t *s)
 	// this just marks it for sending
 	// FIXME: it would be more efficient to send here, but the entity
 	// compressor isn't that flexible
-	sv.writeentitiestoclient_stats_visibleentities++;
-	sv.sententities[s->number] = sv.sententitiesmark;
+	sc->stats_visibleentities++;
+	sc->entitymarks[s->number] = SV_SENDMARK_VISIBLE;
 }
 
 #if MAX_LEVELNETWORKEYES > 0
 #define MAX_EYE_RECURSION 1 // increase if recursion gets supported by portals
-static void SV_AddCameraEyes(void)
+static void SV_AddCameraEyes(sv_sendclient_t *sc)
 {
 	prvm_prog_t *prog = SVVM_prog;
 	int e, i, j, k;
@@ -1770,7 +2013,7 @@ static void SV_AddCameraEyes(void)
 	int n_cameras = 0;
 	vec3_t mi, ma;
 
-	for(i = 0; i < sv.writeentitiestoclient_numeyes; ++i)
+	for(i = 0; i < sc->numeyes; ++i)
 		eye_levels[i] = 0;
 
 	// check line of sight to portal entities and add them to PVS
@@ -1782,12 +2025,12 @@ static void SV_AddCameraEyes(void)
 			{
 				PRVM_serverglobalfloat(time) = sv.time;
 				PRVM_serverglobaledict(self) = e;
-				PRVM_serverglobaledict(other) = sv.writeentitiestoclient_cliententitynumber;
-				VectorCopy(sv.writeentitiestoclient_eyes[0], PRVM_serverglobalvector(trace_endpos));
-				VectorCopy(sv.writeentitiestoclient_eyes[0], PRVM_G_VECTOR(OFS_PARM0));
+				PRVM_serverglobaledict(other) = sc->cliententitynumber;
+				VectorCopy(sc->eyes[0], PRVM_serverglobalvector(trace_endpos));
+				VectorCopy(sc->eyes[0], PRVM_G_VECTOR(OFS_PARM0));
 				VectorClear(PRVM_G_VECTOR(OFS_PARM1));
 				prog->ExecuteProgram(prog, PRVM_serveredictfunction(ed, camera_transform), "QC function e.camera_transform is missing");
-				if(!VectorCompare(PRVM_serverglobalvector(trace_endpos), sv.writeentitiestoclient_eyes[0]))
+				if(!VectorCompare(PRVM_serverglobalvector(trace_endpos), sc->eyes[0]))
 				{
 					VectorCopy(PRVM_serverglobalvector(trace_endpos), camera_origins[n_cameras]);
 					cameras[n_cameras] = e;
@@ -1804,22 +2047,22 @@ static void SV_AddCameraEyes(void)
 
 	// i is loop counter, is reset to 0 when an eye got added
 	// j is camera index to check
-	for(i = 0, j = 0; sv.writeentitiestoclient_numeyes < MAX_CLIENTNETWORKEYES && i < n_cameras; ++i, ++j, j %= n_cameras)
+	for(i = 0, j = 0; sc->numeyes < MAX_CLIENTNETWORKEYES && i < n_cameras; ++i, ++j, j %= n_cameras)
 	{
 		if(!cameras[j])
 			continue;
 		ed = PRVM_EDICT_NUM(cameras[j]);
 		VectorAdd(PRVM_serveredictvector(ed, origin), PRVM_serveredictvector(ed, mins), mi);
 		VectorAdd(PRVM_serveredictvector(ed, origin), PRVM_serveredictvector(ed, maxs), ma);
-		for(k = 0; k < sv.writeentitiestoclient_numeyes; ++k)
+		for(k = 0; k < sc->numeyes; ++k)
 		if(eye_levels[k] <= MAX_EYE_RECURSION)
 		{
-			if(SV_CanSeeBox(sv_cullentities_trace_samples.integer, sv_cullentities_trace_eyejitter.value, sv_cullentities_trace_enlarge.value, sv_cullentities_trace_expand.value, sv.writeentitiestoclient_eyes[k], mi, ma))
+			if(SV_CanSeeBox(sv_cullentities_trace_samples.integer, sv_cullentities_trace_eyejitter.value, sv_cullentities_trace_enlarge.value, sv_cullentities_trace_expand.value, sc->eyes[k], mi, ma))
 			{
-				eye_levels[sv.writeentitiestoclient_numeyes] = eye_levels[k] + 1;
-				VectorCopy(camera_origins[j], sv.writeentitiestoclient_eyes[sv.writeentitiestoclient_numeyes]);
-				// Con_Printf("added eye %d: %f %f %f because we can see %f %f %f .. %f %f %f from eye %d\n", j, sv.writeentitiestoclient_eyes[sv.writeentitiestoclient_numeyes][0], sv.writeentitiestoclient_eyes[sv.writeentitiestoclient_numeyes][1], sv.writeentitiestoclient_eyes[sv.writeentitiestoclient_numeyes][2], mi[0], mi[1], mi[2], ma[0], ma[1], ma[2], k);
-				sv.writeentitiestoclient_numeyes++;
+				eye_levels[sc->numeyes] = eye_levels[k] + 1;
+				VectorCopy(camera_origins[j], sc->eyes[sc->numeyes]);
+				// Con_Printf("added eye %d: %f %f %f because we can see %f %f %f .. %f %f %f from eye %d\n", j, sc->eyes[sc->numeyes][0], sc->eyes[sc->numeyes][1], sc->eyes[sc->numeyes][2], mi[0], mi[1], mi[2], ma[0], ma[1], ma[2], k);
+				sc->numeyes++;
 				cameras[j] = 0;
 				i = 0;
 				break;
@@ -1828,46 +2071,110 @@ static void SV_AddCameraEyes(void)
 	}
 }
 #else
-void SV_AddCameraEyes(void)
+static void SV_AddCameraEyes(sv_sendclient_t *sc)
 {
 }
 #endif
 
-static void SV_WriteEntitiesToClient(client_t *client, prvm_edict_t *clent, sizebuf_t *msg, int maxsize)
+// runs customizeentityforclient and applies exteriormodelforclient for this
+// client, the results go into private copies of the entity states so the
+// culling does not need to run QC or change shared state
+static void SV_WriteEntitiesToClient_ClientStates(sv_sendclient_t *sc)
 {
 	prvm_prog_t *prog = SVVM_prog;
-	qboolean need_empty = false;
-	int i, numsendstates, numcsqcsendstates;
+	int i;
 	entity_state_t *s;
+	prvm_edict_t *ed;
+	sv_sendclientstate_t *cs;
+
+	if (sc->maxclientstates < sv.numclientstateentities)
+	{
+		if (sc->clientstates)
+			Mem_Free(sc->clientstates);
+		sc->maxclientstates = (sv.numclientstateentities + 255) & ~255;
+		sc->clientstates = (sv_sendclientstate_t *)Mem_Alloc(sv_mempool, sc->maxclientstates * sizeof(*sc->clientstates));
+	}
+
+	for (i = 0, cs = sc->clientstates;i < sv.numclientstateentities;i++, cs++)
+	{
+		s = sv.sendentitiesindex[sv.clientstateentities[i]];
+		ed = PRVM_EDICT_NUM(s->number);
+		cs->valid = false;
+		if (s->customizeentityforclient)
+		{
+			PRVM_serverglobalfloat(time) = sv.time;
+			PRVM_serverglobaledict(self) = s->number;
+			PRVM_serverglobaledict(other) = sc->cliententitynumber;
+			prog->ExecuteProgram(prog, s->customizeentityforclient, "customizeentityforclient: NULL function");
+			// the shared state stays as the physics left it, the other
+			// clients and the tag lookups still use it
+			if(!PRVM_G_FLOAT(OFS_RETURN) || !SV_PrepareEntityForSending(ed, &cs->state, s->number))
+				continue;
+		}
+		else
+			cs->state = *s;
+		cs->valid = true;
+		if (cs->state.active == ACTIVE_NETWORK && cs->state.exteriormodelforclient)
+		{
+			if (cs->state.exteriormodelforclient == sc->cliententitynumber)
+				cs->state.flags |= RENDER_EXTERIORMODEL;
+			else
+				cs->state.flags &= ~RENDER_EXTERIORMODEL;
+		}
+		VectorCopy(ed->priv.server->cullmins, cs->cullmins);
+		VectorCopy(ed->priv.server->cullmaxs, cs->cullmaxs);
+		cs->pvs_numclusters = ed->priv.server->pvs_numclusters;
+		cs->pvs_centercluster = ed->priv.server->pvs_centercluster;
+		if (cs->pvs_numclusters > 0)
+			memcpy(cs->pvs_clusterlist, ed->priv.server->pvs_clusterlist, cs->pvs_numclusters * sizeof(*cs->pvs_clusterlist));
+	}
+}
+
+// sets up the eyes and pvs of the client, and runs all the QC the entity
+// culling needs
+static void SV_WriteEntitiesToClient_Begin(sv_sendclient_t *sc)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	client_t *client = sc->client;
+	prvm_edict_t *clent = client->edict;
+	int i;
 	prvm_edict_t *camera;
-	qboolean success;
 	vec3_t eye;
 
 	// if there isn't enough space to accomplish anything, skip it
-	if (msg->cursize + 25 > maxsize)
+	sc->writeentities = sc->msg.cursize + 25 <= sc->maxsize;
+	if (!sc->writeentities)
 		return;
 
-	sv.writeentitiestoclient_msg = msg;
+	sv.writeentitiestoclient_msg = &sc->msg;
 	sv.writeentitiestoclient_clientnumber = client - svs.clients;
 
-	sv.writeentitiestoclient_stats_culled_pvs = 0;
-	sv.writeentitiestoclient_stats_culled_trace = 0;
-	sv.writeentitiestoclient_stats_visibleentities = 0;
-	sv.writeentitiestoclient_stats_totalentities = 0;
-	sv.writeentitiestoclient_numeyes = 0;
+	sc->stats_culled_pvs = 0;
+	sc->stats_culled_trace = 0;
+	sc->stats_visibleentities = 0;
+	sc->stats_totalentities = 0;
+	sc->stats_visibilitycache_hits = 0;
+	sc->stats_visibilitycache_misses = 0;
+	sc->numeyes = 0;
 
 	// get eye location
-	sv.writeentitiestoclient_cliententitynumber = PRVM_EDICT_TO_PROG(clent); // LordHavoc: for comparison purposes
+	sc->cliententitynumber = PRVM_EDICT_TO_PROG(clent); // LordHavoc: for comparison purposes
+	sv.writeentitiestoclient_cliententitynumber = sc->cliententitynumber;
 	camera = PRVM_EDICT_NUM( client->clientcamera );
 	VectorAdd(PRVM_serveredictvector(camera, origin), PRVM_serveredictvector(clent, view_ofs), eye);
-	sv.writeentitiestoclient_pvsbytes = 0;
+	sc->pvsbytes = 0;
 	// get the PVS values for the eye location, later FatPVS calls will merge
 	if (sv.worldmodel && sv.worldmodel->brush.FatPVS)
-		sv.writeentitiestoclient_pvsbytes = sv.worldmodel->brush.FatPVS(sv.worldmodel, eye, 8, sv.writeentitiestoclient_pvs, sizeof(sv.writeentitiestoclient_pvs), sv.writeentitiestoclient_pvsbytes != 0);
+		sc->pvsbytes = sv.worldmodel->brush.FatPVS(sv.worldmodel, eye, 8, sc->pvs, sizeof(sc->pvs), sc->pvsbytes != 0);
+
+	// the cached culling results are valid while the eye stays in this cluster
+	sc->eyecluster = -1;
+	if (sv.worldmodel && sv.worldmodel->brush.PointInLeaf)
+		sc->eyecluster = sv.worldmodel->brush.PointInLeaf(sv.worldmodel, eye)->clusterindex;
 
 	// add the eye to a list for SV_CanSeeBox tests
-	VectorCopy(eye, sv.writeentitiestoclient_eyes[sv.writeentitiestoclient_numeyes]);
-	sv.writeentitiestoclient_numeyes++;
+	VectorCopy(eye, sc->eyes[sc->numeyes]);
+	sc->numeyes++;
 
 	// calculate predicted eye origin for SV_CanSeeBox tests
 	if (sv_cullentities_trace_prediction.integer)
@@ -1877,92 +2184,135 @@ static void SV_WriteEntitiesToClient(client_t *client, prvm_edict_t *clent, size
 		VectorMA(eye, predtime, PRVM_serveredictvector(camera, velocity), predeye);
 		if (SV_CanSeeBox(1, 0, 0, 0, eye, predeye, predeye))
 		{
-			VectorCopy(predeye, sv.writeentitiestoclient_eyes[sv.writeentitiestoclient_numeyes]);
-			sv.writeentitiestoclient_numeyes++;
+			VectorCopy(predeye, sc->eyes[sc->numeyes]);
+			sc->numeyes++;
 		}
 		//if (!sv.writeentitiestoclient_useprediction)
 		//	Con_DPrintf("Trying to walk into solid in a pingtime... not predicting for culling\n");
 	}
 
-	SV_AddCameraEyes();
+	SV_AddCameraEyes(sc);
 
 	// build PVS from the new eyes
 	if (sv.worldmodel && sv.worldmodel->brush.FatPVS)
-		for(i = 1; i < sv.writeentitiestoclient_numeyes; ++i)
-			sv.writeentitiestoclient_pvsbytes = sv.worldmodel->brush.FatPVS(sv.worldmodel, sv.writeentitiestoclient_eyes[i], 8, sv.writeentitiestoclient_pvs, sizeof(sv.writeentitiestoclient_pvs), sv.writeentitiestoclient_pvsbytes != 0);
+		for(i = 1; i < sc->numeyes; ++i)
+			sc->pvsbytes = sv.worldmodel->brush.FatPVS(sv.worldmodel, sc->eyes[i], 8, sc->pvs, sizeof(sc->pvs), sc->pvsbytes != 0);
+
+	// the trace culling draws from its own sequence, the same whichever
+	// thread writes this client
+	sc->randomseed = sv_cullentities_trace.integer ? sv.framenum * 2654435761u + (unsigned int)(client - svs.clients) * 40503u : 0;
 
-	sv.sententitiesmark++;
+	SV_WriteEntitiesToClient_ClientStates(sc);
+}
+
+// decides which entities this client gets, this runs on worker threads
+static void SV_WriteEntitiesToClient_Cull(sv_sendclient_t *sc)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	int i;
+	const entity_state_t *s;
+
+	if (!sc->writeentities)
+		return;
+
+	memset(sc->entitymarks, 0, prog->num_edicts * sizeof(*sc->entitymarks));
 
 	for (i = 0;i < sv.numsendentities;i++)
-		SV_MarkWriteEntityStateToClient(sv.sendentities + i);
+		SV_MarkWriteEntityStateToClient(sc, sv.sendentities + i);
 
-	numsendstates = 0;
-	numcsqcsendstates = 0;
+	sc->numsendstates = 0;
+	sc->numcsqcsendstates = 0;
 	for (i = 0;i < sv.numsendentities;i++)
 	{
-		s = &sv.sendentities[i];
-		if (sv.sententities[s->number] == sv.sententitiesmark)
-		{
-			if(s->active == ACTIVE_NETWORK)
-			{
-				if (s->exteriormodelforclient)
-				{
-					if (s->exteriormodelforclient == sv.writeentitiestoclient_cliententitynumber)
-						s->flags |= RENDER_EXTERIORMODEL;
-					else
-						s->flags &= ~RENDER_EXTERIORMODEL;
-				}
-				sv.writeentitiestoclient_sendstates[numsendstates++] = s;
-			}
-			else if(sv.sendentities[i].active == ACTIVE_SHARED)
-				sv.writeentitiestoclient_csqcsendstates[numcsqcsendstates++] = s->number;
-			else
-				Con_Printf("entity %d is in sv.sendentities and marked, but not active, please breakpoint me\n", s->number);
-		}
+		if (sc->entitymarks[sv.sendentities[i].number] != SV_SENDMARK_VISIBLE)
+			continue;
+		s = SV_SendClientEntityState(sc, sv.sendentities + i);
+		if(s->active == ACTIVE_NETWORK)
+			sc->sendstates[sc->numsendstates++] = s;
+		else if(s->active == ACTIVE_SHARED)
+			sc->csqcsendstates[sc->numcsqcsendstates++] = s->number;
+		else
+			Con_Printf("entity %d is in sv.sendentities and marked, but not active, please breakpoint me\n", s->number);
 	}
+}
+
+static void SV_WriteEntitiesToClient_Cull_Task(taskqueue_task_t *t)
+{
+	SV_WriteEntitiesToClient_Cull((sv_sendclient_t *)t->p[0]);
+}
+
+// writes the csqc entities and the entity frame (except for
+// PROTOCOL_DARKPLACES5 and later, see SV_WriteEntitiesToClient_Frame5)
+static void SV_WriteEntitiesToClient_Frame(sv_sendclient_t *sc)
+{
+	client_t *client = sc->client;
+	sizebuf_t *msg = &sc->msg;
+	int maxsize = sc->maxsize;
+
+	if (!sc->writeentities)
+		return;
+
+	sv.writeentitiestoclient_msg = msg;
+	sv.writeentitiestoclient_clientnumber = client - svs.clients;
+	sv.writeentitiestoclient_cliententitynumber = sc->cliententitynumber;
+
+	sv.visibilitycache_stats_hits += sc->stats_visibilitycache_hits;
+	sv.visibilitycache_stats_misses += sc->stats_visibilitycache_misses;
 
 	if (sv_cullentities_stats.integer)
-		Con_Printf("client \"%s\" entities: %d total, %d visible, %d culled by: %d pvs %d trace\n", client->name, sv.writeentitiestoclient_stats_totalentities, sv.writeentitiestoclient_stats_visibleentities, sv.writeentitiestoclient_stats_culled_pvs + sv.writeentitiestoclient_stats_culled_trace, sv.writeentitiestoclient_stats_culled_pvs, sv.writeentitiestoclient_stats_culled_trace);
+		Con_Printf("client \"%s\" entities: %d total, %d visible, %d culled by: %d pvs %d trace\n", client->name, sc->stats_totalentities, sc->stats_visibleentities, sc->stats_culled_pvs + sc->stats_culled_trace, sc->stats_culled_pvs, sc->stats_culled_trace);
 
+	sc->need_empty = false;
 	if(client->entitydatabase5)
-		need_empty = EntityFrameCSQC_WriteFrame(msg, maxsize, numcsqcsendstates, sv.writeentitiestoclient_csqcsendstates, client->entitydatabase5->latestframenum + 1);
+		sc->need_empty = EntityFrameCSQC_WriteFrame(msg, maxsize, sc->numcsqcsendstates, sc->csqcsendstates, client->entitydatabase5->latestframenum + 1);
 	else
-		EntityFrameCSQC_WriteFrame(msg, maxsize, numcsqcsendstates, sv.writeentitiestoclient_csqcsendstates, 0);
+		EntityFrameCSQC_WriteFrame(msg, maxsize, sc->numcsqcsendstates, sc->csqcsendstates, 0);
 
 	// force every 16th frame to be not empty (or cl_movement replay takes
 	// too long)
 	// BTW, this should normally not kick in any more due to the check
 	// below, except if the client stopped sending movement frames
 	if(client->num_skippedentityframes >= 16)
-		need_empty = true;
+		sc->need_empty = true;
 
 	// help cl_movement a bit more
 	if(client->movesequence != client->lastmovesequence)
-		need_empty = true;
+		sc->need_empty = true;
 	client->lastmovesequence = client->movesequence;
 
 	if (client->entitydatabase5)
-		success = EntityFrame5_WriteFrame(msg, maxsize, client->entitydatabase5, numsendstates, sv.writeentitiestoclient_sendstates, client - svs.clients + 1, client->movesequence, need_empty);
+		EntityFrame5_ResetFullPacketLog(client->entitydatabase5);
 	else if (client->entitydatabase4)
 	{
-		success = EntityFrame4_WriteFrame(msg, maxsize, client->entitydatabase4, numsendstates, sv.writeentitiestoclient_sendstates);
+		sc->success = EntityFrame4_WriteFrame(msg, maxsize, client->entitydatabase4, sc->numsendstates, sc->sendstates);
 		Protocol_WriteStatsReliable();
 	}
 	else if (client->entitydatabase)
 	{
-		success = EntityFrame_WriteFrame(msg, maxsize, client->entitydatabase, numsendstates, sv.writeentitiestoclient_sendstates, client - svs.clients + 1);
+		sc->success = EntityFrame_WriteFrame(msg, maxsize, client->entitydatabase, sc->numsendstates, sc->sendstates, client - svs.clients + 1);
 		Protocol_WriteStatsReliable();
 	}
 	else
 	{
-		success = EntityFrameQuake_WriteFrame(msg, maxsize, numsendstates, sv.writeentitiestoclient_sendstates);
+		sc->success = EntityFrameQuake_WriteFrame(msg, maxsize, sc->numsendstates, sc->sendstates);
 		Protocol_WriteStatsReliable();
 	}
+}
 
-	if(success)
-		client->num_skippedentityframes = 0;
-	else
-		++client->num_skippedentityframes;
+// this runs on worker threads
+static void SV_WriteEntitiesToClient_Frame5(sv_sendclient_t *sc)
+{
+	client_t *client = sc->client;
+
+	if (!sc->writeentities || !client->entitydatabase5)
+		return;
+
+	sc->success = EntityFrame5_WriteFrame(client, &sc->msg, sc->maxsize, client->entitydatabase5, sc->numsendstates, sc->sendstates, client - svs.clients + 1, client->movesequence, sc->need_empty);
+}
+
+static void SV_WriteEntitiesToClient_Frame5_Task(taskqueue_task_t *t)
+{
+	SV_WriteEntitiesToClient_Frame5((sv_sendclient_t *)t->p[0]);
 }
 
 /*
@@ -2314,22 +2664,31 @@ static void SV_WriteUnreliableMessages(client_t *client, sizebuf_t *msg, int max
 
 /*
 =======================
-SV_SendClientDatagram
+SV_SendClientDatagram_Begin
+
+Starts the datagram for a client, the entities are culled and written by the
+SV_WriteEntitiesToClient_* steps and the datagram is sent by
+SV_SendClientDatagram_Finish
 =======================
 */
-static void SV_SendClientDatagram (client_t *client)
+static void SV_SendClientDatagram_Begin (sv_sendclient_t *sc)
 {
-	int clientrate, maxrate, maxsize, maxsize2, downloadsize;
-	sizebuf_t msg;
+	client_t *client = sc->client;
+	int clientrate, maxrate, maxsize, maxsize2;
+	sizebuf_t *msg = &sc->msg;
 	int stats[MAX_CL_STATS];
-	static unsigned char sv_sendclientdatagram_buf[NET_MAXMESSAGE];
 	double timedelta;
 
+	sc->send = false;
+	sc->writeentities = false;
+	sc->success = false;
+
 	// obey rate limit by limiting packet frequency if the packet size
 	// limiting fails
 	// (usually this is caused by reliable messages)
 	if (!NetConn_CanSend(client->netconnection))
 		return;
+	sc->send = true;
 
 	// PROTOCOL_DARKPLACES5 and later support packet size limiting of updates
 	maxrate = max(NET_MINRATE, sv_maxrate.integer);
@@ -2362,8 +2721,8 @@ static void SV_SendClientDatagram (client_t *client)
 		// no packet size limit support on DP1-4 protocols because they kick
 		// the client off if they overflow, and miss effects
 		// packets are simply sent less often to obey the rate limit
-		maxsize = sizeof(sv_sendclientdatagram_buf);
-		maxsize2 = sizeof(sv_sendclientdatagram_buf);
+		maxsize = sizeof(sc->msgbuf);
+		maxsize2 = sizeof(sc->msgbuf);
 		break;
 	default:
 		// DP5 and later protocols support packet size limiting which is a
@@ -2402,8 +2761,8 @@ static void SV_SendClientDatagram (client_t *client)
 	if (LHNETADDRESS_GetAddressType(&host_client->netconnection->peeraddress) == LHNETADDRESSTYPE_LOOP && !sv_ratelimitlocalplayer.integer)
 	{
 		// for good singleplayer, send huge packets
-		maxsize = sizeof(sv_sendclientdatagram_buf);
-		maxsize2 = sizeof(sv_sendclientdatagram_buf);
+		maxsize = sizeof(sc->msgbuf);
+		maxsize2 = sizeof(sc->msgbuf);
 		// never limit frequency in singleplayer
 		clientrate = 1000000000;
 	}
@@ -2413,31 +2772,36 @@ static void SV_SendClientDatagram (client_t *client)
 	if (host_client->download_file)
 		maxsize /= 2;
 
-	msg.data = sv_sendclientdatagram_buf;
-	msg.maxsize = sizeof(sv_sendclientdatagram_buf);
-	msg.cursize = 0;
-	msg.allowoverflow = false;
+	sc->clientrate = clientrate;
+	sc->maxsize = maxsize;
+	sc->maxsize2 = maxsize2;
+
+	msg->data = sc->msgbuf;
+	msg->maxsize = sizeof(sc->msgbuf);
+	msg->cursize = 0;
+	msg->allowoverflow = false;
 
 	if (host_client->begun)
 	{
 		// the player is in the game
-		MSG_WriteByte (&msg, svc_time);
-		MSG_WriteFloat (&msg, sv.time);
+		MSG_WriteByte (msg, svc_time);
+		MSG_WriteFloat (msg, sv.time);
 
 		// add the client specific data to the datagram
-		SV_WriteClientdataToMessage (client, client->edict, &msg, stats);
+		SV_WriteClientdataToMessage (client, client->edict, msg, stats);
 		// now update the stats[] array using any registered custom fields
-		VM_SV_UpdateCustomStats(client, client->edict, &msg, stats);
+		VM_SV_UpdateCustomStats(client, client->edict, msg, stats);
 		// set host_client->statsdeltabits
 		Protocol_UpdateClientStats (stats);
 
 		// add as many queued unreliable messages (effects) as we can fit
 		// limit effects to half of the remaining space
 		if (client->unreliablemsg.cursize)
-			SV_WriteUnreliableMessages (client, &msg, maxsize/2, maxsize2);
+			SV_WriteUnreliableMessages (client, msg, maxsize/2, maxsize2);
 
-		// now write as many entities as we can fit, and also sends stats
-		SV_WriteEntitiesToClient (client, client->edict, &msg, maxsize);
+		// now get ready to write as many entities as we can fit, and also
+		// sends stats
+		SV_WriteEntitiesToClient_Begin (sc);
 	}
 	else if (realtime > client->keepalivetime)
 	{
@@ -2445,12 +2809,35 @@ static void SV_SendClientDatagram (client_t *client)
 		// send small keepalive messages if too much time has passed
 		// (may also be sending downloads)
 		client->keepalivetime = realtime + 5;
-		MSG_WriteChar (&msg, svc_nop);
+		MSG_WriteChar (msg, svc_nop);
+	}
+}
+
+/*
+=======================
+SV_SendClientDatagram_Finish
+=======================
+*/
+static void SV_SendClientDatagram_Finish (sv_sendclient_t *sc)
+{
+	client_t *client = sc->client;
+	int maxsize = sc->maxsize, maxsize2 = sc->maxsize2, downloadsize;
+	sizebuf_t *msg = &sc->msg;
+
+	if (!sc->send)
+		return;
+
+	if (sc->writeentities)
+	{
+		if(sc->success)
+			client->num_skippedentityframes = 0;
+		else
+			++client->num_skippedentityframes;
 	}
 
 	// if a download is active, see if there is room to fit some download data
 	// in this packet
-	downloadsize = min(maxsize*2,maxsize2) - msg.cursize - 7;
+	downloadsize = min(maxsize*2,maxsize2) - msg->cursize - 7;
 	if (host_client->download_file && host_client->download_started && downloadsize > 0)
 	{
 		fs_offset_t downloadstart;
@@ -2464,25 +2851,39 @@ static void SV_SendClientDatagram (client_t *client)
 		//  only occur if the client acks the empty end messages, revealing
 		//  a gap in the download progress, causing the last blocks to be
 		//  sent again)
-		MSG_WriteChar (&msg, svc_downloaddata);
-		MSG_WriteLong (&msg, downloadstart);
-		MSG_WriteShort (&msg, downloadsize);
+		MSG_WriteChar (msg, svc_downloaddata);
+		MSG_WriteLong (msg, downloadstart);
+		MSG_WriteShort (msg, downloadsize);
 		if (downloadsize > 0)
-			SZ_Write (&msg, data, downloadsize);
+			SZ_Write (msg, data, downloadsize);
 	}
 
 	// reliable only if none is in progress
 	if(client->sendsignon != 2 && !client->netconnection->sendMessageLength)
 		SV_WriteDemoMessage(client, &(client->netconnection->message), false);
 	// unreliable
-	SV_WriteDemoMessage(client, &msg, false);
+	SV_WriteDemoMessage(client, msg, false);
 
 // send the datagram
-	NetConn_SendUnreliableMessage (client->netconnection, &msg, sv.protocol, clientrate, client->rate_burstsize, client->sendsignon == 2);
+	NetConn_SendUnreliableMessage (client->netconnection, msg, sv.protocol, sc->clientrate, client->rate_burstsize, client->sendsignon == 2);
 	if (client->sendsignon == 1 && !client->netconnection->message.cursize)
 		client->sendsignon = 2; // prevent reliable until client sends prespawn (this is the keepalive phase)
 }
 
+/*
+=======================
+SV_SendClientDatagram
+=======================
+*/
+static void SV_SendClientDatagram (sv_sendclient_t *sc)
+{
+	SV_SendClientDatagram_Begin(sc);
+	SV_WriteEntitiesToClient_Cull(sc);
+	SV_WriteEntitiesToClient_Frame(sc);
+	SV_WriteEntitiesToClient_Frame5(sc);
+	SV_SendClientDatagram_Finish(sc);
+}
+
 /*
 =======================
 SV_UpdateToReliableMessages
@@ -2595,6 +2996,21 @@ static void SV_UpdateToReliableMessages (void)
 }
 
 
+// runs one of the thread safe SV_WriteEntitiesToClient steps for all clients
+static void SV_SendClients_RunTasks(int numclients, void (*func)(taskqueue_task_t *))
+{
+	int i;
+	for (i = 0;i < numclients;i++)
+	{
+		TaskQueue_Setup(&sv_sendclients[i].task, NULL, func, 0, 0, sv_sendclients + i, NULL);
+		TaskQueue_Enqueue(1, &sv_sendclients[i].task);
+	}
+	for (i = 0;i < numclients;i++)
+		TaskQueue_WaitForTaskDone(&sv_sendclients[i].task);
+}
+
+extern cvar_t mod_collision_bih;
+
 /*
 =======================
 SV_SendClientMessages
@@ -2602,16 +3018,29 @@ SV_SendClientMessages
 */
 void SV_SendClientMessages(void)
 {
-	int i, prepared = false;
+	int i, numsendclients = 0, prepared = false;
+	qboolean threaded;
 
 	if (sv.protocol == PROTOCOL_QUAKEWORLD)
 		Sys_Error("SV_SendClientMessages: no quakeworld support\n");
 
+	sv.framenum++;
+
 	SV_FlushBroadcastMessages();
 
 // update frags, names, etc
 	SV_UpdateToReliableMessages();
 
+	// the entity size profiling prints from inside the entity frame writing
+	threaded = sv_threadedsend.integer && !developer_networkentities.integer;
+	// the q3bsp tree traces used by the trace culling share a static mark
+	// counter, the bih ones are thread safe
+	if (sv_cullentities_trace.integer && sv.worldmodel && sv.worldmodel->type == mod_brushq3 && !mod_collision_bih.integer)
+		threaded = false;
+
+	// the client datagrams go out together in NetConn_FlushWrites
+	NetConn_BeginWrites();
+
 // build individual updates
 	for (i = 0, host_client = svs.clients;i < svs.maxclients;i++, host_client++)
 	{
@@ -2631,10 +3060,45 @@ void SV_SendClientMessages(void)
 			prepared = true;
 			// only prepare entities once per frame
 			SV_PrepareEntitiesForSending();
+			SV_SendClients_Alloc();
+		}
+		// the send tasks can not allocate
+		if (!host_client->visibilitycache && sv_cullentities_trace.integer && sv_cullentities_trace_cache.value > 0)
+			host_client->visibilitycache = (entityvisibilitycache_t *)Mem_Alloc(sv_mempool, MAX_EDICTS * sizeof(entityvisibilitycache_t));
+		if (threaded)
+			sv_sendclients[numsendclients++].client = host_client;
+		else
+		{
+			sv_sendclients[0].client = host_client;
+			SV_SendClientDatagram(sv_sendclients);
 		}
-		SV_SendClientDatagram(host_client);
 	}
 
+	// the steps that run QC or change shared state run one client at a time,
+	// the culling and entity frame compression run for all clients at once
+	if (numsendclients)
+	{
+		for (i = 0;i < numsendclients;i++)
+		{
+			host_client = sv_sendclients[i].client;
+			SV_SendClientDatagram_Begin(sv_sendclients + i);
+		}
+		SV_SendClients_RunTasks(numsendclients, SV_WriteEntitiesToClient_Cull_Task);
+		for (i = 0;i < numsendclients;i++)
+		{
+			host_client = sv_sendclients[i].client;
+			SV_WriteEntitiesToClient_Frame(sv_sendclients + i);
+		}
+		SV_SendClients_RunTasks(numsendclients, SV_WriteEntitiesToClient_Frame5_Task);
+		for (i = 0;i < numsendclients;i++)
+		{
+			host_client = sv_sendclients[i].client;
+			SV_SendClientDatagram_Finish(sv_sendclients + i);
+		}
+	}
+
+	NetConn_FlushWrites();
+
 // clear muzzle flashes
 	SV_CleanupEnts();
 }
@@ -3261,6 +3725,38 @@ void SV_SaveSpawnparms (void)
 	}
 }
 
+/// lets the worker threads inflate the models named by the entities of the
+/// new level while the spawn functions precache them one by one
+static void SV_PrefetchEntityModels(const char *entities)
+{
+	int numpaths = 0;
+	const char **paths;
+	char (*names)[MAX_QPATH];
+	char key[MAX_QPATH];
+	const char *data = entities;
+
+	if (!data)
+		return;
+	paths = (const char **)Mem_Alloc(tempmempool, MAX_MODELS * sizeof(*paths));
+	names = (char (*)[MAX_QPATH])Mem_Alloc(tempmempool, MAX_MODELS * sizeof(*names));
+	while (numpaths < MAX_MODELS && COM_ParseToken_Simple(&data, false, false, true))
+	{
+		if (com_token[0] == '{' || com_token[0] == '}')
+			continue;
+		strlcpy(key, com_token, sizeof(key));
+		if (!COM_ParseToken_Simple(&data, false, false, true))
+			break;
+		if (strcmp(key, "model") || !com_token[0] || com_token[0] == '*')
+			continue;
+		strlcpy(names[numpaths], com_token, sizeof(names[numpaths]));
+		paths[numpaths] = names[numpaths];
+		numpaths++;
+	}
+	FS_PrefetchFiles(paths, numpaths);
+	Mem_Free(names);
+	Mem_Free(paths);
+}
+
 /*
 ================
 SV_SpawnServer
@@ -3450,7 +3946,7 @@ void SV_SpawnServer (const char *server)
 //
 // clear world interaction links
 //
-	World_SetSize(&sv.world, sv.worldname, sv.worldmodel->normalmins, sv.worldmodel->normalmaxs, prog);
+	World_SetSize(&sv.world, sv.worldname, sv.worldmodel->normalmins, sv.worldmodel->normalmaxs, prog, sv_areabvh.integer != 0);
 	World_Start(&sv.world);
 
 	strlcpy(sv.sound_precache[0], "", sizeof(sv.sound_precache[0]));
@@ -3506,11 +4002,15 @@ void SV_SpawnServer (const char *server)
 	if (sv_entpatch.integer && (entities = (char *)FS_LoadFile(va(vabuf, sizeof(vabuf), "%s.ent", sv.worldnamenoextension), tempmempool, true, NULL)))
 	{
 		Con_Printf("Loaded %s.ent\n", sv.worldnamenoextension);
+		SV_PrefetchEntityModels(entities);
 		PRVM_ED_LoadFromFile(prog, entities);
 		Mem_Free(entities);
 	}
 	else
+	{
+		SV_PrefetchEntityModels(sv.worldmodel->brush.entities);
 		PRVM_ED_LoadFromFile(prog, sv.worldmodel->brush.entities);
+	}
 
 
 	// LordHavoc: clear world angles (to fix e3m3.bsp)
@@ -3531,6 +4031,9 @@ void SV_SpawnServer (const char *server)
 	// Once all init frames have been run, we consider svqc code fully initialized.
 	prog->inittime = realtime;
 
+	// drop what was prefetched for the spawn functions but not loaded by them
+	FS_PrefetchFlush();
+
 	if (cls.state == ca_dedicated)
 		Mod_PurgeUnused();
 
@@ -3601,12 +4104,25 @@ static void SVVM_end_increase_edicts(prvm_prog_t *prog)
 			SV_LinkEdict(ent);
 }
 
+// the cached line of sight results of an edict number belong to the
+// entity that used it before
+static void SV_ClearVisibilityCache(int num)
+{
+	int i;
+	for (i = 0;i < svs.maxclients;i++)
+		if (svs.clients[i].visibilitycache)
+			svs.clients[i].visibilitycache[num].expiretime = 0;
+}
+
 static void SVVM_init_edict(prvm_prog_t *prog, prvm_edict_t *e)
 {
 	// LordHavoc: for consistency set these here
 	int num = PRVM_NUM_FOR_EDICT(e) - 1;
 
 	e->priv.server->move = false; // don't move on first frame
+	// not linked yet, cluster 0 is a valid cluster
+	e->priv.server->pvs_centercluster = -1;
+	SV_ClearVisibilityCache(num + 1);
 
 	if (num >= 0 && num < svs.maxclients)
 	{
@@ -3681,6 +4197,8 @@ static void SVVM_free_edict(prvm_prog_t *prog, prvm_edict_t *ed)
 	sv.csqcentityversion[e] = 0;
 	for (i = 0;i < svs.maxclients;i++)
 		svs.clients[i].csqcentitysendflags[e] = 0xFFFFFF;
+	ed->priv.server->pvs_centercluster = -1;
+	SV_ClearVisibilityCache(e);
 }
 
 static void SVVM_count_edicts(prvm_prog_t *prog)
@@ -3918,6 +4436,8 @@ static void SV_VM_Setup(void)
 	// OP_STATE is always supported on server because we add fields/globals for it
 	prog->flag |= PRVM_OP_STATE;
 
+	SV_HotFields_Setup();
+
 	VM_CustomStats_Clear();//[515]: csqc
 
 	SV_Prepare_CSQC();
@@ -4053,6 +4573,7 @@ static int SV_ThreadFunc(void *voiddata)
 			// send an heartbeat if enough time has passed since the last one
 			NetConn_Heartbeat(0);
 
+			SV_Savegame_Frame();
 		}
 
 		// we're back to safe code now
@@ -21,6 +21,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "quakedef.h"
 #include "prvm_cmds.h"
+#include "taskqueue.h"
 
 /*
 
@@ -96,6 +97,58 @@ int SV_GenericHitSuperContentsMask(const prvm_edict_t *passedict)
 		return SUPERCONTENTS_SOLID | SUPERCONTENTS_BODY | SUPERCONTENTS_CORPSE;
 }
 
+/*
+===============================================================================
+
+PRECOMPUTED MOVES
+
+With sv_threadedphysics the world collision of the first move of flying and
+bouncing entities is computed on the taskqueue threads before the entities
+are run.  The world model never changes during a frame, so the result is
+exactly what the trace would have found against the world, and it is only
+used if the trace really is the same move.  Collision against other entities,
+touch and think are still done serially in the usual order.
+
+===============================================================================
+*/
+
+typedef struct sv_premove_s
+{
+	int entitynumber;
+	// the move as SV_TraceLine (point sized entities) or SV_TraceBox would
+	// clip it against the world
+	qboolean line;
+	vec3_t start, mins, maxs, end;
+	int hitsupercontentsmask;
+	float extend;
+	// result
+	trace_t trace;
+}
+sv_premove_t;
+
+#define SV_PREMOVES_PER_TASK 64
+
+static int sv_numpremoves;
+static sv_premove_t sv_premoves[MAX_EDICTS];
+static taskqueue_task_t sv_premove_tasks[(MAX_EDICTS + SV_PREMOVES_PER_TASK - 1) / SV_PREMOVES_PER_TASK];
+static int sv_numpremove_tasks;
+// set once all the tasks are done, the results can't be used before that
+static qboolean sv_premoves_done;
+
+// returns true and the world clip if it was computed ahead of time for this move
+static qboolean SV_GetPreMove(trace_t *trace, prvm_edict_t *passedict, qboolean line, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int hitsupercontentsmask, int skipsupercontentsmask, int skipmaterialflagsmask, float extend)
+{
+	sv_premove_t *p;
+	if (!sv_premoves_done || !passedict || !passedict->priv.server->premove)
+		return false;
+	p = sv_premoves + passedict->priv.server->premove - 1;
+	if (p->line != line || p->hitsupercontentsmask != hitsupercontentsmask || skipsupercontentsmask || skipmaterialflagsmask || p->extend != extend
+	 || !VectorCompare(p->start, start) || !VectorCompare(p->end, end) || !VectorCompare(p->mins, mins) || !VectorCompare(p->maxs, maxs))
+		return false;
+	*trace = p->trace;
+	return true;
+}
+
 /*
 ==================
 SV_TracePoint
@@ -286,7 +339,8 @@ trace_t SV_TraceLine(const vec3_t start, const vec3_t end, int type, prvm_edict_
 #endif
 
 	// clip to world
-	Collision_ClipLineToWorld(&cliptrace, sv.worldmodel, clipstart, clipend, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, extend, false);
+	if (!SV_GetPreMove(&cliptrace, passedict, true, clipstart, vec3_origin, vec3_origin, clipend, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, extend))
+		Collision_ClipLineToWorld(&cliptrace, sv.worldmodel, clipstart, clipend, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, extend, false);
 	cliptrace.worldstartsolid = cliptrace.bmodelstartsolid = cliptrace.startsolid;
 	if (cliptrace.startsolid || cliptrace.fraction < 1)
 		cliptrace.ent = prog->edicts;
@@ -453,7 +507,8 @@ trace_t SV_TraceBox(const vec3_t start, const vec3_t mins, const vec3_t maxs, co
 #endif
 
 	// clip to world
-	Collision_ClipToWorld(&cliptrace, sv.worldmodel, clipstart, clipmins, clipmaxs, clipend, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, extend);
+	if (!SV_GetPreMove(&cliptrace, passedict, false, clipstart, clipmins, clipmaxs, clipend, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, extend))
+		Collision_ClipToWorld(&cliptrace, sv.worldmodel, clipstart, clipmins, clipmaxs, clipend, hitsupercontentsmask, skipsupercontentsmask, skipmaterialflagsmask, extend);
 	cliptrace.worldstartsolid = cliptrace.bmodelstartsolid = cliptrace.startsolid;
 	if (cliptrace.startsolid || cliptrace.fraction < 1)
 		cliptrace.ent = prog->edicts;
@@ -590,6 +645,109 @@ trace_t SV_TraceBox(const vec3_t start, const vec3_t mins, const vec3_t maxs, co
 }
 #endif
 
+// entities overlapping the bounds of the trace batch currently running, with
+// their boxes stored per axis so the per-trace overlap tests are a straight
+// loop over floats the compiler can vectorize
+typedef struct sv_tracebatchcandidates_s
+{
+	int numedicts;
+	prvm_edict_t *edicts[MAX_EDICTS];
+	float mins[3][MAX_EDICTS];
+	float maxs[3][MAX_EDICTS];
+}
+sv_tracebatchcandidates_t;
+
+static sv_tracebatchcandidates_t sv_tracebatch_candidates;
+static qboolean sv_tracebatch_active;
+
+/*
+==================
+SV_TraceBatch
+
+Runs a set of traces with a single area grid query for all of them, each
+trace then only has to filter that list instead of walking the grid again,
+which is a win for clustered traces like shotgun pellets or bot sensors
+==================
+*/
+void SV_TraceBatch(int numtraces, sv_tracebatch_t *traces)
+{
+	int i, j, n;
+	qboolean any = false;
+	vec3_t hullmins, hullmaxs;
+	vec3_t batchmins, batchmaxs;
+	sv_tracebatch_t *t;
+	prvm_edict_t *ed;
+
+	if (numtraces < 1)
+		return;
+
+	// bounding box of every move in the batch, padded enough to cover the
+	// missile and hull size adjustments made by the individual traces
+	VectorSet(batchmins, 999999999, 999999999, 999999999);
+	VectorSet(batchmaxs, -999999999, -999999999, -999999999);
+	for (n = 0, t = traces;n < numtraces;n++, t++)
+	{
+		if (t->type == MOVE_WORLDONLY)
+			continue;
+		any = true;
+		if (!VectorCompare(t->mins, t->maxs) && sv.worldmodel && sv.worldmodel->brush.RoundUpToHullSize)
+			sv.worldmodel->brush.RoundUpToHullSize(sv.worldmodel, t->mins, t->maxs, hullmins, hullmaxs);
+		else
+		{
+			VectorCopy(t->mins, hullmins);
+			VectorCopy(t->maxs, hullmaxs);
+		}
+		for (i = 0;i < 3;i++)
+		{
+			batchmins[i] = min(batchmins[i], min(t->start[i], t->end[i]) + min(t->mins[i], hullmins[i]) - 16);
+			batchmaxs[i] = max(batchmaxs[i], max(t->start[i], t->end[i]) + max(t->maxs[i], hullmaxs[i]) + 16);
+		}
+	}
+
+	// sv_debugmove and sv_areadebug want every trace to see everything
+	if (any && !sv_debugmove.integer && !sv_areadebug.integer)
+	{
+		sv_tracebatch_candidates.numedicts = min(World_EntitiesInBox(&sv.world, batchmins, batchmaxs, MAX_EDICTS, sv_tracebatch_candidates.edicts), MAX_EDICTS);
+		for (j = 0;j < sv_tracebatch_candidates.numedicts;j++)
+		{
+			ed = sv_tracebatch_candidates.edicts[j];
+			for (i = 0;i < 3;i++)
+			{
+				sv_tracebatch_candidates.mins[i][j] = ed->priv.server->areamins[i];
+				sv_tracebatch_candidates.maxs[i][j] = ed->priv.server->areamaxs[i];
+			}
+		}
+		sv_tracebatch_active = true;
+	}
+
+	for (n = 0, t = traces;n < numtraces;n++, t++)
+		t->trace = SV_TraceBox(t->start, t->mins, t->maxs, t->end, t->type, t->passedict, t->hitsupercontentsmask, t->skipsupercontentsmask, t->skipmaterialflagsmask, t->extend);
+
+	sv_tracebatch_active = false;
+}
+
+// returns the subset of the trace batch candidates overlapping the box
+static int SV_TraceBatch_EntitiesInBox(const vec3_t mins, const vec3_t maxs, int maxedicts, prvm_edict_t **resultedicts)
+{
+	int i, numresultedicts = 0, overlap;
+	const sv_tracebatchcandidates_t *c = &sv_tracebatch_candidates;
+	float boxmins0 = mins[0], boxmins1 = mins[1], boxmins2 = mins[2];
+	float boxmaxs0 = maxs[0], boxmaxs1 = maxs[1], boxmaxs2 = maxs[2];
+	if (c->numedicts > maxedicts)
+		return World_EntitiesInBox(&sv.world, mins, maxs, maxedicts, resultedicts);
+	// branchless so the compares vectorize, the store is always done and
+	// only kept if the boxes overlap
+	for (i = 0;i < c->numedicts;i++)
+	{
+		overlap = (c->mins[0][i] <= boxmaxs0) & (c->maxs[0][i] >= boxmins0)
+		        & (c->mins[1][i] <= boxmaxs1) & (c->maxs[1][i] >= boxmins1)
+		        & (c->mins[2][i] <= boxmaxs2) & (c->maxs[2][i] >= boxmins2);
+		resultedicts[numresultedicts] = c->edicts[i];
+		numresultedicts += overlap;
+	}
+	return numresultedicts;
+}
+
 int SV_PointSuperContents(const vec3_t point)
 {
 	prvm_prog_t *prog = SVVM_prog;
@@ -680,6 +838,8 @@ int SV_EntitiesInBox(const vec3_t mins, const vec3_t maxs, int maxedicts, prvm_e
 		}
 		return numresultedicts;
 	}
+	else if (sv_tracebatch_active)
+		return SV_TraceBatch_EntitiesInBox(paddedmins, paddedmaxs, maxedicts, resultedicts);
 	else
 		return World_EntitiesInBox(&sv.world, paddedmins, paddedmaxs, maxedicts, resultedicts);
 }
@@ -2418,6 +2578,7 @@ static void SV_WalkMove (prvm_edict_t *ent)
 			VectorCopy(originalmove_velocity, PRVM_serveredictvector(ent, velocity));
 			//clip = originalmove_clip;
 			PRVM_serveredictfloat(ent, flags) = originalmove_flags;
+			PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(ent));
 			PRVM_serveredictedict(ent, groundentity) = originalmove_groundentity;
 			// now try to unstick if needed
 			//clip = SV_TryUnstick (ent, oldvel);
@@ -2467,6 +2628,7 @@ static void SV_WalkMove (prvm_edict_t *ent)
 		VectorCopy(originalmove_velocity, PRVM_serveredictvector(ent, velocity));
 		//clip = originalmove_clip;
 		PRVM_serveredictfloat(ent, flags) = originalmove_flags;
+		PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(ent));
 		PRVM_serveredictedict(ent, groundentity) = originalmove_groundentity;
 	}
 
@@ -3136,12 +3298,252 @@ static void SV_Physics_ClientEntity(prvm_edict_t *ent)
 	SV_CheckVelocity (ent);
 }
 
+/*
+===============================================================================
+
+HOT FIELDS
+
+===============================================================================
+*/
+
+// most entities of big maps are MOVETYPE_NONE and only think now and then,
+// sv.hotstate and sv.hotnextthink keep what SV_Physics needs to know about
+// them in a few bytes per entity so it can skip them without touching their
+// fields and private data.  QC stores into movetype and nextthink (and
+// OP_STATE) flag the entity in prog->touchededicts, the engine flags it in
+// PRVM_ED_Touch when it allocates, frees or overwrites it, and a flagged
+// entity is looked at again and copied by SV_HotFields_Update.
+
+void SV_HotFields_Setup(void)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	if (prog->fieldoffsets.movetype >= 0)
+		prog->trackfields[prog->fieldoffsets.movetype] |= PRVM_TRACK_EDICT;
+	if (prog->fieldoffsets.nextthink >= 0)
+		prog->trackfields[prog->fieldoffsets.nextthink] |= PRVM_TRACK_EDICT;
+}
+
+// copies the entity after SV_Physics_Entity ran, no QC runs at this point so
+// all stores through field addresses QC took have happened
+static void SV_HotFields_Update(prvm_prog_t *prog, int num, prvm_edict_t *ent)
+{
+	prog->touchededicts[num] = false;
+	if (ent->priv.server->free)
+		sv.hotstate[num] = HOTSTATE_FREE;
+	else if (ent->priv.server->move && (int)PRVM_serveredictfloat(ent, movetype) == MOVETYPE_NONE)
+	{
+		sv.hotstate[num] = HOTSTATE_IDLE;
+		sv.hotnextthink[num] = PRVM_serveredictfloat(ent, nextthink);
+	}
+	else
+		sv.hotstate[num] = HOTSTATE_UNKNOWN;
+}
+
+// true if SV_Physics_Entity would do nothing with the entity this frame
+static qboolean SV_HotFields_Idle(prvm_prog_t *prog, int num)
+{
+	if (prog->touchededicts[num])
+		return false;
+	switch (sv.hotstate[num])
+	{
+	case HOTSTATE_FREE:
+		return true;
+	case HOTSTATE_IDLE:
+		// the same check as the MOVETYPE_NONE case of SV_Physics_Entity
+		return !(sv.hotnextthink[num] > 0 && sv.hotnextthink[num] <= sv.time + sv.frametime);
+	default:
+		return false;
+	}
+}
+
+// adds idle MOVETYPE_NONE entities (like the props of an entity stress map)
+// and times whole SV_Physics frames with sv_hotfields off and on, the game
+// advances by the frames that are run
+void SV_HotFields_Benchmark_f(void)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	int i, mode, frame, frames, numspawned, oldhotfields;
+	int *spawned;
+	double t, frametime[2];
+
+	if (!sv.active)
+	{
+		Con_Print("no server running\n");
+		return;
+	}
+	if (!sv.frametime)
+	{
+		Con_Print("the server is paused\n");
+		return;
+	}
+	numspawned = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 4096;
+	numspawned = bound(0, numspawned, prog->limit_edicts - prog->num_edicts - 256);
+	frames = Cmd_Argc() > 2 ? bound(1, atoi(Cmd_Argv(2)), 10000) : 100;
+
+	spawned = (int *)Mem_Alloc(tempmempool, max(numspawned, 1) * sizeof(int));
+	for (i = 0;i < numspawned;i++)
+		spawned[i] = PRVM_NUM_FOR_EDICT(PRVM_ED_Alloc(prog));
+
+	oldhotfields = sv_hotfields.integer;
+	for (mode = 0;mode < 2;mode++)
+	{
+		Cvar_SetValueQuick(&sv_hotfields, mode);
+		// the first frame sorts out the new entities and the mode switch
+		SV_Physics();
+		t = Sys_DirtyTime();
+		for (frame = 0;frame < frames;frame++)
+			SV_Physics();
+		frametime[mode] = (Sys_DirtyTime() - t) / frames;
+	}
+	Cvar_SetValueQuick(&sv_hotfields, oldhotfields);
+
+	for (i = 0;i < numspawned;i++)
+		PRVM_ED_Free(prog, PRVM_EDICT_NUM(spawned[i]));
+	Mem_Free(spawned);
+
+	Con_Printf("%i frames with %i entities (%i of them added idle ones)\n", frames, prog->num_edicts, numspawned);
+	Con_Printf("SV_Physics: %.4fms per frame with sv_hotfields 0, %.4fms per frame with sv_hotfields 1\n", frametime[0] * 1000.0, frametime[1] * 1000.0);
+}
+
 /*
 ================
 SV_Physics
 
 ================
 */
+static void SV_Physics_PreMoves_Task(taskqueue_task_t *t)
+{
+	size_t i;
+	sv_premove_t *p;
+	for (i = t->i[0];i < t->i[1];i++)
+	{
+		p = sv_premoves + i;
+		if (p->line)
+			Collision_ClipLineToWorld(&p->trace, sv.worldmodel, p->start, p->end, p->hitsupercontentsmask, 0, 0, p->extend, false);
+		else
+			Collision_ClipToWorld(&p->trace, sv.worldmodel, p->start, p->mins, p->maxs, p->end, p->hitsupercontentsmask, 0, 0, p->extend);
+	}
+}
+
+extern cvar_t mod_collision_bih;
+// predicts the first move of the flying and bouncing entities this frame and
+// starts clipping them against the world on the taskqueue threads
+static void SV_Physics_StartPreMoves(void)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	int i, movetype;
+	float wishspeed;
+	vec_t movetime;
+	prvm_vec_t velocity[3];
+	vec3_t start, move, mins, maxs;
+	prvm_edict_t *ent;
+	sv_premove_t *p;
+
+	// tasks from a frame aborted by an error could still be running
+	for (i = 0;i < sv_numpremove_tasks;i++)
+		TaskQueue_WaitForTaskDone(&sv_premove_tasks[i]);
+	sv_numpremove_tasks = 0;
+	sv_numpremoves = 0;
+	sv_premoves_done = false;
+
+	if (!sv_threadedphysics.integer || sv_freezenonclients.integer || !sv.worldmodel || !sv.worldmodel->TraceBox || !sv.worldmodel->TraceLine)
+		return;
+	// the q3bsp tree traces are not thread safe, the bih ones are
+	if (sv.worldmodel->type == mod_brushq3 && !mod_collision_bih.integer)
+		return;
+
+	for (i = svs.maxclients + 1, ent = PRVM_EDICT_NUM(i);i < prog->num_edicts;i++, ent = PRVM_NEXT_EDICT(ent))
+	{
+		// free and MOVETYPE_NONE entities never move
+		if (sv_hotfields.integer && sv.hotstate[i] != HOTSTATE_UNKNOWN && !prog->touchededicts[i])
+			continue;
+		if (ent->priv.server->free)
+			continue;
+		movetype = (int)PRVM_serveredictfloat(ent, movetype);
+		if (movetype != MOVETYPE_TOSS && movetype != MOVETYPE_BOUNCE && movetype != MOVETYPE_BOUNCEMISSILE && movetype != MOVETYPE_FLYMISSILE && movetype != MOVETYPE_FLY && movetype != MOVETYPE_FLY_WORLDONLY)
+			continue;
+		// resting entities usually stay put
+		if ((int)PRVM_serveredictfloat(ent, flags) & FL_ONGROUND)
+			continue;
+		if (!ent->priv.server->move && sv_gameplayfix_delayprojectiles.integer > 0)
+			continue;
+		// think runs before the move and is likely to change it
+		if (PRVM_serveredictfloat(ent, nextthink) > 0 && PRVM_serveredictfloat(ent, nextthink) <= sv.time + sv.frametime)
+			continue;
+
+		// the same math as SV_CheckVelocity, SV_Physics_Toss and SV_PushEntity,
+		// anything that turns out different just makes the result go unused
+		VectorCopy(PRVM_serveredictvector(ent, velocity), velocity);
+		if (PRVM_IS_NAN(velocity[0]) || PRVM_IS_NAN(velocity[1]) || PRVM_IS_NAN(velocity[2]))
+			continue;
+		wishspeed = DotProduct(velocity, velocity);
+		if (wishspeed > sv_maxvelocity.value * sv_maxvelocity.value)
+		{
+			wishspeed = sv_maxvelocity.value / sqrt(wishspeed);
+			velocity[0] *= wishspeed;
+			velocity[1] *= wishspeed;
+			velocity[2] *= wishspeed;
+		}
+		if (movetype == MOVETYPE_TOSS || movetype == MOVETYPE_BOUNCE)
+			velocity[2] -= SV_Gravity(ent);
+		movetime = sv.frametime;
+		VectorScale(velocity, movetime, move);
+		if (VectorLength2(move) == 0)
+			continue;
+		VectorCopy(PRVM_serveredictvector(ent, origin), start);
+		VectorCopy(PRVM_serveredictvector(ent, mins), mins);
+		VectorCopy(PRVM_serveredictvector(ent, maxs), maxs);
+
+		p = sv_premoves + sv_numpremoves++;
+		p->entitynumber = i;
+		p->hitsupercontentsmask = SV_GenericHitSuperContentsMask(ent);
+		p->extend = collision_extendmovelength.value;
+		// SV_TraceBox turns point sized moves into a line trace
+		p->line = VectorCompare(mins, maxs);
+		if (p->line)
+		{
+			VectorAdd(start, mins, p->start);
+			VectorAdd(start, move, p->end);
+			VectorAdd(p->end, mins, p->end);
+			VectorClear(p->mins);
+			VectorClear(p->maxs);
+		}
+		else
+		{
+			VectorCopy(start, p->start);
+			VectorAdd(start, move, p->end);
+			VectorCopy(mins, p->mins);
+			VectorCopy(maxs, p->maxs);
+		}
+		ent->priv.server->premove = sv_numpremoves;
+	}
+
+	for (i = 0;i < sv_numpremoves;i += SV_PREMOVES_PER_TASK)
+		TaskQueue_Setup(&sv_premove_tasks[sv_numpremove_tasks++], NULL, SV_Physics_PreMoves_Task, i, min(i + SV_PREMOVES_PER_TASK, sv_numpremoves), NULL, NULL);
+	TaskQueue_Enqueue(sv_numpremove_tasks, sv_premove_tasks);
+}
+
+// waits for the world clips, they can be used from here on
+static void SV_Physics_FinishPreMoves(void)
+{
+	int i;
+	for (i = 0;i < sv_numpremove_tasks;i++)
+		TaskQueue_WaitForTaskDone(&sv_premove_tasks[i]);
+	sv_numpremove_tasks = 0;
+	sv_premoves_done = sv_numpremoves > 0;
+}
+
+static void SV_Physics_EndPreMoves(void)
+{
+	prvm_prog_t *prog = SVVM_prog;
+	int i;
+	for (i = 0;i < sv_numpremoves;i++)
+		if (sv_premoves[i].entitynumber < prog->max_edicts)
+			PRVM_EDICT_NUM(sv_premoves[i].entitynumber)->priv.server->premove = 0;
+	sv_numpremoves = 0;
+	sv_premoves_done = false;
+}
+
 void SV_Physics (void)
 {
 	prvm_prog_t *prog = SVVM_prog;
@@ -3158,6 +3560,9 @@ void SV_Physics (void)
 	// run physics engine
 	World_Physics_Frame(&sv.world, sv.frametime, sv_gravity.value);
 
+	// the world clips are computed while the clients are run
+	SV_Physics_StartPreMoves();
+
 //
 // treat each object in turn
 //
@@ -3200,15 +3605,23 @@ void SV_Physics (void)
 	// run physics on all the non-client entities
 	if (!sv_freezenonclients.integer)
 	{
+		SV_Physics_FinishPreMoves();
 		for (;i < prog->num_edicts;i++, ent = PRVM_NEXT_EDICT(ent))
+		{
+			if (sv_hotfields.integer && SV_HotFields_Idle(prog, i))
+				continue;
 			if (!ent->priv.server->free)
 				SV_Physics_Entity(ent);
+			if (sv_hotfields.integer)
+				SV_HotFields_Update(prog, i, ent);
+		}
 		// make a second pass to see if any ents spawned this frame and make
 		// sure they run their move/think
 		if (sv_gameplayfix_delayprojectiles.integer < 0)
 			for (i = svs.maxclients + 1, ent = PRVM_EDICT_NUM(i);i < prog->num_edicts;i++, ent = PRVM_NEXT_EDICT(ent))
 				if (!ent->priv.server->move && !ent->priv.server->free)
 					SV_Physics_Entity(ent);
+		SV_Physics_EndPreMoves();
 	}
 
 	if (PRVM_serverglobalfloat(force_retouch) > 0)
@@ -0,0 +1,956 @@
+/*
+Binary savegames
+
+The text format of Host_Savegame_to prints every field of every edict and
+parses it back token by token, which takes long enough on big maps to show.
+This format holds the same state, written by sv_savegame_binary and
+sv_autosave, and is told apart from text by the magic at the start of the
+file.  Fields, globals, functions and strings are stored by name so a save
+still loads after the progs changed, just like a text save.
+
+header, never compressed so the menu can show the comment:
+  magic, version, flags, size of the payload, comment
+payload, deflated if SAVEGAME_BINARY_DEFLATED is set:
+  string table: count, then NUL terminated strings, string 0 is ""
+  skill, map name, time, spawn parms
+  lightstyles, model and sound precaches: count, then index and string each
+  saved fields: count, then name and type each
+  saved globals: count, then name, type and value each
+  edicts: count, a free byte for each, then for each edict in use the values
+    of all saved fields in one block
+  string buffers: count, then index, flags, count and strings each
+
+ints are 32bit little endian, a string is the int index of a string in the
+table and a value is one 64bit little endian word per component: floats as
+doubles, strings, functions and fields as the string of their name and
+entities as their number.
+*/
+
+#include "quakedef.h"
+#include "prvm_cmds.h"
+#include "taskqueue.h"
+#include "sv_save.h"
+
+extern cvar_t sv_autosave;
+extern cvar_t sv_autosave_name;
+extern cvar_t sv_savegame_compress;
+extern cvar_t sv_cheats;
+extern qboolean allowcheats;
+
+#define SAVEGAME_BINARY_MAGIC "DPSAVBIN"
+#define SAVEGAME_BINARY_VERSION 1
+#define SAVEGAME_BINARY_DEFLATED 1
+#define SAVEGAME_BINARY_HEADERSIZE (8 + 3 * 4 + SAVEGAME_COMMENT_LENGTH + 1)
+
+typedef struct savebuffer_s
+{
+	unsigned char *data;
+	size_t size;
+	size_t maxsize;
+}
+savebuffer_t;
+
+typedef struct savewriter_s
+{
+	savebuffer_t body;
+	savebuffer_t strings;
+	int numstrings;
+	int maxstrings;
+	/// where each string starts in strings
+	size_t *stringofs;
+	/// open addressing table of string numbers + 1, 0 is an empty slot
+	int *hash;
+	int hashsize;
+}
+savewriter_t;
+
+typedef struct savereader_s
+{
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	qboolean error;
+	const char **strings;
+	int numstrings;
+	/// function number and field offset of each string, -1 until looked up
+	int *functions;
+	int *fields;
+}
+savereader_t;
+
+/// an autosave waiting for the worker thread to compress it
+static struct
+{
+	taskqueue_task_t task;
+	qboolean pending;
+	char name[MAX_QPATH];
+	char comment[SAVEGAME_COMMENT_LENGTH+1];
+	unsigned char *payload;
+	size_t payloadsize;
+	unsigned char *deflated;
+	size_t deflatedsize;
+	const char *deflateerror; ///< printed by the main thread
+}
+sv_autosave_state;
+
+static unsigned char *SV_Savegame_Reserve(savebuffer_t *buf, size_t size)
+{
+	unsigned char *p;
+	if (buf->size + size > buf->maxsize)
+	{
+		buf->maxsize = max(buf->maxsize * 2, buf->size + size + 65536);
+		buf->data = (unsigned char *)Mem_Realloc(sv_mempool, buf->data, buf->maxsize);
+	}
+	p = buf->data + buf->size;
+	buf->size += size;
+	return p;
+}
+
+static void SV_Savegame_WriteInt(savebuffer_t *buf, int i)
+{
+	StoreLittleLong(SV_Savegame_Reserve(buf, 4), (unsigned int)i);
+}
+
+static void SV_Savegame_StoreWord(unsigned char *p, dpint64 w)
+{
+	StoreLittleLong(p, (unsigned int)w);
+	StoreLittleLong(p + 4, (unsigned int)((dpuint64)w >> 32));
+}
+
+static void SV_Savegame_WriteWord(savebuffer_t *buf, dpint64 w)
+{
+	SV_Savegame_StoreWord(SV_Savegame_Reserve(buf, 8), w);
+}
+
+static dpint64 SV_Savegame_DoubleWord(double d)
+{
+	dpint64 w;
+	memcpy(&w, &d, sizeof(w));
+	return w;
+}
+
+static unsigned int SV_Savegame_HashString(const char *s)
+{
+	unsigned int h = 2166136261u;
+	for (;*s;s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+/// returns the number of s in the string table, adding it if it is new
+static int SV_Savegame_String(savewriter_t *w, const char *s)
+{
+	int i, h;
+	size_t len;
+
+	if (!s || !*s)
+		return 0;
+	if (w->numstrings >= w->maxstrings)
+	{
+		w->maxstrings *= 2;
+		w->stringofs = (size_t *)Mem_Realloc(sv_mempool, w->stringofs, w->maxstrings * sizeof(*w->stringofs));
+	}
+	if (w->numstrings * 2 >= w->hashsize)
+	{
+		Mem_Free(w->hash);
+		w->hashsize *= 2;
+		w->hash = (int *)Mem_Alloc(sv_mempool, w->hashsize * sizeof(*w->hash));
+		for (i = 1;i < w->numstrings;i++)
+		{
+			for (h = SV_Savegame_HashString((const char *)w->strings.data + w->stringofs[i]) & (w->hashsize - 1);w->hash[h];h = (h + 1) & (w->hashsize - 1))
+				;
+			w->hash[h] = i + 1;
+		}
+	}
+	for (h = SV_Savegame_HashString(s) & (w->hashsize - 1);w->hash[h];h = (h + 1) & (w->hashsize - 1))
+		if (!strcmp((const char *)w->strings.data + w->stringofs[w->hash[h] - 1], s))
+			return w->hash[h] - 1;
+	i = w->numstrings++;
+	len = strlen(s) + 1;
+	w->stringofs[i] = w->strings.size;
+	memcpy(SV_Savegame_Reserve(&w->strings, len), s, len);
+	w->hash[h] = i + 1;
+	return i;
+}
+
+/// same choice of fields as PRVM_ED_Write
+static qboolean SV_Savegame_SavedField(prvm_prog_t *prog, ddef_t *d)
+{
+	const char *name = PRVM_GetString(prog, d->s_name);
+	size_t len = strlen(name);
+	if (len > 1 && name[len-2] == '_')
+		return false;
+	switch (d->type & ~DEF_SAVEGLOBAL)
+	{
+	case ev_string:
+	case ev_float:
+	case ev_vector:
+	case ev_entity:
+	case ev_field:
+	case ev_function:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static dpint64 SV_Savegame_Value(prvm_prog_t *prog, savewriter_t *w, int type, prvm_eval_t *val, int component)
+{
+	ddef_t *def;
+	switch (type)
+	{
+	case ev_string:
+		return SV_Savegame_String(w, PRVM_GetString(prog, val->string));
+	case ev_float:
+	case ev_vector:
+		return SV_Savegame_DoubleWord(val->vector[component]);
+	case ev_entity:
+		return val->edict;
+	case ev_function:
+		if (val->function <= 0 || val->function >= prog->numfunctions)
+			return 0;
+		return SV_Savegame_String(w, PRVM_GetString(prog, prog->functions[val->function].s_name));
+	case ev_field:
+		def = PRVM_ED_FieldAtOfs(prog, val->_int);
+		return def ? SV_Savegame_String(w, PRVM_GetString(prog, def->s_name)) : 0;
+	}
+	return 0;
+}
+
+/*
+===============
+SV_Savegame_Build
+
+Copies the game state into a payload allocated from sv_mempool
+===============
+*/
+static unsigned char *SV_Savegame_Build(prvm_prog_t *prog, size_t *payloadsize)
+{
+	savewriter_t w;
+	savebuffer_t *body = &w.body;
+	prvm_stringbuffer_t *stringbuffer;
+	prvm_edict_t *ed;
+	ddef_t *d, **fields;
+	unsigned char *p, *payload;
+	size_t countpos;
+	int i, j, k, type, count, numfields, numwords, numbuffers;
+
+	memset(&w, 0, sizeof(w));
+	w.maxstrings = 4096;
+	w.stringofs = (size_t *)Mem_Alloc(sv_mempool, w.maxstrings * sizeof(*w.stringofs));
+	w.hashsize = 8192;
+	w.hash = (int *)Mem_Alloc(sv_mempool, w.hashsize * sizeof(*w.hash));
+	// string 0 is the empty string
+	*SV_Savegame_Reserve(&w.strings, 1) = 0;
+	w.numstrings = 1;
+
+	SV_Savegame_WriteInt(body, current_skill);
+	SV_Savegame_WriteInt(body, SV_Savegame_String(&w, sv.name));
+	SV_Savegame_WriteWord(body, SV_Savegame_DoubleWord(sv.time));
+	for (i = 0;i < NUM_SPAWN_PARMS;i++)
+		SV_Savegame_WriteWord(body, SV_Savegame_DoubleWord(svs.clients[0].spawn_parms[i]));
+
+	// lightstyles and precaches, the counts are filled in afterwards
+	countpos = body->size;
+	SV_Savegame_WriteInt(body, 0);
+	for (i = 0, count = 0;i < MAX_LIGHTSTYLES;i++)
+	{
+		if (!sv.lightstyles[i][0])
+			continue;
+		SV_Savegame_WriteInt(body, i);
+		SV_Savegame_WriteInt(body, SV_Savegame_String(&w, sv.lightstyles[i]));
+		count++;
+	}
+	StoreLittleLong(body->data + countpos, count);
+	countpos = body->size;
+	SV_Savegame_WriteInt(body, 0);
+	for (i = 1, count = 0;i < MAX_MODELS;i++)
+	{
+		if (!sv.model_precache[i][0])
+			continue;
+		SV_Savegame_WriteInt(body, i);
+		SV_Savegame_WriteInt(body, SV_Savegame_String(&w, sv.model_precache[i]));
+		count++;
+	}
+	StoreLittleLong(body->data + countpos, count);
+	countpos = body->size;
+	SV_Savegame_WriteInt(body, 0);
+	for (i = 1, count = 0;i < MAX_SOUNDS;i++)
+	{
+		if (!sv.sound_precache[i][0])
+			continue;
+		SV_Savegame_WriteInt(body, i);
+		SV_Savegame_WriteInt(body, SV_Savegame_String(&w, sv.sound_precache[i]));
+		count++;
+	}
+	StoreLittleLong(body->data + countpos, count);
+
+	// field table
+	fields = (ddef_t **)Mem_Alloc(sv_mempool, prog->numfielddefs * sizeof(*fields));
+	numfields = 0;
+	numwords = 0;
+	for (i = 1;i < prog->numfielddefs;i++)
+	{
+		d = &prog->fielddefs[i];
+		if (!SV_Savegame_SavedField(prog, d))
+			continue;
+		fields[numfields++] = d;
+		numwords += prvm_type_size[d->type & ~DEF_SAVEGLOBAL];
+	}
+	SV_Savegame_WriteInt(body, numfields);
+	for (i = 0;i < numfields;i++)
+	{
+		SV_Savegame_WriteInt(body, SV_Savegame_String(&w, PRVM_GetString(prog, fields[i]->s_name)));
+		SV_Savegame_WriteInt(body, fields[i]->type & ~DEF_SAVEGLOBAL);
+	}
+
+	// same globals as PRVM_ED_WriteGlobals
+	countpos = body->size;
+	SV_Savegame_WriteInt(body, 0);
+	for (i = 0, count = 0;i < prog->numglobaldefs;i++)
+	{
+		d = &prog->globaldefs[i];
+		type = d->type & ~DEF_SAVEGLOBAL;
+		if (!(d->type & DEF_SAVEGLOBAL) || (type != ev_string && type != ev_float && type != ev_entity))
+			continue;
+		SV_Savegame_WriteInt(body, SV_Savegame_String(&w, PRVM_GetString(prog, d->s_name)));
+		SV_Savegame_WriteInt(body, type);
+		SV_Savegame_WriteWord(body, SV_Savegame_Value(prog, &w, type, (prvm_eval_t *)&prog->globals.fp[d->ofs], 0));
+		count++;
+	}
+	StoreLittleLong(body->data + countpos, count);
+
+	// edicts, each one in use is a single block of words in field table order
+	SV_Savegame_WriteInt(body, prog->num_edicts);
+	p = SV_Savegame_Reserve(body, prog->num_edicts);
+	for (i = 0;i < prog->num_edicts;i++)
+		p[i] = PRVM_EDICT_NUM(i)->priv.required->free;
+	for (i = 0;i < prog->num_edicts;i++)
+	{
+		ed = PRVM_EDICT_NUM(i);
+		if (ed->priv.required->free)
+			continue;
+		p = SV_Savegame_Reserve(body, numwords * 8);
+		for (j = 0;j < numfields;j++)
+		{
+			d = fields[j];
+			type = d->type & ~DEF_SAVEGLOBAL;
+			for (k = 0;k < prvm_type_size[type];k++, p += 8)
+				SV_Savegame_StoreWord(p, SV_Savegame_Value(prog, &w, type, (prvm_eval_t *)(ed->fields.fp + d->ofs), k));
+		}
+	}
+	Mem_Free(fields);
+
+	// string buffers
+	countpos = body->size;
+	SV_Savegame_WriteInt(body, 0);
+	numbuffers = (int)Mem_ExpandableArray_IndexRange(&prog->stringbuffersarray);
+	for (i = 0, count = 0;i < numbuffers;i++)
+	{
+		stringbuffer = (prvm_stringbuffer_t *)Mem_ExpandableArray_RecordAtIndex(&prog->stringbuffersarray, i);
+		if (!stringbuffer || !(stringbuffer->flags & STRINGBUFFER_SAVED))
+			continue;
+		SV_Savegame_WriteInt(body, i);
+		SV_Savegame_WriteInt(body, stringbuffer->flags & STRINGBUFFER_QCFLAGS);
+		SV_Savegame_WriteInt(body, stringbuffer->num_strings);
+		for (k = 0;k < stringbuffer->num_strings;k++)
+			SV_Savegame_WriteInt(body, SV_Savegame_String(&w, stringbuffer->strings[k]));
+		count++;
+	}
+	StoreLittleLong(body->data + countpos, count);
+
+	// the string table goes first so the loader has it before anything uses it
+	*payloadsize = 4 + w.strings.size + body->size;
+	payload = (unsigned char *)Mem_Alloc(sv_mempool, *payloadsize);
+	StoreLittleLong(payload, w.numstrings);
+	memcpy(payload + 4, w.strings.data, w.strings.size);
+	memcpy(payload + 4 + w.strings.size, body->data, body->size);
+
+	Mem_Free(w.body.data);
+	Mem_Free(w.strings.data);
+	Mem_Free(w.stringofs);
+	Mem_Free(w.hash);
+	return payload;
+}
+
+static qboolean SV_Savegame_Write(const char *name, const char *comment, const unsigned char *payload, size_t payloadsize, const unsigned char *deflated, size_t deflatedsize)
+{
+	unsigned char header[SAVEGAME_BINARY_HEADERSIZE];
+	const void *data[2];
+	fs_offset_t len[2];
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, SAVEGAME_BINARY_MAGIC, 8);
+	StoreLittleLong(header + 8, SAVEGAME_BINARY_VERSION);
+	StoreLittleLong(header + 12, deflated ? SAVEGAME_BINARY_DEFLATED : 0);
+	StoreLittleLong(header + 16, (unsigned int)payloadsize);
+	strlcpy((char *)header + 20, comment, SAVEGAME_COMMENT_LENGTH + 1);
+
+	data[0] = header;
+	len[0] = sizeof(header);
+	data[1] = deflated ? deflated : payload;
+	len[1] = deflated ? deflatedsize : payloadsize;
+	return FS_WriteFileInBlocks(name, data, len, 2);
+}
+
+qboolean SV_Savegame_IsBinary(const unsigned char *data, size_t size, char *comment, size_t commentsize)
+{
+	if (size < SAVEGAME_BINARY_HEADERSIZE || memcmp(data, SAVEGAME_BINARY_MAGIC, 8))
+		return false;
+	if (comment)
+		strlcpy(comment, (const char *)data + 20, min(commentsize, SAVEGAME_COMMENT_LENGTH + 1));
+	return true;
+}
+
+/*
+===============
+SV_Savegame_Binary
+
+Writes the game to name in the binary format, used by the save command when
+sv_savegame_binary is set
+===============
+*/
+void SV_Savegame_Binary(prvm_prog_t *prog, const char *name)
+{
+	char comment[SAVEGAME_COMMENT_LENGTH+1];
+	unsigned char *payload, *deflated = NULL;
+	size_t payloadsize, deflatedsize = 0;
+
+	Con_Printf("Saving game to %s...\n", name);
+	Host_Savegame_Comment(prog, comment);
+	payload = SV_Savegame_Build(prog, &payloadsize);
+	if (sv_savegame_compress.integer)
+		deflated = FS_Deflate(payload, payloadsize, &deflatedsize, -1, sv_mempool);
+	if (SV_Savegame_Write(name, comment, payload, payloadsize, deflated, deflatedsize))
+		Con_Print("done.\n");
+	else
+		Con_Print("ERROR: couldn't open.\n");
+	Mem_Free(payload);
+	if (deflated)
+		Mem_Free(deflated);
+}
+
+/*
+===============================================================================
+
+AUTOSAVE
+
+The game state is copied into a payload during the server frame, compressing
+it runs on a worker thread and the file is written by the frame that finds
+it done.
+
+===============================================================================
+*/
+
+static void SV_Savegame_Autosave_Task(taskqueue_task_t *task)
+{
+	sv_autosave_state.deflated = FS_DeflateQuiet(sv_autosave_state.payload, sv_autosave_state.payloadsize, &sv_autosave_state.deflatedsize, -1, sv_mempool, &sv_autosave_state.deflateerror);
+}
+
+static void SV_Savegame_FinishAutosave(void)
+{
+	if (sv_autosave_state.deflateerror)
+		Con_Printf("FS_Deflate: %s\n", sv_autosave_state.deflateerror);
+	if (SV_Savegame_Write(sv_autosave_state.name, sv_autosave_state.comment, sv_autosave_state.payload, sv_autosave_state.payloadsize, sv_autosave_state.deflated, sv_autosave_state.deflatedsize))
+		Con_DPrintf("Autosaved game to %s\n", sv_autosave_state.name);
+	Mem_Free(sv_autosave_state.payload);
+	if (sv_autosave_state.deflated)
+		Mem_Free(sv_autosave_state.deflated);
+	sv_autosave_state.payload = NULL;
+	sv_autosave_state.deflated = NULL;
+	sv_autosave_state.pending = false;
+}
+
+void SV_Savegame_WaitForAutosave(void)
+{
+	if (!sv_autosave_state.pending)
+		return;
+	TaskQueue_WaitForTaskDone(&sv_autosave_state.task);
+	SV_Savegame_FinishAutosave();
+}
+
+void SV_Savegame_Frame(void)
+{
+	prvm_prog_t *prog = SVVM_prog;
+
+	if (sv_autosave_state.pending && TaskQueue_IsDone(&sv_autosave_state.task))
+		SV_Savegame_FinishAutosave();
+
+	if (sv_autosave.value <= 0 || !sv_autosave_name.string[0] || !sv.active || sv.paused)
+		return;
+	if (!sv.autosavetime)
+		sv.autosavetime = sv.time + sv_autosave.value;
+	// try again next frame if the last one is still being written
+	if (sv.time < sv.autosavetime || sv_autosave_state.pending)
+		return;
+	// same checks as the save command
+	if (cl.islocalgame && (cl.intermission || (svs.clients[0].active && PRVM_serveredictfloat(svs.clients[0].edict, deadflag))))
+		return;
+	if (strstr(sv_autosave_name.string, ".."))
+		return;
+	sv.autosavetime = sv.time + sv_autosave.value;
+
+	strlcpy(sv_autosave_state.name, sv_autosave_name.string, sizeof(sv_autosave_state.name));
+	FS_DefaultExtension(sv_autosave_state.name, ".sav", sizeof(sv_autosave_state.name));
+	Host_Savegame_Comment(prog, sv_autosave_state.comment);
+	sv_autosave_state.payload = SV_Savegame_Build(prog, &sv_autosave_state.payloadsize);
+	sv_autosave_state.deflated = NULL;
+	sv_autosave_state.deflatedsize = 0;
+	sv_autosave_state.deflateerror = NULL;
+	sv_autosave_state.pending = true;
+	if (sv_savegame_compress.integer && TaskQueue_NumThreads())
+	{
+		TaskQueue_Setup(&sv_autosave_state.task, NULL, SV_Savegame_Autosave_Task, 0, 0, NULL, NULL);
+		TaskQueue_Enqueue(1, &sv_autosave_state.task);
+		return;
+	}
+	if (sv_savegame_compress.integer)
+		SV_Savegame_Autosave_Task(&sv_autosave_state.task);
+	SV_Savegame_FinishAutosave();
+}
+
+/*
+===============================================================================
+
+LOADING
+
+The payload is read twice, first only to check it is complete so a broken
+file fails before the running game is replaced, then to load it.
+
+===============================================================================
+*/
+
+static const unsigned char *SV_Loadgame_Read(savereader_t *r, size_t size)
+{
+	const unsigned char *p;
+	if (r->error || size > r->size - r->pos)
+	{
+		r->error = true;
+		return NULL;
+	}
+	p = r->data + r->pos;
+	r->pos += size;
+	return p;
+}
+
+static int SV_Loadgame_ReadInt(savereader_t *r)
+{
+	const unsigned char *p = SV_Loadgame_Read(r, 4);
+	return p ? BuffLittleLong(p) : 0;
+}
+
+/// reads a count of items that each take at least itemsize bytes
+static int SV_Loadgame_ReadCount(savereader_t *r, size_t itemsize)
+{
+	int count = SV_Loadgame_ReadInt(r);
+	if (count < 0 || (size_t)count > (r->size - r->pos) / itemsize)
+	{
+		r->error = true;
+		return 0;
+	}
+	return count;
+}
+
+static dpint64 SV_Loadgame_ReadWord(savereader_t *r)
+{
+	const unsigned char *p = SV_Loadgame_Read(r, 8);
+	if (!p)
+		return 0;
+	return (dpint64)(((dpuint64)(unsigned int)BuffLittleLong(p + 4) << 32) | (unsigned int)BuffLittleLong(p));
+}
+
+static double SV_Loadgame_WordDouble(dpint64 w)
+{
+	double d;
+	memcpy(&d, &w, sizeof(d));
+	return d;
+}
+
+static double SV_Loadgame_ReadDouble(savereader_t *r)
+{
+	return SV_Loadgame_WordDouble(SV_Loadgame_ReadWord(r));
+}
+
+static int SV_Loadgame_ReadStringNum(savereader_t *r)
+{
+	int i = SV_Loadgame_ReadInt(r);
+	if (i < 0 || i >= r->numstrings)
+	{
+		r->error = true;
+		return 0;
+	}
+	return i;
+}
+
+static const char *SV_Loadgame_ReadString(savereader_t *r)
+{
+	return r->strings[SV_Loadgame_ReadStringNum(r)];
+}
+
+static int SV_Loadgame_Function(prvm_prog_t *prog, savereader_t *r, int s)
+{
+	mfunction_t *func;
+	if (!s)
+		return 0;
+	if (r->functions[s] < 0)
+	{
+		func = PRVM_ED_FindFunction(prog, r->strings[s]);
+		if (!func)
+			Con_Printf("SV_Loadgame_Binary: Can't find function %s in %s\n", r->strings[s], prog->name);
+		r->functions[s] = func ? func - prog->functions : 0;
+	}
+	return r->functions[s];
+}
+
+static int SV_Loadgame_Field(prvm_prog_t *prog, savereader_t *r, int s)
+{
+	ddef_t *def;
+	if (!s)
+		return 0;
+	if (r->fields[s] < 0)
+	{
+		def = PRVM_ED_FindField(prog, r->strings[s]);
+		if (!def)
+			Con_DPrintf("SV_Loadgame_Binary: Can't find field %s in %s\n", r->strings[s], prog->name);
+		r->fields[s] = def ? def->ofs : 0;
+	}
+	return r->fields[s];
+}
+
+/// reads a value, stores it at ofs of ent (or of the globals) if apply is
+/// set and ofs is not -1
+static void SV_Loadgame_Value(prvm_prog_t *prog, savereader_t *r, prvm_edict_t *ent, int type, int ofs, qboolean apply)
+{
+	prvm_eval_t *val;
+	dpint64 w[3];
+	char *s;
+	size_t len;
+	int i, n;
+
+	n = prvm_type_size[type];
+	for (i = 0;i < n;i++)
+		w[i] = SV_Loadgame_ReadWord(r);
+	if ((type == ev_string || type == ev_function || type == ev_field) && (w[0] < 0 || w[0] >= r->numstrings))
+		r->error = true;
+	if (!apply || ofs < 0)
+		return;
+
+	if (type == ev_entity)
+	{
+		if (w[0] < 0 || w[0] >= prog->limit_edicts)
+		{
+			Con_Printf("SV_Loadgame_Binary: ev_entity reference too large (edict %i >= MAX_EDICTS %u) on %s\n", (int)w[0], prog->limit_edicts, prog->name);
+			w[0] = 0;
+		}
+		while (w[0] >= prog->max_edicts)
+			PRVM_MEM_IncreaseEdicts(prog);
+	}
+	// after PRVM_MEM_IncreaseEdicts
+	val = ent ? (prvm_eval_t *)(ent->fields.fp + ofs) : (prvm_eval_t *)(prog->globals.fp + ofs);
+	switch (type)
+	{
+	case ev_string:
+		if (!w[0])
+		{
+			val->string = 0;
+			break;
+		}
+		len = strlen(r->strings[w[0]]) + 1;
+		val->string = PRVM_AllocString(prog, len, &s);
+		memcpy(s, r->strings[w[0]], len);
+		break;
+	case ev_float:
+	case ev_vector:
+		for (i = 0;i < n;i++)
+			val->vector[i] = SV_Loadgame_WordDouble(w[i]);
+		break;
+	case ev_entity:
+		val->edict = PRVM_EDICT_TO_PROG(PRVM_EDICT_NUM((int)w[0]));
+		break;
+	case ev_function:
+		val->function = SV_Loadgame_Function(prog, r, (int)w[0]);
+		break;
+	case ev_field:
+		val->_int = SV_Loadgame_Field(prog, r, (int)w[0]);
+		break;
+	}
+}
+
+static void SV_Loadgame_Payload(prvm_prog_t *prog, savereader_t *r, qboolean apply)
+{
+	prvm_stringbuffer_t *stringbuffer;
+	prvm_edict_t *ent = NULL;
+	ddef_t *def;
+	const unsigned char *freeflags;
+	const char *name, *s;
+	int i, j, k, n, count, type, skill, numfields, numedicts;
+	int *fieldtypes, *fieldofs;
+	float spawn_parms[NUM_SPAWN_PARMS];
+	char mapname[MAX_QPATH];
+	double time;
+
+	skill = SV_Loadgame_ReadInt(r);
+	strlcpy(mapname, SV_Loadgame_ReadString(r), sizeof(mapname));
+	time = SV_Loadgame_ReadDouble(r);
+	for (i = 0;i < NUM_SPAWN_PARMS;i++)
+		spawn_parms[i] = SV_Loadgame_ReadDouble(r);
+
+	if (apply)
+	{
+		current_skill = skill;
+		Cvar_SetValue("skill", (float)current_skill);
+		allowcheats = sv_cheats.integer != 0;
+
+		SV_SpawnServer(mapname);
+		if (!sv.active)
+		{
+			Con_Print("Couldn't load map\n");
+			return;
+		}
+		sv.paused = true;		// pause until all clients connect
+		sv.loadgame = true;
+
+		memset(sv.lightstyles[0], 0, sizeof(sv.lightstyles));
+		memset(sv.model_precache[0], 0, sizeof(sv.model_precache));
+		memset(sv.sound_precache[0], 0, sizeof(sv.sound_precache));
+		BufStr_Flush(prog);
+		World_UnlinkAll(&sv.world);
+	}
+
+	count = SV_Loadgame_ReadCount(r, 8);
+	for (j = 0;j < count;j++)
+	{
+		i = SV_Loadgame_ReadInt(r);
+		s = SV_Loadgame_ReadString(r);
+		if (!apply)
+			continue;
+		if (i >= 0 && i < MAX_LIGHTSTYLES)
+			strlcpy(sv.lightstyles[i], s, sizeof(sv.lightstyles[i]));
+		else
+			Con_Printf("unsupported lightstyle %i \"%s\"\n", i, s);
+	}
+	count = SV_Loadgame_ReadCount(r, 8);
+	for (j = 0;j < count;j++)
+	{
+		i = SV_Loadgame_ReadInt(r);
+		s = SV_Loadgame_ReadString(r);
+		if (!apply)
+			continue;
+		if (i >= 0 && i < MAX_MODELS)
+		{
+			strlcpy(sv.model_precache[i], s, sizeof(sv.model_precache[i]));
+			sv.models[i] = Mod_ForName (sv.model_precache[i], true, false, sv.model_precache[i][0] == '*' ? sv.worldname : NULL);
+		}
+		else
+			Con_Printf("unsupported model %i \"%s\"\n", i, s);
+	}
+	count = SV_Loadgame_ReadCount(r, 8);
+	for (j = 0;j < count;j++)
+	{
+		i = SV_Loadgame_ReadInt(r);
+		s = SV_Loadgame_ReadString(r);
+		if (!apply)
+			continue;
+		if (i >= 0 && i < MAX_SOUNDS)
+			strlcpy(sv.sound_precache[i], s, sizeof(sv.sound_precache[i]));
+		else
+			Con_Printf("unsupported sound %i \"%s\"\n", i, s);
+	}
+
+	// find the saved fields in the current progs, a field that was removed
+	// or changed its type is skipped
+	numfields = SV_Loadgame_ReadCount(r, 8);
+	fieldtypes = (int *)Mem_Alloc(tempmempool, (numfields + 1) * 2 * sizeof(int));
+	fieldofs = fieldtypes + numfields + 1;
+	for (i = 0;i < numfields;i++)
+	{
+		name = SV_Loadgame_ReadString(r);
+		type = SV_Loadgame_ReadInt(r);
+		if (type != ev_string && type != ev_float && type != ev_vector && type != ev_entity && type != ev_field && type != ev_function)
+		{
+			r->error = true;
+			type = ev_float;
+		}
+		fieldtypes[i] = type;
+		fieldofs[i] = -1;
+		if (!apply)
+			continue;
+		def = PRVM_ED_FindField(prog, name);
+		if (def && (def->type & ~DEF_SAVEGLOBAL) == type)
+			fieldofs[i] = def->ofs;
+		else
+			Con_DPrintf("%s: '%s' is not a field\n", prog->name, name);
+	}
+
+	count = SV_Loadgame_ReadCount(r, 16);
+	for (j = 0;j < count;j++)
+	{
+		name = SV_Loadgame_ReadString(r);
+		type = SV_Loadgame_ReadInt(r);
+		if (type != ev_string && type != ev_float && type != ev_entity)
+		{
+			r->error = true;
+			type = ev_float;
+		}
+		k = -1;
+		if (apply)
+		{
+			def = PRVM_ED_FindGlobal(prog, name);
+			if (def && (def->type & ~DEF_SAVEGLOBAL) == type)
+				k = def->ofs;
+			else
+				Con_DPrintf("'%s' is not a global on %s\n", name, prog->name);
+		}
+		SV_Loadgame_Value(prog, r, NULL, type, k, apply);
+	}
+	if (apply)
+	{
+		// restore the autocvar globals
+		Cvar_UpdateAllAutoCvars();
+	}
+
+	numedicts = SV_Loadgame_ReadCount(r, 1);
+	if (numedicts < 1 || numedicts > MAX_EDICTS)
+		r->error = true;
+	freeflags = SV_Loadgame_Read(r, numedicts);
+	if (apply)
+		while (numedicts > prog->max_edicts)
+			PRVM_MEM_IncreaseEdicts(prog);
+	for (i = 0;i < numedicts && !r->error;i++)
+	{
+		if (apply)
+		{
+			ent = PRVM_EDICT_NUM(i);
+			memset(ent->fields.fp, 0, prog->entityfields * sizeof(prvm_vec_t));
+			ent->priv.required->free = freeflags[i] != 0;
+			if (freeflags[i])
+				ent->priv.required->freetime = realtime;
+			PRVM_ED_Touch(prog, i);
+		}
+		if (freeflags[i])
+			continue;
+		for (j = 0;j < numfields;j++)
+			SV_Loadgame_Value(prog, r, ent, fieldtypes[j], fieldofs[j], apply);
+		// link it into the bsp tree
+		if (apply)
+			SV_LinkEdict(ent);
+	}
+	Mem_Free(fieldtypes);
+
+	count = SV_Loadgame_ReadCount(r, 12);
+	for (j = 0;j < count;j++)
+	{
+		i = SV_Loadgame_ReadInt(r);
+		k = SV_Loadgame_ReadInt(r);
+		n = SV_Loadgame_ReadCount(r, 4);
+		stringbuffer = NULL;
+		if (apply)
+		{
+			stringbuffer = BufStr_FindCreateReplace(prog, i, STRINGBUFFER_SAVED | (k & STRINGBUFFER_QCFLAGS), "string");
+			if (!stringbuffer)
+				Con_Printf("failed to create stringbuffer %i\n", i);
+		}
+		for (k = 0;k < n;k++)
+		{
+			s = SV_Loadgame_ReadString(r);
+			if (stringbuffer && *s)
+				BufStr_Set(prog, stringbuffer, k, s);
+		}
+	}
+
+	if (apply)
+	{
+		prog->num_edicts = numedicts;
+		sv.time = time;
+		for (i = 0;i < NUM_SPAWN_PARMS;i++)
+			svs.clients[0].spawn_parms[i] = spawn_parms[i];
+	}
+}
+
+/*
+===============
+SV_Loadgame_Binary
+
+Loads a binary savegame, called by the load command once
+SV_Savegame_IsBinary accepted the file
+===============
+*/
+void SV_Loadgame_Binary(prvm_prog_t *prog, const unsigned char *data, size_t size)
+{
+	savereader_t r;
+	unsigned char *inflated = NULL;
+	size_t inflatedsize, payloadpos;
+	const char *end;
+	int i, version, flags;
+
+	version = BuffLittleLong(data + 8);
+	if (version != SAVEGAME_BINARY_VERSION)
+	{
+		Con_Printf("Savegame is binary version %i, not %i\n", version, SAVEGAME_BINARY_VERSION);
+		return;
+	}
+	flags = BuffLittleLong(data + 12);
+
+	memset(&r, 0, sizeof(r));
+	r.size = (unsigned int)BuffLittleLong(data + 16);
+	if (flags & SAVEGAME_BINARY_DEFLATED)
+	{
+		inflated = FS_Inflate(data + SAVEGAME_BINARY_HEADERSIZE, size - SAVEGAME_BINARY_HEADERSIZE, &inflatedsize, tempmempool);
+		if (!inflated || inflatedsize != r.size)
+		{
+			if (inflated)
+				Mem_Free(inflated);
+			Con_Print("ERROR: couldn't decompress.\n");
+			return;
+		}
+		r.data = inflated;
+	}
+	else
+	{
+		if (size - SAVEGAME_BINARY_HEADERSIZE != r.size)
+		{
+			Con_Print("ERROR: savegame is truncated.\n");
+			return;
+		}
+		r.data = data + SAVEGAME_BINARY_HEADERSIZE;
+	}
+
+	r.numstrings = SV_Loadgame_ReadCount(&r, 1);
+	r.strings = (const char **)Mem_Alloc(tempmempool, (r.numstrings + 1) * sizeof(*r.strings));
+	r.strings[0] = "";
+	for (i = 0;i < r.numstrings && !r.error;i++)
+	{
+		r.strings[i] = (const char *)r.data + r.pos;
+		end = (const char *)memchr(r.strings[i], 0, r.size - r.pos);
+		if (!end)
+			r.error = true;
+		else
+			r.pos += end - r.strings[i] + 1;
+	}
+	if (r.numstrings < 1 || r.strings[0][0])
+		r.error = true;
+
+	// check everything before anything is changed
+	payloadpos = r.pos;
+	SV_Loadgame_Payload(prog, &r, false);
+	if (r.error || r.pos != r.size)
+	{
+		Con_Print("ERROR: savegame is corrupt.\n");
+		Mem_Free((void *)r.strings);
+		if (inflated)
+			Mem_Free(inflated);
+		return;
+	}
+
+	r.functions = (int *)Mem_Alloc(tempmempool, r.numstrings * 2 * sizeof(int));
+	r.fields = r.functions + r.numstrings;
+	memset(r.functions, -1, r.numstrings * 2 * sizeof(int));
+	r.pos = payloadpos;
+	Con_Printf("Loading binary savegame\n");
+	SV_Loadgame_Payload(prog, &r, true);
+
+	Mem_Free(r.functions);
+	Mem_Free((void *)r.strings);
+	if (inflated)
+		Mem_Free(inflated);
+}
@@ -0,0 +1,14 @@
+#ifndef SV_SAVE_H
+#define SV_SAVE_H
+
+/// true if the loaded file is a binary savegame, copies its comment for the menu
+qboolean SV_Savegame_IsBinary(const unsigned char *data, size_t size, char *comment, size_t commentsize);
+void SV_Savegame_Binary(prvm_prog_t *prog, const char *name);
+void SV_Loadgame_Binary(prvm_prog_t *prog, const unsigned char *data, size_t size);
+/// starts an sv_autosave when it is time and writes finished ones, called
+/// once per server frame
+void SV_Savegame_Frame(void);
+/// finishes writing a pending autosave
+void SV_Savegame_WaitForAutosave(void);
+
+#endif
@@ -106,6 +106,7 @@ const char *vm_sv_extensions =
 "DP_QC_FINDCHAIN_TOFIELD "
 "DP_QC_FINDFLAGS "
 "DP_QC_FINDFLOAT "
+"DP_QC_FINDRADIUS_SORTED "
 "DP_QC_FS_SEARCH "
 "DP_QC_GETLIGHT "
 "DP_QC_GETSURFACE "
@@ -132,6 +133,7 @@ const char *vm_sv_extensions =
 "DP_QC_STRREPLACE "
 "DP_QC_TOKENIZEBYSEPARATOR "
 "DP_QC_TOKENIZE_CONSOLE "
+"DP_QC_TRACEBATCH "
 "DP_QC_TRACEBOX "
 "DP_QC_TRACETOSS "
 "DP_QC_TRACE_MOVETYPE_HITMODEL "
@@ -700,6 +702,122 @@ static void VM_SV_tracebox(prvm_prog_t *prog)
 	VM_SetTraceGlobals(prog, &trace);
 }
 
+#define MAX_TRACEBATCH 256
+static sv_tracebatch_t vm_sv_tracebatch[MAX_TRACEBATCH];
+// entity numbers rather than pointers in case the edicts are reallocated
+// before the batch is run
+static int vm_sv_tracebatch_passedict[MAX_TRACEBATCH];
+static int vm_sv_tracebatch_num;
+static qboolean vm_sv_tracebatch_done;
+
+/*
+=================
+VM_SV_tracebatch_add
+
+queues a tracebox for the next tracebatch_run, returns its index in the batch
+or -1 if the batch is full, the first add after a run starts a new batch
+
+float tracebatch_add(vector v1, vector mins, vector maxs, vector v2, float nomonsters, entity forent)
+=================
+*/
+static void VM_SV_tracebatch_add(prvm_prog_t *prog)
+{
+	sv_tracebatch_t *t;
+	prvm_edict_t *ent;
+
+	VM_SAFEPARMCOUNTRANGE(6, 8, VM_SV_tracebatch_add); // allow more parameters for future expansion
+
+	PRVM_G_FLOAT(OFS_RETURN) = -1;
+
+	if (vm_sv_tracebatch_done)
+	{
+		vm_sv_tracebatch_num = 0;
+		vm_sv_tracebatch_done = false;
+	}
+	if (vm_sv_tracebatch_num >= MAX_TRACEBATCH)
+	{
+		VM_Warning(prog, "VM_SV_tracebatch_add: batch is full (%i traces)\n", MAX_TRACEBATCH);
+		return;
+	}
+
+	t = &vm_sv_tracebatch[vm_sv_tracebatch_num];
+	VectorCopy(PRVM_G_VECTOR(OFS_PARM0), t->start);
+	VectorCopy(PRVM_G_VECTOR(OFS_PARM1), t->mins);
+	VectorCopy(PRVM_G_VECTOR(OFS_PARM2), t->maxs);
+	VectorCopy(PRVM_G_VECTOR(OFS_PARM3), t->end);
+	t->type = (int)PRVM_G_FLOAT(OFS_PARM4);
+	ent = PRVM_G_EDICT(OFS_PARM5);
+
+	if (VEC_IS_NAN(t->start[0]) || VEC_IS_NAN(t->start[1]) || VEC_IS_NAN(t->start[2]) || VEC_IS_NAN(t->end[0]) || VEC_IS_NAN(t->end[1]) || VEC_IS_NAN(t->end[2]))
+		prog->error_cmd("%s: NAN errors detected in tracebatch_add('%f %f %f', '%f %f %f', '%f %f %f', '%f %f %f', %i, entity %i)\n", prog->name, t->start[0], t->start[1], t->start[2], t->mins[0], t->mins[1], t->mins[2], t->maxs[0], t->maxs[1], t->maxs[2], t->end[0], t->end[1], t->end[2], t->type, PRVM_EDICT_TO_PROG(ent));
+
+	vm_sv_tracebatch_passedict[vm_sv_tracebatch_num] = PRVM_NUM_FOR_EDICT(ent);
+	t->hitsupercontentsmask = SV_GenericHitSuperContentsMask(ent);
+	t->skipsupercontentsmask = 0;
+	t->skipmaterialflagsmask = 0;
+	// same extension as traceline/tracebox would have used
+	t->extend = VectorCompare(t->mins, t->maxs) ? collision_extendtracelinelength.value : collision_extendtraceboxlength.value;
+
+	PRVM_G_FLOAT(OFS_RETURN) = vm_sv_tracebatch_num++;
+}
+
+/*
+=================
+VM_SV_tracebatch_run
+
+performs all the traces queued by tracebatch_add, returns how many there were
+
+float tracebatch_run()
+=================
+*/
+static void VM_SV_tracebatch_run(prvm_prog_t *prog)
+{
+	int i, num;
+	prvm_edict_t *ent;
+
+	VM_SAFEPARMCOUNT(0, VM_SV_tracebatch_run);
+
+	prog->xfunction->builtinsprofile += 30 * vm_sv_tracebatch_num;
+
+	for (i = 0;i < vm_sv_tracebatch_num;i++)
+	{
+		// an entity may have been removed since its trace was queued
+		num = vm_sv_tracebatch_passedict[i];
+		ent = num < prog->num_edicts ? PRVM_EDICT_NUM(num) : prog->edicts;
+		vm_sv_tracebatch[i].passedict = ent->priv.required->free ? prog->edicts : ent;
+	}
+
+	SV_TraceBatch(vm_sv_tracebatch_num, vm_sv_tracebatch);
+	vm_sv_tracebatch_done = true;
+
+	PRVM_G_FLOAT(OFS_RETURN) = vm_sv_tracebatch_num;
+}
+
+/*
+=================
+VM_SV_tracebatch_get
+
+sets the trace_ globals to the result of one trace of the last tracebatch_run
+
+void tracebatch_get(float index)
+=================
+*/
+static void VM_SV_tracebatch_get(prvm_prog_t *prog)
+{
+	int i;
+
+	VM_SAFEPARMCOUNT(1, VM_SV_tracebatch_get);
+
+	i = (int)PRVM_G_FLOAT(OFS_PARM0);
+	if (!vm_sv_tracebatch_done || i < 0 || i >= vm_sv_tracebatch_num)
+	{
+		VM_Warning(prog, "VM_SV_tracebatch_get: index %i is not a result of the last tracebatch_run\n", i);
+		return;
+	}
+
+	VM_SetTraceGlobals(prog, &vm_sv_tracebatch[i].trace);
+}
+
 static trace_t SV_Trace_Toss(prvm_prog_t *prog, prvm_edict_t *tossent, prvm_edict_t *ignore)
 {
 	int i;
@@ -979,20 +1097,19 @@ VM_SV_findradius
 Returns a chain of entities that have origins within a spherical area
 
 findradius (origin, radius)
+findradius_sorted (origin, radius), the chain starts with the nearest
 =================
 */
-static void VM_SV_findradius(prvm_prog_t *prog)
+static void VM_SV_FindRadius(prvm_prog_t *prog, qboolean sorted)
 {
 	prvm_edict_t *ent, *chain;
-	vec_t radius, radius2;
-	vec3_t org, eorg, mins, maxs;
-	int i;
+	vec_t radius;
+	vec3_t org, mins, maxs;
+	int i, numedicts;
 	int numtouchedicts;
 	static prvm_edict_t *touchedicts[MAX_EDICTS];
 	int chainfield;
 
-	VM_SAFEPARMCOUNTRANGE(2, 3, VM_SV_findradius);
-
 	if(prog->argc == 3)
 		chainfield = PRVM_G_INT(OFS_PARM2);
 	else
@@ -1004,7 +1121,6 @@ static void VM_SV_findradius(prvm_prog_t *prog)
 
 	VectorCopy(PRVM_G_VECTOR(OFS_PARM0), org);
 	radius = PRVM_G_FLOAT(OFS_PARM1);
-	radius2 = radius * radius;
 
 	mins[0] = org[0] - (radius + 1);
 	mins[1] = org[1] - (radius + 1);
@@ -1019,7 +1135,7 @@ static void VM_SV_findradius(prvm_prog_t *prog)
 		Con_Printf("SV_EntitiesInBox returned %i edicts, max was %i\n", numtouchedicts, MAX_EDICTS);
 		numtouchedicts = MAX_EDICTS;
 	}
-	for (i = 0;i < numtouchedicts;i++)
+	for (i = 0, numedicts = 0;i < numtouchedicts;i++)
 	{
 		ent = touchedicts[i];
 		prog->xfunction->builtinsprofile++;
@@ -1027,28 +1143,35 @@ static void VM_SV_findradius(prvm_prog_t *prog)
 		// (note: this is the reason you can't blow up fallen zombies)
 		if (PRVM_serveredictfloat(ent, solid) == SOLID_NOT && !sv_gameplayfix_blowupfallenzombies.integer)
 			continue;
-		// LordHavoc: compare against bounding box rather than center so it
-		// doesn't miss large objects, and use DotProduct instead of Length
-		// for a major speedup
-		VectorSubtract(org, PRVM_serveredictvector(ent, origin), eorg);
-		if (sv_gameplayfix_findradiusdistancetobox.integer)
-		{
-			eorg[0] -= bound(PRVM_serveredictvector(ent, mins)[0], eorg[0], PRVM_serveredictvector(ent, maxs)[0]);
-			eorg[1] -= bound(PRVM_serveredictvector(ent, mins)[1], eorg[1], PRVM_serveredictvector(ent, maxs)[1]);
-			eorg[2] -= bound(PRVM_serveredictvector(ent, mins)[2], eorg[2], PRVM_serveredictvector(ent, maxs)[2]);
-		}
-		else
-			VectorMAMAM(1, eorg, -0.5f, PRVM_serveredictvector(ent, mins), -0.5f, PRVM_serveredictvector(ent, maxs), eorg);
-		if (DotProduct(eorg, eorg) < radius2)
-		{
-			PRVM_EDICTFIELDEDICT(ent,chainfield) = PRVM_EDICT_TO_PROG(chain);
-			chain = ent;
-		}
+		touchedicts[numedicts++] = ent;
+	}
+	// LordHavoc: compare against bounding box rather than center so it
+	// doesn't miss large objects, and use DotProduct instead of Length
+	// for a major speedup
+	numedicts = VM_FindRadius_Filter(prog, org, radius, sv_gameplayfix_findradiusdistancetobox.integer != 0, sorted, touchedicts, numedicts);
+	// the chain is built backwards, so the sorted one starts at the nearest
+	for (i = 0;i < numedicts;i++)
+	{
+		ent = touchedicts[sorted ? numedicts - 1 - i : i];
+		PRVM_EDICTFIELDEDICT(ent,chainfield) = PRVM_EDICT_TO_PROG(chain);
+		chain = ent;
 	}
 
 	VM_RETURN_EDICT(chain);
 }
 
+static void VM_SV_findradius(prvm_prog_t *prog)
+{
+	VM_SAFEPARMCOUNTRANGE(2, 3, VM_SV_findradius);
+	VM_SV_FindRadius(prog, false);
+}
+
+static void VM_SV_findradius_sorted(prvm_prog_t *prog)
+{
+	VM_SAFEPARMCOUNTRANGE(2, 3, VM_SV_findradius_sorted);
+	VM_SV_FindRadius(prog, true);
+}
+
 static void VM_SV_precache_sound(prvm_prog_t *prog)
 {
 	VM_SAFEPARMCOUNT(1, VM_SV_precache_sound);
@@ -1772,6 +1895,7 @@ static void VM_SV_copyentity(prvm_prog_t *prog)
 		return;
 	}
 	memcpy(out->fields.fp, in->fields.fp, prog->entityfields * sizeof(prvm_vec_t));
+	PRVM_ED_Touch(prog, PRVM_NUM_FOR_EDICT(out));
 	SV_LinkEdict(out);
 }
 
@@ -3824,10 +3948,10 @@ VM_getsurfacetriangle,			// #629 vector(entity e, float s, float n) getsurfacepo
 NULL,							// #630
 NULL,							// #631
 NULL,							// #632
-NULL,							// #633
-NULL,							// #634
-NULL,							// #635
-NULL,							// #636
+VM_SV_tracebatch_add,			// #633 float(vector v1, vector min, vector max, vector v2, float nomonsters, entity forent) tracebatch_add (DP_QC_TRACEBATCH)
+VM_SV_tracebatch_run,			// #634 float() tracebatch_run (DP_QC_TRACEBATCH)
+VM_SV_tracebatch_get,			// #635 void(float index) tracebatch_get (DP_QC_TRACEBATCH)
+VM_SV_findradius_sorted,		// #636 entity(vector org, float rad, .entity tofield) findradius_sorted (DP_QC_FINDRADIUS_SORTED)
 NULL,							// #637
 NULL,							// #638
 VM_digest_hex,						// #639
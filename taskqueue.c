@@ -0,0 +1,267 @@
+#include "quakedef.h"
+#include "thread.h"
+#include "taskqueue.h"
+
+cvar_t taskqueue_maxthreads = {CVAR_SAVE, "taskqueue_maxthreads", "4", "how many worker threads to use for parallel tasks (0 = run all tasks on the thread that waits for them)"};
+
+#define TASKQUEUE_MAXTHREADS 64
+
+typedef struct taskqueue_state_s
+{
+	// protects everything below, NULL if threading is not available
+	void *mutex;
+	// broadcast when tasks are queued (or the threads are asked to quit)
+	void *cond_work;
+	// broadcast when a task has been completed
+	void *cond_done;
+
+	// thread count last requested by taskqueue_maxthreads, and actually running
+	int wantthreads;
+	int numthreads;
+	void *threads[TASKQUEUE_MAXTHREADS];
+	// number of tasks currently executing on any thread
+	int running;
+	volatile qboolean threadsquit;
+
+	// circular queue of tasks that have not been started yet
+	int queue_start;
+	int queue_used;
+	int queue_size;
+	taskqueue_task_t **queue_data;
+}
+taskqueue_state_t;
+
+static taskqueue_state_t taskqueue_state;
+static mempool_t *taskqueue_mempool;
+
+void TaskQueue_Init(void)
+{
+	Cvar_RegisterVariable(&taskqueue_maxthreads);
+	taskqueue_mempool = Mem_AllocPool("taskqueue", 0, NULL);
+	if (Thread_HasThreads())
+	{
+		taskqueue_state.mutex = Thread_CreateMutex();
+		taskqueue_state.cond_work = Thread_CreateCond();
+		taskqueue_state.cond_done = Thread_CreateCond();
+	}
+}
+
+void TaskQueue_Shutdown(void)
+{
+	TaskQueue_Frame(true);
+	if (taskqueue_state.mutex)
+	{
+		Thread_DestroyCond(taskqueue_state.cond_done);
+		Thread_DestroyCond(taskqueue_state.cond_work);
+		Thread_DestroyMutex(taskqueue_state.mutex);
+	}
+	if (taskqueue_state.queue_data)
+		Mem_Free(taskqueue_state.queue_data);
+	Mem_FreePool(&taskqueue_mempool);
+	memset(&taskqueue_state, 0, sizeof(taskqueue_state));
+}
+
+static void TaskQueue_Lock(void)
+{
+	if (taskqueue_state.mutex)
+		Thread_LockMutex(taskqueue_state.mutex);
+}
+
+static void TaskQueue_Unlock(void)
+{
+	if (taskqueue_state.mutex)
+		Thread_UnlockMutex(taskqueue_state.mutex);
+}
+
+// must be called with the mutex locked, returns the first task that is ready
+// to run (its preceding task is done) and removes it from the queue
+static taskqueue_task_t *TaskQueue_DequeueTask(void)
+{
+	int i, j;
+	int start = taskqueue_state.queue_start;
+	int size = taskqueue_state.queue_size;
+	taskqueue_task_t *t;
+	for (i = 0;i < taskqueue_state.queue_used;i++)
+	{
+		t = taskqueue_state.queue_data[(start + i) % size];
+		if (t->preceding && !t->preceding->done)
+			continue;
+		// close the gap by moving the skipped entries up one slot
+		for (j = i;j > 0;j--)
+			taskqueue_state.queue_data[(start + j) % size] = taskqueue_state.queue_data[(start + j - 1) % size];
+		taskqueue_state.queue_start = (start + 1) % size;
+		taskqueue_state.queue_used--;
+		return t;
+	}
+	return NULL;
+}
+
+// must be called with the mutex locked, returns with the mutex locked
+static void TaskQueue_ExecuteTask(taskqueue_task_t *t)
+{
+	taskqueue_state.running++;
+	TaskQueue_Unlock();
+	t->func(t);
+	TaskQueue_Lock();
+	taskqueue_state.running--;
+	t->done = 1;
+	if (taskqueue_state.mutex)
+	{
+		Thread_CondBroadcast(taskqueue_state.cond_done);
+		// a task waiting on this one may be able to run now
+		if (taskqueue_state.queue_used)
+			Thread_CondBroadcast(taskqueue_state.cond_work);
+	}
+}
+
+static int TaskQueue_ThreadFunc(void *d)
+{
+	taskqueue_task_t *t;
+	Thread_LockMutex(taskqueue_state.mutex);
+	while (!taskqueue_state.threadsquit)
+	{
+		t = TaskQueue_DequeueTask();
+		if (t)
+			TaskQueue_ExecuteTask(t);
+		else
+			Thread_CondWait(taskqueue_state.cond_work, taskqueue_state.mutex);
+	}
+	Thread_UnlockMutex(taskqueue_state.mutex);
+	return 0;
+}
+
+void TaskQueue_Enqueue(int numtasks, taskqueue_task_t *tasks)
+{
+	int i;
+	TaskQueue_Lock();
+	if (taskqueue_state.queue_used + numtasks > taskqueue_state.queue_size)
+	{
+		// grow the queue, unwrapping the old contents to the start
+		int newsize = max(taskqueue_state.queue_size * 2, 1024);
+		taskqueue_task_t **newdata;
+		while (newsize < taskqueue_state.queue_used + numtasks)
+			newsize *= 2;
+		newdata = (taskqueue_task_t **)Mem_Alloc(taskqueue_mempool, newsize * sizeof(*newdata));
+		for (i = 0;i < taskqueue_state.queue_used;i++)
+			newdata[i] = taskqueue_state.queue_data[(taskqueue_state.queue_start + i) % taskqueue_state.queue_size];
+		if (taskqueue_state.queue_data)
+			Mem_Free(taskqueue_state.queue_data);
+		taskqueue_state.queue_data = newdata;
+		taskqueue_state.queue_size = newsize;
+		taskqueue_state.queue_start = 0;
+	}
+	for (i = 0;i < numtasks;i++)
+	{
+		tasks[i].done = 0;
+		taskqueue_state.queue_data[(taskqueue_state.queue_start + taskqueue_state.queue_used) % taskqueue_state.queue_size] = &tasks[i];
+		taskqueue_state.queue_used++;
+	}
+	if (taskqueue_state.numthreads)
+		Thread_CondBroadcast(taskqueue_state.cond_work);
+	TaskQueue_Unlock();
+}
+
+qboolean TaskQueue_IsDone(taskqueue_task_t *t)
+{
+	return t->done != 0;
+}
+
+void TaskQueue_WaitForTaskDone(taskqueue_task_t *t)
+{
+	taskqueue_task_t *run;
+	TaskQueue_Lock();
+	while (!t->done)
+	{
+		// help out rather than sleeping, this is also what makes progress
+		// when there are no worker threads
+		run = TaskQueue_DequeueTask();
+		if (run)
+			TaskQueue_ExecuteTask(run);
+		else if (taskqueue_state.numthreads || taskqueue_state.running)
+			Thread_CondWait(taskqueue_state.cond_done, taskqueue_state.mutex);
+		else
+		{
+			Con_Printf("TaskQueue_WaitForTaskDone: task was never queued\n");
+			break;
+		}
+	}
+	TaskQueue_Unlock();
+}
+
+void TaskQueue_Setup(taskqueue_task_t *t, taskqueue_task_t *preceding, void (*func)(taskqueue_task_t *), size_t i0, size_t i1, void *p0, void *p1)
+{
+	memset(t, 0, sizeof(*t));
+	t->preceding = preceding;
+	t->func = func;
+	t->i[0] = i0;
+	t->i[1] = i1;
+	t->p[0] = p0;
+	t->p[1] = p1;
+}
+
+void TaskQueue_RunTasks(int numtasks, taskqueue_task_t *tasks)
+{
+	int i;
+	TaskQueue_Enqueue(numtasks, tasks);
+	for (i = 0;i < numtasks;i++)
+		TaskQueue_WaitForTaskDone(&tasks[i]);
+}
+
+int TaskQueue_NumThreads(void)
+{
+	return taskqueue_state.numthreads;
+}
+
+void TaskQueue_Frame(qboolean shutdown)
+{
+	int i;
+	int numthreads = shutdown ? 0 : bound(0, taskqueue_maxthreads.integer, TASKQUEUE_MAXTHREADS);
+	taskqueue_task_t *t;
+
+	if (!taskqueue_state.mutex)
+		numthreads = 0;
+
+	if (taskqueue_state.wantthreads != numthreads)
+	{
+		taskqueue_state.wantthreads = numthreads;
+		// stop all the threads, any tasks they did not start stay queued
+		if (taskqueue_state.numthreads)
+		{
+			Thread_LockMutex(taskqueue_state.mutex);
+			taskqueue_state.threadsquit = true;
+			Thread_CondBroadcast(taskqueue_state.cond_work);
+			Thread_UnlockMutex(taskqueue_state.mutex);
+			for (i = 0;i < taskqueue_state.numthreads;i++)
+				Thread_WaitThread(taskqueue_state.threads[i], 0);
+			Thread_LockMutex(taskqueue_state.mutex);
+			taskqueue_state.threadsquit = false;
+			taskqueue_state.numthreads = 0;
+			// anyone sleeping in TaskQueue_WaitForTaskDone has to run the
+			// remaining tasks itself now
+			Thread_CondBroadcast(taskqueue_state.cond_done);
+			Thread_UnlockMutex(taskqueue_state.mutex);
+		}
+		// start the new set of threads
+		for (i = 0;i < numthreads;i++)
+		{
+			taskqueue_state.threads[i] = Thread_CreateThread(TaskQueue_ThreadFunc, NULL);
+			if (!taskqueue_state.threads[i])
+			{
+				Con_Printf("TaskQueue_Frame: failed to create worker thread %i\n", i);
+				break;
+			}
+			Thread_LockMutex(taskqueue_state.mutex);
+			taskqueue_state.numthreads++;
+			Thread_UnlockMutex(taskqueue_state.mutex);
+		}
+	}
+
+	// without worker threads nobody else will run the leftover tasks
+	if (!taskqueue_state.numthreads)
+	{
+		TaskQueue_Lock();
+		while ((t = TaskQueue_DequeueTask()))
+			TaskQueue_ExecuteTask(t);
+		TaskQueue_Unlock();
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef TASKQUEUE_H
+#define TASKQUEUE_H
+
+#include "qtypes.h"
+
+typedef struct taskqueue_task_s
+{
+	// if not NULL, this task must be done before this one will dequeue
+	struct taskqueue_task_s *preceding;
+	// set to 1 by the task queue once func has returned, use TaskQueue_IsDone() to poll it
+	volatile int done;
+	// function to call, and parameters for it to use
+	void (*func)(struct taskqueue_task_s *task);
+	void *p[4];
+	size_t i[4];
+}
+taskqueue_task_t;
+
+// queue the tasks to be executed by the worker threads (if there are no
+// worker threads they are executed by TaskQueue_WaitForTaskDone or the next
+// TaskQueue_Frame call)
+void TaskQueue_Enqueue(int numtasks, taskqueue_task_t *tasks);
+// polls for status of task and returns the result, does not cause tasks to
+// be executed (see TaskQueue_WaitForTaskDone for that)
+qboolean TaskQueue_IsDone(taskqueue_task_t *t);
+// executes queued tasks on the calling thread until the specified task is done
+void TaskQueue_WaitForTaskDone(taskqueue_task_t *t);
+// convenience function for setting up a task structure
+void TaskQueue_Setup(taskqueue_task_t *t, taskqueue_task_t *preceding, void (*func)(taskqueue_task_t *), size_t i0, size_t i1, void *p0, void *p1);
+// enqueues an array of tasks and waits for all of them to finish
+void TaskQueue_RunTasks(int numtasks, taskqueue_task_t *tasks);
+// returns the number of worker threads currently running (0 if threading is
+// not available or disabled by taskqueue_maxthreads)
+int TaskQueue_NumThreads(void);
+
+void TaskQueue_Init(void);
+void TaskQueue_Shutdown(void);
+// starts/stops worker threads to match taskqueue_maxthreads, and runs any
+// leftover tasks if there are no worker threads
+void TaskQueue_Frame(qboolean shutdown);
+
+#endif
@@ -54,6 +54,13 @@ static void World_Physics_End(world_t *world);
 void World_End(world_t *world)
 {
 	World_Physics_End(world);
+	if (world->areabvh_nodes)
+		Mem_Free(world->areabvh_nodes);
+	world->areabvh_nodes = NULL;
+	world->areabvh = false;
+	world->areabvh_root = -1;
+	world->areabvh_numnodes = 0;
+	world->areabvh_numleafs = 0;
 }
 
 //============================================================================
@@ -90,7 +97,10 @@ ENTITY AREA CHECKING
 
 void World_PrintAreaStats(world_t *world, const char *worldname)
 {
-	Con_Printf("%s areagrid check stats: %d calls %d nodes (%f per call) %d entities (%f per call)\n", worldname, world->areagrid_stats_calls, world->areagrid_stats_nodechecks, (double) world->areagrid_stats_nodechecks / (double) world->areagrid_stats_calls, world->areagrid_stats_entitychecks, (double) world->areagrid_stats_entitychecks / (double) world->areagrid_stats_calls);
+	if (world->areabvh)
+		Con_Printf("%s areabvh check stats: %d calls %d nodes (%f per call) %d entities (%f per call), %d entities in %d nodes, height %d\n", worldname, world->areagrid_stats_calls, world->areagrid_stats_nodechecks, (double) world->areagrid_stats_nodechecks / (double) world->areagrid_stats_calls, world->areagrid_stats_entitychecks, (double) world->areagrid_stats_entitychecks / (double) world->areagrid_stats_calls, world->areabvh_numleafs, world->areabvh_numnodes, world->areabvh_root >= 0 ? world->areabvh_nodes[world->areabvh_root].height : 0);
+	else
+		Con_Printf("%s areagrid check stats: %d calls %d nodes (%f per call) %d entities (%f per call)\n", worldname, world->areagrid_stats_calls, world->areagrid_stats_nodechecks, (double) world->areagrid_stats_nodechecks / (double) world->areagrid_stats_calls, world->areagrid_stats_entitychecks, (double) world->areagrid_stats_entitychecks / (double) world->areagrid_stats_calls);
 	world->areagrid_stats_calls = 0;
 	world->areagrid_stats_nodechecks = 0;
 	world->areagrid_stats_entitychecks = 0;
@@ -102,7 +112,7 @@ World_SetSize
 
 ===============
 */
-void World_SetSize(world_t *world, const char *filename, const vec3_t mins, const vec3_t maxs, prvm_prog_t *prog)
+void World_SetSize(world_t *world, const char *filename, const vec3_t mins, const vec3_t maxs, prvm_prog_t *prog, qboolean areabvh)
 {
 	int i;
 
@@ -133,6 +143,19 @@ void World_SetSize(world_t *world, const char *filename, const vec3_t mins, cons
 	World_ClearLink(&world->areagrid_outside);
 	for (i = 0;i < AREA_GRIDNODES;i++)
 		World_ClearLink(&world->areagrid[i]);
+	// empty bvh, nodes are only initialized as they are allocated
+	world->areabvh = areabvh;
+	if (areabvh && !world->areabvh_nodes)
+		world->areabvh_nodes = (areabvhnode_t *)Mem_Alloc(prog->progs_mempool, AREA_BVHNODES * sizeof(areabvhnode_t));
+	else if (!areabvh && world->areabvh_nodes)
+	{
+		Mem_Free(world->areabvh_nodes);
+		world->areabvh_nodes = NULL;
+	}
+	world->areabvh_root = -1;
+	world->areabvh_freenode = -1;
+	world->areabvh_numnodes = 0;
+	world->areabvh_numleafs = 0;
 	if (developer_extra.integer)
 		Con_DPrintf("areagrid settings: divisions %ix%ix1 : box %f %f %f : %f %f %f size %f %f %f grid %f %f %f (mingrid %f)\n", AREA_GRID, AREA_GRID, world->areagrid_mins[0], world->areagrid_mins[1], world->areagrid_mins[2], world->areagrid_maxs[0], world->areagrid_maxs[1], world->areagrid_maxs[2], world->areagrid_size[0], world->areagrid_size[1], world->areagrid_size[2], 1.0f / world->areagrid_scale[0], 1.0f / world->areagrid_scale[1], 1.0f / world->areagrid_scale[2], sv_areagrid_mingridsize.value);
 }
@@ -155,6 +178,297 @@ void World_UnlinkAll(world_t *world)
 	for (i = 0, grid = world->areagrid;i < AREA_GRIDNODES;i++, grid++)
 		while (grid->next != grid)
 			World_UnlinkEdict(PRVM_EDICT_NUM(grid->next->entitynumber));
+	// and everything in the bvh, unlinking never moves the other leafs
+	for (i = 0;i < world->areabvh_numnodes;i++)
+		if (world->areabvh_nodes[i].height == 0)
+			World_UnlinkEdict(PRVM_EDICT_NUM(world->areabvh_nodes[i].entitynumber));
+}
+
+/*
+===============================================================================
+
+AREA BVH
+
+Dynamic bounding volume tree with one leaf per entity, kept balanced with
+tree rotations as leafs are inserted and removed.  Each leaf box is padded by
+AREABVH_MARGIN so an entity moving a little stays in its leaf, which means
+relinking most entities is just a box check.
+
+===============================================================================
+*/
+
+#define AREABVH_MARGIN 8
+
+static float World_AreaBVH_Area(const float *mins, const float *maxs)
+{
+	float x = maxs[0] - mins[0], y = maxs[1] - mins[1], z = maxs[2] - mins[2];
+	return x * y + y * z + z * x;
+}
+
+static void World_AreaBVH_Combine(float *outmins, float *outmaxs, const float *amins, const float *amaxs, const float *bmins, const float *bmaxs)
+{
+	outmins[0] = min(amins[0], bmins[0]);
+	outmins[1] = min(amins[1], bmins[1]);
+	outmins[2] = min(amins[2], bmins[2]);
+	outmaxs[0] = max(amaxs[0], bmaxs[0]);
+	outmaxs[1] = max(amaxs[1], bmaxs[1]);
+	outmaxs[2] = max(amaxs[2], bmaxs[2]);
+}
+
+static int World_AreaBVH_AllocNode(world_t *world)
+{
+	int i;
+	areabvhnode_t *node;
+	if (world->areabvh_freenode >= 0)
+	{
+		i = world->areabvh_freenode;
+		world->areabvh_freenode = world->areabvh_nodes[i].parent;
+	}
+	else
+		i = world->areabvh_numnodes++;
+	node = world->areabvh_nodes + i;
+	node->parent = -1;
+	node->children[0] = node->children[1] = -1;
+	node->height = 0;
+	node->entitynumber = 0;
+	return i;
+}
+
+static void World_AreaBVH_FreeNode(world_t *world, int i)
+{
+	world->areabvh_nodes[i].height = -1;
+	world->areabvh_nodes[i].parent = world->areabvh_freenode;
+	world->areabvh_freenode = i;
+}
+
+// recalculates box and height of an internal node from its children
+static void World_AreaBVH_Refit(world_t *world, int i)
+{
+	areabvhnode_t *node = world->areabvh_nodes + i;
+	areabvhnode_t *c0 = world->areabvh_nodes + node->children[0];
+	areabvhnode_t *c1 = world->areabvh_nodes + node->children[1];
+	World_AreaBVH_Combine(node->mins, node->maxs, c0->mins, c0->maxs, c1->mins, c1->maxs);
+	node->height = 1 + max(c0->height, c1->height);
+}
+
+// if one child of node a is more than one level taller than the other, rotate
+// it up to replace a, returns the node that is now in a's place
+static int World_AreaBVH_Balance(world_t *world, int a)
+{
+	areabvhnode_t *nodes = world->areabvh_nodes;
+	int b, c, up, other, f, g, side, balance;
+	if (nodes[a].height < 2)
+		return a;
+	b = nodes[a].children[0];
+	c = nodes[a].children[1];
+	balance = nodes[c].height - nodes[b].height;
+	if (balance > 1)
+	{
+		up = c;
+		side = 1;
+	}
+	else if (balance < -1)
+	{
+		up = b;
+		side = 0;
+	}
+	else
+		return a;
+
+	// the taller child takes a's place, and a takes the place of one of its
+	// children, the other (taller) one stays under it
+	f = nodes[up].children[0];
+	g = nodes[up].children[1];
+	nodes[up].children[0] = a;
+	nodes[up].parent = nodes[a].parent;
+	nodes[a].parent = up;
+	if (nodes[up].parent >= 0)
+	{
+		if (nodes[nodes[up].parent].children[0] == a)
+			nodes[nodes[up].parent].children[0] = up;
+		else
+			nodes[nodes[up].parent].children[1] = up;
+	}
+	else
+		world->areabvh_root = up;
+	if (nodes[f].height > nodes[g].height)
+	{
+		nodes[up].children[1] = f;
+		other = g;
+	}
+	else
+	{
+		nodes[up].children[1] = g;
+		other = f;
+	}
+	nodes[a].children[side] = other;
+	nodes[other].parent = a;
+	World_AreaBVH_Refit(world, a);
+	World_AreaBVH_Refit(world, up);
+	return up;
+}
+
+// walks up from node i fixing boxes and heights
+static void World_AreaBVH_RefitUp(world_t *world, int i)
+{
+	while (i >= 0)
+	{
+		i = World_AreaBVH_Balance(world, i);
+		World_AreaBVH_Refit(world, i);
+		i = world->areabvh_nodes[i].parent;
+	}
+}
+
+static void World_AreaBVH_InsertLeaf(world_t *world, int leaf)
+{
+	areabvhnode_t *nodes = world->areabvh_nodes;
+	int i, sibling, oldparent, newparent, child;
+	float area, combinedarea, cost, inheritcost, childcost[2];
+	vec3_t combinedmins, combinedmaxs;
+
+	if (world->areabvh_root < 0)
+	{
+		world->areabvh_root = leaf;
+		nodes[leaf].parent = -1;
+		return;
+	}
+
+	// descend towards the sibling that grows the surface area of the tree the
+	// least (surface area heuristic)
+	sibling = world->areabvh_root;
+	while (nodes[sibling].height > 0)
+	{
+		area = World_AreaBVH_Area(nodes[sibling].mins, nodes[sibling].maxs);
+		World_AreaBVH_Combine(combinedmins, combinedmaxs, nodes[sibling].mins, nodes[sibling].maxs, nodes[leaf].mins, nodes[leaf].maxs);
+		combinedarea = World_AreaBVH_Area(combinedmins, combinedmaxs);
+		// cost of making a new parent for this node and the leaf
+		cost = 2 * combinedarea;
+		// minimum cost of pushing the leaf further down the tree
+		inheritcost = 2 * (combinedarea - area);
+		for (i = 0;i < 2;i++)
+		{
+			child = nodes[sibling].children[i];
+			World_AreaBVH_Combine(combinedmins, combinedmaxs, nodes[child].mins, nodes[child].maxs, nodes[leaf].mins, nodes[leaf].maxs);
+			childcost[i] = World_AreaBVH_Area(combinedmins, combinedmaxs) + inheritcost;
+			if (nodes[child].height > 0)
+				childcost[i] -= World_AreaBVH_Area(nodes[child].mins, nodes[child].maxs);
+		}
+		if (cost < childcost[0] && cost < childcost[1])
+			break;
+		sibling = nodes[sibling].children[childcost[0] < childcost[1] ? 0 : 1];
+	}
+
+	// create a new parent for the sibling and the leaf
+	oldparent = nodes[sibling].parent;
+	newparent = World_AreaBVH_AllocNode(world);
+	nodes[newparent].parent = oldparent;
+	nodes[newparent].children[0] = sibling;
+	nodes[newparent].children[1] = leaf;
+	nodes[sibling].parent = newparent;
+	nodes[leaf].parent = newparent;
+	if (oldparent >= 0)
+	{
+		if (nodes[oldparent].children[0] == sibling)
+			nodes[oldparent].children[0] = newparent;
+		else
+			nodes[oldparent].children[1] = newparent;
+	}
+	else
+		world->areabvh_root = newparent;
+
+	World_AreaBVH_RefitUp(world, newparent);
+}
+
+static void World_AreaBVH_RemoveLeaf(world_t *world, int leaf)
+{
+	areabvhnode_t *nodes = world->areabvh_nodes;
+	int parent, grandparent, sibling;
+
+	if (leaf == world->areabvh_root)
+	{
+		world->areabvh_root = -1;
+		return;
+	}
+
+	// the sibling takes the place of the parent
+	parent = nodes[leaf].parent;
+	grandparent = nodes[parent].parent;
+	sibling = nodes[parent].children[nodes[parent].children[0] == leaf ? 1 : 0];
+	nodes[sibling].parent = grandparent;
+	World_AreaBVH_FreeNode(world, parent);
+	if (grandparent >= 0)
+	{
+		if (nodes[grandparent].children[0] == parent)
+			nodes[grandparent].children[0] = sibling;
+		else
+			nodes[grandparent].children[1] = sibling;
+		World_AreaBVH_RefitUp(world, grandparent);
+	}
+	else
+		world->areabvh_root = sibling;
+}
+
+static int World_EntitiesInBox_AreaBVH(world_t *world, const vec3_t mins, const vec3_t maxs, int maxlist, prvm_edict_t **list)
+{
+	prvm_prog_t *prog = world->prog;
+	areabvhnode_t *node;
+	prvm_edict_t *ent;
+	int numlist = 0, stackpos = 0;
+	// the tree is balanced so this is far more than it could ever use
+	int stack[256];
+
+	world->areagrid_stats_calls++;
+	if (world->areabvh_root >= 0)
+		stack[stackpos++] = world->areabvh_root;
+	while (stackpos)
+	{
+		node = world->areabvh_nodes + stack[--stackpos];
+		world->areagrid_stats_nodechecks++;
+		if (!BoxesOverlap(mins, maxs, node->mins, node->maxs))
+			continue;
+		if (node->height > 0)
+		{
+			stack[stackpos++] = node->children[0];
+			stack[stackpos++] = node->children[1];
+			continue;
+		}
+		ent = PRVM_EDICT_NUM(node->entitynumber);
+		if (!ent->priv.server->free && BoxesOverlap(mins, maxs, ent->priv.server->areamins, ent->priv.server->areamaxs))
+		{
+			if (numlist < maxlist)
+				list[numlist] = ent;
+			numlist++;
+		}
+		world->areagrid_stats_entitychecks++;
+	}
+	return numlist;
+}
+
+static void World_LinkEdict_AreaBVH(world_t *world, prvm_edict_t *ent)
+{
+	prvm_prog_t *prog = world->prog;
+	areabvhnode_t *node;
+	int leaf, entitynumber = PRVM_NUM_FOR_EDICT(ent);
+
+	if (entitynumber <= 0 || entitynumber >= prog->max_edicts || PRVM_EDICT_NUM(entitynumber) != ent)
+	{
+		Con_Printf ("World_LinkEdict_AreaBVH: invalid edict %p (edicts is %p, edict compared to prog->edicts is %i)\n", (void *)ent, (void *)prog->edicts, entitynumber);
+		return;
+	}
+
+	leaf = World_AreaBVH_AllocNode(world);
+	node = world->areabvh_nodes + leaf;
+	node->entitynumber = entitynumber;
+	node->mins[0] = ent->priv.server->areamins[0] - AREABVH_MARGIN;
+	node->mins[1] = ent->priv.server->areamins[1] - AREABVH_MARGIN;
+	node->mins[2] = ent->priv.server->areamins[2] - AREABVH_MARGIN;
+	node->maxs[0] = ent->priv.server->areamaxs[0] + AREABVH_MARGIN;
+	node->maxs[1] = ent->priv.server->areamaxs[1] + AREABVH_MARGIN;
+	node->maxs[2] = ent->priv.server->areamaxs[2] + AREABVH_MARGIN;
+	World_AreaBVH_InsertLeaf(world, leaf);
+	world->areabvh_numleafs++;
+	ent->priv.server->areabvhnode = leaf + 1;
+	ent->priv.server->areabvhworld = world;
 }
 
 /*
@@ -165,6 +479,16 @@ void World_UnlinkAll(world_t *world)
 void World_UnlinkEdict(prvm_edict_t *ent)
 {
 	int i;
+	world_t *world;
+	if (ent->priv.server->areabvhnode)
+	{
+		world = ent->priv.server->areabvhworld;
+		World_AreaBVH_RemoveLeaf(world, ent->priv.server->areabvhnode - 1);
+		World_AreaBVH_FreeNode(world, ent->priv.server->areabvhnode - 1);
+		world->areabvh_numleafs--;
+		ent->priv.server->areabvhnode = 0;
+		ent->priv.server->areabvhworld = NULL;
+	}
 	for (i = 0;i < ENTITYGRIDAREAS;i++)
 	{
 		if (ent->priv.server->areagrid[i].prev)
@@ -189,6 +513,9 @@ int World_EntitiesInBox(world_t *world, const vec3_t requestmins, const vec3_t r
 	if (prog == NULL || prog->num_edicts < 1)
 		return 0;
 
+	if (world->areabvh)
+		return World_EntitiesInBox_AreaBVH(world, requestmins, requestmaxs, maxlist, list);
+
 	// LordHavoc: discovered this actually causes its own bugs (dm6 teleporters being too close to info_teleport_destination)
 	//VectorSet(paddedmins, requestmins[0] - 1.0f, requestmins[1] - 1.0f, requestmins[2] - 1.0f);
 	//VectorSet(paddedmaxs, requestmaxs[0] + 1.0f, requestmaxs[1] + 1.0f, requestmaxs[2] + 1.0f);
@@ -310,8 +637,23 @@ World_LinkEdict
 void World_LinkEdict(world_t *world, prvm_edict_t *ent, const vec3_t mins, const vec3_t maxs)
 {
 	prvm_prog_t *prog = world->prog;
+	areabvhnode_t *leaf;
+
+	// in the bvh a small move usually stays inside the padded leaf box, in
+	// which case only the exact box has to be updated
+	if (ent->priv.server->areabvhnode && ent->priv.server->areabvhworld == world && !ent->priv.server->free)
+	{
+		leaf = world->areabvh_nodes + ent->priv.server->areabvhnode - 1;
+		if (leaf->mins[0] <= mins[0] && leaf->mins[1] <= mins[1] && leaf->mins[2] <= mins[2] && leaf->maxs[0] >= maxs[0] && leaf->maxs[1] >= maxs[1] && leaf->maxs[2] >= maxs[2])
+		{
+			VectorCopy(mins, ent->priv.server->areamins);
+			VectorCopy(maxs, ent->priv.server->areamaxs);
+			return;
+		}
+	}
+
 	// unlink from old position first
-	if (ent->priv.server->areagrid[0].prev)
+	if (ent->priv.server->areagrid[0].prev || ent->priv.server->areabvhnode)
 		World_UnlinkEdict(ent);
 
 	// don't add the world
@@ -324,7 +666,10 @@ void World_LinkEdict(world_t *world, prvm_edict_t *ent, const vec3_t mins, const
 
 	VectorCopy(mins, ent->priv.server->areamins);
 	VectorCopy(maxs, ent->priv.server->areamaxs);
-	World_LinkEdict_AreaGrid(world, ent);
+	if (world->areabvh)
+		World_LinkEdict_AreaBVH(world, ent);
+	else
+		World_LinkEdict_AreaGrid(world, ent);
 }
 
 
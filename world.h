@@ -39,6 +39,27 @@ typedef struct link_s
 	struct link_s	*prev, *next;
 } link_t;
 
+// every entity is one leaf, so a full tree never has more nodes than this
+#define AREA_BVHNODES (MAX_EDICTS * 2)
+
+/// node of the dynamic bounding volume tree used instead of the areagrid when
+/// sv_areabvh is enabled, leaf boxes are padded so small moves don't have to
+/// change the tree
+typedef struct areabvhnode_s
+{
+	float mins[3];
+	float maxs[3];
+	// parent node (or next node in the free list), -1 if none
+	int parent;
+	// both -1 for leafs
+	int children[2];
+	// 0 for leafs, -1 for free nodes
+	int height;
+	// entity linked to this leaf
+	int entitynumber;
+}
+areabvhnode_t;
+
 typedef struct world_physics_s
 {
 	// for ODE physics engine
@@ -84,6 +105,15 @@ typedef struct world_s
 	vec3_t areagrid_size;
 	int areagrid_marknumber;
 
+	// alternative to the areagrid, chosen by the caller of World_SetSize,
+	// AREA_BVHNODES nodes allocated only while it is used
+	qboolean areabvh;
+	int areabvh_root;
+	int areabvh_freenode;
+	int areabvh_numnodes;
+	int areabvh_numleafs;
+	areabvhnode_t *areabvh_nodes;
+
 	// if the QC uses a physics engine, the data for it is here
 	world_physics_t physics;
 }
@@ -99,8 +129,9 @@ void World_InsertLinkBefore(link_t *l, link_t *before, int entitynumber);
 void World_Init(void);
 void World_Shutdown(void);
 
-/// called after the world model has been loaded, before linking any entities
-void World_SetSize(world_t *world, const char *filename, const vec3_t mins, const vec3_t maxs, struct prvm_prog_s *prog);
+/// called after the world model has been loaded, before linking any entities,
+/// areabvh picks the bounding volume tree instead of the areagrid
+void World_SetSize(world_t *world, const char *filename, const vec3_t mins, const vec3_t maxs, struct prvm_prog_s *prog, qboolean areabvh);
 /// unlinks all entities (used before reallocation of edicts)
 void World_UnlinkAll(world_t *world);
 